@@ -0,0 +1,344 @@
+/*
+ * Blocked Bloom filter and exact table of IPv4 addresses, see
+ * blocklist.h.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include "blocklist.h"
+
+#define BL_BLOCK_WORDS 16    /* 64 bytes, one cache line */
+#define BL_BITS_PER_ENTRY 16 /* about 0.2% of false positives */
+#define BL_SEED1 0x2545f491
+#define BL_SEED2 0x9e3779b9
+
+/* Half a block. The operations on it compile to single AVX2
+ * instructions, or to pairs of SSE2 ones. */
+typedef uint32_t bl_vec __attribute__((vector_size(32)));
+
+/* One bit per word of the block, from a multiply by an odd salt. */
+static const bl_vec bl_salt[2] = {
+    {0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d, 0x705495c7, 0x2df1424b,
+     0x9efc4947, 0x5c6bfb31},
+    {0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f, 0x165667b1, 0xd3a2646d,
+     0xfd7046c5, 0xb55a4f09},
+};
+
+/* The lookups are compiled for AVX2 too, and picked at load time. */
+#if defined(__x86_64__)
+#define BL_SIMD __attribute__((target_clones("avx2", "default")))
+#else
+#define BL_SIMD
+#endif
+
+/* Finalizer of MurmurHash3: shifts and 32-bit multiplies only, which
+ * all have vector instructions. */
+static inline uint32_t
+bl_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/* h1 selects the Bloom block and the table slot, h2 the bits. */
+static inline void
+bl_hash(const uint32_t *restrict addr, uint32_t *restrict h1,
+        uint32_t *restrict h2, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        h1[i] = bl_mix(addr[i] ^ BL_SEED1);
+        h2[i] = bl_mix(addr[i] ^ BL_SEED2);
+    }
+}
+
+static inline bl_vec *
+bl_block(const struct blocklist *bl, uint32_t h1)
+{
+    /* Range reduction without a division. */
+    uint32_t b = ((uint64_t)h1 * bl->nblocks) >> 32;
+
+    return (bl_vec *)(bl->bloom + b * BL_BLOCK_WORDS);
+}
+
+static inline void
+bl_bits(uint32_t h2, bl_vec *bits)
+{
+    const bl_vec one = {1, 1, 1, 1, 1, 1, 1, 1};
+
+    bits[0] = one << ((h2 * bl_salt[0]) >> 27);
+    bits[1] = one << ((h2 * bl_salt[1]) >> 27);
+}
+
+static inline int
+bl_bloom_test(const bl_vec *block, uint32_t h2)
+{
+    bl_vec bits[2];
+    bl_vec missing;
+    uint64_t w[4];
+
+    bl_bits(h2, bits);
+    missing = (bits[0] & ~block[0]) | (bits[1] & ~block[1]);
+    memcpy(w, &missing, sizeof(w));
+
+    return (w[0] | w[1] | w[2] | w[3]) == 0;
+}
+
+static inline int
+bl_find(const struct blocklist *bl, uint32_t addr, uint32_t h1)
+{
+    uint32_t i;
+
+    for (i = h1 & bl->mask; bl->table[i]; i = (i + 1) & bl->mask) {
+        if (bl->table[i] == addr) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+bl_insert(struct blocklist *bl, uint32_t addr, uint32_t h1, uint32_t h2)
+{
+    bl_vec bits[2];
+    bl_vec *block;
+    uint32_t i;
+
+    if (addr == 0) {
+        return;
+    }
+    for (i = h1 & bl->mask; bl->table[i]; i = (i + 1) & bl->mask) {
+        if (bl->table[i] == addr) {
+            return; /* duplicate */
+        }
+    }
+    bl->table[i] = addr;
+    bl->entries++;
+
+    block = bl_block(bl, h1);
+    bl_bits(h2, bits);
+    block[0] |= bits[0];
+    block[1] |= bits[1];
+}
+
+/* Zeroed memory for tables looked up at random: huge pages, where
+ * available, save most of the TLB misses. */
+static void *
+bl_alloc(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+    return p;
+}
+
+struct blocklist *
+blocklist_build(const uint32_t *addrs, size_t n)
+{
+    uint32_t h1[BLOCKLIST_BURST];
+    uint32_t h2[BLOCKLIST_BURST];
+    struct blocklist *bl;
+    size_t slots = 64;
+    size_t i, j;
+
+    if (n > (1UL << 30)) {
+        errno = E2BIG;
+        return NULL;
+    }
+    bl = calloc(1, sizeof(*bl));
+    if (bl == NULL) {
+        return NULL;
+    }
+
+    /* At most two thirds of the table is used, which keeps the probe
+     * sequences short. */
+    while (slots < n + n / 2) {
+        slots *= 2;
+    }
+    bl->nblocks    = n * BL_BITS_PER_ENTRY / (BL_BLOCK_WORDS * 32) + 1;
+    bl->mask       = slots - 1;
+    bl->bloom_size = (size_t)bl->nblocks * BL_BLOCK_WORDS * sizeof(uint32_t);
+    bl->table_size = slots * sizeof(uint32_t);
+    bl->bloom      = bl_alloc(bl->bloom_size);
+    bl->table      = bl_alloc(bl->table_size);
+    if (bl->bloom == NULL || bl->table == NULL) {
+        blocklist_free(bl);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (i = 0; i < n; i += BLOCKLIST_BURST) {
+        unsigned int m = n - i < BLOCKLIST_BURST ? n - i : BLOCKLIST_BURST;
+
+        bl_hash(addrs + i, h1, h2, m);
+        for (j = 0; j < m; j++) {
+            bl_insert(bl, addrs[i + j], h1[j], h2[j]);
+        }
+    }
+
+    return bl;
+}
+
+struct blocklist *
+blocklist_load(const char *path, char *errbuf)
+{
+    struct blocklist *bl = NULL;
+    unsigned long lineno = 0;
+    uint32_t *addrs      = NULL;
+    size_t n = 0, size = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        snprintf(errbuf, BLOCKLIST_ERRBUF_SIZE, "%s", strerror(errno));
+        return NULL;
+    }
+
+    while ((len = getline(&line, &cap, f)) >= 0) {
+        char *s = line;
+        struct in_addr a;
+
+        lineno++;
+        while (len > 0 && isspace((unsigned char)line[len - 1])) {
+            line[--len] = '\0';
+        }
+        while (isspace((unsigned char)*s)) {
+            s++;
+        }
+        if (*s == '\0' || *s == '#') {
+            continue;
+        }
+        if (inet_pton(AF_INET, s, &a) != 1) {
+            snprintf(errbuf, BLOCKLIST_ERRBUF_SIZE,
+                     "line %lu: invalid address '%.64s'", lineno, s);
+            goto out;
+        }
+        if (n == size) {
+            uint32_t *tmp;
+
+            size = size ? 2 * size : 4096;
+            tmp  = realloc(addrs, size * sizeof(*addrs));
+            if (tmp == NULL) {
+                snprintf(errbuf, BLOCKLIST_ERRBUF_SIZE, "%s",
+                         strerror(ENOMEM));
+                goto out;
+            }
+            addrs = tmp;
+        }
+        addrs[n++] = a.s_addr;
+    }
+    if (ferror(f)) {
+        snprintf(errbuf, BLOCKLIST_ERRBUF_SIZE, "%s", strerror(errno));
+        goto out;
+    }
+
+    bl = blocklist_build(addrs, n);
+    if (bl == NULL) {
+        snprintf(errbuf, BLOCKLIST_ERRBUF_SIZE, "%s", strerror(errno));
+    }
+out:
+    free(line);
+    free(addrs);
+    fclose(f);
+
+    return bl;
+}
+
+void
+blocklist_free(struct blocklist *bl)
+{
+    if (bl == NULL) {
+        return;
+    }
+    if (bl->bloom) {
+        munmap(bl->bloom, bl->bloom_size);
+    }
+    if (bl->table) {
+        munmap(bl->table, bl->table_size);
+    }
+    free(bl);
+}
+
+/* Source address of an IPv4 frame, 0 for anything else. */
+static inline uint32_t
+bl_src(const char *buf, unsigned int len)
+{
+    const struct ether_header *ethh = (const struct ether_header *)buf;
+    const struct ip *iph            = (const struct ip *)(ethh + 1);
+
+    if (len < sizeof(*ethh) + sizeof(*iph) ||
+        ethh->ether_type != htons(ETHERTYPE_IP) || iph->ip_v != 4) {
+        return 0;
+    }
+
+    return iph->ip_src.s_addr;
+}
+
+BL_SIMD static void
+bl_lookup(const struct blocklist *bl, const uint32_t *addr, unsigned int n,
+          uint8_t *blocked)
+{
+    const bl_vec *block[BLOCKLIST_BURST];
+    uint32_t h1[BLOCKLIST_BURST];
+    uint32_t h2[BLOCKLIST_BURST];
+    unsigned int i;
+
+    bl_hash(addr, h1, h2, n);
+
+    /* Have all the cache misses of the burst in flight at once. */
+    for (i = 0; i < n; i++) {
+        block[i] = bl_block(bl, h1[i]);
+        __builtin_prefetch(block[i]);
+    }
+    for (i = 0; i < n; i++) {
+        blocked[i] = addr[i] != 0 && bl_bloom_test(block[i], h2[i]);
+        if (blocked[i]) {
+            __builtin_prefetch(&bl->table[h1[i] & bl->mask]);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (blocked[i]) {
+            blocked[i] = bl_find(bl, addr[i], h1[i]);
+        }
+    }
+}
+
+void
+blocklist_run_ring(const struct blocklist *bl, const struct pio_ring *ring,
+                   uint32_t head, unsigned int n, uint8_t *blocked)
+{
+    uint32_t addr[BLOCKLIST_BURST];
+    unsigned int i;
+
+    for (i = 0; i < n; i++, head = pio_ring_next(ring, head)) {
+        const struct pio_slot *slot = &ring->slot[head];
+
+        addr[i] = bl_src(PIO_BUF(ring, slot->buf_idx), slot->len);
+    }
+    bl_lookup(bl, addr, n, blocked);
+}
@@ -0,0 +1,57 @@
+/*
+ * Blocklist of IPv4 source addresses, sized for millions of entries.
+ *
+ * A lookup first tests a blocked Bloom filter: the key selects one
+ * 64-byte block, a single cache line, and one bit in each of its 16
+ * 32-bit words. Most addresses are not listed, and for them this is the
+ * only memory access. Addresses that pass the filter are confirmed in
+ * an exact open-addressing table, so false positives never drop a
+ * packet.
+ *
+ * Lookups are made over a whole burst. The addresses are hashed
+ * together, in a loop that the compiler vectorizes. The Bloom blocks of
+ * the whole burst are then prefetched before the first one is tested,
+ * which overlaps the cache misses. A block is tested with a few vector
+ * instructions. Both use AVX2 where the CPU has it.
+ *
+ * A blocklist is never modified once built. To update it, build a new
+ * one and publish its pointer.
+ */
+#ifndef __BLOCKLIST_H__
+#define __BLOCKLIST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pktio.h"
+
+#define BLOCKLIST_BURST 64
+#define BLOCKLIST_ERRBUF_SIZE 256
+
+struct blocklist {
+    uint32_t *bloom;       /* nblocks blocks of 16 words */
+    uint32_t nblocks;
+    uint32_t *table;       /* addresses, 0 for empty slots */
+    uint32_t mask;         /* table slots - 1 */
+    unsigned long entries; /* distinct addresses */
+    size_t bloom_size;     /* bytes mapped */
+    size_t table_size;
+};
+
+/* Build a blocklist of n addresses (network byte order). 0.0.0.0 and
+ * duplicates are ignored. */
+struct blocklist *blocklist_build(const uint32_t *addrs, size_t n);
+
+/* Load a file with one address per line. Empty lines and lines
+ * starting with '#' are skipped. On failure errbuf
+ * (BLOCKLIST_ERRBUF_SIZE bytes) tells why. */
+struct blocklist *blocklist_load(const char *path, char *errbuf);
+
+void blocklist_free(struct blocklist *bl);
+
+/* Look up the n (at most BLOCKLIST_BURST) slots of ring from head on.
+ * blocked[i] becomes 1 for IPv4 packets whose source is listed. */
+void blocklist_run_ring(const struct blocklist *bl,
+                        const struct pio_ring *ring, uint32_t head,
+                        unsigned int n, uint8_t *blocked);
+
+#endif /* __BLOCKLIST_H__ */
@@ -0,0 +1,343 @@
+/*
+ * pcap/pcapng capture through a writer thread, see capture.h.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "capture.h"
+
+#define CAP_ALIGN 4096 /* O_DIRECT alignment of buffers, sizes, offsets */
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_SNAPLEN 65535
+
+/* pcapng: section header and interface description blocks, with
+ * nanosecond timestamps (if_tsresol = 9). */
+struct pcapng_hdr {
+    uint32_t shb_type;
+    uint32_t shb_len;
+    uint32_t bom;
+    uint16_t major;
+    uint16_t minor;
+    int64_t section_len;
+    uint32_t shb_len2;
+
+    uint32_t idb_type;
+    uint32_t idb_len;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+    uint16_t opt_tsresol;
+    uint16_t opt_tsresol_len;
+    uint8_t tsresol;
+    uint8_t pad[3];
+    uint32_t opt_end;
+    uint32_t idb_len2;
+} __attribute__((packed));
+
+struct pcapng_epb_hdr {
+    uint32_t type;
+    uint32_t len;
+    uint32_t iface;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t origlen;
+};
+
+/* Hand the current chunk over to the writer and move to the next one. */
+static void
+cap_submit(struct capture *cap, int last)
+{
+    struct cap_chunk *c = &cap->chunk[cap->cur];
+
+    c->last = last;
+    __atomic_store_n(&c->state, CAP_FULL, __ATOMIC_RELEASE);
+    sem_post(&cap->full);
+
+    cap->cur = (cap->cur + 1) % CAP_NCHUNKS;
+    c        = &cap->chunk[cap->cur];
+    if (__atomic_load_n(&c->state, __ATOMIC_ACQUIRE) == CAP_FREE) {
+        c->len = 0;
+    } else {
+        cap->stalled = 1;
+    }
+}
+
+/* Append to the staged stream. The caller makes sure that a record
+ * never needs more than the current chunk and a free next one. */
+static void
+cap_copy(struct capture *cap, const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len > 0) {
+        struct cap_chunk *c = &cap->chunk[cap->cur];
+        size_t n            = CAP_CHUNK_SIZE - c->len;
+
+        if (n > len) {
+            n = len;
+        }
+        memcpy(c->buf + c->len, p, n);
+        c->len += n;
+        cap->file_len += n;
+        p += n;
+        len -= n;
+        if (c->len == CAP_CHUNK_SIZE) {
+            cap_submit(cap, 0);
+        }
+    }
+}
+
+static void *
+cap_writer(void *arg)
+{
+    struct capture *cap = arg;
+    uint64_t off        = 0;
+    unsigned int w      = 0;
+    int last            = 0;
+
+    while (!last) {
+        struct cap_chunk *c = &cap->chunk[w];
+        size_t len, done = 0;
+
+        while (sem_wait(&cap->full) && errno == EINTR) {
+        }
+        len  = c->len;
+        last = c->last;
+        if (cap->direct) {
+            /* Only the last chunk can be partial: pad it, the file is
+             * truncated to its real length at the end. */
+            len = (len + CAP_ALIGN - 1) & ~(size_t)(CAP_ALIGN - 1);
+        }
+        while (done < len && !cap->error) {
+            ssize_t n = pwrite(cap->fd, c->buf + done, len - done, off + done);
+
+            if (n < 0) {
+                if (errno != EINTR) {
+                    cap->error = errno;
+                }
+                continue;
+            }
+            done += n;
+        }
+        off += c->len;
+        __atomic_store_n(&c->state, CAP_FREE, __ATOMIC_RELEASE);
+        w = (w + 1) % CAP_NCHUNKS;
+    }
+
+    return NULL;
+}
+
+struct capture *
+cap_open(const char *path)
+{
+    struct capture *cap;
+    size_t plen = strlen(path);
+    unsigned int i;
+    int ret;
+
+    cap = calloc(1, sizeof(*cap));
+    if (cap == NULL) {
+        return NULL;
+    }
+    cap->pcapng = plen > 7 && !strcmp(path + plen - 7, ".pcapng");
+
+    cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (cap->fd >= 0) {
+        cap->direct = 1;
+    } else if (errno == EINVAL) {
+        /* The file system does not support O_DIRECT (e.g. tmpfs). */
+        cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (cap->fd < 0) {
+        free(cap);
+        return NULL;
+    }
+
+    for (i = 0; i < CAP_NCHUNKS; i++) {
+        cap->chunk[i].buf = aligned_alloc(CAP_ALIGN, CAP_CHUNK_SIZE);
+        if (cap->chunk[i].buf == NULL) {
+            goto err;
+        }
+        /* Fault the pages in now rather than in the RX loop. */
+        memset(cap->chunk[i].buf, 0, CAP_CHUNK_SIZE);
+    }
+    sem_init(&cap->full, 0, 0);
+    ret = pthread_create(&cap->writer, NULL, cap_writer, cap);
+    if (ret) {
+        errno = ret;
+        goto err;
+    }
+
+    if (cap->pcapng) {
+        struct pcapng_hdr h;
+
+        memset(&h, 0, sizeof(h));
+        h.shb_type        = 0x0a0d0d0a;
+        h.shb_len         = 28;
+        h.bom             = 0x1a2b3c4d;
+        h.major           = 1;
+        h.section_len     = -1;
+        h.shb_len2        = 28;
+        h.idb_type        = 1;
+        h.idb_len         = 32;
+        h.linktype        = PCAP_LINKTYPE_ETHERNET;
+        h.snaplen         = PCAP_SNAPLEN;
+        h.opt_tsresol     = 9;
+        h.opt_tsresol_len = 1;
+        h.tsresol         = 9; /* nanoseconds */
+        h.idb_len2        = 32;
+        cap_copy(cap, &h, sizeof(h));
+    } else {
+        struct pcap_file_hdr h;
+
+        memset(&h, 0, sizeof(h));
+        h.magic         = PCAP_MAGIC_NSEC;
+        h.version_major = 2;
+        h.version_minor = 4;
+        h.snaplen       = PCAP_SNAPLEN;
+        h.linktype      = PCAP_LINKTYPE_ETHERNET;
+        cap_copy(cap, &h, sizeof(h));
+    }
+
+    return cap;
+err:
+    ret = errno;
+    for (i = 0; i < CAP_NCHUNKS; i++) {
+        free(cap->chunk[i].buf);
+    }
+    close(cap->fd);
+    free(cap);
+    errno = ret;
+    return NULL;
+}
+
+/* Stage one packet. Returns -1 (and counts a drop) if there is no room
+ * left because the writer is behind. */
+int
+cap_packet(struct capture *cap, const char *buf, unsigned int len,
+           uint64_t ts_ns)
+{
+    return cap_packet_snap(cap, buf, len, len, ts_ns);
+}
+
+int
+cap_packet_snap(struct capture *cap, const char *buf, unsigned int caplen,
+                unsigned int len, uint64_t ts_ns)
+{
+    static const uint32_t zero = 0;
+    unsigned int pad           = 0;
+    size_t need;
+
+    if (cap->stalled) {
+        struct cap_chunk *c = &cap->chunk[cap->cur];
+
+        if (__atomic_load_n(&c->state, __ATOMIC_ACQUIRE) != CAP_FREE) {
+            cap->drops++;
+            return -1;
+        }
+        c->len       = 0;
+        cap->stalled = 0;
+    }
+    if (cap->pcapng) {
+        pad  = (4 - (caplen & 3)) & 3;
+        need = sizeof(struct pcapng_epb_hdr) + caplen + pad + 4;
+    } else {
+        need = sizeof(struct pcap_rec_hdr) + caplen;
+    }
+    if (need > CAP_CHUNK_SIZE - cap->chunk[cap->cur].len) {
+        /* The record spans into the next chunk, which must be free. */
+        struct cap_chunk *next = &cap->chunk[(cap->cur + 1) % CAP_NCHUNKS];
+
+        if (__atomic_load_n(&next->state, __ATOMIC_ACQUIRE) != CAP_FREE) {
+            cap->drops++;
+            return -1;
+        }
+    }
+
+    if (cap->pcapng) {
+        struct pcapng_epb_hdr h;
+        uint32_t total = need;
+
+        h.type    = 6;
+        h.len     = total;
+        h.iface   = 0;
+        h.ts_high = ts_ns >> 32;
+        h.ts_low  = (uint32_t)ts_ns;
+        h.caplen  = caplen;
+        h.origlen = len;
+        cap_copy(cap, &h, sizeof(h));
+        cap_copy(cap, buf, caplen);
+        cap_copy(cap, &zero, pad);
+        cap_copy(cap, &total, sizeof(total));
+    } else {
+        struct pcap_rec_hdr h;
+
+        h.ts_sec  = ts_ns / 1000000000ULL;
+        h.ts_nsec = ts_ns % 1000000000ULL;
+        h.caplen  = caplen;
+        h.len     = len;
+        cap_copy(cap, &h, sizeof(h));
+        cap_copy(cap, buf, caplen);
+    }
+    cap->pkts++;
+    cap->bytes += caplen;
+
+    return 0;
+}
+
+/* Flush the staged data and close the file. */
+int
+cap_close(struct capture *cap)
+{
+    struct cap_chunk *c = &cap->chunk[cap->cur];
+    int ret             = 0;
+    unsigned int i;
+
+    if (cap->stalled) {
+        while (__atomic_load_n(&c->state, __ATOMIC_ACQUIRE) != CAP_FREE) {
+            usleep(1000);
+        }
+        c->len = 0;
+    }
+    cap_submit(cap, 1);
+    pthread_join(cap->writer, NULL);
+
+    if (cap->error) {
+        errno = cap->error;
+        ret   = -1;
+    } else if (ftruncate(cap->fd, cap->file_len)) {
+        ret = -1;
+    }
+    close(cap->fd);
+    sem_destroy(&cap->full);
+    for (i = 0; i < CAP_NCHUNKS; i++) {
+        free(cap->chunk[i].buf);
+    }
+    free(cap);
+
+    return ret;
+}
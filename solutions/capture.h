@@ -0,0 +1,60 @@
+/*
+ * Packet capture to a pcap or pcapng file, without ever blocking the
+ * RX loop on the disk.
+ *
+ * Records are staged into large, page-aligned, preallocated chunks. A
+ * writer thread writes each full chunk with O_DIRECT (when the file
+ * system supports it) while the RX loop fills the other one. Records
+ * may span two chunks, so that every chunk but the last is written in
+ * full and the file is contiguous. If the writer falls behind and no
+ * chunk is free, packets are dropped and counted instead.
+ */
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define CAP_NCHUNKS 2                   /* double buffering */
+#define CAP_CHUNK_SIZE (16 * 1024 * 1024) /* multiple of the page size */
+
+/* Chunk states. */
+#define CAP_FREE 0
+#define CAP_FULL 1 /* waiting for the writer */
+
+struct cap_chunk {
+    char *buf;
+    uint32_t len;
+    int state;
+    int last; /* final chunk, may be partial */
+};
+
+struct capture {
+    int fd;
+    int pcapng;
+    int direct; /* file opened with O_DIRECT */
+    struct cap_chunk chunk[CAP_NCHUNKS];
+    unsigned int cur; /* chunk being filled, by the RX thread */
+    int stalled;      /* cur was not free yet */
+    sem_t full;       /* chunks handed to the writer */
+    pthread_t writer;
+    int done;
+    uint64_t file_len; /* bytes staged so far */
+    int error;         /* errno of a failed write, set by the writer */
+
+    unsigned long long pkts;
+    unsigned long long bytes;
+    unsigned long long drops;
+};
+
+/* Files whose name ends with ".pcapng" are written as pcapng. */
+struct capture *cap_open(const char *path);
+int cap_packet(struct capture *cap, const char *buf, unsigned int len,
+               uint64_t ts_ns);
+/* Stage the first caplen bytes of a packet of len bytes. */
+int cap_packet_snap(struct capture *cap, const char *buf, unsigned int caplen,
+                    unsigned int len, uint64_t ts_ns);
+int cap_close(struct capture *cap);
+
+#endif /* __CAPTURE_H__ */
@@ -0,0 +1,336 @@
+/*
+ * tcpdump filters: translation of classic BPF programs to eBPF, run by
+ * the JIT of ebpf_jit.c. The expressions are compiled to classic BPF in
+ * cbpf_pcap.c.
+ *
+ * The classic registers live in eBPF registers (A in r0, X in r7), the
+ * 16 scratch words M[] at the bottom of the stack, and the packet loads
+ * become bounds-checked eBPF loads followed by a byte swap: a load out
+ * of the frame drops the packet, as it rejects it in classic BPF.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include "ebpf.h"
+
+#define REG_A BPF_REG_0
+#define REG_X BPF_REG_7
+#define REG_P BPF_REG_1   /* frame */
+#define REG_LEN BPF_REG_2 /* frame length */
+#define REG_TMP BPF_REG_3
+
+/* Stack offset of M[k]. */
+#define MEM_OFF(k) (-(BPF_MEMWORDS - (int)(k)) * 4)
+
+struct xlate {
+    struct bpf_insn *out; /* NULL to only count */
+    unsigned int n;
+    const unsigned int *start; /* eBPF index of each classic insn */
+};
+
+static void
+emit(struct xlate *x, uint8_t code, uint8_t dst, uint8_t src, int16_t off,
+     int32_t imm)
+{
+    if (x->out) {
+        struct bpf_insn *insn = &x->out[x->n];
+
+        memset(insn, 0, sizeof(*insn));
+        insn->code    = code;
+        insn->dst_reg = dst;
+        insn->src_reg = src;
+        insn->off     = off;
+        insn->imm     = imm;
+    }
+    x->n++;
+}
+
+/* Jump (JA, or code with its operands) to classic instruction target. */
+static void
+emit_jmp(struct xlate *x, uint8_t code, uint8_t src, int32_t imm,
+         unsigned int target)
+{
+    emit(x, code, REG_A, src, x->start[target] - (x->n + 1), imm);
+}
+
+/* dst = P[k] or P[X + k], in host byte order. */
+static void
+emit_load(struct xlate *x, uint8_t dst, uint8_t size, int ind, uint32_t k)
+{
+    uint8_t base = REG_P;
+
+    if (ind || k > INT16_MAX) {
+        emit(x, BPF_ALU64 | BPF_MOV | BPF_X, REG_TMP, REG_P, 0, 0);
+        if (ind) {
+            emit(x, BPF_ALU64 | BPF_ADD | BPF_X, REG_TMP, REG_X, 0, 0);
+        }
+        if (k > INT16_MAX) {
+            /* Beyond 2 GB the pointer wraps below the frame, which is
+             * out of bounds as well. */
+            emit(x, BPF_ALU64 | BPF_ADD | BPF_K, REG_TMP, 0, 0, k);
+            k = 0;
+        }
+        base = REG_TMP;
+    }
+    emit(x, BPF_LDX | BPF_MEM | size, dst, base, k, 0);
+    if (size != BPF_B) {
+        emit(x, BPF_ALU | BPF_END | BPF_TO_BE, dst, 0, 0,
+             size == BPF_H ? 16 : 32);
+    }
+}
+
+/* Return reg (r0 or r7) or k, normalized to EBPF_PASS or EBPF_DROP. */
+static void
+emit_ret(struct xlate *x, int is_k, uint8_t reg, uint32_t k)
+{
+    if (is_k) {
+        emit(x, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0,
+             k ? EBPF_PASS : EBPF_DROP);
+    } else {
+        if (reg != BPF_REG_0) {
+            emit(x, BPF_ALU | BPF_MOV | BPF_X, BPF_REG_0, reg, 0, 0);
+        }
+        emit(x, BPF_JMP32 | BPF_JEQ | BPF_K, BPF_REG_0, 0, 1, 0);
+        emit(x, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, EBPF_PASS);
+    }
+    emit(x, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+static int
+xlate_insn(struct xlate *x, const struct sock_filter *insns, unsigned int i,
+           unsigned int n)
+{
+    const struct sock_filter *f = &insns[i];
+    uint8_t size                = BPF_SIZE(f->code);
+    uint8_t op                  = BPF_OP(f->code);
+
+    switch (BPF_CLASS(f->code)) {
+    case BPF_LD:
+    case BPF_LDX: {
+        uint8_t dst = BPF_CLASS(f->code) == BPF_LD ? REG_A : REG_X;
+
+        switch (BPF_MODE(f->code)) {
+        case BPF_ABS:
+        case BPF_IND:
+            if (dst != REG_A || size == BPF_DW) {
+                return -1;
+            }
+            emit_load(x, dst, size, BPF_MODE(f->code) == BPF_IND, f->k);
+            break;
+        case BPF_MSH: /* X = 4 * (P[k] & 0xf), the IP header length */
+            if (dst != REG_X || size != BPF_B) {
+                return -1;
+            }
+            emit_load(x, dst, BPF_B, 0, f->k);
+            emit(x, BPF_ALU | BPF_AND | BPF_K, dst, 0, 0, 0xf);
+            emit(x, BPF_ALU | BPF_LSH | BPF_K, dst, 0, 0, 2);
+            break;
+        case BPF_LEN:
+            emit(x, BPF_ALU | BPF_MOV | BPF_X, dst, REG_LEN, 0, 0);
+            break;
+        case BPF_IMM:
+            emit(x, BPF_ALU | BPF_MOV | BPF_K, dst, 0, 0, f->k);
+            break;
+        case BPF_MEM:
+            if (f->k >= BPF_MEMWORDS) {
+                return -1;
+            }
+            emit(x, BPF_LDX | BPF_MEM | BPF_W, dst, BPF_REG_10, MEM_OFF(f->k),
+                 0);
+            break;
+        default:
+            return -1;
+        }
+        break;
+    }
+
+    case BPF_ST:
+    case BPF_STX:
+        if (f->k >= BPF_MEMWORDS) {
+            return -1;
+        }
+        emit(x, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10,
+             BPF_CLASS(f->code) == BPF_ST ? REG_A : REG_X, MEM_OFF(f->k), 0);
+        break;
+
+    case BPF_ALU:
+        if (op == BPF_NEG) {
+            emit(x, BPF_ALU | BPF_NEG, REG_A, 0, 0, 0);
+        } else if (BPF_SRC(f->code) == BPF_X) {
+            if (op == BPF_DIV || op == BPF_MOD) {
+                /* Division by zero rejects the packet. */
+                emit(x, BPF_JMP32 | BPF_JNE | BPF_K, REG_X, 0, 2, 0);
+                emit(x, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0,
+                     EBPF_DROP);
+                emit(x, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+            }
+            emit(x, BPF_ALU | op | BPF_X, REG_A, REG_X, 0, 0);
+        } else {
+            emit(x, BPF_ALU | op | BPF_K, REG_A, 0, 0, f->k);
+        }
+        break;
+
+    case BPF_JMP:
+        if (op == BPF_JA) {
+            if (f->k >= n - i - 1) {
+                return -1;
+            }
+            emit_jmp(x, BPF_JMP | BPF_JA, 0, 0, i + 1 + f->k);
+            break;
+        }
+        if (i + 1 + f->jt >= n || i + 1 + f->jf >= n) {
+            return -1;
+        }
+        /* Conditional jump to jt, then fall through or jump to jf. */
+        if (BPF_SRC(f->code) == BPF_X) {
+            emit_jmp(x, BPF_JMP32 | op | BPF_X, REG_X, 0, i + 1 + f->jt);
+        } else {
+            emit_jmp(x, BPF_JMP32 | op | BPF_K, 0, f->k, i + 1 + f->jt);
+        }
+        if (f->jf) {
+            emit_jmp(x, BPF_JMP | BPF_JA, 0, 0, i + 1 + f->jf);
+        }
+        break;
+
+    case BPF_RET:
+        emit_ret(x, BPF_RVAL(f->code) == BPF_K,
+                 BPF_RVAL(f->code) == BPF_X ? REG_X : REG_A, f->k);
+        break;
+
+    case BPF_MISC:
+        if (BPF_MISCOP(f->code) == BPF_TAX) {
+            emit(x, BPF_ALU | BPF_MOV | BPF_X, REG_X, REG_A, 0, 0);
+        } else {
+            emit(x, BPF_ALU | BPF_MOV | BPF_X, REG_A, REG_X, 0, 0);
+        }
+        break;
+
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+struct ebpf_prog *
+cbpf_translate(const struct sock_filter *insns, unsigned int n)
+{
+    struct ebpf_prog *prog = NULL;
+    unsigned int *start;
+    struct xlate x;
+    unsigned int i;
+
+    if (n == 0 || n > BPF_MAXINSNS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    start = calloc(n + 1, sizeof(*start));
+    if (start == NULL) {
+        return NULL;
+    }
+
+    /* First pass to lay out the code, second one to emit it. */
+    memset(&x, 0, sizeof(x));
+    x.start = start;
+    for (i = 0; i < n; i++) {
+        start[i] = x.n;
+        if (xlate_insn(&x, insns, i, n)) {
+            errno = EINVAL;
+            goto out;
+        }
+    }
+    start[n] = x.n;
+    if (x.n > EBPF_MAX_INSNS) {
+        errno = E2BIG;
+        goto out;
+    }
+    x.out = calloc(x.n, sizeof(*x.out));
+    if (x.out == NULL) {
+        goto out;
+    }
+    x.n = 0;
+    for (i = 0; i < n; i++) {
+        xlate_insn(&x, insns, i, n);
+    }
+
+    prog = ebpf_create(x.out, x.n);
+    if (prog) {
+        ebpf_jit(prog); /* falls back to the interpreter */
+    }
+out:
+    free(x.out);
+    free(start);
+    return prog;
+}
+
+/* Read the output of tcpdump -ddd: the count, then "code jt jf k" lines. */
+static struct sock_filter *
+cbpf_read(const char *path, unsigned int *n, char *errbuf)
+{
+    struct sock_filter *insns = NULL;
+    unsigned int i;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        snprintf(errbuf, CBPF_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        return NULL;
+    }
+    if (fscanf(f, "%u", n) != 1 || *n == 0 || *n > BPF_MAXINSNS) {
+        snprintf(errbuf, CBPF_ERRBUF_SIZE, "%s: bad instruction count", path);
+        goto out;
+    }
+    insns = calloc(*n, sizeof(*insns));
+    if (insns == NULL) {
+        snprintf(errbuf, CBPF_ERRBUF_SIZE, "%s", strerror(errno));
+        goto out;
+    }
+    for (i = 0; i < *n; i++) {
+        unsigned int code, jt, jf, k;
+
+        if (fscanf(f, "%u %u %u %u", &code, &jt, &jf, &k) != 4 ||
+            code > 0xffff || jt > 0xff || jf > 0xff) {
+            snprintf(errbuf, CBPF_ERRBUF_SIZE, "%s: bad instruction %u", path,
+                     i);
+            free(insns);
+            insns = NULL;
+            goto out;
+        }
+        insns[i].code = code;
+        insns[i].jt   = jt;
+        insns[i].jf   = jf;
+        insns[i].k    = k;
+    }
+out:
+    fclose(f);
+    return insns;
+}
+
+struct ebpf_prog *
+cbpf_compile(const char *expr, char *errbuf)
+{
+    struct sock_filter *insns;
+    struct ebpf_prog *prog;
+    unsigned int n;
+
+    if (expr[0] == '@') {
+        insns = cbpf_read(expr + 1, &n, errbuf);
+    } else {
+        insns = cbpf_pcap(expr, &n, errbuf);
+    }
+    if (insns == NULL) {
+        return NULL;
+    }
+
+    prog = cbpf_translate(insns, n);
+    if (prog == NULL) {
+        snprintf(errbuf, CBPF_ERRBUF_SIZE, "cannot translate the program: %s",
+                 strerror(errno));
+    }
+    free(insns);
+
+    return prog;
+}
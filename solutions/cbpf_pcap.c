@@ -0,0 +1,65 @@
+/*
+ * Compilation of tcpdump expressions to classic BPF with libpcap, for
+ * Ethernet frames. Kept apart from cbpf.c, as <pcap/bpf.h> and
+ * <linux/bpf.h> both define struct bpf_insn.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/filter.h>
+#ifdef WITH_PCAP
+#include <pcap/pcap.h>
+#endif
+#include "ebpf.h"
+
+#define CBPF_SNAPLEN 65535
+
+#ifdef WITH_PCAP
+struct sock_filter *
+cbpf_pcap(const char *expr, unsigned int *n, char *errbuf)
+{
+    struct sock_filter *insns = NULL;
+    struct bpf_program bp;
+    unsigned int i;
+    pcap_t *p;
+
+    p = pcap_open_dead(DLT_EN10MB, CBPF_SNAPLEN);
+    if (p == NULL) {
+        snprintf(errbuf, CBPF_ERRBUF_SIZE, "pcap_open_dead() failed");
+        return NULL;
+    }
+    if (pcap_compile(p, &bp, expr, 1, PCAP_NETMASK_UNKNOWN)) {
+        snprintf(errbuf, CBPF_ERRBUF_SIZE, "%s", pcap_geterr(p));
+        pcap_close(p);
+        return NULL;
+    }
+
+    /* Same layout, different types. */
+    insns = calloc(bp.bf_len, sizeof(*insns));
+    if (insns == NULL) {
+        snprintf(errbuf, CBPF_ERRBUF_SIZE, "%s", strerror(errno));
+    } else {
+        for (i = 0; i < bp.bf_len; i++) {
+            insns[i].code = bp.bf_insns[i].code;
+            insns[i].jt   = bp.bf_insns[i].jt;
+            insns[i].jf   = bp.bf_insns[i].jf;
+            insns[i].k    = bp.bf_insns[i].k;
+        }
+        *n = bp.bf_len;
+    }
+    pcap_freecode(&bp);
+    pcap_close(p);
+
+    return insns;
+}
+#else  /* !WITH_PCAP */
+struct sock_filter *
+cbpf_pcap(const char *expr, unsigned int *n, char *errbuf)
+{
+    snprintf(errbuf, CBPF_ERRBUF_SIZE,
+             "built without libpcap (make WITH_PCAP=1), use @FILE with the "
+             "output of tcpdump -ddd");
+    return NULL;
+}
+#endif /* WITH_PCAP */
@@ -0,0 +1,167 @@
+/*
+ * CoDel active queue management (RFC 8289) for the egress queues of
+ * forward and fe (see qos.h and htb.h).
+ *
+ * The packets are stamped with the TSC when queued. When one leaves,
+ * its sojourn time tells how long the queue has been standing: if it
+ * stayed above target for a whole interval, the queue is not absorbing
+ * a burst but adding latency, and CoDel starts dropping at dequeue. The
+ * drops come closer together, at interval / sqrt(count), until the
+ * sojourn time falls below target again. When the queue soon goes back
+ * to dropping, count starts from where it was, as the standing queue
+ * has not been dealt with.
+ *
+ * All the times are in TSC ticks. 1 / sqrt(count) is kept in fixed
+ * point and updated with one Newton step when count changes, as in
+ * Linux.
+ */
+#ifndef __CODEL_H__
+#define __CODEL_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define CODEL_TARGET_US 5000     /* the defaults of RFC 8289 */
+#define CODEL_INTERVAL_US 100000
+
+struct codel_params {
+    uint64_t target;   /* TSC, 0 to never drop */
+    uint64_t interval; /* TSC */
+};
+
+/* The state of one queue. */
+struct codel {
+    uint64_t first_above; /* when the sojourn time may start to count */
+    uint64_t drop_next;   /* when to drop again while dropping */
+    uint32_t count;       /* drops since dropping started */
+    uint32_t lastcount;
+    uint16_t rec_inv_sqrt; /* 1 / sqrt(count), Q0.16 */
+    uint8_t dropping;
+};
+
+/* Parse TARGET_US[:INTERVAL_US], the interval defaulting to 100 ms.
+ * Returns 0 on success. */
+static inline int
+codel_parse(const char *s, unsigned int *target_us,
+            unsigned int *interval_us)
+{
+    char *end;
+
+    *target_us   = strtoul(s, &end, 10);
+    *interval_us = CODEL_INTERVAL_US;
+    if (*end == ':') {
+        *interval_us = strtoul(end + 1, &end, 10);
+    }
+    if (end == s || *end != '\0' || *target_us == 0 ||
+        *interval_us < *target_us) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void
+codel_params_init(struct codel_params *p, unsigned int target_us,
+                  unsigned int interval_us, uint64_t tsc_hz)
+{
+    p->target   = target_us * tsc_hz / 1000000;
+    p->interval = interval_us * tsc_hz / 1000000;
+}
+
+static inline void
+codel_init(struct codel *cd)
+{
+    cd->first_above  = 0;
+    cd->drop_next    = 0;
+    cd->count        = 0;
+    cd->lastcount    = 0;
+    cd->rec_inv_sqrt = UINT16_MAX;
+    cd->dropping     = 0;
+}
+
+/* rec_inv_sqrt = rec_inv_sqrt * (3 - count * rec_inv_sqrt^2) / 2 */
+static inline void
+codel_newton_step(struct codel *cd)
+{
+    uint32_t invsqrt  = (uint32_t)cd->rec_inv_sqrt << 16;
+    uint32_t invsqrt2 = ((uint64_t)invsqrt * invsqrt) >> 32;
+    uint64_t val      = (3ULL << 32) - (uint64_t)cd->count * invsqrt2;
+
+    val >>= 2; /* no overflow in the multiply */
+    val              = (val * invsqrt) >> (32 - 2 + 1);
+    cd->rec_inv_sqrt = val >> 16;
+}
+
+static inline uint64_t
+codel_control_law(const struct codel *cd, const struct codel_params *p,
+                  uint64_t t)
+{
+    return t + ((p->interval * cd->rec_inv_sqrt) >> 16);
+}
+
+/* Has the sojourn time been above target for an interval? last tells
+ * that the packet was the last one queued: a queue that empties is not
+ * standing. */
+static inline int
+codel_above(struct codel *cd, const struct codel_params *p, uint64_t ts,
+            uint64_t now, int last)
+{
+    if (now - ts < p->target || last) {
+        cd->first_above = 0;
+        return 0;
+    }
+    if (cd->first_above == 0) {
+        cd->first_above = now + p->interval;
+        return 0;
+    }
+
+    return now >= cd->first_above;
+}
+
+/* Should the packet queued at ts and dequeued at now be dropped? */
+static inline int
+codel_drop(struct codel *cd, const struct codel_params *p, uint64_t ts,
+           uint64_t now, int last)
+{
+    int above;
+
+    if (p->target == 0) {
+        return 0;
+    }
+    above = codel_above(cd, p, ts, now, last);
+    if (cd->dropping) {
+        if (!above) {
+            cd->dropping = 0;
+            return 0;
+        }
+        if (now < cd->drop_next) {
+            return 0;
+        }
+        cd->count++;
+        codel_newton_step(cd);
+        cd->drop_next = codel_control_law(cd, p, cd->drop_next);
+        return 1;
+    }
+    if (!above) {
+        return 0;
+    }
+
+    /* Start dropping, from the last count if that was not long ago. */
+    cd->dropping = 1;
+    if (cd->count - cd->lastcount > 1 &&
+        now - cd->drop_next < 16 * p->interval) {
+        cd->count -= cd->lastcount;
+        codel_newton_step(cd);
+    } else {
+        cd->count        = 1;
+        cd->rec_inv_sqrt = UINT16_MAX;
+    }
+    cd->lastcount = cd->count;
+    cd->drop_next = codel_control_law(cd, p, now);
+
+    return 1;
+}
+
+#endif /* __CODEL_H__ */
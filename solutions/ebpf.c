@@ -0,0 +1,514 @@
+/*
+ * eBPF classifiers: ELF loader, load-time checks and interpreter. The
+ * JIT is in ebpf_jit.c.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/bpf.h>
+#include "ebpf.h"
+
+#ifndef EM_BPF
+#define EM_BPF 247
+#endif
+
+/* Find the program section: the one named section, or else the first
+ * non-empty executable one. */
+static const Elf64_Shdr *
+elf_find_prog(const char *map, size_t size, const char *section,
+              unsigned int *index)
+{
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)map;
+    const Elf64_Shdr *sh;
+    const char *names;
+    unsigned int i;
+
+    if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_machine != EM_BPF ||
+        eh->e_shentsize != sizeof(*sh) || eh->e_shoff > size ||
+        (size - eh->e_shoff) / sizeof(*sh) < eh->e_shnum ||
+        eh->e_shstrndx >= eh->e_shnum) {
+        errno = ENOEXEC;
+        return NULL;
+    }
+    sh = (const Elf64_Shdr *)(map + eh->e_shoff);
+    if (sh[eh->e_shstrndx].sh_offset >= size) {
+        errno = ENOEXEC;
+        return NULL;
+    }
+    names = map + sh[eh->e_shstrndx].sh_offset;
+
+    for (i = 1; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_PROGBITS || sh[i].sh_size == 0 ||
+            sh[i].sh_offset > size || sh[i].sh_size > size - sh[i].sh_offset ||
+            sh[i].sh_name >= sh[eh->e_shstrndx].sh_size) {
+            continue;
+        }
+        if (section ? !strcmp(names + sh[i].sh_name, section)
+                    : (sh[i].sh_flags & SHF_EXECINSTR) != 0) {
+            *index = i;
+            return &sh[i];
+        }
+    }
+    errno = ENOENT;
+    return NULL;
+}
+
+/* Maps and global variables would need relocations: refuse them. */
+static int
+elf_has_relocs(const char *map, unsigned int index)
+{
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)map;
+    const Elf64_Shdr *sh = (const Elf64_Shdr *)(map + eh->e_shoff);
+    unsigned int i;
+
+    for (i = 1; i < eh->e_shnum; i++) {
+        if ((sh[i].sh_type == SHT_REL || sh[i].sh_type == SHT_RELA) &&
+            sh[i].sh_info == index && sh[i].sh_size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+check_mem(const struct bpf_insn *insn, unsigned int base)
+{
+    static const int sizes[] = {4, 2, 1, 8}; /* BPF_W, BPF_H, BPF_B, BPF_DW */
+    int size                 = sizes[BPF_SIZE(insn->code) >> 3];
+
+    if (BPF_MODE(insn->code) != BPF_MEM || base > BPF_REG_10) {
+        return -1;
+    }
+    /* Stack accesses are checked here, the others at run time. */
+    if (base == BPF_REG_10 &&
+        (insn->off < -EBPF_STACK_SIZE || insn->off > -size)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Load-time checks. The program must be safe for both the interpreter
+ * and the JIT, which rely on them. */
+static int
+ebpf_check(const struct bpf_insn *insns, unsigned int n)
+{
+    unsigned int i;
+
+    if (n == 0 || n > EBPF_MAX_INSNS ||
+        insns[n - 1].code != (BPF_JMP | BPF_EXIT)) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        const struct bpf_insn *insn = &insns[i];
+        uint8_t cls                 = BPF_CLASS(insn->code);
+
+        if (insn->dst_reg > BPF_REG_10 || insn->src_reg > BPF_REG_10) {
+            return -1;
+        }
+        switch (cls) {
+        case BPF_ALU:
+        case BPF_ALU64:
+            if (insn->dst_reg == BPF_REG_10) {
+                return -1;
+            }
+            switch (BPF_OP(insn->code)) {
+            case BPF_DIV:
+            case BPF_MOD:
+                if (BPF_SRC(insn->code) == BPF_K && insn->imm == 0) {
+                    return -1;
+                }
+                break;
+            case BPF_NEG:
+                /* The interpreter only knows the BPF_K encoding. */
+                if (BPF_SRC(insn->code) != BPF_K) {
+                    return -1;
+                }
+                break;
+            case BPF_END:
+                if (cls != BPF_ALU || (insn->imm != 16 && insn->imm != 32 &&
+                                       insn->imm != 64)) {
+                    return -1;
+                }
+                break;
+            case BPF_ADD:
+            case BPF_SUB:
+            case BPF_MUL:
+            case BPF_OR:
+            case BPF_AND:
+            case BPF_LSH:
+            case BPF_RSH:
+            case BPF_XOR:
+            case BPF_MOV:
+            case BPF_ARSH:
+                break;
+            default:
+                return -1;
+            }
+            break;
+
+        case BPF_LD:
+            /* Only 64-bit immediates, not map references. */
+            if (insn->code != (BPF_LD | BPF_IMM | BPF_DW) ||
+                insn->src_reg != 0 || insn->dst_reg == BPF_REG_10 ||
+                i + 1 == n || insns[i + 1].code != 0) {
+                return -1;
+            }
+            i++;
+            break;
+
+        case BPF_LDX:
+            if (insn->dst_reg == BPF_REG_10 ||
+                check_mem(insn, insn->src_reg)) {
+                return -1;
+            }
+            break;
+
+        case BPF_ST:
+        case BPF_STX:
+            if (check_mem(insn, insn->dst_reg)) {
+                return -1;
+            }
+            break;
+
+        case BPF_JMP:
+        case BPF_JMP32: {
+            uint8_t op = BPF_OP(insn->code);
+            unsigned int target;
+
+            if (op == BPF_EXIT) {
+                if (cls != BPF_JMP) {
+                    return -1;
+                }
+                break;
+            }
+            if (op == BPF_CALL || op > BPF_JSLE ||
+                (op == BPF_JA && cls != BPF_JMP)) {
+                return -1; /* no helpers */
+            }
+            /* Forward jumps only, which bounds the run time. */
+            target = i + 1 + insn->off;
+            if (insn->off < 0 || target >= n ||
+                (target > 0 && insns[target - 1].code ==
+                                   (BPF_LD | BPF_IMM | BPF_DW))) {
+                return -1;
+            }
+            break;
+        }
+
+        default:
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+struct ebpf_prog *
+ebpf_create(const struct bpf_insn *insns, unsigned int n)
+{
+    struct ebpf_prog *prog;
+
+    if (ebpf_check(insns, n)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    prog = calloc(1, sizeof(*prog));
+    if (prog == NULL || (prog->insns = malloc(n * sizeof(*insns))) == NULL) {
+        free(prog);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(prog->insns, insns, n * sizeof(*insns));
+    prog->ninsns = n;
+
+    return prog;
+}
+
+struct ebpf_prog *
+ebpf_load(const char *path, const char *section)
+{
+    struct ebpf_prog *prog = NULL;
+    const Elf64_Shdr *sh;
+    unsigned int index;
+    struct stat st;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        errno = ENOEXEC;
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    sh = elf_find_prog(map, st.st_size, section, &index);
+    if (sh == NULL) {
+        goto out;
+    }
+    if (elf_has_relocs(map, index)) {
+        errno = ENOTSUP;
+        goto out;
+    }
+    if (sh->sh_size % sizeof(struct bpf_insn)) {
+        errno = EINVAL;
+        goto out;
+    }
+    prog = ebpf_create((const struct bpf_insn *)(map + sh->sh_offset),
+                       sh->sh_size / sizeof(struct bpf_insn));
+out:
+    munmap(map, st.st_size);
+    return prog;
+}
+
+struct ebpf_prog *
+ebpf_open(const char *spec)
+{
+    char path[256];
+    const char *colon = strrchr(spec, ':');
+    struct ebpf_prog *prog;
+
+    snprintf(path, sizeof(path), "%.*s",
+             colon ? (int)(colon - spec) : (int)strlen(spec), spec);
+    prog = ebpf_load(path, colon ? colon + 1 : NULL);
+    if (prog) {
+        ebpf_jit(prog); /* falls back to the interpreter */
+    }
+    return prog;
+}
+
+void
+ebpf_free(struct ebpf_prog *prog)
+{
+    if (prog == NULL) {
+        return;
+    }
+    if (prog->jit_mem) {
+        munmap(prog->jit_mem, prog->jit_size);
+    }
+    free(prog->insns);
+    free(prog);
+}
+
+/* Accesses through r10 were checked at load time, the others must be
+ * within the frame. */
+static inline int
+mem_ok(unsigned int base, uint64_t addr, unsigned int size, uint64_t pkt,
+       uint32_t len)
+{
+    return base == BPF_REG_10 || (addr - pkt < len && addr - pkt + size <= len);
+}
+
+#define ALU(opc, expr)                                                         \
+    case BPF_ALU64 | (opc) | BPF_X:                                            \
+        reg[insn->dst_reg] = (uint64_t)(expr(reg[insn->dst_reg],               \
+                                             reg[insn->src_reg]));             \
+        break;                                                                 \
+    case BPF_ALU64 | (opc) | BPF_K:                                            \
+        reg[insn->dst_reg] = (uint64_t)(expr(reg[insn->dst_reg],               \
+                                             (uint64_t)(int64_t)insn->imm));   \
+        break;                                                                 \
+    case BPF_ALU | (opc) | BPF_X:                                              \
+        reg[insn->dst_reg] = (uint32_t)(expr((uint32_t)reg[insn->dst_reg],     \
+                                             (uint32_t)reg[insn->src_reg]));   \
+        break;                                                                 \
+    case BPF_ALU | (opc) | BPF_K:                                              \
+        reg[insn->dst_reg] = (uint32_t)(expr((uint32_t)reg[insn->dst_reg],     \
+                                             (uint32_t)insn->imm));            \
+        break
+
+#define JMP(opc, expr)                                                         \
+    case BPF_JMP | (opc) | BPF_X:                                              \
+        if (expr(reg[insn->dst_reg], reg[insn->src_reg], uint64_t, int64_t)) { \
+            pc += insn->off;                                                   \
+        }                                                                      \
+        break;                                                                 \
+    case BPF_JMP | (opc) | BPF_K:                                              \
+        if (expr(reg[insn->dst_reg], (uint64_t)(int64_t)insn->imm, uint64_t,   \
+                 int64_t)) {                                                   \
+            pc += insn->off;                                                   \
+        }                                                                      \
+        break;                                                                 \
+    case BPF_JMP32 | (opc) | BPF_X:                                            \
+        if (expr(reg[insn->dst_reg], reg[insn->src_reg], uint32_t, int32_t)) { \
+            pc += insn->off;                                                   \
+        }                                                                      \
+        break;                                                                 \
+    case BPF_JMP32 | (opc) | BPF_K:                                            \
+        if (expr(reg[insn->dst_reg], (uint32_t)insn->imm, uint32_t,            \
+                 int32_t)) {                                                   \
+            pc += insn->off;                                                   \
+        }                                                                      \
+        break
+
+#define MEM(sz, type)                                                          \
+    case BPF_LDX | BPF_MEM | (sz):                                             \
+        addr = reg[insn->src_reg] + insn->off;                                 \
+        if (!mem_ok(insn->src_reg, addr, sizeof(type), pkt, len)) {            \
+            return EBPF_DROP;                                                  \
+        }                                                                      \
+        reg[insn->dst_reg] = *(type *)(uintptr_t)addr;                         \
+        break;                                                                 \
+    case BPF_STX | BPF_MEM | (sz):                                             \
+        addr = reg[insn->dst_reg] + insn->off;                                 \
+        if (!mem_ok(insn->dst_reg, addr, sizeof(type), pkt, len)) {            \
+            return EBPF_DROP;                                                  \
+        }                                                                      \
+        *(type *)(uintptr_t)addr = reg[insn->src_reg];                         \
+        break;                                                                 \
+    case BPF_ST | BPF_MEM | (sz):                                              \
+        addr = reg[insn->dst_reg] + insn->off;                                 \
+        if (!mem_ok(insn->dst_reg, addr, sizeof(type), pkt, len)) {            \
+            return EBPF_DROP;                                                  \
+        }                                                                      \
+        *(type *)(uintptr_t)addr = insn->imm;                                  \
+        break
+
+#define OP_ADD(a, b) ((a) + (b))
+#define OP_SUB(a, b) ((a) - (b))
+#define OP_MUL(a, b) ((a) * (b))
+#define OP_OR(a, b) ((a) | (b))
+#define OP_AND(a, b) ((a) & (b))
+#define OP_XOR(a, b) ((a) ^ (b))
+#define OP_MOV(a, b) (b)
+/* Shift counts are masked as on x86. */
+#define OP_LSH(a, b) ((a) << ((b) & (sizeof(a) * 8 - 1)))
+#define OP_RSH(a, b) ((a) >> ((b) & (sizeof(a) * 8 - 1)))
+#define OP_ARSH(a, b)                                                          \
+    (sizeof(a) == 8 ? (uint64_t)((int64_t)(a) >> ((b)&63))                     \
+                    : (uint32_t)((int32_t)(a) >> ((b)&31)))
+/* Division by zero gives 0, modulo by zero leaves the dividend. */
+#define OP_DIV(a, b) ((b) ? (a) / (b) : 0)
+#define OP_MOD(a, b) ((b) ? (a) % (b) : (a))
+
+#define J_EQ(a, b, u, s) ((u)(a) == (u)(b))
+#define J_NE(a, b, u, s) ((u)(a) != (u)(b))
+#define J_GT(a, b, u, s) ((u)(a) > (u)(b))
+#define J_GE(a, b, u, s) ((u)(a) >= (u)(b))
+#define J_LT(a, b, u, s) ((u)(a) < (u)(b))
+#define J_LE(a, b, u, s) ((u)(a) <= (u)(b))
+#define J_SGT(a, b, u, s) ((s)(a) > (s)(b))
+#define J_SGE(a, b, u, s) ((s)(a) >= (s)(b))
+#define J_SLT(a, b, u, s) ((s)(a) < (s)(b))
+#define J_SLE(a, b, u, s) ((s)(a) <= (s)(b))
+#define J_SET(a, b, u, s) (((u)(a) & (u)(b)) != 0)
+
+static uint32_t
+ebpf_interp_one(const struct bpf_insn *insns, void *frame, uint32_t len)
+{
+    uint64_t stack_mem[EBPF_STACK_SIZE / 8];
+    uint64_t pkt = (uintptr_t)frame;
+    uint64_t reg[11];
+    unsigned int pc;
+
+    memset(reg, 0, sizeof(reg));
+    reg[BPF_REG_1]  = pkt;
+    reg[BPF_REG_2]  = len;
+    reg[BPF_REG_10] = (uintptr_t)(stack_mem + EBPF_STACK_SIZE / 8);
+
+    for (pc = 0;; pc++) {
+        const struct bpf_insn *insn = &insns[pc];
+        uint64_t addr;
+
+        switch (insn->code) {
+            ALU(BPF_ADD, OP_ADD);
+            ALU(BPF_SUB, OP_SUB);
+            ALU(BPF_MUL, OP_MUL);
+            ALU(BPF_DIV, OP_DIV);
+            ALU(BPF_MOD, OP_MOD);
+            ALU(BPF_OR, OP_OR);
+            ALU(BPF_AND, OP_AND);
+            ALU(BPF_XOR, OP_XOR);
+            ALU(BPF_MOV, OP_MOV);
+            ALU(BPF_LSH, OP_LSH);
+            ALU(BPF_RSH, OP_RSH);
+            ALU(BPF_ARSH, OP_ARSH);
+
+        case BPF_ALU64 | BPF_NEG:
+            reg[insn->dst_reg] = -reg[insn->dst_reg];
+            break;
+        case BPF_ALU | BPF_NEG:
+            reg[insn->dst_reg] = (uint32_t)-reg[insn->dst_reg];
+            break;
+
+        case BPF_ALU | BPF_END | BPF_TO_BE:
+            switch (insn->imm) {
+            case 16:
+                reg[insn->dst_reg] = __builtin_bswap16(reg[insn->dst_reg]);
+                break;
+            case 32:
+                reg[insn->dst_reg] = __builtin_bswap32(reg[insn->dst_reg]);
+                break;
+            default:
+                reg[insn->dst_reg] = __builtin_bswap64(reg[insn->dst_reg]);
+                break;
+            }
+            break;
+        case BPF_ALU | BPF_END | BPF_TO_LE:
+            if (insn->imm == 16) {
+                reg[insn->dst_reg] = (uint16_t)reg[insn->dst_reg];
+            } else if (insn->imm == 32) {
+                reg[insn->dst_reg] = (uint32_t)reg[insn->dst_reg];
+            }
+            break;
+
+        case BPF_LD | BPF_IMM | BPF_DW:
+            reg[insn->dst_reg] = (uint32_t)insn->imm |
+                                 ((uint64_t)(uint32_t)insn[1].imm << 32);
+            pc++;
+            break;
+
+            MEM(BPF_B, uint8_t);
+            MEM(BPF_H, uint16_t);
+            MEM(BPF_W, uint32_t);
+            MEM(BPF_DW, uint64_t);
+
+        case BPF_JMP | BPF_JA:
+            pc += insn->off;
+            break;
+            JMP(BPF_JEQ, J_EQ);
+            JMP(BPF_JNE, J_NE);
+            JMP(BPF_JGT, J_GT);
+            JMP(BPF_JGE, J_GE);
+            JMP(BPF_JLT, J_LT);
+            JMP(BPF_JLE, J_LE);
+            JMP(BPF_JSGT, J_SGT);
+            JMP(BPF_JSGE, J_SGE);
+            JMP(BPF_JSLT, J_SLT);
+            JMP(BPF_JSLE, J_SLE);
+            JMP(BPF_JSET, J_SET);
+
+        case BPF_JMP | BPF_EXIT:
+            return reg[BPF_REG_0];
+
+        default:
+            return EBPF_DROP; /* rejected at load time */
+        }
+    }
+}
+
+void
+ebpf_interp(const struct ebpf_prog *prog, void *const *pkt,
+            const uint32_t *len, uint32_t *verdict, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        verdict[i] = ebpf_interp_one(prog->insns, pkt[i], len[i]);
+    }
+}
@@ -0,0 +1,104 @@
+/*
+ * User-supplied packet classifiers: eBPF programs loaded from an ELF
+ * object (as produced by clang -target bpf) and run per packet, either
+ * by an interpreter or by an x86-64 JIT.
+ *
+ * A program sees the frame in r1 and its length in r2 and returns a
+ * verdict in r0: EBPF_DROP, EBPF_PASS or EBPF_OUT(i) to select output i
+ * where a program has several. Programs are run over a whole burst at
+ * a time: the JIT compiles the loop over the burst around the program,
+ * so there is one call per burst, not per packet.
+ *
+ * Only what a classifier needs is accepted: no helper calls, no maps or
+ * global data, and forward jumps only, so that every program ends. The
+ * stack is accessed through r10 at constant offsets, checked at load
+ * time; every other memory access must fall within the frame, which is
+ * checked at run time (a packet accessed out of bounds is dropped).
+ */
+#ifndef __EBPF_H__
+#define __EBPF_H__
+
+#include <stdint.h>
+#include "pktio.h"
+
+#define EBPF_MAX_INSNS 4096
+#define EBPF_STACK_SIZE 512
+#define EBPF_BURST 64
+
+/* Verdicts. */
+#define EBPF_DROP 0
+#define EBPF_PASS 1
+#define EBPF_OUT(i) (2 + (i))
+
+struct bpf_insn;
+
+typedef void (*ebpf_burst_fn)(void *const *pkt, const uint32_t *len,
+                              uint32_t *verdict, unsigned int n);
+
+struct ebpf_prog {
+    struct bpf_insn *insns;
+    unsigned int ninsns;
+    ebpf_burst_fn jitted; /* NULL when interpreted */
+    void *jit_mem;
+    size_t jit_size;
+};
+
+struct ebpf_prog *ebpf_create(const struct bpf_insn *insns, unsigned int n);
+struct ebpf_prog *ebpf_load(const char *path, const char *section);
+int ebpf_jit(struct ebpf_prog *prog);
+void ebpf_interp(const struct ebpf_prog *prog, void *const *pkt,
+                 const uint32_t *len, uint32_t *verdict, unsigned int n);
+void ebpf_free(struct ebpf_prog *prog);
+
+/* Parse FILE[:SECTION] and load the program, JIT compiled if possible. */
+struct ebpf_prog *ebpf_open(const char *spec);
+
+/*
+ * tcpdump filters (cbpf.c): a classic BPF program, as compiled by
+ * libpcap, is translated to eBPF and then JIT compiled like the others,
+ * so it runs as native code. EXPR is a tcpdump expression (when built
+ * with libpcap, make WITH_PCAP=1) or @FILE, the output of tcpdump -ddd.
+ * On failure errbuf (CBPF_ERRBUF_SIZE bytes) tells why.
+ */
+#define CBPF_ERRBUF_SIZE 256
+
+struct sock_filter;
+
+struct ebpf_prog *cbpf_translate(const struct sock_filter *insns,
+                                 unsigned int n);
+struct ebpf_prog *cbpf_compile(const char *expr, char *errbuf);
+
+/* Compile EXPR with libpcap (cbpf_pcap.c), or fail if built without it. */
+struct sock_filter *cbpf_pcap(const char *expr, unsigned int *n,
+                              char *errbuf);
+
+static inline void
+ebpf_run(const struct ebpf_prog *prog, void *const *pkt, const uint32_t *len,
+         uint32_t *verdict, unsigned int n)
+{
+    if (prog->jitted) {
+        prog->jitted(pkt, len, verdict, n);
+    } else {
+        ebpf_interp(prog, pkt, len, verdict, n);
+    }
+}
+
+/* Classify the n (at most EBPF_BURST) slots of ring from head on. */
+static inline void
+ebpf_run_ring(const struct ebpf_prog *prog, const struct pio_ring *ring,
+              uint32_t head, unsigned int n, uint32_t *verdict)
+{
+    void *pkt[EBPF_BURST];
+    uint32_t len[EBPF_BURST];
+    unsigned int i;
+
+    for (i = 0; i < n; i++, head = pio_ring_next(ring, head)) {
+        const struct pio_slot *slot = &ring->slot[head];
+
+        pkt[i] = PIO_BUF(ring, slot->buf_idx);
+        len[i] = slot->len;
+    }
+    ebpf_run(prog, pkt, len, verdict, n);
+}
+
+#endif /* __EBPF_H__ */
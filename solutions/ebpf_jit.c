@@ -0,0 +1,611 @@
+/*
+ * x86-64 JIT for the eBPF classifiers of ebpf.c.
+ *
+ * The generated function has the ebpf_burst_fn signature and wraps the
+ * program in the loop over the burst, so the registers, the stack frame
+ * and the verdict array are set up once per burst:
+ *
+ *   prologue: save the callee-saved registers, set up the frame
+ *   loop:     r1 = pkt[i], r2 = len[i], other registers = 0
+ *             program (exit jumps to next)
+ *   oob:      r0 = EBPF_DROP
+ *   next:     verdict[i++] = r0, loop while i < n
+ *   epilogue
+ *
+ * The BPF stack is the 512 bytes below rbp (BPF r10); above rbp are the
+ * arguments and the current frame and length, used for the bounds
+ * checks. All jumps are emitted with 32-bit displacements and resolved
+ * once the code has been laid out.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <linux/bpf.h>
+#include "ebpf.h"
+
+#if defined(__x86_64__)
+
+enum {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+};
+
+/* BPF r0-r10. r9 and r10 are scratch registers for div/mod, r11 for the
+ * bounds checks and shifts, r12 holds the index in the burst. */
+static const uint8_t reg_map[] = {RAX, RDI, RSI, RDX, RCX, R8,
+                                  RBX, R13, R14, R15, RBP};
+
+/* Frame slots above rbp. */
+#define F_PKTS 0
+#define F_LENS 8
+#define F_VERDICTS 16
+#define F_N 24
+#define F_PKT 32
+#define F_LEN 40
+#define F_SIZE 48
+
+/* Jump targets other than BPF instructions. */
+#define T_OOB -1
+#define T_NEXT -2
+
+/* x86 condition codes. */
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+#define CC_L 0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G 0xf
+
+struct fixup {
+    uint32_t pos; /* of the rel32 */
+    int target;
+};
+
+struct jit {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    int err;
+    uint32_t *off; /* code offset of each instruction */
+    struct fixup *fix;
+    unsigned int nfix;
+    uint32_t oob;
+    uint32_t next;
+};
+
+static void
+emit1(struct jit *j, uint8_t b)
+{
+    if (j->len == j->cap) {
+        j->err = 1;
+        return;
+    }
+    j->buf[j->len++] = b;
+}
+
+static void
+emit4(struct jit *j, uint32_t v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        emit1(j, v >> (8 * i));
+    }
+}
+
+static void
+emit_rex(struct jit *j, int w, int reg, int index, int rm, int force)
+{
+    uint8_t rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) |
+                  ((rm & 8) >> 3);
+
+    if (rex != 0x40 || force) {
+        emit1(j, rex);
+    }
+}
+
+static void
+emit_op(struct jit *j, int op)
+{
+    if (op > 0xff) {
+        emit1(j, op >> 8);
+    }
+    emit1(j, op & 0xff);
+}
+
+/* op reg, rm (register direct). */
+static void
+emit_rr(struct jit *j, int op, int w, int reg, int rm)
+{
+    emit_rex(j, w, reg, 0, rm, 0);
+    emit_op(j, op);
+    emit1(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op reg, [base + disp]. */
+static void
+emit_mem(struct jit *j, int op, int w, int reg, int base, int32_t disp,
+         int force_rex)
+{
+    emit_rex(j, w, reg, 0, base, force_rex);
+    emit_op(j, op);
+    emit1(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit1(j, 0x24);
+    }
+    emit4(j, disp);
+}
+
+/* op reg, [base + index * (1 << scale)]. base must not be rbp or r13. */
+static void
+emit_sib(struct jit *j, int op, int w, int reg, int base, int index,
+         int scale)
+{
+    emit_rex(j, w, reg, index, base, 0);
+    emit_op(j, op);
+    emit1(j, 0x04 | ((reg & 7) << 3));
+    emit1(j, (scale << 6) | ((index & 7) << 3) | (base & 7));
+}
+
+/* op /ext rm, imm32. */
+static void
+emit_ri(struct jit *j, int op, int ext, int w, int rm, int32_t imm)
+{
+    emit_rex(j, w, 0, 0, rm, 0);
+    emit_op(j, op);
+    emit1(j, 0xc0 | (ext << 3) | (rm & 7));
+    emit4(j, imm);
+}
+
+static void
+emit_jmp(struct jit *j, int cc, int target)
+{
+    if (cc < 0) {
+        emit1(j, 0xe9);
+    } else {
+        emit1(j, 0x0f);
+        emit1(j, 0x80 | cc);
+    }
+    j->fix[j->nfix].pos    = j->len;
+    j->fix[j->nfix].target = target;
+    j->nfix++;
+    emit4(j, 0);
+}
+
+/* Jump within an instruction: returns the position to patch. */
+static uint32_t
+emit_jmp_local(struct jit *j, int cc)
+{
+    if (cc < 0) {
+        emit1(j, 0xe9);
+    } else {
+        emit1(j, 0x0f);
+        emit1(j, 0x80 | cc);
+    }
+    emit4(j, 0);
+    return j->len - 4;
+}
+
+static void
+patch(struct jit *j, uint32_t pos, uint32_t to)
+{
+    uint32_t rel = to - (pos + 4);
+
+    if (pos + 4 <= j->len) {
+        memcpy(j->buf + pos, &rel, 4);
+    }
+}
+
+/* Jump to oob unless [base + off, base + off + size) is in the frame. */
+static void
+emit_bounds(struct jit *j, int base, int16_t off, int size)
+{
+    emit_mem(j, 0x8d, 1, R11, base, off, 0);    /* lea r11, [base+off] */
+    emit_mem(j, 0x2b, 1, R11, RBP, F_PKT, 0);   /* sub r11, pkt */
+    emit_mem(j, 0x3b, 1, R11, RBP, F_LEN, 0);   /* cmp r11, len */
+    emit_jmp(j, CC_AE, T_OOB);
+    emit_ri(j, 0x81, 0, 1, R11, size);          /* add r11, size */
+    emit_mem(j, 0x3b, 1, R11, RBP, F_LEN, 0);   /* cmp r11, len */
+    emit_jmp(j, CC_A, T_OOB);
+}
+
+static void
+emit_divmod(struct jit *j, const struct bpf_insn *insn, int w)
+{
+    int dst = reg_map[insn->dst_reg];
+    int mod = BPF_OP(insn->code) == BPF_MOD;
+    uint32_t zero, end;
+
+    if (BPF_SRC(insn->code) == BPF_X) {
+        emit_rr(j, 0x89, w, reg_map[insn->src_reg], R11);
+    } else {
+        emit_ri(j, 0xc7, 0, w, R11, insn->imm);
+    }
+    emit_rr(j, 0x85, w, R11, R11); /* test r11, r11 */
+    zero = emit_jmp_local(j, CC_E);
+
+    emit_rr(j, 0x89, 1, RAX, R9);
+    emit_rr(j, 0x89, 1, RDX, R10);
+    emit_rr(j, 0x89, w, dst, RAX);
+    emit_rr(j, 0x31, 0, RDX, RDX);
+    emit_rr(j, 0xf7, w, 6, R11); /* div r11 */
+    emit_rr(j, 0x89, 1, mod ? RDX : RAX, R11);
+    emit_rr(j, 0x89, 1, R9, RAX);
+    emit_rr(j, 0x89, 1, R10, RDX);
+    emit_rr(j, 0x89, w, R11, dst);
+    end = emit_jmp_local(j, -1);
+
+    /* Division by zero gives 0, modulo by zero leaves the dividend. */
+    patch(j, zero, j->len);
+    if (!mod) {
+        emit_rr(j, 0x31, 0, dst, dst);
+    } else if (!w) {
+        emit_rr(j, 0x89, 0, dst, dst);
+    }
+    patch(j, end, j->len);
+}
+
+static void
+emit_shift(struct jit *j, const struct bpf_insn *insn, int w, int ext)
+{
+    int dst = reg_map[insn->dst_reg];
+    int src;
+
+    if (BPF_SRC(insn->code) == BPF_K) {
+        emit_rex(j, w, 0, 0, dst, 0);
+        emit1(j, 0xc1);
+        emit1(j, 0xc0 | (ext << 3) | (dst & 7));
+        emit1(j, insn->imm & (w ? 63 : 31));
+        return;
+    }
+
+    /* The count must be in cl: save rcx in r11. */
+    src = reg_map[insn->src_reg];
+    emit_rr(j, 0x89, 1, RCX, R11);
+    if (src != RCX) {
+        emit_rr(j, 0x89, 1, src, RCX);
+    }
+    if (dst == RCX) {
+        emit_rr(j, 0xd3, w, ext, R11);
+        emit_rr(j, 0x89, 1, R11, RCX);
+    } else {
+        emit_rr(j, 0xd3, w, ext, dst);
+        emit_rr(j, 0x89, 1, R11, RCX);
+    }
+}
+
+static int
+jmp_cc(uint8_t op)
+{
+    switch (op) {
+    case BPF_JEQ:
+        return CC_E;
+    case BPF_JNE:
+    case BPF_JSET:
+        return CC_NE;
+    case BPF_JGT:
+        return CC_A;
+    case BPF_JGE:
+        return CC_AE;
+    case BPF_JLT:
+        return CC_B;
+    case BPF_JLE:
+        return CC_BE;
+    case BPF_JSGT:
+        return CC_G;
+    case BPF_JSGE:
+        return CC_GE;
+    case BPF_JSLT:
+        return CC_L;
+    default:
+        return CC_LE;
+    }
+}
+
+static void
+emit_insn(struct jit *j, const struct bpf_insn *insns, unsigned int i)
+{
+    const struct bpf_insn *insn = &insns[i];
+    uint8_t cls                 = BPF_CLASS(insn->code);
+    uint8_t op                  = BPF_OP(insn->code);
+    int w                       = cls == BPF_ALU64 || cls == BPF_JMP;
+    int dst                     = reg_map[insn->dst_reg];
+    int src                     = reg_map[insn->src_reg];
+    int x                       = BPF_SRC(insn->code) == BPF_X;
+    static const int alu_rr[16] = {
+        [BPF_ADD >> 4] = 0x01, [BPF_SUB >> 4] = 0x29, [BPF_OR >> 4] = 0x09,
+        [BPF_AND >> 4] = 0x21, [BPF_XOR >> 4] = 0x31, [BPF_MOV >> 4] = 0x89,
+    };
+    static const int alu_ext[16] = {
+        [BPF_ADD >> 4] = 0, [BPF_SUB >> 4] = 5, [BPF_OR >> 4] = 1,
+        [BPF_AND >> 4] = 4, [BPF_XOR >> 4] = 6,
+    };
+    /* load opcodes for BPF_W, BPF_H, BPF_B, BPF_DW */
+    static const int ld_op[4] = {0x8b, 0x0fb7, 0x0fb6, 0x8b};
+    static const int sizes[4] = {4, 2, 1, 8};
+    int sz                    = BPF_SIZE(insn->code) >> 3;
+
+    switch (cls) {
+    case BPF_ALU:
+    case BPF_ALU64:
+        switch (op) {
+        case BPF_ADD:
+        case BPF_SUB:
+        case BPF_OR:
+        case BPF_AND:
+        case BPF_XOR:
+            if (x) {
+                emit_rr(j, alu_rr[op >> 4], w, src, dst);
+            } else {
+                emit_ri(j, 0x81, alu_ext[op >> 4], w, dst, insn->imm);
+            }
+            break;
+        case BPF_MOV:
+            if (x) {
+                emit_rr(j, 0x89, w, src, dst);
+            } else {
+                emit_ri(j, 0xc7, 0, w, dst, insn->imm);
+            }
+            break;
+        case BPF_MUL:
+            if (x) {
+                emit_rr(j, 0x0faf, w, dst, src);
+            } else {
+                emit_rex(j, w, dst, 0, dst, 0);
+                emit1(j, 0x69);
+                emit1(j, 0xc0 | ((dst & 7) << 3) | (dst & 7));
+                emit4(j, insn->imm);
+            }
+            break;
+        case BPF_DIV:
+        case BPF_MOD:
+            emit_divmod(j, insn, w);
+            break;
+        case BPF_LSH:
+            emit_shift(j, insn, w, 4);
+            break;
+        case BPF_RSH:
+            emit_shift(j, insn, w, 5);
+            break;
+        case BPF_ARSH:
+            emit_shift(j, insn, w, 7);
+            break;
+        case BPF_NEG:
+            emit_rr(j, 0xf7, w, 3, dst);
+            break;
+        case BPF_END:
+            if (BPF_SRC(insn->code) == BPF_TO_BE) {
+                if (insn->imm == 16) {
+                    emit1(j, 0x66); /* rol dst16, 8 */
+                    emit_rex(j, 0, 0, 0, dst, 0);
+                    emit1(j, 0xc1);
+                    emit1(j, 0xc0 | (dst & 7));
+                    emit1(j, 8);
+                    emit_rr(j, 0x0fb7, 0, dst, dst);
+                } else {
+                    emit_rex(j, insn->imm == 64, 0, 0, dst, 0);
+                    emit1(j, 0x0f);
+                    emit1(j, 0xc8 | (dst & 7));
+                }
+            } else if (insn->imm == 16) {
+                emit_rr(j, 0x0fb7, 0, dst, dst);
+            } else if (insn->imm == 32) {
+                emit_rr(j, 0x89, 0, dst, dst);
+            }
+            break;
+        }
+        break;
+
+    case BPF_LD: /* lddw: movabs dst, imm64 */
+        emit_rex(j, 1, 0, 0, dst, 0);
+        emit1(j, 0xb8 | (dst & 7));
+        emit4(j, insn->imm);
+        emit4(j, insns[i + 1].imm);
+        break;
+
+    case BPF_LDX:
+        if (src != RBP) {
+            emit_bounds(j, src, insn->off, sizes[sz]);
+        }
+        emit_mem(j, ld_op[sz], BPF_SIZE(insn->code) == BPF_DW, dst, src,
+                 insn->off, 0);
+        break;
+
+    case BPF_STX:
+        if (dst != RBP) {
+            emit_bounds(j, dst, insn->off, sizes[sz]);
+        }
+        if (BPF_SIZE(insn->code) == BPF_H) {
+            emit1(j, 0x66);
+        }
+        emit_mem(j, BPF_SIZE(insn->code) == BPF_B ? 0x88 : 0x89,
+                 BPF_SIZE(insn->code) == BPF_DW, src, dst, insn->off,
+                 BPF_SIZE(insn->code) == BPF_B);
+        break;
+
+    case BPF_ST:
+        if (dst != RBP) {
+            emit_bounds(j, dst, insn->off, sizes[sz]);
+        }
+        if (BPF_SIZE(insn->code) == BPF_H) {
+            emit1(j, 0x66);
+        }
+        emit_mem(j, BPF_SIZE(insn->code) == BPF_B ? 0xc6 : 0xc7,
+                 BPF_SIZE(insn->code) == BPF_DW, 0, dst, insn->off, 0);
+        if (BPF_SIZE(insn->code) == BPF_B) {
+            emit1(j, insn->imm);
+        } else if (BPF_SIZE(insn->code) == BPF_H) {
+            emit1(j, insn->imm);
+            emit1(j, insn->imm >> 8);
+        } else {
+            emit4(j, insn->imm);
+        }
+        break;
+
+    case BPF_JMP:
+    case BPF_JMP32:
+        if (op == BPF_EXIT) {
+            emit_jmp(j, -1, T_NEXT);
+            break;
+        }
+        if (op == BPF_JA) {
+            emit_jmp(j, -1, i + 1 + insn->off);
+            break;
+        }
+        if (op == BPF_JSET) {
+            if (x) {
+                emit_rr(j, 0x85, w, src, dst);
+            } else {
+                emit_ri(j, 0xf7, 0, w, dst, insn->imm);
+            }
+        } else if (x) {
+            emit_rr(j, 0x39, w, src, dst);
+        } else {
+            emit_ri(j, 0x81, 7, w, dst, insn->imm);
+        }
+        emit_jmp(j, jmp_cc(op), i + 1 + insn->off);
+        break;
+    }
+}
+
+static void
+emit_prog(struct jit *j, const struct bpf_insn *insns, unsigned int n)
+{
+    static const uint8_t saved[] = {RBP, RBX, R12, R13, R14, R15};
+    static const uint8_t zeroed[] = {RAX, RDX, RCX, R8, RBX, R13, R14, R15};
+    uint32_t loop, done;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(saved); i++) {
+        emit_rex(j, 0, 0, 0, saved[i], 0);
+        emit1(j, 0x50 | (saved[i] & 7)); /* push */
+    }
+    emit_ri(j, 0x81, 5, 1, RSP, EBPF_STACK_SIZE + F_SIZE);
+    emit_mem(j, 0x8d, 1, RBP, RSP, EBPF_STACK_SIZE, 0);
+    emit_mem(j, 0x89, 1, RDI, RBP, F_PKTS, 0);
+    emit_mem(j, 0x89, 1, RSI, RBP, F_LENS, 0);
+    emit_mem(j, 0x89, 1, RDX, RBP, F_VERDICTS, 0);
+    emit_rr(j, 0x89, 0, RCX, RCX);
+    emit_mem(j, 0x89, 1, RCX, RBP, F_N, 0);
+    emit_rr(j, 0x31, 0, R12, R12);
+
+    loop = j->len;
+    emit_mem(j, 0x3b, 1, R12, RBP, F_N, 0);
+    done = emit_jmp_local(j, CC_AE);
+    emit_mem(j, 0x8b, 1, RAX, RBP, F_PKTS, 0);
+    emit_sib(j, 0x8b, 1, RDI, RAX, R12, 3);
+    emit_mem(j, 0x89, 1, RDI, RBP, F_PKT, 0);
+    emit_mem(j, 0x8b, 1, RAX, RBP, F_LENS, 0);
+    emit_sib(j, 0x8b, 0, RSI, RAX, R12, 2);
+    emit_mem(j, 0x89, 1, RSI, RBP, F_LEN, 0);
+    for (i = 0; i < sizeof(zeroed); i++) {
+        emit_rr(j, 0x31, 0, zeroed[i], zeroed[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        j->off[i] = j->len;
+        emit_insn(j, insns, i);
+        if (insns[i].code == (BPF_LD | BPF_IMM | BPF_DW)) {
+            j->off[++i] = j->len;
+        }
+    }
+
+    j->oob = j->len;
+    emit_rr(j, 0x31, 0, RAX, RAX);
+    j->next = j->len;
+    emit_mem(j, 0x8b, 1, RCX, RBP, F_VERDICTS, 0);
+    emit_sib(j, 0x89, 0, RAX, RCX, R12, 2);
+    emit_rr(j, 0xff, 1, 0, R12); /* inc r12 */
+    patch(j, emit_jmp_local(j, -1), loop);
+
+    patch(j, done, j->len);
+    emit_ri(j, 0x81, 0, 1, RSP, EBPF_STACK_SIZE + F_SIZE);
+    for (i = sizeof(saved); i-- > 0;) {
+        emit_rex(j, 0, 0, 0, saved[i], 0);
+        emit1(j, 0x58 | (saved[i] & 7)); /* pop */
+    }
+    emit1(j, 0xc3);
+
+    for (i = 0; i < j->nfix; i++) {
+        int target = j->fix[i].target;
+
+        patch(j, j->fix[i].pos,
+              target == T_OOB ? j->oob
+                              : target == T_NEXT ? j->next : j->off[target]);
+    }
+}
+
+int
+ebpf_jit(struct ebpf_prog *prog)
+{
+    struct jit j;
+    void *mem;
+
+    memset(&j, 0, sizeof(j));
+    /* Enough for the largest instructions (div/mod, checked stores). */
+    j.cap = 256 + (size_t)prog->ninsns * 96;
+    j.buf = malloc(j.cap);
+    j.off = calloc(prog->ninsns, sizeof(*j.off));
+    j.fix = calloc(prog->ninsns * 2, sizeof(*j.fix));
+    if (j.buf == NULL || j.off == NULL || j.fix == NULL) {
+        j.err = 1;
+        goto out;
+    }
+
+    emit_prog(&j, prog->insns, prog->ninsns);
+    if (j.err) {
+        goto out;
+    }
+
+    mem = mmap(NULL, j.len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        j.err = 1;
+        goto out;
+    }
+    memcpy(mem, j.buf, j.len);
+    if (mprotect(mem, j.len, PROT_READ | PROT_EXEC)) {
+        munmap(mem, j.len);
+        j.err = 1;
+        goto out;
+    }
+    prog->jit_mem  = mem;
+    prog->jit_size = j.len;
+    prog->jitted   = (ebpf_burst_fn)mem;
+out:
+    free(j.buf);
+    free(j.off);
+    free(j.fix);
+    return j.err ? -1 : 0;
+}
+
+#else /* !__x86_64__ */
+
+int
+ebpf_jit(struct ebpf_prog *prog)
+{
+    (void)prog;
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * epoll event loop over pio ports.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "evloop.h"
+
+/* epoll data of the internal descriptors, above the port ids. */
+#define EV_ID_EVENTFD EV_MAX_PORTS
+#define EV_ID_TIMERFD (EV_MAX_PORTS + 1)
+
+static uint32_t
+ev_mask(short events)
+{
+    return (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+}
+
+static int
+ev_ctl(struct evloop *ev, int op, int fd, uint32_t mask, uint32_t id)
+{
+    struct epoll_event e;
+
+    memset(&e, 0, sizeof(e));
+    e.events   = mask;
+    e.data.u32 = id;
+
+    return epoll_ctl(ev->epfd, op, fd, &e);
+}
+
+/* A tick_ms of 0 disables the timer. */
+int
+ev_init(struct evloop *ev, unsigned int tick_ms)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->efd  = -1;
+    ev->tfd  = -1;
+    ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev->epfd < 0) {
+        return -1;
+    }
+
+    ev->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ev->efd < 0 || ev_ctl(ev, EPOLL_CTL_ADD, ev->efd, EPOLLIN,
+                              EV_ID_EVENTFD)) {
+        goto fail;
+    }
+
+    if (tick_ms) {
+        struct itimerspec its;
+
+        its.it_interval.tv_sec  = tick_ms / 1000;
+        its.it_interval.tv_nsec = (tick_ms % 1000) * 1000000L;
+        its.it_value            = its.it_interval;
+        ev->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (ev->tfd < 0 || timerfd_settime(ev->tfd, 0, &its, NULL) ||
+            ev_ctl(ev, EPOLL_CTL_ADD, ev->tfd, EPOLLIN, EV_ID_TIMERFD)) {
+            goto fail;
+        }
+    }
+
+    return 0;
+fail:
+    ev_close(ev);
+    return -1;
+}
+
+/* Returns the id of the port, its bit in the ev_wait() bitmap. */
+int
+ev_add_port(struct evloop *ev, struct pio_port *port, short events)
+{
+    unsigned int id = ev->nports;
+
+    if (id == EV_MAX_PORTS) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (port->fd < 0) {
+        ev->nofd |= 1ULL << id;
+    } else if (ev_ctl(ev, EPOLL_CTL_ADD, port->fd, ev_mask(events), id)) {
+        return -1;
+    }
+    ev->port[id]   = port;
+    ev->events[id] = events;
+    ev->nports++;
+
+    return id;
+}
+
+/*
+ * Set the events to wait for on a port. Must be called for every port
+ * whose rings the program has touched, as these are the ones pushed by
+ * the next ev_wait().
+ */
+int
+ev_want(struct evloop *ev, unsigned int id, short events)
+{
+    struct pio_port *port = ev->port[id];
+
+    ev->dirty |= 1ULL << id;
+    if (events == ev->events[id]) {
+        return 0;
+    }
+    ev->events[id] = events;
+    if (port->fd < 0) {
+        return 0;
+    }
+
+    return ev_ctl(ev, EPOLL_CTL_MOD, port->fd, ev_mask(events), id);
+}
+
+/*
+ * Wait up to timeout milliseconds (-1 forever) and store the bitmap of
+ * the ready ports in *ready, with their rings synchronized. Returns the
+ * EV_* flags, or -1 on error.
+ */
+int
+ev_wait(struct evloop *ev, int timeout, uint64_t *ready)
+{
+    struct epoll_event evs[EV_MAX_PORTS + 2];
+    uint64_t touched = ev->dirty;
+    uint64_t dirty;
+    int flags = 0;
+
+    /* Hand the released slots over to the backends. */
+    ev->dirty = 0;
+    for (dirty = touched; dirty; dirty &= dirty - 1) {
+        struct pio_port *port = ev->port[__builtin_ctzll(dirty)];
+
+        port->ops->push(port);
+        if (port->ops->kick) {
+            port->ops->kick(port);
+        }
+    }
+
+    *ready = 0;
+    for (;;) {
+        uint64_t nofd = ev->nofd;
+        int n, i;
+
+        n = epoll_wait(ev->epfd, evs, EV_MAX_PORTS + 2, nofd ? 0 : timeout);
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            uint32_t id = evs[i].data.u32;
+            uint64_t val;
+
+            if (id == EV_ID_EVENTFD) {
+                if (read(ev->efd, &val, sizeof(val)) == sizeof(val)) {
+                    flags |= EV_CONTROL;
+                }
+            } else if (id == EV_ID_TIMERFD) {
+                if (read(ev->tfd, &val, sizeof(val)) == sizeof(val)) {
+                    flags |= EV_TICK;
+                }
+            } else {
+                *ready |= 1ULL << id;
+            }
+        }
+        /* Pull the ready ports, and the touched ones to reclaim their
+         * TX slots even if they are only waited on for RX. */
+        for (dirty = (*ready | touched) & ~nofd; dirty; dirty &= dirty - 1) {
+            struct pio_port *port = ev->port[__builtin_ctzll(dirty)];
+
+            pio_pull(port);
+        }
+        touched = 0;
+        while (nofd) {
+            unsigned int id       = __builtin_ctzll(nofd);
+            struct pio_port *port = ev->port[id];
+
+            nofd &= nofd - 1;
+            pio_pull(port);
+            if (pio_revents(port, ev->events[id])) {
+                *ready |= 1ULL << id;
+            }
+        }
+        if (*ready || flags || !ev->nofd || timeout == 0 ||
+            __atomic_load_n(&ev->requests, __ATOMIC_RELAXED)) {
+            return flags;
+        }
+        sched_yield();
+    }
+}
+
+/* Post requests to the loop. Async-signal-safe. */
+void
+ev_notify(struct evloop *ev, uint32_t req)
+{
+    uint64_t one = 1;
+
+    __atomic_fetch_or(&ev->requests, req, __ATOMIC_RELEASE);
+    if (write(ev->efd, &one, sizeof(one)) < 0) {
+        /* The counter is already non-zero, the loop will wake up. */
+    }
+}
+
+/* Take the pending requests. */
+uint32_t
+ev_requests(struct evloop *ev)
+{
+    return __atomic_exchange_n(&ev->requests, 0, __ATOMIC_ACQUIRE);
+}
+
+void
+ev_close(struct evloop *ev)
+{
+    if (ev->tfd >= 0) {
+        close(ev->tfd);
+    }
+    if (ev->efd >= 0) {
+        close(ev->efd);
+    }
+    if (ev->epfd >= 0) {
+        close(ev->epfd);
+    }
+    ev->tfd = ev->efd = ev->epfd = -1;
+}
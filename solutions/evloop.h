@@ -0,0 +1,52 @@
+/*
+ * epoll event loop over pio ports, for programs with many ports.
+ *
+ * Ports are registered once and their events only change (EPOLL_CTL_MOD)
+ * when ev_want() asks for different ones. An eventfd carries stop and
+ * control requests, posted with ev_notify() (also from signal handlers),
+ * and a timerfd ticks for the periodic work such as publishing stats,
+ * so that the loop can block without a timeout.
+ *
+ * ev_wait() returns the bitmap of the ports that woke up. Only the ports
+ * passed to ev_want() since the previous call are pushed, and only the
+ * ready ones are pulled, so an iteration costs O(active ports) whatever
+ * the number of registered ones. Ports without a file descriptor (mem:)
+ * cannot be waited on: as in pio_poll(), they are busy-polled.
+ */
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include <stdint.h>
+#include "pktio.h"
+
+#define EV_MAX_PORTS 64
+
+/* Flags returned by ev_wait(). */
+#define EV_TICK 0x1    /* the timer expired */
+#define EV_CONTROL 0x2 /* requests are pending, see ev_requests() */
+
+/* Requests for ev_notify(). */
+#define EV_REQ_STOP 0x1
+#define EV_REQ_DUMP 0x2 /* print the counters */
+
+struct evloop {
+    int epfd;
+    int efd; /* eventfd for the requests */
+    int tfd; /* timerfd for the ticks */
+    unsigned int nports;
+    struct pio_port *port[EV_MAX_PORTS];
+    short events[EV_MAX_PORTS]; /* as registered */
+    uint64_t nofd;              /* ports to busy-poll */
+    uint64_t dirty;             /* ports to push before waiting */
+    uint32_t requests;
+};
+
+int ev_init(struct evloop *ev, unsigned int tick_ms);
+int ev_add_port(struct evloop *ev, struct pio_port *port, short events);
+int ev_want(struct evloop *ev, unsigned int id, short events);
+int ev_wait(struct evloop *ev, int timeout, uint64_t *ready);
+void ev_notify(struct evloop *ev, uint32_t req);
+uint32_t ev_requests(struct evloop *ev);
+void ev_close(struct evloop *ev);
+
+#endif /* __EVLOOP_H__ */
@@ -5,7 +5,23 @@
  * B by command line: packets with destination port A will be forwarded
  * to the second netmap port; packets with destination port B will be
  * forwarded to the third netmap port; all the other packets are
- * dropped.
+ * dropped. Instead of UDP ports, the packets for the second and third
+ * ports can be selected by tcpdump expressions (-f, see ebpf.h).
+ * Optionally (-F) a flight recorder keeps a trace of the
+ * packets seen and of their verdicts, see trace.h and nmtrace.
+ * With -E the ports are waited on with an epoll event loop (evloop.h)
+ * instead of poll().
+ * With -H the packets that would be dropped are passed to the host
+ * stack through the host rings of the first port (NAME^), and what the
+ * host stack sends goes out of the first port.
+ * With -T the egress of the second and third ports is shaped by a
+ * hierarchical token bucket tree loaded from a file (htb.h): the packets
+ * routed there are queued in its leaves, by destination address, and
+ * leave when the tree lets them. With -A they are also dropped by CoDel
+ * (codel.h) when they stood there too long.
+ * With -s and -w one packet in N received on the first port, or the
+ * packets of one flow in N, is sampled, and its first bytes are written
+ * to a pcap file by an exporter thread, see sample.h.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,86 +29,88 @@
 #include <signal.h>
 #include <errno.h>
 #include <poll.h>
+#include <string.h>
 #include <net/if.h>
 #include <stdint.h>
-#include <net/netmap.h>
-#define NETMAP_WITH_LIBS
-#include <net/netmap_user.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
 #include <netinet/tcp.h>
+#include "pktio.h"
+#include "pkt.h"
+#include "ebpf.h"
+#include "evloop.h"
+#include "fwdloop.h"
+#include "qos.h"
+#include "sample.h"
+#include "stats.h"
+#include "trace.h"
+#include "tsc.h"
 
 static int stop                   = 0;
 static unsigned long long fwdback = 0;
 static unsigned long long fwda    = 0;
 static unsigned long long fwdb    = 0;
 static unsigned long long tot     = 0;
+static unsigned long long tohost   = 0;
+static unsigned long long fromhost = 0;
+static struct stats_hist batch_h;
+static struct stats_hist proc_h;
+static struct trace *trace = NULL;
+static struct evloop *evl   = NULL;
+static struct sampler *sampler    = NULL;
+static struct ebpf_prog *filter_a = NULL;
+static struct ebpf_prog *filter_b = NULL;
+
+/* The most stats entries registered: 15 counters, the RX rings of four
+ * ports, the tree and two histograms. */
+#define FE_STATS                                                               \
+    (15 + 4 * STATS_PORT_ENTRIES + HTB_STATS + 2 * STATS_HIST_ENTRIES)
+_Static_assert(FE_STATS <= STATS_MAX, "the stats of fe fit");
+
+#ifdef SOLUTION
+static fwd_fn host_pkts; /* from the host stack to port one */
+static struct fwd_ctx host_ctx;
+static struct qos *shape_two; /* the egress queues of -T */
+static struct qos *shape_three;
+static uint32_t sample_left; /* packets to the next sample_take() */
+#endif /* SOLUTION */
 
 static void
 sigint_handler(int signum)
 {
     stop = 1;
-}
-
-static int
-rx_ready(struct nm_desc *nmd)
-{
-    unsigned int ri;
-
-    for (ri = nmd->first_rx_ring; ri <= nmd->last_rx_ring; ri++) {
-        struct netmap_ring *ring;
-
-        ring = NETMAP_RXRING(nmd->nifp, ri);
-        if (nm_ring_space(ring)) {
-            return 1; /* there is something to read */
-        }
+    if (evl) {
+        ev_notify(evl, EV_REQ_STOP);
     }
-
-    return 0;
 }
 
-static inline int
-pkt_get_udp_port(const char *buf)
+static void
+sigusr1_handler(int signum)
 {
-    struct ether_header *ethh;
-    struct ip *iph;
-    struct udphdr *udph;
-
-    ethh = (struct ether_header *)buf;
-    if (ethh->ether_type != htons(ETHERTYPE_IP)) {
-        /* Filter out non-IP traffic. */
-        return 0;
-    }
-    iph = (struct ip *)(ethh + 1);
-    if (iph->ip_p != IPPROTO_UDP) {
-        /* Filter out non-UDP traffic. */
-        return 0;
+    if (evl) {
+        ev_notify(evl, EV_REQ_DUMP);
     }
-    udph = (struct udphdr *)(iph + 1);
-
-    /* Return destination port. */
-    return ntohs(udph->uh_dport);
 }
 
 #ifdef SOLUTION
 static int
-pkt_copy_or_drop(struct nm_desc *dst, const char *buf, unsigned len)
+pkt_copy_or_drop(struct pio_port *dst, const char *buf, unsigned len)
 {
     unsigned int di;
 
     for (di = dst->first_tx_ring; di <= dst->last_tx_ring; di++) {
-        struct netmap_ring *txring = NETMAP_TXRING(dst->nifp, di);
+        struct pio_ring *txring = PIO_TXRING(dst, di);
 
-        if (nm_ring_space(txring)) {
-            struct netmap_slot *ts = &txring->slot[txring->head];
-            char *txbuf            = NETMAP_BUF(txring, ts->buf_idx);
+        if (pio_ring_space(txring)) {
+            struct pio_slot *ts = &txring->slot[txring->head];
+            char *txbuf         = PIO_BUF(txring, ts->buf_idx);
 
             ts->len = len;
             memcpy(txbuf, buf, len);
-            txring->cur = txring->head = nm_ring_next(txring, txring->head);
+            txring->cur = txring->head = pio_ring_next(txring, txring->head);
             return 1;
         }
     }
@@ -101,59 +119,124 @@ pkt_copy_or_drop(struct nm_desc *dst, const char *buf, unsigned len)
 }
 
 static void
-route_forward(struct nm_desc *one, struct nm_desc *two, struct nm_desc *three,
+route_forward(struct pio_port *one, struct pio_port *two,
+              struct pio_port *three, struct pio_port *host,
               unsigned int udp_port_a, unsigned int udp_port_b)
 {
-    unsigned int si = one->first_rx_ring;
+    unsigned int si    = pio_rx_next(one, one->first_rx_ring);
+    unsigned int hi    = host ? host->first_tx_ring : 0;
+    int host_zc        = host && pio_same_mem(host, one);
+    uint64_t now       = shape_two ? rdtsc() : 0;
+    uint32_t countdown = sample_left;
+    uint32_t verdict_a[EBPF_BURST], verdict_b[EBPF_BURST];
 
     while (si <= one->last_rx_ring) {
-        struct netmap_ring *rxring;
+        struct pio_ring *rxring;
         unsigned int rxhead;
+        unsigned int nv = 0, k = 0;
         int nrx;
 
-        rxring = NETMAP_RXRING(one->nifp, si);
-        nrx    = nm_ring_space(rxring);
+        rxring = PIO_RXRING(one, si);
+        nrx    = pio_ring_space(rxring);
         if (nrx == 0) {
-            si++;
+            pio_rx_update(one, si);
+            si = pio_rx_next(one, si + 1);
             continue;
         }
 
         rxhead = rxring->head;
-        for (; nrx > 0; nrx--, rxhead = nm_ring_next(rxring, rxhead)) {
-            struct netmap_slot *rs = &rxring->slot[rxhead];
-            char *rxbuf            = NETMAP_BUF(rxring, rs->buf_idx);
-            int udp_port           = pkt_get_udp_port(rxbuf);
-
-            if (udp_port == udp_port_a) {
-                fwda += pkt_copy_or_drop(two, rxbuf, rs->len);
-            } else if (udp_port == udp_port_b) {
-                fwdb += pkt_copy_or_drop(three, rxbuf, rs->len);
+        for (; nrx > 0; nrx--, rxhead = pio_ring_next(rxring, rxhead)) {
+            struct pio_slot *rs = &rxring->slot[rxhead];
+            char *rxbuf         = PIO_BUF(rxring, rs->buf_idx);
+            int verdict         = TRACE_DROP;
+            int is_a, is_b;
+
+            if (--countdown == 0) {
+                countdown = sample_take(sampler, rxbuf, rs->len);
+            }
+            if (filter_a) {
+                if (k == nv) {
+                    /* Classify the next burst with one call each. */
+                    nv = nrx < EBPF_BURST ? nrx : EBPF_BURST;
+                    ebpf_run_ring(filter_a, rxring, rxhead, nv, verdict_a);
+                    if (filter_b) {
+                        ebpf_run_ring(filter_b, rxring, rxhead, nv, verdict_b);
+                    }
+                    k = 0;
+                }
+                is_a = verdict_a[k] != EBPF_DROP;
+                is_b = filter_b && verdict_b[k] != EBPF_DROP;
+                k++;
+            } else {
+                int udp_port = pkt_get_udp_port(rxbuf);
+
+                is_a = udp_port == udp_port_a;
+                is_b = udp_port == udp_port_b;
+            }
+
+            if (is_a) {
+                if (shape_two) {
+                    /* Counted in fwda when it leaves the queue. */
+                    verdict = qos_enqueue(shape_two, rs, rxbuf, now)
+                                  ? TRACE_FWD_A
+                                  : TRACE_FULL;
+                } else if (pkt_copy_or_drop(two, rxbuf, rs->len)) {
+                    fwda++;
+                    verdict = TRACE_FWD_A;
+                } else {
+                    verdict = TRACE_FULL;
+                }
+            } else if (is_b) {
+                if (shape_three) {
+                    verdict = qos_enqueue(shape_three, rs, rxbuf, now)
+                                  ? TRACE_FWD_B
+                                  : TRACE_FULL;
+                } else if (pkt_copy_or_drop(three, rxbuf, rs->len)) {
+                    fwdb++;
+                    verdict = TRACE_FWD_B;
+                } else {
+                    verdict = TRACE_FULL;
+                }
+            } else if (host) {
+                if (fwd_to_host(host, &hi, host_zc, rs, rxbuf)) {
+                    tohost++;
+                    verdict = TRACE_HOST;
+                } else {
+                    verdict = TRACE_FULL;
+                }
+            }
+            if (trace && trace_want(trace, verdict)) {
+                trace_record(trace, 0, si, rxhead, rxbuf, rs->len, verdict,
+                             rdtsc());
             }
             tot++;
         }
         rxring->head = rxring->cur = rxhead;
+        pio_rx_update(one, si);
     }
+    sample_left = countdown;
 }
 #endif /* SOLUTION */
 
 static void
-forward_pkts(struct nm_desc *src, struct nm_desc *dst)
+forward_pkts(struct pio_port *src, unsigned int src_id, struct pio_port *dst)
 {
-    unsigned int si = src->first_rx_ring;
+    unsigned int si = pio_rx_next(src, src->first_rx_ring);
     unsigned int di = dst->first_tx_ring;
 
     while (si <= src->last_rx_ring && di <= dst->last_tx_ring) {
-        struct netmap_ring *txring;
-        struct netmap_ring *rxring;
+        struct pio_ring *txring;
+        struct pio_ring *rxring;
         unsigned int rxhead, txhead;
         int nrx, ntx;
 
-        rxring = NETMAP_RXRING(src->nifp, si);
-        txring = NETMAP_TXRING(dst->nifp, di);
-        nrx    = nm_ring_space(rxring);
-        ntx    = nm_ring_space(txring);
+        rxring = PIO_RXRING(src, si);
+        txring = PIO_TXRING(dst, di);
+        nrx    = pio_ring_space(rxring);
+        ntx    = pio_ring_space(txring);
         if (nrx == 0) {
-            si++;
+            pio_rx_update(src, si);
+            si = pio_rx_next(src, si + 1);
             continue;
         }
         if (ntx == 0) {
@@ -164,78 +247,299 @@ forward_pkts(struct nm_desc *src, struct nm_desc *dst)
         rxhead = rxring->head;
         txhead = txring->head;
         for (; nrx > 0 && ntx > 0;
-             nrx--, rxhead = nm_ring_next(rxring, rxhead), tot++) {
-            struct netmap_slot *rs = &rxring->slot[rxhead];
-            struct netmap_slot *ts = &txring->slot[txhead];
-            char *rxbuf            = NETMAP_BUF(rxring, rs->buf_idx);
-            char *txbuf            = NETMAP_BUF(txring, ts->buf_idx);
+             nrx--, rxhead = pio_ring_next(rxring, rxhead), tot++) {
+            struct pio_slot *rs = &rxring->slot[rxhead];
+            struct pio_slot *ts = &txring->slot[txhead];
+            char *rxbuf         = PIO_BUF(rxring, rs->buf_idx);
+            char *txbuf         = PIO_BUF(txring, ts->buf_idx);
 
             ts->len = rs->len;
             memcpy(txbuf, rxbuf, ts->len);
-            txhead = nm_ring_next(txring, txhead);
+            txhead = pio_ring_next(txring, txhead);
             ntx--;
             fwdback++;
             tot++;
+            if (trace && trace_want(trace, TRACE_BACK)) {
+                trace_record(trace, src_id, si, rxhead, rxbuf, rs->len,
+                             TRACE_BACK, rdtsc());
+            }
         }
         /* Update state of netmap ring. */
         rxring->head = rxring->cur = rxhead;
         txring->head = txring->cur = txhead;
+        pio_rx_update(src, si);
+    }
+}
+
+#ifdef SOLUTION
+#define FE_TICK_MS 10 /* stats publishing period */
+#define FE_ONE (1ULL << 0)
+#define FE_TWO (1ULL << 1)
+#define FE_THREE (1ULL << 2)
+#define FE_HOST (1ULL << 3)
+
+/*
+ * The forwarding of the poll() loop below, driven by an evloop. Ports
+ * two and three only stay pending when port one ran out of TX space;
+ * their readiness is recomputed only after processing them.
+ */
+static void
+event_loop(struct pio_port *port_one, struct pio_port *port_two,
+           struct pio_port *port_three, struct pio_port *host,
+           int udp_port_a, int udp_port_b, struct stats *st)
+{
+    struct evloop ev;
+    uint64_t pending = 0; /* ports with RX slots left over */
+
+    if (ev_init(&ev, FE_TICK_MS) || ev_add_port(&ev, port_one, POLLIN) < 0 ||
+        ev_add_port(&ev, port_two, POLLIN) < 0 ||
+        ev_add_port(&ev, port_three, POLLIN) < 0 ||
+        (host && ev_add_port(&ev, host, POLLIN) < 0)) {
+        printf("Failed to set up the event loop: %s\n", strerror(errno));
+        ev_close(&ev);
+        return;
+    }
+    evl = &ev;
+
+    while (!stop) {
+        unsigned long long tot0;
+        uint64_t ready, active;
+        uint64_t t0;
+        int flags;
+
+        /* No timeout: stop requests come through the eventfd. */
+        flags = ev_wait(&ev, -1, &ready);
+        if (flags < 0) {
+            perror("ev_wait()");
+            break;
+        }
+        /* Hand over the samples of the last round, at least every tick. */
+        sample_flush(sampler);
+        if (flags & EV_TICK) {
+            stats_publish(st);
+        }
+        if (flags & EV_CONTROL) {
+            uint32_t req = ev_requests(&ev);
+
+            if (req & EV_REQ_STOP) {
+                break;
+            }
+            if (req & EV_REQ_DUMP) {
+                printf("tot %llu fwda %llu fwdb %llu fwdback %llu\n", tot,
+                       fwda, fwdb, fwdback);
+            }
+        }
+        active = ready | pending;
+        if (!active) {
+            continue;
+        }
+        t0   = rdtsc();
+        tot0 = tot;
+
+        if (active & FE_ONE) {
+            route_forward(port_one, port_two, port_three, host, udp_port_a,
+                          udp_port_b);
+        }
+        if (active & FE_TWO) {
+            forward_pkts(port_two, 1, port_one);
+        }
+        if (active & FE_THREE) {
+            forward_pkts(port_three, 2, port_one);
+        }
+        if (active & FE_HOST) {
+            host_pkts(host, port_one, NULL, &host_ctx);
+        }
+        if (tot != tot0) {
+            stats_hist_add(&batch_h, tot - tot0);
+            stats_hist_add(&proc_h, tsc2ns(rdtsc() - t0));
+        }
+
+        /* Port one is always drained (packets that do not fit are
+         * dropped), ports two and three may be left with packets. */
+        pending &= ~active;
+        if ((active & FE_TWO) && pio_rx_ready(port_two)) {
+            pending |= FE_TWO;
+        }
+        if ((active & FE_THREE) && pio_rx_ready(port_three)) {
+            pending |= FE_THREE;
+        }
+        if ((active & FE_HOST) && pio_rx_ready(host)) {
+            pending |= FE_HOST;
+        }
+
+        /* Update the ports whose rings were touched. */
+        ev_want(&ev, 0, POLLIN | (pending ? POLLOUT : 0));
+        if (active & (FE_ONE | FE_TWO)) {
+            ev_want(&ev, 1, pending & FE_TWO ? 0 : POLLIN);
+        }
+        if (active & (FE_ONE | FE_THREE)) {
+            ev_want(&ev, 2, pending & FE_THREE ? 0 : POLLIN);
+        }
+        if (host && (active & (FE_ONE | FE_HOST))) {
+            ev_want(&ev, 3, pending & FE_HOST ? 0 : POLLIN);
+        }
     }
+
+    evl = NULL;
+    ev_close(&ev);
 }
+#endif /* SOLUTION */
 
 static int
 main_loop(const char *netmap_port_one, const char *netmap_port_two,
-          const char *netmap_port_three, int udp_port_a, int udp_port_b)
+          const char *netmap_port_three, int udp_port_a, int udp_port_b,
+          const char *metrics, struct pio_wakeup *wk,
+          struct pio_txflush *tf, int epoll, int host,
+          struct qos_conf *qc)
 {
-    struct nm_desc *nmd_one;
-    struct nm_desc *nmd_two;
-    struct nm_desc *nmd_three;
+    struct pio_port *port_one;
+    struct pio_port *port_two;
+    struct pio_port *port_three;
+    struct pio_port *host_one = NULL;
+    struct stats *st;
+    int serr = 0; /* a stats registration failed */
+#ifdef SOLUTION
+    struct qos qos_two;
+    struct qos qos_three;
+#endif /* SOLUTION */
 
-    nmd_one = nm_open(netmap_port_one, NULL, 0, NULL);
-    if (nmd_one == NULL) {
+    port_one = pio_open(netmap_port_one, NULL);
+    if (port_one == NULL) {
         if (!errno) {
-            printf("Failed to nm_open(%s): not a netmap port\n",
+            printf("Failed to pio_open(%s): unknown port type\n",
                    netmap_port_one);
         } else {
-            printf("Failed to nm_open(%s): %s\n", netmap_port_one,
+            printf("Failed to pio_open(%s): %s\n", netmap_port_one,
                    strerror(errno));
         }
         return -1;
     }
 
-    nmd_two = nm_open(netmap_port_two, NULL, 0, NULL);
-    if (nmd_two == NULL) {
+    port_two = pio_open(netmap_port_two, NULL);
+    if (port_two == NULL) {
         if (!errno) {
-            printf("Failed to nm_open(%s): not a netmap port\n",
+            printf("Failed to pio_open(%s): unknown port type\n",
                    netmap_port_two);
         } else {
-            printf("Failed to nm_open(%s): %s\n", netmap_port_two,
+            printf("Failed to pio_open(%s): %s\n", netmap_port_two,
                    strerror(errno));
         }
         return -1;
     }
 
-    nmd_three = nm_open(netmap_port_three, NULL, 0, NULL);
-    if (nmd_three == NULL) {
+    port_three = pio_open(netmap_port_three, NULL);
+    if (port_three == NULL) {
         if (!errno) {
-            printf("Failed to nm_open(%s): not a netmap port\n",
+            printf("Failed to pio_open(%s): unknown port type\n",
                    netmap_port_three);
         } else {
-            printf("Failed to nm_open(%s): %s\n", netmap_port_three,
+            printf("Failed to pio_open(%s): %s\n", netmap_port_three,
                    strerror(errno));
         }
         return -1;
     }
 
-    while (!stop) {
+    if (host) {
+        host_one = pio_open_host(port_one);
+        if (host_one == NULL) {
+            printf("Failed to open the host rings of %s: %s\n",
+                   netmap_port_one,
+                   errno ? strerror(errno) : "unknown port type");
+            return -1;
+        }
+#ifdef SOLUTION
+        /* Everything from the host stack goes out of port one. */
+        memset(&host_ctx, 0, sizeof(host_ctx));
+        host_ctx.zerocopy = pio_same_mem(host_one, port_one);
+        host_ctx.filter   = FWD_FILTER_NONE;
+        host_ctx.rewrite  = FWD_REWRITE_NONE;
+        host_ctx.tot      = &tot;
+        host_ctx.out      = &fromhost;
+        host_pkts         = fwd_select(&host_ctx);
+#endif /* SOLUTION */
+    }
+
 #ifdef SOLUTION
-        struct pollfd pfd[3];
+    sample_left = sample_countdown(sampler);
+    if (qc) {
+        /* The ports do not share memory: the packets are copied. */
+        if (qos_init(&qos_two, qc, port_one, port_two, tsc_hz) ||
+            qos_init(&qos_three, qc, port_one, port_three, tsc_hz)) {
+            printf("Failed to set up the shaper: %s\n", strerror(errno));
+            return -1;
+        }
+        shape_two   = &qos_two;
+        shape_three = &qos_three;
+        printf("Shaper: %u classes, %u leaves of %u packets\n",
+               qc->htb->ncls, qc->htb->nleaves, HTB_LEAF_QLEN);
+    }
+#endif /* SOLUTION */
+
+    if (tf) {
+        pio_set_txflush(port_one, tf);
+        pio_set_txflush(port_two, tf);
+        pio_set_txflush(port_three, tf);
+    }
+
+    st = stats_open("fe");
+    if (st == NULL) {
+        printf("Failed to create the stats segment: %s\n", strerror(errno));
+    }
+    serr |= stats_add(st, "tot", &tot);
+    serr |= stats_add(st, "fwda", &fwda);
+    serr |= stats_add(st, "fwdb", &fwdb);
+    serr |= stats_add(st, "fwdback", &fwdback);
+    serr |= stats_add_port(st, "one", port_one);
+    serr |= stats_add_port(st, "two", port_two);
+    serr |= stats_add_port(st, "three", port_three);
+    if (host) {
+        serr |= stats_add(st, "tohost", &tohost);
+        serr |= stats_add(st, "fromhost", &fromhost);
+        serr |= stats_add_port(st, "host", host_one);
+    }
+    if (qc) {
+        serr |= htb_stats_add(st, &qc->htb->st);
+    }
+    if (sampler) {
+        serr |= stats_add(st, "sampled", &sampler->samples);
+        serr |= stats_add(st, "sample_drops", &sampler->drops);
+        serr |= stats_add(st, "sample_written", &sampler->written);
+    }
+    serr |= stats_add_hist(st, "batch", &batch_h);
+    serr |= stats_add_hist(st, "proc_ns", &proc_h);
+    serr |= stats_add_wakeup(st, wk);
+    serr |= stats_add_txflush(st, tf);
+    if (serr) {
+        printf("Failed to register the stats: %s\n", strerror(errno));
+    }
+    if (metrics && stats_export(st, metrics)) {
+        printf("Failed to export metrics on %s: %s\n", metrics,
+               strerror(errno));
+    }
+    if (pio_wakeup_start(wk)) {
+        printf("Failed to lower the timer slack: %s\n", strerror(errno));
+    }
+
+#ifdef SOLUTION
+    if (epoll) {
+        event_loop(port_one, port_two, port_three, host_one, udp_port_a,
+                   udp_port_b, st);
+    }
+#endif /* SOLUTION */
+
+    while (!stop && !epoll) {
+        stats_publish(st);
+#ifdef SOLUTION
+        struct pio_pollfd pfd[4];
+        unsigned long long tot0;
+        uint64_t t0;
         int ret;
         int two_ready, three_ready;
+        int timed; /* queued packets wait for a deadline */
 
-        pfd[0].fd     = nmd_one->fd;
-        pfd[1].fd     = nmd_two->fd;
-        pfd[2].fd     = nmd_three->fd;
+        pfd[0].port   = port_one;
+        pfd[1].port   = port_two;
+        pfd[2].port   = port_three;
         pfd[0].events = POLLIN;
         pfd[1].events = 0;
         pfd[2].events = 0;
@@ -244,14 +548,33 @@ main_loop(const char *netmap_port_one, const char *netmap_port_two,
          * line blocking (we don't know in advance which packets are going to
          * be forwarded where). As a result, unfortunately, we may end dropping
          * packets. */
-        two_ready   = rx_ready(nmd_two);
-        three_ready = rx_ready(nmd_three);
+        two_ready   = pio_rx_ready(port_two);
+        three_ready = pio_rx_ready(port_three);
         if (!two_ready) {
             pfd[1].events |= POLLIN;
         }
         if (!three_ready) {
             pfd[2].events |= POLLIN;
         }
+        /* The shaped packets are known to go there, though, unless the
+         * shaper holds them back or too many slots are in flight: then
+         * we wake up in time to drain them. */
+        timed = 0;
+        if (qc) {
+            uint64_t now = rdtsc();
+            uint64_t at_two, at_three;
+
+            pfd[1].events |= qos_wait(shape_two, port_two, now, &at_two);
+            pfd[2].events |= qos_wait(shape_three, port_three, now, &at_three);
+            if (at_two != UINT64_MAX) {
+                pio_wake_in(port_two, tsc2ns(at_two - now));
+                timed = 1;
+            }
+            if (at_three != UINT64_MAX) {
+                pio_wake_in(port_three, tsc2ns(at_three - now));
+                timed = 1;
+            }
+        }
 
         /* We can wait for TX space on port one, because we know all traffic
          * coming from ports two and three unconditionally goes to port one. */
@@ -259,33 +582,103 @@ main_loop(const char *netmap_port_one, const char *netmap_port_two,
             pfd[0].events |= POLLOUT;
         }
 
+        /* The same holds for the traffic from the host stack. */
+        if (host) {
+            pfd[3].port   = host_one;
+            pfd[3].events = 0;
+            if (!pio_rx_ready(host_one)) {
+                pfd[3].events |= POLLIN;
+            } else {
+                pfd[0].events |= POLLOUT;
+            }
+        }
+
         /* We poll with a timeout to have a chance to break the main loop if
          * no packets are coming. */
-        ret = poll(pfd, 3, 1000);
+        ret = pio_poll_moderated(pfd, host ? 4 : 3, 1000, wk);
+        /* Hand over the samples of the last round, also when idle. */
+        sample_flush(sampler);
         if (ret < 0) {
-            perror("poll()");
-        } else if (ret == 0) {
+            perror("pio_poll()");
+        } else if (ret == 0 && !timed) {
             /* Timeout */
             continue;
         }
+        t0   = rdtsc();
+        tot0 = tot;
 
         /* Route and forward from port one to ports two and three. */
-        route_forward(nmd_one, nmd_two, nmd_three, udp_port_a, udp_port_b);
+        route_forward(port_one, port_two, port_three, host_one, udp_port_a,
+                      udp_port_b);
+        if (host) {
+            host_pkts(host_one, port_one, NULL, &host_ctx);
+        }
+        if (qc) {
+            uint64_t now = rdtsc();
+
+            fwda += qos_drain(shape_two, port_two, now);
+            fwdb += qos_drain(shape_three, port_three, now);
+        }
 #endif /* SOLUTION */
 
         /* Forward traffic from ports two and three back to port one. */
-        forward_pkts(nmd_two, nmd_one);
-        forward_pkts(nmd_three, nmd_one);
+        forward_pkts(port_two, 1, port_one);
+        forward_pkts(port_three, 2, port_one);
+#ifdef SOLUTION
+        if (tot != tot0) {
+            stats_hist_add(&batch_h, tot - tot0);
+            stats_hist_add(&proc_h, tsc2ns(rdtsc() - t0));
+        }
+#endif /* SOLUTION */
     }
 
-    nm_close(nmd_one);
-    nm_close(nmd_two);
-    nm_close(nmd_three);
+    stats_close(st);
+#ifdef SOLUTION
+    if (qc) {
+        qos_free(shape_two, port_one);
+        qos_free(shape_three, port_one);
+    }
+#endif /* SOLUTION */
+    pio_close(port_one);
+    pio_close(port_two);
+    pio_close(port_three);
+    if (host) {
+        pio_close(host_one);
+    }
 
     printf("Total processed packets: %llu\n", tot);
     printf("Forwarded to port one  : %llu\n", fwdback);
     printf("Forwarded to port two  : %llu\n", fwda);
     printf("Forwarded to port three: %llu\n", fwdb);
+    if (host) {
+        printf("Passed to the host     : %llu\n", tohost);
+        printf("Sent by the host       : %llu\n", fromhost);
+    }
+    if (qc) {
+        const struct htb_stats *hs = &qc->htb->st;
+
+        printf("Shaped packets         : %llu sent, %llu borrowed\n",
+               hs->pkts, hs->borrowed);
+        printf("Shaper drops           : %llu full, %llu unclassified, "
+               "%llu CoDel\n",
+               hs->drops, hs->unclassified, hs->codel_drops);
+        if (hs->pkts) {
+            printf("Shaper sojourn         : %llu ns avg\n",
+                   hs->sojourn.sum / hs->pkts);
+        }
+    }
+    if (sampler) {
+        printf("Sampled packets        : %llu (%llu dropped)\n",
+               sampler->samples, sampler->drops);
+    }
+    if (wk && wk->wakeups) {
+        printf("Wakeups                : %llu (%.1f slots each)\n",
+               wk->wakeups, (double)wk->slots / wk->wakeups);
+    }
+    if (tf) {
+        printf("TX flushes             : %llu batch, %llu deadline\n",
+               tf->by_batch, tf->by_deadline);
+    }
 
     return 0;
 }
@@ -295,7 +688,13 @@ usage(char **argv)
 {
     printf("usage: %s [-h] [-i NETMAP_PORT_ONE] "
            "[-i NETMAP_PORT_TWO] [-i NETMAP_PORT_THREE] "
-           "[-p UDP_PORT_A] [-p UDP_PORT_B]\n",
+           "[-p UDP_PORT_A] [-p UDP_PORT_B] [-M unix:PATH|tcp:PORT] "
+           "[-F TRACE_FILE [-S SAMPLE_EVERY] [-V VERDICT[,VERDICT...]]] "
+           "[-W TARGET[:MAX_US]] [-D BATCH[:DELAY_US]] [-E] "
+           "[-f EXPR_A|@FILE] [-f EXPR_B|@FILE] [-H] [-T FILE] "
+           "[-A TARGET_US[:INTERVAL_US]] [-s [count:|flow:]N] "
+           "[-w FILE.pcap|FILE.pcapng]\n"
+           "    verdicts: fwd-a, fwd-b, back, drop, full, host\n",
            argv[0]);
     exit(EXIT_SUCCESS);
 }
@@ -306,15 +705,35 @@ main(int argc, char **argv)
     const char *netmap_port_one   = NULL;
     const char *netmap_port_two   = NULL;
     const char *netmap_port_three = NULL;
+    const char *metrics           = NULL;
+    const char *trace_file        = NULL;
+    unsigned int trace_every      = 64;
+    uint32_t trace_trigger        = 0;
+    struct pio_wakeup *wk         = NULL;
+    struct pio_txflush *tf        = NULL;
+    struct qos_conf *qc           = NULL;
+    const char *shaper_path       = NULL;
+    const char *sample_path       = NULL;
+    uint32_t sample_rate          = 0;
+    int sample_mode               = SAMPLE_COUNT;
+    struct pio_wakeup wakeup;
+    struct pio_txflush txflush;
+    struct qos_conf qosconf;
+    int epoll = 0;
+    int host  = 0;
     int udp_port;
     int udp_port_a    = 8000;
     int udp_port_b    = 8001;
     int udp_port_args = 0;
+    const char *filter_name[2] = {NULL, NULL};
+    char errbuf[CBPF_ERRBUF_SIZE];
+    char htberr[HTB_ERRBUF_SIZE];
     struct sigaction sa;
     int opt;
     int ret;
 
-    while ((opt = getopt(argc, argv, "hi:p:")) != -1) {
+    memset(&qosconf, 0, sizeof(qosconf));
+    while ((opt = getopt(argc, argv, "hi:p:M:F:S:V:W:D:Ef:HT:A:s:w:")) != -1) {
         switch (opt) {
         case 'h':
             usage(argv);
@@ -347,6 +766,99 @@ main(int argc, char **argv)
             udp_port_args++;
             break;
 
+        case 'M':
+            /* Serve OpenMetrics on a Unix socket or localhost TCP. */
+            metrics = optarg;
+            break;
+
+        case 'F':
+            trace_file = optarg;
+            break;
+
+        case 'S':
+            /* Record one packet every N, 0 for triggers only. */
+            trace_every = atoi(optarg);
+            break;
+
+        case 'V':
+            /* Always record packets with these verdicts. */
+            if (trace_parse_verdicts(optarg, &trace_trigger)) {
+                printf("    invalid verdicts %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'W':
+            /* Hold small wakeups back, TARGET slots within MAX_US. */
+            if (pio_wakeup_parse(&wakeup, optarg)) {
+                printf("    invalid wakeup moderation %s\n", optarg);
+                usage(argv);
+            }
+            wk = &wakeup;
+            break;
+
+        case 'D':
+            /* Flush TX after BATCH slots or DELAY_US. */
+            if (pio_txflush_parse(&txflush, optarg)) {
+                printf("    invalid TX flush policy %s\n", optarg);
+                usage(argv);
+            }
+            tf = &txflush;
+            break;
+
+        case 'E':
+            epoll = 1;
+            break;
+
+        case 'H':
+            /* Pass the packets not routed to the host stack. */
+            host = 1;
+            break;
+
+        case 'T':
+            /* Shape the egress of ports two and three. */
+            shaper_path = optarg;
+            break;
+
+        case 'A':
+            /* Drop from the shaper queues with CoDel. */
+            if (codel_parse(optarg, &qosconf.codel_target_us,
+                            &qosconf.codel_interval_us)) {
+                printf("    invalid CoDel setting %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 's':
+            /* Sample one packet (or flow) in N from port one. */
+            if (sample_parse(optarg, &sample_mode, &sample_rate)) {
+                printf("    invalid sampling %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'w':
+            /* Write the samples to a pcap or pcapng file. */
+            sample_path = optarg;
+            break;
+
+        case 'f': {
+            /* Route with tcpdump expressions instead of UDP ports. */
+            struct ebpf_prog **filter = filter_a ? &filter_b : &filter_a;
+
+            if (filter_b) {
+                printf("    at most two -f filters\n");
+                usage(argv);
+            }
+            *filter = cbpf_compile(optarg, errbuf);
+            if (*filter == NULL) {
+                printf("    invalid filter '%s': %s\n", optarg, errbuf);
+                usage(argv);
+            }
+            filter_name[filter == &filter_b] = optarg;
+            break;
+        }
+
         default:
             printf("    unrecognized option '-%c'\n", opt);
             usage(argv);
@@ -364,6 +876,26 @@ main(int argc, char **argv)
         usage(argv);
     }
 
+    if ((wk || tf) && epoll) {
+        printf("    -W and -D are not supported with -E\n");
+        usage(argv);
+    }
+
+    if (shaper_path && epoll) {
+        printf("    -T is not supported with -E\n");
+        usage(argv);
+    }
+
+    if (qosconf.codel_target_us && shaper_path == NULL) {
+        printf("    CoDel needs -T\n");
+        usage(argv);
+    }
+
+    if (!sample_rate != !sample_path) {
+        printf("    sampling needs both -s and -w\n");
+        usage(argv);
+    }
+
     /* Register Ctrl-C handler. */
     sa.sa_handler = sigint_handler;
     sigemptyset(&sa.sa_mask);
@@ -373,18 +905,73 @@ main(int argc, char **argv)
         perror("sigaction(SIGINT)");
         exit(EXIT_FAILURE);
     }
-    (void)rx_ready;
+    /* SIGUSR1 prints the counters (event loop only). */
+    sa.sa_handler = sigusr1_handler;
+    ret           = sigaction(SIGUSR1, &sa, NULL);
+    if (ret) {
+        perror("sigaction(SIGUSR1)");
+        exit(EXIT_FAILURE);
+    }
 
     printf("Port one  : %s\n", netmap_port_one);
     printf("Port two  : %s\n", netmap_port_two);
     printf("Port three: %s\n", netmap_port_three);
-    printf("UDP port A: %d\n", udp_port_a);
-    printf("UDP port B: %d\n", udp_port_b);
+    if (filter_a) {
+        printf("Filter A  : %s (%s)\n", filter_name[0],
+               filter_a->jitted ? "JIT compiled" : "interpreted");
+        printf("Filter B  : %s\n", filter_name[1] ? filter_name[1] : "none");
+    } else {
+        printf("UDP port A: %d\n", udp_port_a);
+        printf("UDP port B: %d\n", udp_port_b);
+    }
+    if (shaper_path) {
+        qosconf.htb = htb_conf_load(shaper_path, htberr);
+        if (qosconf.htb == NULL) {
+            printf("Failed to load %s: %s\n", shaper_path, htberr);
+            exit(EXIT_FAILURE);
+        }
+        qc = &qosconf;
+        printf("Shaper    : %s\n", shaper_path);
+    }
+    if (qosconf.codel_target_us) {
+        printf("CoDel     : %u us target, %u us interval\n",
+               qosconf.codel_target_us, qosconf.codel_interval_us);
+    }
+
+    tsc_calibrate();
+
+    if (trace_file) {
+        trace = trace_open(trace_file, "fe", TRACE_DEFAULT_RECS, tsc_hz);
+        if (trace == NULL) {
+            printf("Failed to open %s: %s\n", trace_file, strerror(errno));
+            return -1;
+        }
+        trace->every     = trace_every;
+        trace->countdown = trace_every;
+        trace->trigger   = trace_trigger;
+        printf("Trace     : %s\n", trace_file);
+    }
+    if (sample_path) {
+        sampler = sample_open(sample_path, sample_mode, sample_rate, tsc_hz);
+        if (sampler == NULL) {
+            printf("Failed to open %s: %s\n", sample_path, strerror(errno));
+            return -1;
+        }
+        printf("Sampling  : 1 %s in %u to %s\n",
+               sample_mode == SAMPLE_FLOW ? "flow" : "packet", sample_rate,
+               sample_path);
+    }
 
     main_loop(netmap_port_one, netmap_port_two, netmap_port_three, udp_port_a,
-              udp_port_b);
+              udp_port_b, metrics, wk, tf, epoll, host, qc);
 
-    (void)pkt_get_udp_port;
+    trace_close(trace);
+    if (sampler && sample_close(sampler)) {
+        printf("Failed to write %s: %s\n", sample_path, strerror(errno));
+    }
+    htb_conf_free(qosconf.htb);
+    ebpf_free(filter_a);
+    ebpf_free(filter_b);
 
     return 0;
 }
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Compare the throughput of the NFV graph run as separate processes
+# (as in flowgraph-up.sh, over mem: pipes so no netmap module is needed)
+# with the single-process placements of nfv.
+#
+# usage: ./flowgraph-bench.sh [SECONDS]
+
+D=${1:-10}
+OUT=$(mktemp -d)
+
+./gen -i mem:bench{1 -s 10.0.0.1:7000-10.0.0.1:7010 -d 10.0.0.1:8000-10.0.0.1:8004 > /dev/null &
+PIDS="$!"
+sleep 0.5
+./fe -i mem:bench}1 -i mem:bench{2 -i mem:bench{3 -p 8000 -p 8001 > /dev/null &
+PIDS="$PIDS $!"
+./swap -i mem:bench}2 -i mem:bench{4 > /dev/null &
+PIDS="$PIDS $!"
+./swap -i mem:bench}3 -i mem:bench{5 > /dev/null &
+PIDS="$PIDS $!"
+./sink -i mem:bench}4 -p 7000 > $OUT/sink1 &
+PIDS="$PIDS $!"
+./sink -i mem:bench}5 -p 7001 > $OUT/sink2 &
+PIDS="$PIDS $!"
+
+sleep $D
+kill -INT $PIDS
+wait
+
+for s in sink1 sink2; do
+    awk -v d=$D -v s=$s '/Total received/ {
+        printf "multi-process %s rate: %.3f Mpps\n", s, $4 / d / 1e6 }' $OUT/$s
+done
+rm -rf $OUT
+
+for m in pipeline rtc fused; do
+    echo "nfv -m $m:"
+    ./nfv -g flowgraph.nfv -m $m -d $D | grep rate
+done
@@ -0,0 +1,195 @@
+/*
+ * Construction of the per-flow frame templates.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "flows.h"
+
+static uint16_t
+csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static uint32_t
+csum_add(uint32_t sum, const void *data, unsigned len)
+{
+    const uint8_t *p = data;
+    unsigned int i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+    if (len & 1) {
+        sum += p[len - 1] << 8;
+    }
+
+    return sum;
+}
+
+static int
+addr_parse(const char *s, size_t len, uint32_t *ip, uint16_t *port)
+{
+    char tmp[32];
+    char *colon;
+    struct in_addr in;
+
+    if (len >= sizeof(tmp)) {
+        return -1;
+    }
+    memcpy(tmp, s, len);
+    tmp[len] = '\0';
+    colon    = strchr(tmp, ':');
+    if (colon) {
+        int p = atoi(colon + 1);
+
+        if (p <= 0 || p > 65535) {
+            return -1;
+        }
+        *port  = p;
+        *colon = '\0';
+    }
+    if (!inet_aton(tmp, &in)) {
+        return -1;
+    }
+    *ip = ntohl(in.s_addr);
+
+    return 0;
+}
+
+/* Parse IP[:PORT][-IP[:PORT]]. A missing upper bound equals the lower
+ * one, a missing port is 1234 as in pkt-gen. */
+int
+flow_range_parse(const char *s, struct flow_range *r)
+{
+    const char *dash = strchr(s, '-');
+
+    r->port_lo = 1234;
+    if (addr_parse(s, dash ? (size_t)(dash - s) : strlen(s), &r->ip_lo,
+                   &r->port_lo)) {
+        return -1;
+    }
+    r->ip_hi   = r->ip_lo;
+    r->port_hi = r->port_lo;
+    if (dash && addr_parse(dash + 1, strlen(dash + 1), &r->ip_hi,
+                           &r->port_hi)) {
+        return -1;
+    }
+    if (r->ip_hi < r->ip_lo || r->port_hi < r->port_lo) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+tmpl_build(char *buf, unsigned int len, uint32_t sip, uint16_t sport,
+           uint32_t dip, uint16_t dport)
+{
+    struct ether_header *ethh = (struct ether_header *)buf;
+    struct ip *iph            = (struct ip *)(ethh + 1);
+    struct udphdr *udph       = (struct udphdr *)(iph + 1);
+    unsigned int udplen       = len - sizeof(*ethh) - sizeof(*iph);
+    uint32_t sum;
+
+    memset(buf, 0, FLOW_TMPL_SIZE);
+    memset(ethh->ether_dhost, 0xff, ETH_ALEN);
+    ethh->ether_shost[0] = 0x02; /* locally administered */
+    ethh->ether_shost[5] = 0x01;
+    ethh->ether_type     = htons(ETHERTYPE_IP);
+
+    iph->ip_v          = 4;
+    iph->ip_hl         = 5;
+    iph->ip_len        = htons(len - sizeof(*ethh));
+    iph->ip_ttl        = 64;
+    iph->ip_p          = IPPROTO_UDP;
+    iph->ip_src.s_addr = htonl(sip);
+    iph->ip_dst.s_addr = htonl(dip);
+    iph->ip_sum        = htons(csum_fold(csum_add(0, iph, sizeof(*iph))));
+
+    udph->uh_sport = htons(sport);
+    udph->uh_dport = htons(dport);
+    udph->uh_ulen  = htons(udplen);
+
+    /* UDP checksum over the pseudo header and the datagram. */
+    sum = csum_add(0, &iph->ip_src, 8) + IPPROTO_UDP + udplen;
+    sum = csum_add(sum, udph, udplen);
+    udph->uh_sum = htons(csum_fold(sum));
+    if (udph->uh_sum == 0) {
+        udph->uh_sum = 0xffff;
+    }
+}
+
+int
+flow_set_build(struct flow_set *fs, const struct flow_range *src,
+               const struct flow_range *dst, unsigned int len)
+{
+    uint64_t nsip   = (uint64_t)src->ip_hi - src->ip_lo + 1;
+    uint64_t nsport = src->port_hi - src->port_lo + 1;
+    uint64_t ndip   = (uint64_t)dst->ip_hi - dst->ip_lo + 1;
+    uint64_t ndport = dst->port_hi - dst->port_lo + 1;
+    uint64_t n      = nsip * nsport * ndip * ndport;
+    uint64_t i;
+
+    if (len < PKT_STAMP_OFS || len > FLOW_TMPL_SIZE || n > FLOW_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    fs->tmpl = aligned_alloc(64, n * FLOW_TMPL_SIZE);
+    if (fs->tmpl == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    fs->nflows = n;
+    fs->len    = len;
+
+    /* Destination ports vary fastest, as in pkt-gen. */
+    for (i = 0; i < n; i++) {
+        uint64_t k     = i;
+        uint16_t dport = dst->port_lo + k % ndport;
+        uint32_t dip, sip;
+        uint16_t sport;
+
+        k /= ndport;
+        sport = src->port_lo + k % nsport;
+        k /= nsport;
+        dip = dst->ip_lo + k % ndip;
+        k /= ndip;
+        sip = src->ip_lo + k % nsip;
+        tmpl_build(fs->tmpl + i * FLOW_TMPL_SIZE, len, sip, sport, dip,
+                   dport);
+    }
+
+    return 0;
+}
+
+void
+flow_set_dscp(struct flow_set *fs, const uint8_t *dscp, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < fs->nflows; i++) {
+        char *buf      = fs->tmpl + i * FLOW_TMPL_SIZE;
+        struct ip *iph = (struct ip *)(buf + sizeof(struct ether_header));
+        uint16_t old, new;
+
+        /* The checksum is updated over the 16-bit word of the TOS. */
+        memcpy(&old, iph, sizeof(old));
+        iph->ip_tos = dscp[i % n] << 2;
+        memcpy(&new, iph, sizeof(new));
+        iph->ip_sum = csum_update(iph->ip_sum, &old, &new, sizeof(old));
+    }
+}
+
+void
+flow_set_free(struct flow_set *fs)
+{
+    free(fs->tmpl);
+    fs->tmpl = NULL;
+}
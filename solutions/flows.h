@@ -0,0 +1,95 @@
+/*
+ * Prebuilt UDP frame templates, one per flow, used by the traffic
+ * generators. A flow set covers the cartesian product of the source and
+ * destination address ranges, given in the pkt-gen syntax
+ * IP[:PORT][-IP[:PORT]].
+ */
+#ifndef __FLOWS_H__
+#define __FLOWS_H__
+
+#include <stdint.h>
+#include <string.h>
+#include "pkt.h"
+
+#define FLOW_MAX 65536
+#define FLOW_TMPL_SIZE 128 /* room for the largest template */
+
+_Static_assert(FLOW_MAX <= PKT_STAMP_FLOWS, "flow indices fit in stamps");
+
+struct flow_range {
+    uint32_t ip_lo, ip_hi; /* host byte order */
+    uint16_t port_lo, port_hi;
+};
+
+struct flow_set {
+    unsigned int nflows;
+    unsigned int len; /* frame length, without FCS */
+    char *tmpl;       /* nflows templates, FLOW_TMPL_SIZE apart */
+};
+
+int flow_range_parse(const char *s, struct flow_range *r);
+int flow_set_build(struct flow_set *fs, const struct flow_range *src,
+                   const struct flow_range *dst, unsigned int len);
+void flow_set_free(struct flow_set *fs);
+/* Mark the flows with the n DSCP values, round robin. */
+void flow_set_dscp(struct flow_set *fs, const uint8_t *dscp, unsigned int n);
+
+static inline const char *
+flow_tmpl(const struct flow_set *fs, unsigned int i)
+{
+    return fs->tmpl + i * FLOW_TMPL_SIZE;
+}
+
+/* Incremental update of an Internet checksum (RFC 1624) for a field of
+ * len bytes (even) changing from old to new. */
+static inline uint16_t
+csum_update(uint16_t csum, const void *old, const void *new, unsigned len)
+{
+    const uint16_t *o = old, *n = new;
+    uint32_t sum      = (uint16_t)~csum;
+    unsigned int i;
+
+    for (i = 0; i < len / 2; i++) {
+        sum += (uint16_t)~o[i];
+        sum += n[i];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum;
+}
+
+/* Copy the template of flow i into buf. */
+static inline void
+flow_fill(const struct flow_set *fs, unsigned int i, char *buf)
+{
+    memcpy(buf, flow_tmpl(fs, i), fs->len);
+}
+
+/* Copy the template of flow i into buf and stamp it with i, the seq of
+ * the flow and ts, patching the UDP checksum incrementally. */
+static inline void
+flow_fill_stamp(const struct flow_set *fs, unsigned int i, char *buf,
+                uint32_t seq, uint64_t ts)
+{
+    struct udphdr *udph  = (struct udphdr *)(buf + PKT_STAMP_OFS -
+                                            sizeof(struct udphdr));
+    struct pkt_stamp *st = (struct pkt_stamp *)(buf + PKT_STAMP_OFS);
+    struct pkt_stamp nst;
+    uint16_t csum;
+
+    memcpy(buf, flow_tmpl(fs, i), fs->len);
+    if (fs->len < PKT_STAMP_OFS + sizeof(*st)) {
+        return;
+    }
+    nst.magic    = htons(PKT_STAMP_MAGIC);
+    nst.flow     = htons(i);
+    nst.seq      = htonl(seq);
+    nst.ts       = ts;
+    csum         = csum_update(udph->uh_sum, st, &nst, sizeof(nst));
+    *st          = nst;
+    udph->uh_sum = csum ? csum : 0xffff;
+}
+
+#endif /* __FLOWS_H__ */
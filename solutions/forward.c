@@ -3,6 +3,27 @@
  * Only UDP packets with a destination port specified
  * by command-line option are forwarded, while all the other ones are
  * dropped. If port 0 is specified, all packets are forwarded.
+ * Alternatively the packets are selected by an eBPF program (-e) or a
+ * tcpdump expression (-f), see ebpf.h.
+ * With -H the packets not selected are passed to the host stack through
+ * the host rings of the port they came from (NAME^), and the packets
+ * sent by the host stack go out of that port, so that ARP, ICMP or SSH
+ * keep working on the interfaces.
+ * With -b the packets whose source address is in a blocklist file are
+ * dropped before anything else, see blocklist.h. On SIGHUP the file is
+ * loaded again by a thread, while forwarding goes on with the old list.
+ * The new list then replaces the old one between two batches.
+ * With -Q the packets are queued by DSCP class and sent by strict
+ * priority, with at most TXSLOTS slots of each TX ring in flight and
+ * optional rate caps on the classes (-c) and the link, see qos.h.
+ * With -T the packets are shaped instead by a hierarchical token bucket
+ * tree loaded from a file, whose leaves are selected by the destination
+ * address, see htb.h. -Q then sets the slots in flight and the link rate.
+ * With -A the queues of -Q or -T drop the packets that stood too long,
+ * by CoDel (codel.h), to bound the queueing latency under overload.
+ * With -s and -w one packet in N, or the packets of one flow in N, is
+ * sampled on input, and its first bytes are written to a pcap file by
+ * an exporter thread, see sample.h.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,21 +31,47 @@
 #include <signal.h>
 #include <errno.h>
 #include <poll.h>
+#include <string.h>
+#include <pthread.h>
 #include <net/if.h>
 #include <stdint.h>
-#include <net/netmap.h>
-#define NETMAP_WITH_LIBS
-#include <net/netmap_user.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
 #include <netinet/tcp.h>
+#include "pktio.h"
+#include "pkt.h"
+#include "ebpf.h"
+#include "fwdloop.h"
+#include "blocklist.h"
+#include "qos.h"
+#include "sample.h"
+#include "stats.h"
+#include "tsc.h"
 
 static int stop               = 0;
 static unsigned long long fwd = 0;
 static unsigned long long tot = 0;
+static unsigned long long to_host   = 0;
+static unsigned long long from_host = 0;
+static unsigned long long blocked   = 0;
+static unsigned long long blocklist_entries = 0;
+static struct stats_hist batch_h;
+static struct stats_hist proc_h;
+static struct ebpf_prog *filter = NULL;
+static struct blocklist *blocklist = NULL;
+static struct sampler *sampler     = NULL;
+static const char *blocklist_path  = NULL;
+static int reload                  = 0;
+
+/* The most stats entries registered: 15 counters, the RX rings of four
+ * ports, the DSCP classes (more than a tree) and two histograms. */
+#define FWD_STATS                                                              \
+    (15 + 4 * STATS_PORT_ENTRIES + QOS_CLASSES * (4 + STATS_HIST_ENTRIES) +   \
+     2 * STATS_HIST_ENTRIES)
+_Static_assert(FWD_STATS <= STATS_MAX, "the stats of forward fit");
 
 static void
 sigint_handler(int signum)
@@ -32,162 +79,283 @@ sigint_handler(int signum)
     stop = 1;
 }
 
-static int
-rx_ready(struct nm_desc *nmd)
+static void
+sighup_handler(int signum)
 {
-    unsigned int ri;
-
-    for (ri = nmd->first_rx_ring; ri <= nmd->last_rx_ring; ri++) {
-        struct netmap_ring *ring;
-
-        ring = NETMAP_RXRING(nmd->nifp, ri);
-        if (nm_ring_space(ring)) {
-            return 1; /* there is something to read */
-        }
-    }
-
-    return 0;
+    reload = 1;
 }
 
-static inline int
-pkt_select(const char *buf, int udp_port)
+static struct pio_port *
+host_open(struct pio_port *port)
 {
-    struct ether_header *ethh;
-    struct ip *iph;
-    struct udphdr *udph;
-
-    if (udp_port == 0) {
-        return 1; /* no filter */
-    }
+    struct pio_port *host = pio_open_host(port);
 
-    ethh = (struct ether_header *)buf;
-    if (ethh->ether_type != htons(ETHERTYPE_IP)) {
-        /* Filter out non-IP traffic. */
-        return 0;
-    }
-    iph = (struct ip *)(ethh + 1);
-    if (iph->ip_p != IPPROTO_UDP) {
-        /* Filter out non-UDP traffic. */
-        return 0;
-    }
-    udph = (struct udphdr *)(iph + 1);
-
-    /* Match the destination port. */
-    if (udph->uh_dport != htons(udp_port)) {
-        return 0;
+    if (host == NULL) {
+        printf("Failed to open the host rings of %s: %s\n", port->name,
+               errno ? strerror(errno) : "unknown port type");
     }
 
-    return 1;
+    return host;
 }
 
 #ifdef SOLUTION
-static void
-forward_pkts(struct nm_desc *src, struct nm_desc *dst, int udp_port,
-             int zerocopy)
+/* Handoff between the loader thread and the forwarding loop. */
+static struct blocklist *blocklist_next = NULL; /* loaded, not in use yet */
+static struct blocklist *blocklist_old  = NULL; /* replaced, to be freed */
+static int blocklist_loading            = 0;
+
+static void *
+blocklist_loader(void *arg)
 {
-    unsigned int si = src->first_rx_ring;
-    unsigned int di = dst->first_tx_ring;
-
-    while (si <= src->last_rx_ring && di <= dst->last_tx_ring) {
-        struct netmap_ring *txring;
-        struct netmap_ring *rxring;
-        unsigned int rxhead, txhead;
-        int nrx, ntx;
-
-        rxring = NETMAP_RXRING(src->nifp, si);
-        txring = NETMAP_TXRING(dst->nifp, di);
-        nrx    = nm_ring_space(rxring);
-        ntx    = nm_ring_space(txring);
-        if (nrx == 0) {
-            si++;
-            continue;
-        }
-        if (ntx == 0) {
-            di++;
-            continue;
+    char errbuf[BLOCKLIST_ERRBUF_SIZE];
+    struct blocklist *bl;
+    struct blocklist *old;
+
+    bl = blocklist_load(blocklist_path, errbuf);
+    if (bl == NULL) {
+        printf("Failed to reload %s: %s\n", blocklist_path, errbuf);
+    } else {
+        /* Publish the new list, and wait for the forwarding loop to
+         * hand the old one back: only then is nobody using it. */
+        __atomic_store_n(&blocklist_next, bl, __ATOMIC_RELEASE);
+        while ((old = __atomic_exchange_n(&blocklist_old, NULL,
+                                          __ATOMIC_ACQUIRE)) == NULL) {
+            usleep(1000);
         }
+        printf("Reloaded %s: %lu addresses\n", blocklist_path, bl->entries);
+        blocklist_free(old);
+    }
+    __atomic_store_n(&blocklist_loading, 0, __ATOMIC_RELEASE);
 
-        rxhead = rxring->head;
-        txhead = txring->head;
-        for (; nrx > 0 && ntx > 0;
-             nrx--, rxhead = nm_ring_next(rxring, rxhead), tot++) {
-            struct netmap_slot *rs = &rxring->slot[rxhead];
-            struct netmap_slot *ts = &txring->slot[txhead];
-            char *rxbuf            = NETMAP_BUF(rxring, rs->buf_idx);
+    return NULL;
+}
 
-            if (!pkt_select(rxbuf, udp_port)) {
-                continue; /* discard */
-            }
+/* Called between two batches: starts loading the blocklist again after
+ * a SIGHUP, and switches to it once it is loaded. */
+static void
+blocklist_update(struct fwd_ctx *ctx)
+{
+    struct blocklist *bl;
+    pthread_t th;
+    int ret;
 
-            ts->len = rs->len;
-            if (zerocopy) {
-                uint32_t idx = ts->buf_idx;
-                ts->buf_idx  = rs->buf_idx;
-                rs->buf_idx  = idx;
-                /* report the buffer change. */
-                ts->flags |= NS_BUF_CHANGED;
-                rs->flags |= NS_BUF_CHANGED;
-            } else {
-                char *txbuf = NETMAP_BUF(txring, ts->buf_idx);
-                memcpy(txbuf, rxbuf, ts->len);
-            }
-            txhead = nm_ring_next(txring, txhead);
-            ntx--;
-            fwd++;
+    if (reload && !__atomic_load_n(&blocklist_loading, __ATOMIC_ACQUIRE)) {
+        reload            = 0;
+        blocklist_loading = 1;
+        ret = pthread_create(&th, NULL, blocklist_loader, NULL);
+        if (ret) {
+            printf("Failed to start the blocklist loader: %s\n",
+                   strerror(ret));
+            blocklist_loading = 0;
+        } else {
+            pthread_detach(th);
         }
-        /* Update state of netmap ring. */
-        rxring->head = rxring->cur = rxhead;
-        txring->head = txring->cur = txhead;
+    }
+
+    bl = __atomic_exchange_n(&blocklist_next, NULL, __ATOMIC_ACQUIRE);
+    if (bl) {
+        __atomic_store_n(&blocklist_old, blocklist, __ATOMIC_RELEASE);
+        blocklist         = bl;
+        ctx->bl           = bl;
+        blocklist_entries = bl->entries;
     }
 }
 #endif /* SOLUTION */
 
 static int
 main_loop(const char *netmap_port_one, const char *netmap_port_two,
-          int udp_port)
+          int udp_port, const char *metrics, struct pio_wakeup *wk,
+          struct pio_txflush *tf, int host, struct qos_conf *qc)
 {
-    struct nm_desc *nmd_one;
-    struct nm_desc *nmd_two;
+    struct pio_port *port_one;
+    struct pio_port *port_two;
+    struct pio_port *host_one = NULL;
+    struct pio_port *host_two = NULL;
+    struct stats *st;
+    unsigned int c;
     int zerocopy;
+    int serr = 0; /* a stats registration failed */
+#ifdef SOLUTION
+    fwd_fn forward_pkts;
+    fwd_fn host_pkts = NULL;
+    struct fwd_ctx ctx;
+    struct fwd_ctx hctx;
+    struct qos qos_one; /* from port_one to port_two */
+    struct qos qos_two;
+#endif /* SOLUTION */
 
-    nmd_one = nm_open(netmap_port_one, NULL, 0, NULL);
-    if (nmd_one == NULL) {
+    /* The queues of -Q and -T hold packets in extra buffers, if any. */
+    port_one = pio_open_extra(netmap_port_one, NULL,
+                              qc ? qos_conf_bufs(qc) : 0);
+    if (port_one == NULL) {
         if (!errno) {
-            printf("Failed to nm_open(%s): not a netmap port\n",
+            printf("Failed to pio_open(%s): unknown port type\n",
                    netmap_port_one);
         } else {
-            printf("Failed to nm_open(%s): %s\n", netmap_port_one,
+            printf("Failed to pio_open(%s): %s\n", netmap_port_one,
                    strerror(errno));
         }
         return -1;
     }
 
-    nmd_two = nm_open(netmap_port_two, NULL, NM_OPEN_NO_MMAP, nmd_one);
-    if (nmd_two == NULL) {
+    port_two = pio_open_extra(netmap_port_two, port_one,
+                              qc ? qos_conf_bufs(qc) : 0);
+    if (port_two == NULL) {
         if (!errno) {
-            printf("Failed to nm_open(%s): not a netmap port\n",
+            printf("Failed to pio_open(%s): unknown port type\n",
                    netmap_port_two);
         } else {
-            printf("Failed to nm_open(%s): %s\n", netmap_port_two,
+            printf("Failed to pio_open(%s): %s\n", netmap_port_two,
                    strerror(errno));
         }
         return -1;
     }
 
+    if (host) {
+        host_one = host_open(port_one);
+        if (host_one == NULL) {
+            return -1;
+        }
+        host_two = host_open(port_two);
+        if (host_two == NULL) {
+            return -1;
+        }
+    }
+
     /* Check if we can do zerocopy. */
-    zerocopy = (nmd_one->mem == nmd_two->mem);
+    zerocopy = pio_same_mem(port_one, port_two);
     printf("zerocopy %sabled\n", zerocopy ? "en" : "dis");
 
+#ifdef SOLUTION
+    /* Pick the forwarding loop compiled for this configuration. */
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.zerocopy = zerocopy;
+    ctx.filter   = FWD_FILTER_NONE; /* -p 0 */
+    if (filter) {
+        ctx.filter = FWD_FILTER_EBPF;
+    } else if (udp_port) {
+        ctx.filter = FWD_FILTER_UDP;
+    }
+    ctx.rewrite   = FWD_REWRITE_NONE;
+    ctx.udp_port  = udp_port;
+    ctx.prog      = filter;
+    ctx.bl        = blocklist;
+    ctx.tot       = &tot;
+    ctx.out       = &fwd;
+    ctx.to_host   = &to_host;
+    ctx.blocked   = &blocked;
+    ctx.smp       = sampler;
+    ctx.countdown = sample_countdown(sampler);
+    forward_pkts  = fwd_select(&ctx);
+
+    if (host) {
+        /* Everything from the host stack goes out of its port. */
+        memset(&hctx, 0, sizeof(hctx));
+        hctx.zerocopy = pio_same_mem(host_one, port_one) &&
+                        pio_same_mem(host_two, port_two);
+        hctx.filter   = FWD_FILTER_NONE;
+        hctx.rewrite  = FWD_REWRITE_NONE;
+        hctx.tot      = &tot;
+        hctx.out      = &from_host;
+        host_pkts     = fwd_select(&hctx);
+    }
+
+    if (qc) {
+        if (qos_init(&qos_one, qc, port_one, port_two, tsc_hz) ||
+            qos_init(&qos_two, qc, port_two, port_one, tsc_hz)) {
+            printf("Failed to set up the QoS queues: %s\n", strerror(errno));
+            return -1;
+        }
+        if (qc->htb) {
+            printf("Shaper: %u classes, %u leaves of %u packets, %s "
+                   "buffers\n",
+                   qc->htb->ncls, qc->htb->nleaves, HTB_LEAF_QLEN,
+                   qos_one.zerocopy ? "extra" : "private");
+        } else {
+            printf("QoS: %u classes of %u packets, %s buffers\n",
+                   QOS_CLASSES, QOS_QLEN,
+                   qos_one.zerocopy ? "extra" : "private");
+        }
+    }
+#endif /* SOLUTION */
+
+    if (tf) {
+        pio_set_txflush(port_one, tf);
+        pio_set_txflush(port_two, tf);
+    }
+
+    st = stats_open("forward");
+    if (st == NULL) {
+        printf("Failed to create the stats segment: %s\n", strerror(errno));
+    }
+    serr |= stats_add(st, "tot", &tot);
+    serr |= stats_add(st, "fwd", &fwd);
+    serr |= stats_add_port(st, "one", port_one);
+    serr |= stats_add_port(st, "two", port_two);
+    if (host) {
+        serr |= stats_add(st, "to_host", &to_host);
+        serr |= stats_add(st, "from_host", &from_host);
+        serr |= stats_add_port(st, "host_one", host_one);
+        serr |= stats_add_port(st, "host_two", host_two);
+    }
+    if (blocklist) {
+        serr |= stats_add(st, "blocked", &blocked);
+        serr |= stats_add(st, "blocklist_entries", &blocklist_entries);
+    }
+    if (sampler) {
+        serr |= stats_add(st, "sampled", &sampler->samples);
+        serr |= stats_add(st, "sample_drops", &sampler->drops);
+        serr |= stats_add(st, "sample_written", &sampler->written);
+    }
+    if (qc && qc->htb) {
+        serr |= htb_stats_add(st, &qc->htb->st);
+    }
+    for (c = 0; qc && !qc->htb && c < QOS_CLASSES; c++) {
+        char name[STATS_NAME_MAX];
+
+        snprintf(name, sizeof(name), "q%u_pkts", c);
+        serr |= stats_add(st, name, &qc->cls[c].pkts);
+        snprintf(name, sizeof(name), "q%u_drops", c);
+        serr |= stats_add(st, name, &qc->cls[c].drops);
+        snprintf(name, sizeof(name), "q%u_codel_drops", c);
+        serr |= stats_add(st, name, &qc->cls[c].codel_drops);
+        snprintf(name, sizeof(name), "q%u_depth", c);
+        serr |= stats_add_gauge(st, name, &qc->cls[c].depth);
+        snprintf(name, sizeof(name), "q%u_sojourn_ns", c);
+        serr |= stats_add_hist(st, name, &qc->cls[c].sojourn);
+    }
+    serr |= stats_add_hist(st, "batch", &batch_h);
+    serr |= stats_add_hist(st, "proc_ns", &proc_h);
+    serr |= stats_add_wakeup(st, wk);
+    serr |= stats_add_txflush(st, tf);
+    if (serr) {
+        printf("Failed to register the stats: %s\n", strerror(errno));
+    }
+    if (metrics && stats_export(st, metrics)) {
+        printf("Failed to export metrics on %s: %s\n", metrics,
+               strerror(errno));
+    }
+    if (pio_wakeup_start(wk)) {
+        printf("Failed to lower the timer slack: %s\n", strerror(errno));
+    }
+
     while (!stop) {
+        stats_publish(st);
 #ifdef SOLUTION
-        struct pollfd pfd[2];
+        struct pio_pollfd pfd[4];
+        unsigned long long tot0;
+        uint64_t t0;
+        int timed; /* queued packets wait for a deadline */
         int ret;
 
-        pfd[0].fd     = nmd_one->fd;
-        pfd[1].fd     = nmd_two->fd;
+        if (blocklist) {
+            blocklist_update(&ctx);
+        }
+        pfd[0].port   = port_one;
+        pfd[1].port   = port_two;
         pfd[0].events = 0;
         pfd[1].events = 0;
-        if (!rx_ready(nmd_one)) {
+        if (!pio_rx_ready(port_one)) {
             /* Ran out of input packets on the first port, we need to
              * wait for them. */
             pfd[0].events |= POLLIN;
@@ -196,7 +364,7 @@ main_loop(const char *netmap_port_one, const char *netmap_port_two,
              * TX ring space in the other port. */
             pfd[1].events |= POLLOUT;
         }
-        if (!rx_ready(nmd_two)) {
+        if (!pio_rx_ready(port_two)) {
             /* Ran out of input packets on the second port, we need to
              * wait for them. */
             pfd[1].events |= POLLIN;
@@ -205,28 +373,144 @@ main_loop(const char *netmap_port_one, const char *netmap_port_two,
              * TX ring space in the other port. */
             pfd[0].events |= POLLOUT;
         }
+        if (host) {
+            /* The host rings are waited on like the other port: input
+             * from the host stack goes to the port, while input from
+             * the port may go to the host stack. */
+            pfd[2].port   = host_one;
+            pfd[3].port   = host_two;
+            pfd[2].events = pio_rx_ready(port_one) ? POLLOUT : 0;
+            pfd[3].events = pio_rx_ready(port_two) ? POLLOUT : 0;
+            if (!pio_rx_ready(host_one)) {
+                pfd[2].events |= POLLIN;
+            } else {
+                pfd[0].events |= POLLOUT;
+            }
+            if (!pio_rx_ready(host_two)) {
+                pfd[3].events |= POLLIN;
+            } else {
+                pfd[1].events |= POLLOUT;
+            }
+        }
+        timed = 0;
+        if (qc) {
+            /* Queued packets wait for TX ring space too, unless a rate
+             * cap holds them back or too many slots are in flight: then
+             * we wake up in time to drain them. */
+            uint64_t now = rdtsc();
+            uint64_t at_one, at_two;
+
+            pfd[1].events |= qos_wait(&qos_one, port_two, now, &at_one);
+            pfd[0].events |= qos_wait(&qos_two, port_one, now, &at_two);
+            if (at_one != UINT64_MAX) {
+                pio_wake_in(port_two, tsc2ns(at_one - now));
+                timed = 1;
+            }
+            if (at_two != UINT64_MAX) {
+                pio_wake_in(port_one, tsc2ns(at_two - now));
+                timed = 1;
+            }
+        }
 
         /* We poll with a timeout to have a chance to break the main loop if
          * no packets are coming. */
-        ret = poll(pfd, 2, 1000);
+        ret = pio_poll_moderated(pfd, host ? 4 : 2, 1000, wk);
+        /* Hand over the samples of the last round, also when idle. */
+        sample_flush(sampler);
         if (ret < 0) {
-            perror("poll()");
-        } else if (ret == 0) {
+            perror("pio_poll()");
+        } else if (ret == 0 && !timed) {
             /* Timeout */
             continue;
         }
+        t0   = rdtsc();
+        tot0 = tot;
 
         /* Forward in the two directions. */
-        forward_pkts(nmd_one, nmd_two, udp_port, zerocopy);
-        forward_pkts(nmd_two, nmd_one, udp_port, zerocopy);
+        if (qc) {
+            uint64_t now;
+
+            fwd_enqueue(port_one, &qos_one, host_one, &ctx);
+            fwd_enqueue(port_two, &qos_two, host_two, &ctx);
+            now = rdtsc();
+            fwd += qos_drain(&qos_one, port_two, now);
+            fwd += qos_drain(&qos_two, port_one, now);
+        } else {
+            forward_pkts(port_one, port_two, host_one, &ctx);
+            forward_pkts(port_two, port_one, host_two, &ctx);
+        }
+        if (host) {
+            host_pkts(host_one, port_one, NULL, &hctx);
+            host_pkts(host_two, port_two, NULL, &hctx);
+        }
+        if (tot != tot0) {
+            stats_hist_add(&batch_h, tot - tot0);
+            stats_hist_add(&proc_h, tsc2ns(rdtsc() - t0));
+        }
 #endif /* SOLUTION */
     }
 
-    nm_close(nmd_one);
-    nm_close(nmd_two);
+    stats_close(st);
+#ifdef SOLUTION
+    if (qc) {
+        qos_free(&qos_one, port_one);
+        qos_free(&qos_two, port_two);
+    }
+#endif /* SOLUTION */
+    pio_close(port_one);
+    pio_close(port_two);
+    if (host) {
+        pio_close(host_one);
+        pio_close(host_two);
+    }
 
     printf("Total processed packets: %llu\n", tot);
     printf("Forwarded packets      : %llu\n", fwd);
+    if (host) {
+        printf("Passed to the host     : %llu\n", to_host);
+        printf("Sent by the host       : %llu\n", from_host);
+    }
+    if (blocklist) {
+        printf("Blocked packets        : %llu\n", blocked);
+    }
+    if (sampler) {
+        printf("Sampled packets        : %llu (%llu dropped)\n",
+               sampler->samples, sampler->drops);
+    }
+    if (qc && qc->htb) {
+        const struct htb_stats *hs = &qc->htb->st;
+
+        printf("Shaped packets         : %llu sent, %llu borrowed\n",
+               hs->pkts, hs->borrowed);
+        printf("Shaper drops           : %llu full, %llu unclassified, "
+               "%llu CoDel\n",
+               hs->drops, hs->unclassified, hs->codel_drops);
+        if (hs->pkts) {
+            printf("Shaper sojourn         : %llu ns avg\n",
+                   hs->sojourn.sum / hs->pkts);
+        }
+    }
+    for (c = 0; qc && !qc->htb && c < QOS_CLASSES; c++) {
+        const struct qos_class *cls = &qc->cls[c];
+
+        printf("Class %u                : %llu sent, %llu dropped", c,
+               cls->pkts, cls->drops);
+        if (cls->codel_drops) {
+            printf(", %llu CoDel drops", cls->codel_drops);
+        }
+        if (cls->pkts) {
+            printf(", %llu ns avg sojourn", cls->sojourn.sum / cls->pkts);
+        }
+        printf("\n");
+    }
+    if (wk && wk->wakeups) {
+        printf("Wakeups                : %llu (%.1f slots each)\n",
+               wk->wakeups, (double)wk->slots / wk->wakeups);
+    }
+    if (tf) {
+        printf("TX flushes             : %llu batch, %llu deadline\n",
+               tf->by_batch, tf->by_deadline);
+    }
 
     return 0;
 }
@@ -235,7 +519,13 @@ static void
 usage(char **argv)
 {
     printf("usage: %s [-h] [-p UDP_PORT] [-i NETMAP_PORT_ONE] "
-           "[-i NETMAP_PORT_TWO]\n",
+           "[-i NETMAP_PORT_TWO] [-M unix:PATH|tcp:PORT] "
+           "[-W TARGET[:MAX_US]] [-D BATCH[:DELAY_US]] "
+           "[-e FILE[:SECTION]] [-f EXPR|@FILE] [-H] [-b BLOCKLIST] "
+           "[-Q TXSLOTS[:MBPS]] [-c CLASS:MBPS] [-T FILE] "
+           "[-A TARGET_US[:INTERVAL_US]] [-s [count:|flow:]N] "
+           "[-w FILE.pcap|FILE.pcapng]\n",
+
            argv[0]);
     exit(EXIT_SUCCESS);
 }
@@ -246,11 +536,28 @@ main(int argc, char **argv)
     const char *netmap_port_one = NULL;
     const char *netmap_port_two = NULL;
     int udp_port                = 0; /* zero means select everything */
+    const char *metrics         = NULL;
+    struct pio_wakeup *wk       = NULL;
+    struct pio_txflush *tf      = NULL;
+    struct qos_conf *qc         = NULL;
+    const char *filter_name     = NULL;
+    const char *shaper_path     = NULL;
+    const char *sample_path     = NULL;
+    uint32_t sample_rate        = 0;
+    int sample_mode             = SAMPLE_COUNT;
+    int host                    = 0;
+    char errbuf[CBPF_ERRBUF_SIZE];
+    char blerr[BLOCKLIST_ERRBUF_SIZE];
+    char htberr[HTB_ERRBUF_SIZE];
+    struct pio_wakeup wakeup;
+    struct pio_txflush txflush;
+    struct qos_conf qosconf;
     struct sigaction sa;
     int opt;
     int ret;
 
-    while ((opt = getopt(argc, argv, "hi:p:")) != -1) {
+    memset(&qosconf, 0, sizeof(qosconf));
+    while ((opt = getopt(argc, argv, "hi:p:M:W:D:e:f:Hb:Q:c:T:A:s:w:")) != -1) {
         switch (opt) {
         case 'h':
             usage(argv);
@@ -272,6 +579,112 @@ main(int argc, char **argv)
             }
             break;
 
+        case 'M':
+            /* Serve OpenMetrics on a Unix socket or localhost TCP. */
+            metrics = optarg;
+            break;
+
+        case 'W':
+            /* Hold small wakeups back, TARGET slots within MAX_US. */
+            if (pio_wakeup_parse(&wakeup, optarg)) {
+                printf("    invalid wakeup moderation %s\n", optarg);
+                usage(argv);
+            }
+            wk = &wakeup;
+            break;
+
+        case 'D':
+            /* Flush TX after BATCH slots or DELAY_US. */
+            if (pio_txflush_parse(&txflush, optarg)) {
+                printf("    invalid TX flush policy %s\n", optarg);
+                usage(argv);
+            }
+            tf = &txflush;
+            break;
+
+        case 'e':
+            /* Select the packets with an eBPF program. */
+            if (filter) {
+                printf("    at most one -e or -f filter\n");
+                usage(argv);
+            }
+            filter = ebpf_open(optarg);
+            if (filter == NULL) {
+                printf("    failed to load %s: %s\n", optarg,
+                       strerror(errno));
+                usage(argv);
+            }
+            filter_name = optarg;
+            break;
+
+        case 'f':
+            /* Select the packets with a tcpdump expression. */
+            if (filter) {
+                printf("    at most one -e or -f filter\n");
+                usage(argv);
+            }
+            filter = cbpf_compile(optarg, errbuf);
+            if (filter == NULL) {
+                printf("    invalid filter '%s': %s\n", optarg, errbuf);
+                usage(argv);
+            }
+            filter_name = optarg;
+            break;
+
+        case 'H':
+            /* Pass the packets not selected to the host stack. */
+            host = 1;
+            break;
+
+        case 'b':
+            /* Drop the packets from the addresses listed in a file. */
+            blocklist_path = optarg;
+            break;
+
+        case 'Q':
+            /* Queue by DSCP class, TXSLOTS in flight per TX ring. */
+            if (qos_conf_parse(&qosconf, optarg)) {
+                printf("    invalid QoS setting %s\n", optarg);
+                usage(argv);
+            }
+            qc = &qosconf;
+            break;
+
+        case 'c':
+            /* Cap the rate of a class. */
+            if (qos_class_parse(&qosconf, optarg)) {
+                printf("    invalid class rate %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'T':
+            /* Shape with a hierarchical token bucket tree. */
+            shaper_path = optarg;
+            break;
+
+        case 'A':
+            /* Drop from the queues with CoDel. */
+            if (codel_parse(optarg, &qosconf.codel_target_us,
+                            &qosconf.codel_interval_us)) {
+                printf("    invalid CoDel setting %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 's':
+            /* Sample one packet (or flow) in N. */
+            if (sample_parse(optarg, &sample_mode, &sample_rate)) {
+                printf("    invalid sampling %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'w':
+            /* Write the samples to a pcap or pcapng file. */
+            sample_path = optarg;
+            break;
+
         default:
             printf("    unrecognized option '-%c'\n", opt);
             usage(argv);
@@ -289,6 +702,32 @@ main(int argc, char **argv)
         usage(argv);
     }
 
+    for (opt = 0; opt < QOS_CLASSES; opt++) {
+        if (qosconf.cls[opt].mbps && (qc == NULL || shaper_path)) {
+            printf("    class rates need -Q, without -T\n");
+            usage(argv);
+        }
+    }
+
+    if (qosconf.codel_target_us && qc == NULL && shaper_path == NULL) {
+        printf("    CoDel needs -Q or -T\n");
+        usage(argv);
+    }
+
+    if (!sample_rate != !sample_path) {
+        printf("    sampling needs both -s and -w\n");
+        usage(argv);
+    }
+
+    if (shaper_path) {
+        qosconf.htb = htb_conf_load(shaper_path, htberr);
+        if (qosconf.htb == NULL) {
+            printf("Failed to load %s: %s\n", shaper_path, htberr);
+            exit(EXIT_FAILURE);
+        }
+        qc = &qosconf;
+    }
+
     /* Register Ctrl-C handler. */
     sa.sa_handler = sigint_handler;
     sigemptyset(&sa.sa_mask);
@@ -298,15 +737,65 @@ main(int argc, char **argv)
         perror("sigaction(SIGINT)");
         exit(EXIT_FAILURE);
     }
-    (void)rx_ready;
+
+    if (blocklist_path) {
+        blocklist = blocklist_load(blocklist_path, blerr);
+        if (blocklist == NULL) {
+            printf("Failed to load %s: %s\n", blocklist_path, blerr);
+            exit(EXIT_FAILURE);
+        }
+        blocklist_entries = blocklist->entries;
+
+        /* Reload the file on SIGHUP. */
+        sa.sa_handler = sighup_handler;
+        ret           = sigaction(SIGHUP, &sa, NULL);
+        if (ret) {
+            perror("sigaction(SIGHUP)");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     printf("Port one: %s\n", netmap_port_one);
     printf("Port two: %s\n", netmap_port_two);
-    printf("UDP port: %d\n", udp_port);
+    if (filter) {
+        printf("Filter  : %s (%u eBPF insns, %s)\n", filter_name,
+               filter->ninsns, filter->jitted ? "JIT compiled" : "interpreted");
+    } else {
+        printf("UDP port: %d\n", udp_port);
+    }
+    if (blocklist) {
+        printf("Blocklist: %s (%lu addresses)\n", blocklist_path,
+               blocklist->entries);
+    }
+    if (shaper_path) {
+        printf("Shaper  : %s\n", shaper_path);
+    }
+    if (qosconf.codel_target_us) {
+        printf("CoDel   : %u us target, %u us interval\n",
+               qosconf.codel_target_us, qosconf.codel_interval_us);
+    }
 
-    main_loop(netmap_port_one, netmap_port_two, udp_port);
+    tsc_calibrate();
 
-    (void)pkt_select; /* silence the compiler */
+    if (sample_path) {
+        sampler = sample_open(sample_path, sample_mode, sample_rate, tsc_hz);
+        if (sampler == NULL) {
+            printf("Failed to open %s: %s\n", sample_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        printf("Sampling: 1 %s in %u to %s\n",
+               sample_mode == SAMPLE_FLOW ? "flow" : "packet", sample_rate,
+               sample_path);
+    }
+
+    main_loop(netmap_port_one, netmap_port_two, udp_port, metrics, wk, tf,
+              host, qc);
+    if (sampler && sample_close(sampler)) {
+        printf("Failed to write %s: %s\n", sample_path, strerror(errno));
+    }
+    ebpf_free(filter);
+    blocklist_free(blocklist);
+    htb_conf_free(qosconf.htb);
 
     return 0;
 }
@@ -0,0 +1,346 @@
+/*
+ * This program measures the forwarding loops of fwdloop.h at 64-byte
+ * frames: for each combination of zerocopy, filter and rewrite it runs
+ * the loop specialized for it and the generic one, which tests them for
+ * every packet, over a pair of in-memory rings. The cost is reported in
+ * TSC cycles per packet, together with the branches per packet counted
+ * with perf_event_open(), which shows the per-packet tests going away.
+ * With -b the same loops are also run with a blocklist of that many
+ * random addresses, and random sources that are mostly not listed, to
+ * show the cost of the lookups.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "pktio.h"
+#include "pkt.h"
+#include "ebpf.h"
+#include "fwdloop.h"
+#include "blocklist.h"
+#include "tsc.h"
+
+#define RING_SLOTS 1024
+/* One cache line more than the netmap buffers: with 2048 bytes all the
+ * headers map to the same two L1 sets, and the misses hide the loop. */
+#define BUF_SIZE (2048 + 64)
+#define FRAME_LEN 60 /* 64 bytes on the wire with the FCS */
+#define UDP_PORT 8000
+
+static struct pio_slot rx_slots[RING_SLOTS];
+static struct pio_slot tx_slots[RING_SLOTS];
+static struct pio_ring rxring;
+static struct pio_ring txring;
+static struct pio_port src;
+static struct pio_port dst;
+static char *bufs;
+static uint32_t seed = 1;
+
+static const char *filter_names[] = {"none", "udp", "ebpf"};
+static const char *rewrite_names[] = {"none", "swap"};
+
+/* Both rings share the buffers, so that zerocopy is possible. */
+static void
+rings_init(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < 2 * RING_SLOTS; i++) {
+        char *buf                 = bufs + i * BUF_SIZE;
+        struct ether_header *ethh = (struct ether_header *)buf;
+        struct ip *iph            = (struct ip *)(ethh + 1);
+        struct udphdr *udph       = (struct udphdr *)(iph + 1);
+
+        /* Same ports both ways: swapping keeps the packets matching. */
+        memset(buf, 0, FRAME_LEN);
+        ethh->ether_type = htons(ETHERTYPE_IP);
+        iph->ip_v        = 4;
+        iph->ip_hl       = 5;
+        iph->ip_p        = IPPROTO_UDP;
+        udph->uh_sport   = htons(UDP_PORT);
+        udph->uh_dport   = htons(UDP_PORT);
+    }
+    for (i = 0; i < RING_SLOTS; i++) {
+        rx_slots[i].buf_idx = i;
+        tx_slots[i].buf_idx = RING_SLOTS + i;
+    }
+
+    rxring.num_slots = txring.num_slots = RING_SLOTS;
+    rxring.buf_base = txring.buf_base = bufs;
+    rxring.buf_size = txring.buf_size = BUF_SIZE;
+    rxring.slot                       = rx_slots;
+    txring.slot                       = tx_slots;
+    src.rx[0]                         = &rxring;
+    dst.tx[0]                         = &txring;
+    src.mem = dst.mem = bufs;
+}
+
+/* xorshift32, enough to spread the addresses. */
+static uint32_t
+rand32(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return seed;
+}
+
+/* A full RX ring to forward into an empty TX ring, with new sources
+ * for a blocklist, so that its cache lines are not all hot. */
+static void
+rings_refill(int new_sources)
+{
+    unsigned int i;
+
+    for (i = 0; i < RING_SLOTS; i++) {
+        rx_slots[i].len = FRAME_LEN;
+        if (new_sources) {
+            char *buf      = bufs + rx_slots[i].buf_idx * BUF_SIZE;
+            struct ip *iph = (struct ip *)(buf + sizeof(struct ether_header));
+
+            iph->ip_src.s_addr = rand32();
+        }
+    }
+    rxring.head = rxring.cur = 0;
+    rxring.tail              = RING_SLOTS - 1;
+    txring.head = txring.cur = 0;
+    txring.tail              = RING_SLOTS - 1;
+    src.rx_pending[0]        = 1;
+}
+
+static int
+perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Returns the cycles per packet, and the branches in *branches. */
+static double
+run(fwd_fn fn, struct fwd_ctx *ctx, unsigned int rounds, int perf_fd,
+    double *branches)
+{
+    unsigned long long tot0 = *ctx->tot;
+    long long count         = 0;
+    unsigned int r;
+    uint64_t cycles = 0;
+
+    rings_refill(ctx->bl != NULL);
+    fn(&src, &dst, NULL, ctx); /* warm up the caches */
+    tot0 = *ctx->tot;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    }
+    for (r = 0; r < rounds; r++) {
+        uint64_t t0;
+
+        rings_refill(ctx->bl != NULL);
+        if (perf_fd >= 0) {
+            ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        t0 = rdtsc();
+        fn(&src, &dst, NULL, ctx);
+        cycles += rdtsc() - t0;
+        if (perf_fd >= 0) {
+            ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    if (perf_fd >= 0 && read(perf_fd, &count, sizeof(count)) != sizeof(count)) {
+        count = 0;
+    }
+    *branches = (double)count / (*ctx->tot - tot0);
+
+    return (double)cycles / (*ctx->tot - tot0);
+}
+
+static void
+usage(char **argv)
+{
+    printf("usage: %s [-h] [-r ROUNDS] [-e FILE[:SECTION]] "
+           "[-f EXPR|@FILE] [-b ENTRIES]\n",
+           argv[0]);
+    exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int rounds    = 2000;
+    struct ebpf_prog *prog = NULL;
+    unsigned long long tot = 0;
+    unsigned long long out = 0;
+    unsigned long long blk = 0;
+    unsigned long entries  = 0;
+    struct blocklist *bl   = NULL;
+    int nfilters           = FWD_FILTER_EBPF;
+    char errbuf[CBPF_ERRBUF_SIZE];
+    struct fwd_ctx ctx;
+    int perf_fd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hr:e:f:b:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage(argv);
+            return 0;
+
+        case 'r':
+            rounds = atoi(optarg);
+            if (rounds == 0) {
+                printf("    invalid number of rounds %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'e':
+            prog = ebpf_open(optarg);
+            if (prog == NULL) {
+                printf("    failed to load %s: %s\n", optarg,
+                       strerror(errno));
+                usage(argv);
+            }
+            nfilters = FWD_FILTER_MAX;
+            break;
+
+        case 'f':
+            prog = cbpf_compile(optarg, errbuf);
+            if (prog == NULL) {
+                printf("    invalid filter '%s': %s\n", optarg, errbuf);
+                usage(argv);
+            }
+            nfilters = FWD_FILTER_MAX;
+            break;
+
+        case 'b':
+            entries = strtoul(optarg, NULL, 0);
+            if (entries == 0) {
+                printf("    invalid number of entries %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        default:
+            printf("    unrecognized option '-%c'\n", opt);
+            usage(argv);
+            return -1;
+        }
+    }
+
+    bufs = aligned_alloc(64, 2 * RING_SLOTS * BUF_SIZE);
+    if (bufs == NULL) {
+        printf("Failed to allocate the ring buffers\n");
+        return -1;
+    }
+    rings_init();
+    perf_fd = perf_open();
+    if (perf_fd < 0) {
+        printf("perf_event_open(): %s, branches not available\n",
+               strerror(errno));
+    }
+    tsc_calibrate();
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.udp_port = UDP_PORT;
+    ctx.prog     = prog;
+    ctx.tot      = &tot;
+    ctx.out      = &out;
+    ctx.blocked  = &blk;
+
+    printf("%-8s %-6s %-7s %14s %14s %6s %12s %12s\n", "zerocopy", "filter",
+           "rewrite", "generic cyc", "special cyc", "gain", "generic br",
+           "special br");
+    for (ctx.zerocopy = 0; ctx.zerocopy < 2; ctx.zerocopy++) {
+        for (ctx.filter = 0; ctx.filter < nfilters; ctx.filter++) {
+            for (ctx.rewrite = 0; ctx.rewrite < FWD_REWRITE_MAX;
+                 ctx.rewrite++) {
+                double gc, sc, gb, sb;
+
+                gc = run(fwd_generic, &ctx, rounds, perf_fd, &gb);
+                sc = run(fwd_select(&ctx), &ctx, rounds, perf_fd, &sb);
+                printf("%-8s %-6s %-7s %14.2f %14.2f %5.1f%% ",
+                       ctx.zerocopy ? "yes" : "no", filter_names[ctx.filter],
+                       rewrite_names[ctx.rewrite], gc, sc,
+                       100 * (gc - sc) / gc);
+                if (perf_fd >= 0) {
+                    printf("%12.2f %12.2f\n", gb, sb);
+                } else {
+                    printf("%12s %12s\n", "n/a", "n/a");
+                }
+            }
+        }
+    }
+
+    if (entries) {
+        uint32_t *addrs = malloc(entries * sizeof(*addrs));
+        unsigned long i;
+        uint64_t t0;
+
+        if (addrs == NULL) {
+            printf("Failed to allocate %lu addresses\n", entries);
+            return -1;
+        }
+        for (i = 0; i < entries; i++) {
+            addrs[i] = rand32();
+        }
+        t0 = rdtsc();
+        bl = blocklist_build(addrs, entries);
+        if (bl == NULL) {
+            printf("Failed to build the blocklist: %s\n", strerror(errno));
+            return -1;
+        }
+        printf("\nblocklist of %lu addresses built in %.0f ms\n",
+               bl->entries, tsc2ns(rdtsc() - t0) / 1e6);
+        free(addrs);
+
+        printf("%-8s %-6s %-7s %14s %14s %9s %10s\n", "zerocopy", "filter",
+               "rewrite", "plain cyc", "blocklist cyc", "overhead",
+               "blocked");
+        for (ctx.zerocopy = 0; ctx.zerocopy < 2; ctx.zerocopy++) {
+            for (ctx.filter = 0; ctx.filter < nfilters; ctx.filter++) {
+                for (ctx.rewrite = 0; ctx.rewrite < FWD_REWRITE_MAX;
+                     ctx.rewrite++) {
+                    unsigned long long tot0;
+                    double pc, bc, pb, bb;
+
+                    ctx.bl = NULL;
+                    pc     = run(fwd_select(&ctx), &ctx, rounds, -1, &pb);
+                    ctx.bl = bl;
+                    blk    = 0;
+                    tot0   = tot;
+                    bc     = run(fwd_select(&ctx), &ctx, rounds, -1, &bb);
+                    printf("%-8s %-6s %-7s %14.2f %14.2f %8.1f%% %9.3f%%\n",
+                           ctx.zerocopy ? "yes" : "no",
+                           filter_names[ctx.filter],
+                           rewrite_names[ctx.rewrite], pc, bc,
+                           100 * (bc - pc) / pc,
+                           100.0 * blk / (tot - tot0));
+                }
+            }
+        }
+        ctx.bl = NULL;
+    }
+
+    if (perf_fd >= 0) {
+        close(perf_fd);
+    }
+    blocklist_free(bl);
+    ebpf_free(prog);
+    free(bufs);
+
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Forwarding loops between two ports, see fwdloop.h. The loop is written
+ * once, in fwd_loop(), and instantiated for each combination with
+ * constant arguments, which the compiler folds away: this file is always
+ * built with optimizations (see the Makefile).
+ */
+#include <string.h>
+#include "fwdloop.h"
+#include "ebpf.h"
+#include "blocklist.h"
+#include "qos.h"
+#include "sample.h"
+#include "pkt.h"
+#include "tsc.h"
+
+_Static_assert(EBPF_BURST <= BLOCKLIST_BURST, "bursts are shared");
+
+int
+fwd_to_host(struct pio_port *host, unsigned int *hi, int zerocopy,
+            struct pio_slot *rs, const char *rxbuf)
+{
+    for (; *hi <= host->last_tx_ring; (*hi)++) {
+        struct pio_ring *txring = PIO_TXRING(host, *hi);
+        struct pio_slot *ts;
+
+        if (pio_ring_space(txring) == 0) {
+            continue;
+        }
+        ts      = &txring->slot[txring->head];
+        ts->len = rs->len;
+        if (zerocopy) {
+            uint32_t idx = ts->buf_idx;
+            ts->buf_idx  = rs->buf_idx;
+            rs->buf_idx  = idx;
+            ts->flags |= PIO_BUF_CHANGED;
+            rs->flags |= PIO_BUF_CHANGED;
+        } else {
+            memcpy(PIO_BUF(txring, ts->buf_idx), rxbuf, rs->len);
+        }
+        txring->head = txring->cur = pio_ring_next(txring, txring->head);
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline __attribute__((always_inline)) void
+fwd_loop(struct pio_port *src, struct pio_port *dst, struct pio_port *host,
+         struct fwd_ctx *ctx, int zerocopy, int filter, int rewrite,
+         int block, struct qos *qos)
+{
+    unsigned int si        = pio_rx_next(src, src->first_rx_ring);
+    unsigned int di        = qos ? 0 : dst->first_tx_ring;
+    unsigned long long tot = 0;
+    unsigned long long out = 0;
+    unsigned long long hst = 0;
+    unsigned long long blk = 0;
+    unsigned int hi        = host ? host->first_tx_ring : 0;
+    int host_zc            = host && pio_same_mem(host, src);
+    int burst              = filter == FWD_FILTER_EBPF || block;
+    uint64_t now           = qos ? rdtsc() : 0;
+    uint32_t countdown     = ctx->countdown;
+    uint32_t verdict[EBPF_BURST];
+    uint8_t blocked[EBPF_BURST];
+    unsigned int nv, k;
+
+    while (si <= src->last_rx_ring && (qos || di <= dst->last_tx_ring)) {
+        struct pio_ring *txring = NULL;
+        struct pio_ring *rxring;
+        unsigned int rxhead, txhead = 0;
+        int nrx, ntx;
+
+        rxring = PIO_RXRING(src, si);
+        nrx    = pio_ring_space(rxring);
+        if (nrx == 0) {
+            pio_rx_update(src, si);
+            si = pio_rx_next(src, si + 1);
+            continue;
+        }
+        if (qos) {
+            ntx = nrx; /* queued or dropped, never held back */
+        } else {
+            txring = PIO_TXRING(dst, di);
+            ntx    = pio_ring_space(txring);
+            if (ntx == 0) {
+                di++;
+                continue;
+            }
+            txhead = txring->head;
+        }
+
+        rxhead = rxring->head;
+        nv = k = 0;
+        for (; nrx > 0 && ntx > 0;
+             nrx--, rxhead = pio_ring_next(rxring, rxhead), tot++) {
+            struct pio_slot *rs = &rxring->slot[rxhead];
+            char *rxbuf         = PIO_BUF(rxring, rs->buf_idx);
+            struct pio_slot *ts;
+            char *txbuf;
+
+            if (--countdown == 0) {
+                countdown = sample_take(ctx->smp, rxbuf, rs->len);
+            }
+            if (burst) {
+                if (k == nv) {
+                    /* Classify the next burst with one call. */
+                    nv = nrx < EBPF_BURST ? nrx : EBPF_BURST;
+                    if (filter == FWD_FILTER_EBPF) {
+                        ebpf_run_ring(ctx->prog, rxring, rxhead, nv, verdict);
+                    }
+                    if (block) {
+                        blocklist_run_ring(ctx->bl, rxring, rxhead, nv,
+                                           blocked);
+                    }
+                    k = 0;
+                }
+                k++;
+            }
+            if (block && blocked[k - 1]) {
+                blk++;
+                continue; /* dropped, never passed to the host */
+            }
+            if (filter != FWD_FILTER_NONE) {
+                int selected;
+
+                if (filter == FWD_FILTER_UDP) {
+                    selected = udp_port_match(rxbuf, rs->len, ctx->udp_port);
+                } else {
+                    selected = verdict[k - 1] != EBPF_DROP;
+                }
+                if (!selected) {
+                    if (host) {
+                        hst += fwd_to_host(host, &hi, host_zc, rs, rxbuf);
+                    }
+                    continue; /* not forwarded */
+                }
+            }
+
+            if (qos) {
+                if (rewrite == FWD_REWRITE_SWAP) {
+                    out += pkt_udp_port_swap(rxbuf);
+                }
+                qos_enqueue(qos, rs, rxbuf, now);
+                continue; /* sent by qos_drain() */
+            }
+            ts      = &txring->slot[txhead];
+            ts->len = rs->len;
+            if (zerocopy) {
+                uint32_t idx = ts->buf_idx;
+                ts->buf_idx  = rs->buf_idx;
+                rs->buf_idx  = idx;
+                /* report the buffer change. */
+                ts->flags |= PIO_BUF_CHANGED;
+                rs->flags |= PIO_BUF_CHANGED;
+                txbuf = rxbuf;
+            } else {
+                txbuf = PIO_BUF(txring, ts->buf_idx);
+                memcpy(txbuf, rxbuf, ts->len);
+            }
+
+            if (rewrite == FWD_REWRITE_SWAP) {
+                out += pkt_udp_port_swap(txbuf);
+            } else {
+                out++;
+            }
+            txhead = pio_ring_next(txring, txhead);
+            ntx--;
+        }
+        /* Update state of netmap ring. */
+        rxring->head = rxring->cur = rxhead;
+        if (!qos) {
+            txring->head = txring->cur = txhead;
+        }
+        pio_rx_update(src, si);
+    }
+
+    ctx->countdown = countdown;
+    *ctx->tot += tot;
+    *ctx->out += out;
+    if (hst) {
+        *ctx->to_host += hst;
+    }
+    if (blk) {
+        *ctx->blocked += blk;
+    }
+}
+
+#define FWD_VARIANT(zc, f, rw, bl)                                             \
+    static void fwd_##zc##f##rw##bl(struct pio_port *src,                      \
+                                    struct pio_port *dst,                      \
+                                    struct pio_port *host,                     \
+                                    struct fwd_ctx *ctx)                       \
+    {                                                                          \
+        fwd_loop(src, dst, host, ctx, zc, f, rw, bl, NULL);                    \
+    }
+#define FWD_VARIANTS(zc, f, rw)                                                \
+    FWD_VARIANT(zc, f, rw, 0)                                                  \
+    FWD_VARIANT(zc, f, rw, 1)
+
+/* fwd_<zerocopy><filter><rewrite><blocklist>, see the enums in fwdloop.h. */
+FWD_VARIANTS(0, 0, 0)
+FWD_VARIANTS(0, 0, 1)
+FWD_VARIANTS(0, 1, 0)
+FWD_VARIANTS(0, 1, 1)
+FWD_VARIANTS(0, 2, 0)
+FWD_VARIANTS(0, 2, 1)
+FWD_VARIANTS(1, 0, 0)
+FWD_VARIANTS(1, 0, 1)
+FWD_VARIANTS(1, 1, 0)
+FWD_VARIANTS(1, 1, 1)
+FWD_VARIANTS(1, 2, 0)
+FWD_VARIANTS(1, 2, 1)
+
+#define FWD_PAIR(zc, f, rw)                                                    \
+    {                                                                          \
+        fwd_##zc##f##rw##0, fwd_##zc##f##rw##1                                 \
+    }
+
+static const fwd_fn fwd_variants[2][FWD_FILTER_MAX][FWD_REWRITE_MAX][2] = {
+    {{FWD_PAIR(0, 0, 0), FWD_PAIR(0, 0, 1)},
+     {FWD_PAIR(0, 1, 0), FWD_PAIR(0, 1, 1)},
+     {FWD_PAIR(0, 2, 0), FWD_PAIR(0, 2, 1)}},
+    {{FWD_PAIR(1, 0, 0), FWD_PAIR(1, 0, 1)},
+     {FWD_PAIR(1, 1, 0), FWD_PAIR(1, 1, 1)},
+     {FWD_PAIR(1, 2, 0), FWD_PAIR(1, 2, 1)}},
+};
+
+fwd_fn
+fwd_select(const struct fwd_ctx *ctx)
+{
+    return fwd_variants[!!ctx->zerocopy][ctx->filter][ctx->rewrite]
+                       [ctx->bl != NULL];
+}
+
+void
+fwd_generic(struct pio_port *src, struct pio_port *dst, struct pio_port *host,
+            struct fwd_ctx *ctx)
+{
+    fwd_loop(src, dst, host, ctx, ctx->zerocopy, ctx->filter, ctx->rewrite,
+             ctx->bl != NULL, NULL);
+}
+
+void
+fwd_enqueue(struct pio_port *src, struct qos *q, struct pio_port *host,
+            struct fwd_ctx *ctx)
+{
+    fwd_loop(src, NULL, host, ctx, 0, ctx->filter, ctx->rewrite,
+             ctx->bl != NULL, q);
+}
@@ -0,0 +1,79 @@
+/*
+ * Forwarding loops between two ports, specialized at compile time.
+ *
+ * forward and swap move the packets from the RX rings of a port to the
+ * TX rings of another one, selecting and rewriting them on the way.
+ * Whether buffers can be swapped (zerocopy), how the packets are
+ * selected and how they are rewritten is fixed at startup: rather than
+ * testing it for every packet, fwd_select() returns the loop compiled
+ * for that combination, which has none of these branches.
+ * fwd_generic() is the same loop testing them at run time, the baseline
+ * of fwdbench.
+ *
+ * The packets not selected are dropped, or passed to the host stack
+ * through host, the host rings of src (NAME^ in netmap), when given.
+ * With a blocklist, the packets from the listed sources are dropped
+ * before any of that. All the packets received are first counted down
+ * for the sampler, if any (see sample.h).
+ *
+ * fwd_enqueue() selects the packets in the same way, but queues them by
+ * class for qos_drain() rather than sending them (see qos.h), which
+ * counts them as forwarded. It tests the configuration at run time: the
+ * queueing costs more than that.
+ */
+#ifndef __FWDLOOP_H__
+#define __FWDLOOP_H__
+
+#include "pktio.h"
+
+/* Packet selection. */
+enum {
+    FWD_FILTER_NONE, /* all packets */
+    FWD_FILTER_UDP,  /* UDP packets to udp_port */
+    FWD_FILTER_EBPF, /* packets not dropped by prog */
+    FWD_FILTER_MAX,
+};
+
+/* Rewriting of the forwarded packets. */
+enum {
+    FWD_REWRITE_NONE,
+    FWD_REWRITE_SWAP, /* swap the UDP ports */
+    FWD_REWRITE_MAX,
+};
+
+struct ebpf_prog;
+struct blocklist;
+struct qos;
+struct sampler;
+
+struct fwd_ctx {
+    int zerocopy;
+    int filter;
+    int rewrite;
+    int udp_port;                 /* FWD_FILTER_UDP */
+    const struct ebpf_prog *prog; /* FWD_FILTER_EBPF */
+    const struct blocklist *bl;   /* or NULL, may change between calls */
+    struct sampler *smp;          /* or NULL */
+    uint32_t countdown;           /* packets to the next sample_take() */
+    unsigned long long *tot;      /* received packets */
+    unsigned long long *out;      /* forwarded, or rewritten with SWAP */
+    unsigned long long *to_host;  /* passed to the host stack */
+    unsigned long long *blocked;  /* dropped by the blocklist */
+};
+
+typedef void (*fwd_fn)(struct pio_port *src, struct pio_port *dst,
+                       struct pio_port *host, struct fwd_ctx *ctx);
+
+fwd_fn fwd_select(const struct fwd_ctx *ctx);
+
+/* Pass a packet not selected (slot rs, buffer rxbuf) to the TX rings of
+ * host from ring *hi on, swapping the buffers with zerocopy. Returns 0
+ * if the rings are full, and the packet is to be dropped. */
+int fwd_to_host(struct pio_port *host, unsigned int *hi, int zerocopy,
+                struct pio_slot *rs, const char *rxbuf);
+void fwd_generic(struct pio_port *src, struct pio_port *dst,
+                 struct pio_port *host, struct fwd_ctx *ctx);
+void fwd_enqueue(struct pio_port *src, struct qos *q, struct pio_port *host,
+                 struct fwd_ctx *ctx);
+
+#endif /* __FWDLOOP_H__ */
@@ -0,0 +1,292 @@
+/*
+ * This program generates UDP packets on a port, replacing pkt-gen for
+ * the exercises. One frame template is prebuilt for each flow in the
+ * source and destination ranges; TX slots are filled in batches by
+ * copying the templates round robin. Optionally each packet carries its
+ * flow index, a sequence number of its flow and a TSC timestamp (patched
+ * in with an incremental UDP checksum update), and the rate can be paced
+ * using the TSC.
+ * With -t the flows are marked with DSCP values, round robin, e.g. to
+ * mix a few EF flows into bulk traffic.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <stdint.h>
+#include "pktio.h"
+#include "flows.h"
+#include "tsc.h"
+
+static int stop                = 0;
+static unsigned long long sent = 0;
+
+static void
+sigint_handler(int signum)
+{
+    stop = 1;
+}
+
+static int
+main_loop(const char *netmap_port, const struct flow_set *fs, double rate,
+          unsigned long long count, unsigned int batch, int stamp)
+{
+    struct pio_port *port;
+    double tsc_per_pkt = 0;
+    uint64_t next_tsc;
+    unsigned int flow = 0;
+    uint32_t *seq; /* next of each flow */
+    uint64_t t_start, t_end;
+
+    seq = calloc(fs->nflows, sizeof(*seq));
+    if (seq == NULL) {
+        printf("Failed to allocate the sequence numbers\n");
+        return -1;
+    }
+
+    port = pio_open(netmap_port, NULL);
+    if (port == NULL) {
+        if (!errno) {
+            printf("Failed to pio_open(%s): unknown port type\n", netmap_port);
+        } else {
+            printf("Failed to pio_open(%s): %s\n", netmap_port,
+                   strerror(errno));
+        }
+        free(seq);
+        return -1;
+    }
+
+    if (rate > 0) {
+        tsc_per_pkt = tsc_hz / rate;
+    }
+    t_start = next_tsc = rdtsc();
+
+    while (!stop && (count == 0 || sent < count)) {
+        struct pio_pollfd pfd[1];
+        unsigned int ri;
+        int ret;
+
+        pfd[0].port   = port;
+        pfd[0].events = POLLOUT;
+
+        /* We poll with a timeout to have a chance to break the main loop if
+         * the port does not drain. */
+        ret = pio_poll(pfd, 1, 1000);
+        if (ret < 0) {
+            perror("pio_poll()");
+        } else if (ret == 0) {
+            /* Timeout */
+            continue;
+        }
+
+        for (ri = port->first_tx_ring; ri <= port->last_tx_ring; ri++) {
+            struct pio_ring *txring = PIO_TXRING(port, ri);
+            unsigned int n          = pio_ring_space(txring);
+            unsigned int head       = txring->head;
+            uint64_t ts;
+
+            if (n > batch) {
+                n = batch;
+            }
+            if (count && n > count - sent) {
+                n = count - sent;
+            }
+            if (n == 0) {
+                continue;
+            }
+            if (tsc_per_pkt > 0) {
+                /* Busy wait until this batch is due. */
+                while ((ts = rdtsc()) < next_tsc) {
+                }
+                next_tsc += n * tsc_per_pkt;
+            } else {
+                ts = rdtsc();
+            }
+
+            sent += n;
+            for (; n > 0; n--, head = pio_ring_next(txring, head)) {
+                struct pio_slot *slot = &txring->slot[head];
+                char *txbuf           = PIO_BUF(txring, slot->buf_idx);
+
+                if (stamp) {
+                    flow_fill_stamp(fs, flow, txbuf, seq[flow]++, ts);
+                } else {
+                    flow_fill(fs, flow, txbuf);
+                }
+                slot->len = fs->len;
+                if (++flow == fs->nflows) {
+                    flow = 0;
+                }
+            }
+            txring->head = txring->cur = head;
+        }
+    }
+
+    /* Flush the last batch. */
+    {
+        struct pio_pollfd pfd[1] = {{port, 0, 0}};
+
+        pio_poll(pfd, 1, 0);
+    }
+    t_end = rdtsc();
+    pio_close(port);
+    free(seq);
+
+    printf("Total sent packets: %llu\n", sent);
+    if (t_end > t_start) {
+        printf("Average rate      : %.3f Mpps\n",
+               sent / (double)tsc2ns(t_end - t_start) * 1e3);
+    }
+
+    return 0;
+}
+
+static void
+usage(char **argv)
+{
+    printf("usage: %s [-h] [-i NETMAP_PORT] [-s SRC_RANGE] [-d DST_RANGE] "
+           "[-l FRAME_LEN] [-R RATE_PPS] [-n COUNT] [-b BATCH] [-T] "
+           "[-t DSCP[,DSCP...]]\n"
+           "    ranges are IP[:PORT][-IP[:PORT]]\n",
+           argv[0]);
+    exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *netmap_port  = NULL;
+    const char *src          = "10.0.0.1:7000";
+    const char *dst          = "10.0.0.1:8000";
+    unsigned int len         = 60;
+    double rate              = 0; /* zero means line rate */
+    unsigned long long count = 0; /* zero means forever */
+    unsigned int batch       = 256;
+    int stamp                = 0;
+    const char *tos          = NULL;
+    uint8_t dscp[FLOW_MAX];
+    unsigned int ndscp = 0;
+    struct flow_range srange, drange;
+    struct flow_set fs;
+    struct sigaction sa;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "hi:s:d:l:R:n:b:Tt:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage(argv);
+            return 0;
+
+        case 'i':
+            netmap_port = optarg;
+            break;
+
+        case 's':
+            src = optarg;
+            break;
+
+        case 'd':
+            dst = optarg;
+            break;
+
+        case 'l':
+            len = atoi(optarg);
+            break;
+
+        case 'R':
+            rate = atof(optarg);
+            break;
+
+        case 'n':
+            count = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'b':
+            batch = atoi(optarg);
+            if (batch == 0) {
+                printf("    invalid batch %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'T':
+            stamp = 1;
+            break;
+
+        case 't':
+            tos = optarg;
+            break;
+
+        default:
+            printf("    unrecognized option '-%c'\n", opt);
+            usage(argv);
+            return -1;
+        }
+    }
+
+    if (netmap_port == NULL) {
+        printf("    missing netmap port\n");
+        usage(argv);
+    }
+
+    if (flow_range_parse(src, &srange) || flow_range_parse(dst, &drange)) {
+        printf("    invalid address range\n");
+        usage(argv);
+    }
+
+    if (tos) {
+        const char *s = tos;
+        char *end;
+
+        do {
+            unsigned long v = strtoul(s, &end, 10);
+
+            if (end == s || v > 63 || ndscp == FLOW_MAX) {
+                printf("    invalid DSCP list %s\n", tos);
+                usage(argv);
+            }
+            dscp[ndscp++] = v;
+            s             = end + 1;
+        } while (*end == ',');
+        if (*end != '\0') {
+            printf("    invalid DSCP list %s\n", tos);
+            usage(argv);
+        }
+    }
+
+    if (flow_set_build(&fs, &srange, &drange, len)) {
+        printf("Failed to build the flow templates: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ndscp) {
+        flow_set_dscp(&fs, dscp, ndscp);
+    }
+
+    /* Register Ctrl-C handler. */
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    ret         = sigaction(SIGINT, &sa, NULL);
+    if (ret) {
+        perror("sigaction(SIGINT)");
+        exit(EXIT_FAILURE);
+    }
+
+    tsc_calibrate();
+
+    printf("Port      : %s\n", netmap_port);
+    printf("Source    : %s\n", src);
+    printf("Dest      : %s\n", dst);
+    printf("Flows     : %u\n", fs.nflows);
+    printf("Frame len : %u\n", len);
+
+    main_loop(netmap_port, &fs, rate, count, batch, stamp);
+
+    flow_set_free(&fs);
+
+    return 0;
+}
@@ -0,0 +1,824 @@
+/*
+ * Hierarchical token bucket shaper, see htb.h.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include "htb.h"
+#include "qos.h"
+#include "tsc.h"
+
+#define HTB_NIL UINT32_MAX
+#define HTB_MTU 1514         /* bytes */
+#define HTB_BURST_HZ 100     /* buckets hold 1/100 s of tokens, or a MTU */
+#define HTB_MIN_QUANTUM 1514 /* DRR quanta, rate / 10 within these */
+#define HTB_MAX_QUANTUM 200000
+
+enum { HTB_CANT_SEND, HTB_MAY_BORROW, HTB_CAN_SEND };
+enum { HTB_NOWHERE, HTB_FEED, HTB_INNER };
+
+#define htb_entry(p, member)                                                   \
+    ((struct htb_class *)((char *)(p) - offsetof(struct htb_class, member)))
+
+static inline void
+htb_list_init(struct htb_list *l)
+{
+    l->next = l->prev = l;
+}
+
+static inline int
+htb_list_empty(const struct htb_list *l)
+{
+    return l->next == l;
+}
+
+static inline void
+htb_list_add_tail(struct htb_list *head, struct htb_list *n)
+{
+    n->prev          = head->prev;
+    n->next          = head;
+    head->prev->next = n;
+    head->prev       = n;
+}
+
+static inline void
+htb_list_add_head(struct htb_list *head, struct htb_list *n)
+{
+    htb_list_add_tail(head->next, n);
+}
+
+/* Unlink n, if linked, leaving it linked to itself. */
+static inline void
+htb_list_del(struct htb_list *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    htb_list_init(n);
+}
+
+/* Finalizer of MurmurHash3. */
+static inline uint32_t
+htb_hash(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static int32_t
+htb_map_find(const struct htb_map *m, uint32_t key)
+{
+    uint32_t i;
+
+    if (m->key == NULL) {
+        return -1;
+    }
+    for (i = htb_hash(key) & m->mask; m->key[i]; i = (i + 1) & m->mask) {
+        if (m->key[i] == key) {
+            return m->val[i];
+        }
+    }
+
+    return -1;
+}
+
+static void
+htb_map_free(struct htb_map *m)
+{
+    free(m->key);
+    free(m->val);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Insert a key that is not there yet. Returns -1 without memory. */
+static int
+htb_map_insert(struct htb_map *m, uint32_t key, int32_t val)
+{
+    uint32_t i;
+
+    /* At most two thirds of the slots are used. */
+    if (m->key == NULL || 3 * (m->n + 1) > 2 * (m->mask + 1UL)) {
+        struct htb_map g;
+        uint32_t j;
+
+        g.mask = m->key ? 2 * m->mask + 1 : 63;
+        g.n    = 0;
+        g.key  = calloc(g.mask + 1UL, sizeof(*g.key));
+        g.val  = malloc((g.mask + 1UL) * sizeof(*g.val));
+        if (g.key == NULL || g.val == NULL) {
+            htb_map_free(&g);
+            return -1;
+        }
+        for (j = 0; m->key && j <= m->mask; j++) {
+            if (m->key[j]) {
+                htb_map_insert(&g, m->key[j], m->val[j]);
+            }
+        }
+        htb_map_free(m);
+        *m = g;
+    }
+    for (i = htb_hash(key) & m->mask; m->key[i]; i = (i + 1) & m->mask) {
+    }
+    m->key[i] = key;
+    m->val[i] = val;
+    m->n++;
+
+    return 0;
+}
+
+void
+htb_conf_free(struct htb_conf *conf)
+{
+    if (conf == NULL) {
+        return;
+    }
+    free(conf->cls);
+    htb_map_free(&conf->addrs);
+    free(conf);
+}
+
+/* Parse "class ID PARENT RATE[:CEIL] [ADDR...]" (after "class"). Leaf
+ * addresses are added to conf->addrs as leaf indices to check later. */
+static int
+htb_parse_class(struct htb_conf *conf, struct htb_map *ids, char **save,
+                size_t *size, char *errbuf, unsigned long lineno)
+{
+    struct htb_spec *spec;
+    char *tok[3];
+    char *end;
+    unsigned long id, parent;
+    unsigned int i;
+
+    for (i = 0; i < 3; i++) {
+        tok[i] = strtok_r(NULL, " \t", save);
+        if (tok[i] == NULL) {
+            snprintf(errbuf, HTB_ERRBUF_SIZE,
+                     "line %lu: expected class ID PARENT RATE[:CEIL]", lineno);
+            return -1;
+        }
+    }
+    if (conf->ncls == *size) {
+        struct htb_spec *tmp;
+
+        *size = *size ? 2 * *size : 256;
+        tmp   = realloc(conf->cls, *size * sizeof(*tmp));
+        if (tmp == NULL) {
+            snprintf(errbuf, HTB_ERRBUF_SIZE, "%s", strerror(ENOMEM));
+            return -1;
+        }
+        conf->cls = tmp;
+    }
+    spec = &conf->cls[conf->ncls];
+    memset(spec, 0, sizeof(*spec));
+
+    id       = strtoul(tok[0], &end, 10);
+    spec->id = id;
+    if (*end != '\0' || id == 0 || id > UINT32_MAX) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE, "line %lu: invalid class ID '%.32s'",
+                 lineno, tok[0]);
+        return -1;
+    }
+    if (htb_map_find(ids, id) >= 0) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE, "line %lu: class %lu redefined",
+                 lineno, id);
+        return -1;
+    }
+    parent       = strtoul(tok[1], &end, 10);
+    spec->parent = parent ? htb_map_find(ids, parent) : -1;
+    if (*end != '\0' || (parent && spec->parent < 0)) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE, "line %lu: unknown parent '%.32s'",
+                 lineno, tok[1]);
+        return -1;
+    }
+    spec->rate = strtod(tok[2], &end);
+    spec->ceil = spec->rate;
+    if (*end == ':') {
+        spec->ceil = strtod(end + 1, &end);
+    }
+    if (*end != '\0' || !(spec->rate > 0) || spec->ceil < spec->rate) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE, "line %lu: invalid rate '%.32s'",
+                 lineno, tok[2]);
+        return -1;
+    }
+
+    while ((tok[0] = strtok_r(NULL, " \t", save)) != NULL) {
+        struct in_addr a;
+
+        if (inet_pton(AF_INET, tok[0], &a) != 1 || a.s_addr == 0) {
+            snprintf(errbuf, HTB_ERRBUF_SIZE,
+                     "line %lu: invalid address '%.32s'", lineno, tok[0]);
+            return -1;
+        }
+        if (htb_map_find(&conf->addrs, a.s_addr) >= 0) {
+            snprintf(errbuf, HTB_ERRBUF_SIZE,
+                     "line %lu: address %.32s in two classes", lineno, tok[0]);
+            return -1;
+        }
+        if (htb_map_insert(&conf->addrs, a.s_addr, conf->ncls)) {
+            snprintf(errbuf, HTB_ERRBUF_SIZE, "%s", strerror(ENOMEM));
+            return -1;
+        }
+    }
+    if (htb_map_insert(ids, id, conf->ncls)) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE, "%s", strerror(ENOMEM));
+        return -1;
+    }
+    conf->ncls++;
+
+    return 0;
+}
+
+/* Compute the levels, and check that only leaves select packets. */
+static int
+htb_conf_check(struct htb_conf *conf, char *errbuf)
+{
+    unsigned int i;
+    uint32_t j;
+
+    /* The children come after their parent, so going backwards a class
+     * is final before its parent is raised above it. */
+    for (i = conf->ncls; i-- > 0;) {
+        struct htb_spec *spec = &conf->cls[i];
+
+        if (spec->level >= HTB_MAX_LEVELS) {
+            snprintf(errbuf, HTB_ERRBUF_SIZE,
+                     "class %u: more than %d levels", spec->id,
+                     HTB_MAX_LEVELS);
+            return -1;
+        }
+        if (spec->parent >= 0 &&
+            conf->cls[spec->parent].level < spec->level + 1) {
+            conf->cls[spec->parent].level = spec->level + 1;
+        }
+    }
+    for (i = 0; i < conf->ncls; i++) {
+        conf->nleaves += conf->cls[i].level == 0;
+    }
+    for (j = 0; conf->addrs.key && j <= conf->addrs.mask; j++) {
+        if (conf->addrs.key[j] && conf->cls[conf->addrs.val[j]].level) {
+            snprintf(errbuf, HTB_ERRBUF_SIZE,
+                     "class %u: addresses on a class with children",
+                     conf->cls[conf->addrs.val[j]].id);
+            return -1;
+        }
+    }
+    if (conf->deflt >= 0 && conf->cls[conf->deflt].level) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE,
+                 "class %u: the default class has children",
+                 conf->cls[conf->deflt].id);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct htb_conf *
+htb_conf_load(const char *path, char *errbuf)
+{
+    struct htb_map ids   = {0};
+    unsigned long lineno = 0;
+    unsigned long deflt  = 0;
+    struct htb_conf *conf;
+    char *line = NULL;
+    size_t cap = 0, size = 0;
+    int ret = -1;
+    FILE *f;
+
+    conf = calloc(1, sizeof(*conf));
+    if (conf == NULL) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE, "%s", strerror(ENOMEM));
+        return NULL;
+    }
+    conf->deflt = -1;
+    f           = fopen(path, "r");
+    if (f == NULL) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE, "%s", strerror(errno));
+        free(conf);
+        return NULL;
+    }
+
+    while (getline(&line, &cap, f) >= 0) {
+        char *save, *tok;
+
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        tok = strtok_r(line, " \t", &save);
+        if (tok == NULL) {
+            continue;
+        }
+        if (!strcmp(tok, "class")) {
+            if (htb_parse_class(conf, &ids, &save, &size, errbuf, lineno)) {
+                goto out;
+            }
+        } else if (!strcmp(tok, "default")) {
+            tok = strtok_r(NULL, " \t", &save);
+            if (tok == NULL || (deflt = strtoul(tok, NULL, 10)) == 0) {
+                snprintf(errbuf, HTB_ERRBUF_SIZE,
+                         "line %lu: expected default ID", lineno);
+                goto out;
+            }
+        } else {
+            snprintf(errbuf, HTB_ERRBUF_SIZE, "line %lu: unknown '%.32s'",
+                     lineno, tok);
+            goto out;
+        }
+    }
+    if (ferror(f)) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE, "%s", strerror(errno));
+        goto out;
+    }
+    if (conf->ncls == 0) {
+        snprintf(errbuf, HTB_ERRBUF_SIZE, "no classes");
+        goto out;
+    }
+    if (deflt) {
+        conf->deflt = htb_map_find(&ids, deflt);
+        if (conf->deflt < 0) {
+            snprintf(errbuf, HTB_ERRBUF_SIZE, "unknown default class %lu",
+                     deflt);
+            goto out;
+        }
+    }
+    ret = htb_conf_check(conf, errbuf);
+out:
+    free(line);
+    fclose(f);
+    htb_map_free(&ids);
+    if (ret) {
+        htb_conf_free(conf);
+        return NULL;
+    }
+
+    return conf;
+}
+
+/* Depth in TSC of a bucket whose bytes cost cost. */
+static int64_t
+htb_depth(uint64_t cost, uint64_t hz)
+{
+    int64_t mtu = (HTB_MTU * cost) >> 16;
+
+    return hz / HTB_BURST_HZ > mtu ? hz / HTB_BURST_HZ : mtu;
+}
+
+struct htb *
+htb_create(struct htb_conf *conf, uint64_t hz)
+{
+    struct htb *h = calloc(1, sizeof(*h));
+    unsigned int i, j;
+
+    if (h == NULL) {
+        return NULL;
+    }
+    h->conf = conf;
+    h->st   = &conf->st;
+    h->cls  = calloc(conf->ncls, sizeof(*h->cls));
+    h->pkt  = malloc(HTB_BUFS * sizeof(*h->pkt));
+    h->free = malloc(HTB_BUFS * sizeof(*h->free));
+    if (h->cls == NULL || h->pkt == NULL || h->free == NULL) {
+        htb_free(h, NULL);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (h->nfree = 0; h->nfree < HTB_BUFS; h->nfree++) {
+        h->free[h->nfree] = h->nfree;
+    }
+    for (i = 0; i < HTB_MAX_LEVELS; i++) {
+        htb_list_init(&h->feed[i]);
+    }
+    for (i = 0; i < HTB_WHEEL_SLOTS; i++) {
+        htb_list_init(&h->wheel[i]);
+    }
+    h->tick     = rdtsc() >> HTB_WHEEL_SHIFT;
+    h->mbuffer  = hz; /* a second */
+    h->tsc2ns20 = (1000000000ULL << 20) / hz;
+
+    for (i = 0; i < conf->ncls; i++) {
+        const struct htb_spec *spec = &conf->cls[i];
+        struct htb_class *c         = &h->cls[i];
+        double bytes_per_s          = spec->rate * 1e6 / 8;
+        double quantum              = bytes_per_s / 10;
+
+        c->spec    = spec;
+        c->parent  = spec->parent >= 0 ? &h->cls[spec->parent] : NULL;
+        c->level   = spec->level;
+        c->mode    = HTB_CAN_SEND;
+        c->cost    = hz * 65536.0 / bytes_per_s;
+        c->ccost   = hz * 65536.0 * 8 / (spec->ceil * 1e6);
+        c->buffer  = htb_depth(c->cost, hz);
+        c->cbuffer = htb_depth(c->ccost, hz);
+        c->tokens  = c->buffer;
+        c->ctokens = c->cbuffer;
+        c->quantum = quantum < HTB_MIN_QUANTUM   ? HTB_MIN_QUANTUM
+                     : quantum > HTB_MAX_QUANTUM ? HTB_MAX_QUANTUM
+                                                 : quantum;
+        for (j = 0; j < HTB_MAX_LEVELS; j++) {
+            c->deficit[j] = c->quantum;
+        }
+        c->qhead = c->qtail = HTB_NIL;
+        codel_init(&c->codel);
+        htb_list_init(&c->node);
+        htb_list_init(&c->inner);
+        htb_list_init(&c->timer);
+    }
+
+    return h;
+}
+
+void
+htb_free(struct htb *h, struct qos *q)
+{
+    unsigned int i;
+
+    if (h == NULL) {
+        return;
+    }
+    for (i = 0; q && i < h->conf->ncls; i++) {
+        struct htb_class *c = &h->cls[i];
+
+        for (; c->qhead != HTB_NIL; c->qhead = h->pkt[c->qhead].next) {
+            q->free[q->nfree++] = h->pkt[c->qhead].buf_idx;
+            h->st->backlog--;
+        }
+    }
+    free(h->cls);
+    free(h->pkt);
+    free(h->free);
+    free(h);
+}
+
+/* Tokens of c at now: they grow with the time since t_c. */
+static inline int64_t
+htb_diff(const struct htb *h, const struct htb_class *c, uint64_t now)
+{
+    uint64_t diff = now - c->t_c;
+
+    return diff > (uint64_t)h->mbuffer ? h->mbuffer : (int64_t)diff;
+}
+
+/* Mode of c at now, and when it may change if it cannot send. */
+static int
+htb_mode(const struct htb *h, const struct htb_class *c, uint64_t now,
+         uint64_t *wake)
+{
+    int64_t diff = htb_diff(h, c, now);
+    int64_t toks;
+
+    toks = c->ctokens + diff;
+    if (toks < 0) {
+        *wake = now - toks;
+        return HTB_CANT_SEND;
+    }
+    toks = c->tokens + diff;
+    if (toks >= 0) {
+        return HTB_CAN_SEND;
+    }
+    *wake = now - toks;
+
+    return HTB_MAY_BORROW;
+}
+
+static void
+htb_wheel_add(struct htb *h, struct htb_class *c, uint64_t wake)
+{
+    uint64_t t = wake >> HTB_WHEEL_SHIFT;
+
+    /* Beyond the wheel, come back in a round and check again. */
+    if (t <= h->tick) {
+        t = h->tick + 1;
+    } else if (t - h->tick >= HTB_WHEEL_SLOTS) {
+        t = h->tick + HTB_WHEEL_SLOTS - 1;
+    }
+    c->t_wake = wake;
+    htb_list_del(&c->timer);
+    htb_list_add_tail(&h->wheel[t & (HTB_WHEEL_SLOTS - 1)], &c->timer);
+}
+
+/* Link c to the list of level, where it goes on with its turn
+ * if it had one. The classes move often between the feeds and the inner
+ * lists, as their tokens come and go: at the tail they would lose their
+ * turns to those that move less. */
+static inline void
+htb_link(struct htb_class *c, struct htb_list *head, int level)
+{
+    if (c->turn & 1U << level) {
+        htb_list_add_head(head, &c->node);
+    } else {
+        htb_list_add_tail(head, &c->node);
+    }
+}
+
+/* Put the active class c where its mode at now says: on the feed of its
+ * level, on the inner list of its parent (which becomes active), or
+ * nowhere. Unless it can send, c also goes on the wheel. */
+static void
+htb_place(struct htb *h, struct htb_class *c, uint64_t now)
+{
+    uint64_t wake = 0;
+
+    c->mode = htb_mode(h, c, now, &wake);
+    if (c->mode == HTB_CAN_SEND) {
+        htb_link(c, &h->feed[c->level], c->level);
+        c->where = HTB_FEED;
+        return;
+    }
+    if (c->mode == HTB_MAY_BORROW && c->parent) {
+        struct htb_class *p = c->parent;
+        int idle            = htb_list_empty(&p->inner);
+
+        htb_link(c, &p->inner, p->level);
+        c->where = HTB_INNER;
+        if (idle) {
+            p->active = 1;
+            htb_place(h, p, now);
+        }
+    }
+    htb_wheel_add(h, c, wake);
+}
+
+/* Undo htb_place(), deactivating the parents left with no borrowers. */
+static void
+htb_unplace(struct htb *h, struct htb_class *c)
+{
+    if (c->where != HTB_NOWHERE) {
+        htb_list_del(&c->node);
+        if (c->where == HTB_INNER && htb_list_empty(&c->parent->inner)) {
+            c->parent->active = 0;
+            htb_unplace(h, c->parent);
+        }
+        c->where = HTB_NOWHERE;
+    }
+    htb_list_del(&c->timer);
+}
+
+/* Move the classes whose time has come. */
+static void
+htb_wheel_run(struct htb *h, uint64_t now)
+{
+    uint64_t t = now >> HTB_WHEEL_SHIFT;
+
+    /* Every slot is run at most once. */
+    if (t - h->tick > HTB_WHEEL_SLOTS) {
+        h->tick = t - HTB_WHEEL_SLOTS;
+    }
+    while (h->tick < t) {
+        struct htb_list *slot;
+        struct htb_list due;
+
+        h->tick++;
+        slot = &h->wheel[h->tick & (HTB_WHEEL_SLOTS - 1)];
+        if (htb_list_empty(slot)) {
+            continue;
+        }
+        /* Take the slot over: its classes may be added back to it. */
+        due            = *slot;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        htb_list_init(slot);
+        while (!htb_list_empty(&due)) {
+            struct htb_class *c = htb_entry(due.next, timer);
+            uint64_t wake       = c->t_wake;
+
+            htb_list_del(&c->timer);
+            if (wake <= now && htb_mode(h, c, now, &wake) != c->mode) {
+                htb_unplace(h, c);
+                htb_place(h, c, now);
+            } else {
+                htb_wheel_add(h, c, wake);
+            }
+        }
+    }
+}
+
+static inline int64_t
+htb_account(int64_t toks, int64_t buffer, int64_t cost, int64_t mbuffer)
+{
+    if (toks > buffer) {
+        toks = buffer;
+    }
+    toks -= cost;
+
+    return toks < -mbuffer ? -mbuffer : toks;
+}
+
+/* Charge len bytes sent from level to the leaf c and its ancestors. The
+ * classes below level borrowed: only their ceilings pay. */
+static void
+htb_charge(struct htb *h, struct htb_class *c, int level, unsigned int len,
+           uint64_t now)
+{
+    for (; c; c = c->parent) {
+        int64_t diff  = htb_diff(h, c, now);
+        uint64_t wake = 0;
+
+        if (c->level >= level) {
+            c->tokens = htb_account(c->tokens + diff, c->buffer,
+                                    (len * c->cost) >> 16, h->mbuffer);
+        } else {
+            c->tokens += diff;
+            if (c->tokens > c->buffer) {
+                c->tokens = c->buffer;
+            }
+        }
+        c->ctokens = htb_account(c->ctokens + diff, c->cbuffer,
+                                 (len * c->ccost) >> 16, h->mbuffer);
+        c->t_c     = now;
+        if (c->active && htb_mode(h, c, now, &wake) != c->mode) {
+            htb_unplace(h, c);
+            htb_place(h, c, now);
+        }
+    }
+}
+
+static inline int32_t
+htb_classify(const struct htb *h, const char *buf, unsigned int len)
+{
+    const struct ether_header *ethh = (const struct ether_header *)buf;
+    const struct ip *iph            = (const struct ip *)(ethh + 1);
+    int32_t leaf                    = -1;
+
+    if (len >= sizeof(*ethh) + sizeof(*iph) &&
+        ethh->ether_type == htons(ETHERTYPE_IP)) {
+        leaf = htb_map_find(&h->conf->addrs, iph->ip_dst.s_addr);
+    }
+
+    return leaf >= 0 ? leaf : h->conf->deflt;
+}
+
+int
+htb_enqueue(struct htb *h, struct qos *q, struct pio_slot *rs,
+            const char *rxbuf, uint64_t now)
+{
+    int32_t li = htb_classify(h, rxbuf, rs->len);
+    struct htb_class *c;
+    struct htb_pkt *p;
+    uint32_t idx, e;
+
+    if (li < 0) {
+        h->st->unclassified++;
+        return 0;
+    }
+    c = &h->cls[li];
+    if (c->qlen == HTB_LEAF_QLEN || h->nfree == 0 ||
+        !qos_pool_get(q, rs, rxbuf, &idx)) {
+        c->drops++;
+        h->st->drops++;
+        return 0;
+    }
+    e          = h->free[--h->nfree];
+    p          = &h->pkt[e];
+    p->buf_idx = idx;
+    p->len     = rs->len;
+    p->ts      = now;
+    p->next    = HTB_NIL;
+    if (c->qtail == HTB_NIL) {
+        c->qhead = e;
+    } else {
+        h->pkt[c->qtail].next = e;
+    }
+    c->qtail = e;
+    h->st->backlog++;
+    if (c->qlen++ == 0) {
+        c->active = 1;
+        htb_place(h, c, now);
+    }
+
+    return 1;
+}
+
+int
+htb_dequeue(struct htb *h, struct qos *q, uint64_t now, uint32_t *idx,
+            uint16_t *len)
+{
+    struct htb_class *leaf, *c;
+    struct htb_pkt *p;
+    uint32_t e;
+    int level, turn;
+
+    htb_wheel_run(h, now);
+    for (level = 0; level < HTB_MAX_LEVELS; level++) {
+        if (!htb_list_empty(&h->feed[level])) {
+            break;
+        }
+    }
+    if (level == HTB_MAX_LEVELS) {
+        return 0;
+    }
+
+    /* From the lender down to a leaf, through the borrowers. */
+    leaf = htb_entry(h->feed[level].next, node);
+    while (leaf->level > 0) {
+        leaf = htb_entry(leaf->inner.next, node);
+    }
+    for (;;) {
+        e           = leaf->qhead;
+        p           = &h->pkt[e];
+        leaf->qhead = p->next;
+        if (leaf->qhead == HTB_NIL) {
+            leaf->qtail = HTB_NIL;
+        }
+        leaf->qlen--;
+        h->free[h->nfree++] = e;
+        if (!codel_drop(&leaf->codel, &q->codel, p->ts, now,
+                        leaf->qlen == 0)) {
+            break;
+        }
+        /* CoDel never drops the last packet: the leaf stays active. */
+        qos_pool_free(q, p->buf_idx);
+        q->queued--;
+        leaf->drops++;
+        h->st->codel_drops++;
+        h->st->backlog--;
+    }
+    *idx = p->buf_idx;
+    *len = p->len;
+
+    leaf->pkts++;
+    h->st->pkts++;
+    h->st->backlog--;
+    if (level > 0) {
+        leaf->borrowed++;
+        h->st->borrowed++;
+    }
+    stats_hist_add(&h->st->sojourn, ((now - p->ts) * h->tsc2ns20) >> 20);
+
+    /* Deficit round robin, with a deficit for each level lending to the
+     * leaf: the leaf and the borrowers above it have the turn until its
+     * quantum is used, then go to the back of their lists. */
+    leaf->deficit[level] -= p->len;
+    turn = leaf->deficit[level] > 0;
+    if (!turn) {
+        leaf->deficit[level] += leaf->quantum;
+    }
+    for (c = leaf; c->where != HTB_NOWHERE; c = c->parent) {
+        int feed              = c->where == HTB_FEED;
+        struct htb_list *head = feed ? &h->feed[c->level] : &c->parent->inner;
+        unsigned int bit      = 1U << (feed ? c->level : c->parent->level);
+
+        if (turn) {
+            c->turn |= bit;
+        } else {
+            c->turn &= ~bit;
+            htb_list_del(&c->node);
+            htb_list_add_tail(head, &c->node);
+        }
+        if (feed) {
+            break;
+        }
+    }
+    if (leaf->qlen == 0) {
+        leaf->active = 0;
+        htb_unplace(h, leaf);
+    }
+    htb_charge(h, leaf, level, *len, now);
+
+    return 1;
+}
+
+uint64_t
+htb_next(const struct htb *h)
+{
+    unsigned int i;
+
+    for (i = 0; i < HTB_MAX_LEVELS; i++) {
+        if (!htb_list_empty(&h->feed[i])) {
+            return 0;
+        }
+    }
+    /* The first slot with timers: it may only bring a check forward. */
+    for (i = 1; i < HTB_WHEEL_SLOTS; i++) {
+        uint64_t t = h->tick + i;
+
+        if (!htb_list_empty(&h->wheel[t & (HTB_WHEEL_SLOTS - 1)])) {
+            return t << HTB_WHEEL_SHIFT;
+        }
+    }
+
+    return UINT64_MAX;
+}
+
+int
+htb_stats_add(struct stats *s, struct htb_stats *st)
+{
+    if (stats_add(s, "htb_pkts", &st->pkts) ||
+        stats_add(s, "htb_drops", &st->drops) ||
+        stats_add(s, "htb_unclassified", &st->unclassified) ||
+        stats_add(s, "htb_borrowed", &st->borrowed) ||
+        stats_add(s, "htb_codel_drops", &st->codel_drops) ||
+        stats_add_gauge(s, "htb_backlog", &st->backlog)) {
+        return -1;
+    }
+
+    return stats_add_hist(s, "htb_sojourn_ns", &st->sojourn);
+}
@@ -0,0 +1,167 @@
+/*
+ * Hierarchical token bucket shaper, after Linux HTB, for the egress
+ * queues of forward and fe (see qos.h).
+ *
+ * The classes form a tree. Each has an assured rate and a ceiling, both
+ * token buckets kept in TSC units, and is in one of three modes: it may
+ * send on its own tokens (CAN_SEND), only by borrowing from its parent
+ * (MAY_BORROW), or not at all (CANT_SEND). Packets are queued in the
+ * leaves, which are selected by the destination IPv4 address with one
+ * hash lookup. A leaf with packets that can send is on the feed of its
+ * level (0 for the leaves). A leaf that may borrow goes on the inner
+ * list of its parent instead, and the parent is then placed by its own
+ * mode in the same way. A packet is dequeued from the lowest level with
+ * a class on its feed: that class lends, and the inner lists lead down
+ * from it to a leaf. Classes on the same list are served by deficit
+ * round robin with a quantum proportional to their rate.
+ *
+ * Dequeueing the packet charges the leaf and its ancestors, which may
+ * change their modes. A class that cannot send on its own is put on a
+ * timer wheel, in the slot of the time when its tokens come back. The
+ * wheel moves it back on the feeds then. Every step touches at most one
+ * class per level, so a packet costs O(depth) whatever the number of
+ * classes.
+ *
+ * The tree is loaded from a file, with one statement per line:
+ *
+ *   class ID PARENT RATE[:CEIL] [ADDR...]
+ *   default ID
+ *
+ * The IDs are positive integers, and PARENT is 0 for a top-level class.
+ * A parent must be declared before its children. RATE and CEIL are in
+ * Mbit/s, and CEIL defaults to RATE. The addresses select the packets
+ * of a leaf. The packets that match no leaf go to the default leaf, or
+ * are dropped without one. Text after '#' is a comment.
+ */
+#ifndef __HTB_H__
+#define __HTB_H__
+
+#include <stdint.h>
+#include "pktio.h"
+#include "stats.h"
+#include "codel.h"
+
+#define HTB_ERRBUF_SIZE 256
+#define HTB_MAX_LEVELS 8
+#define HTB_LEAF_QLEN 256  /* packets per leaf */
+#define HTB_BUFS 16384     /* packets per direction, all the leaves */
+#define HTB_WHEEL_SLOTS 4096
+#define HTB_WHEEL_SHIFT 14 /* TSC ticks per slot, 2^14 (about 5 us) */
+#define HTB_STATS (6 + STATS_HIST_ENTRIES) /* entries of htb_stats_add() */
+
+struct qos;
+
+/* A class as declared in the file. */
+struct htb_spec {
+    uint32_t id;
+    int32_t parent; /* index, -1 for the top level */
+    uint8_t level;  /* 0 for the leaves */
+    double rate;    /* Mbit/s */
+    double ceil;
+};
+
+/* Counters of all the classes, shared by the directions. */
+struct htb_stats {
+    unsigned long long pkts;         /* sent */
+    unsigned long long drops;        /* leaf or pool full */
+    unsigned long long unclassified; /* dropped, no leaf and no default */
+    unsigned long long borrowed;     /* sent on the tokens of a parent */
+    unsigned long long codel_drops;  /* dropped at dequeue by CoDel */
+    unsigned long long backlog;      /* packets queued, gauge */
+    struct stats_hist sojourn;       /* ns */
+};
+
+/* Open-addressing hash of nonzero 32-bit keys. */
+struct htb_map {
+    uint32_t *key; /* 0 for empty slots */
+    int32_t *val;
+    uint32_t mask; /* slots - 1 */
+    unsigned long n;
+};
+
+/* A parsed file, the template of the trees of each direction. */
+struct htb_conf {
+    struct htb_spec *cls;
+    unsigned int ncls;
+    unsigned int nleaves;
+    struct htb_map addrs; /* address (network byte order) to leaf index */
+    int32_t deflt;        /* default leaf index, or -1 */
+    struct htb_stats st;
+};
+
+struct htb_list {
+    struct htb_list *next, *prev;
+};
+
+struct htb_class {
+    const struct htb_spec *spec;
+    struct htb_class *parent;
+    uint8_t level;
+    uint8_t mode;  /* HTB_CAN_SEND... */
+    uint8_t where; /* HTB_NOWHERE, HTB_FEED, HTB_INNER */
+    uint8_t active;
+    uint8_t turn; /* bit by level: in the middle of its turn there */
+    int64_t tokens, ctokens; /* TSC of credit, at t_c */
+    int64_t buffer, cbuffer; /* bucket depths, TSC */
+    uint64_t cost, ccost;    /* TSC per byte << 16 */
+    uint64_t t_c;
+    uint64_t t_wake; /* when the mode may change */
+    int32_t deficit[HTB_MAX_LEVELS]; /* by the level of the lender */
+    uint32_t quantum;
+    struct htb_list node;  /* on a feed, or the inner list of parent */
+    struct htb_list inner; /* children borrowing from this class */
+    struct htb_list timer; /* on the wheel */
+    /* Leaves: the packets, linked through htb_pkt.next. */
+    uint32_t qhead, qtail, qlen;
+    struct codel codel;
+    unsigned long long pkts, drops, borrowed;
+};
+
+struct htb_pkt {
+    uint32_t buf_idx;
+    uint32_t next;
+    uint16_t len;
+    uint64_t ts; /* TSC when queued */
+};
+
+/* The tree of one direction. */
+struct htb {
+    const struct htb_conf *conf;
+    struct htb_stats *st;
+    struct htb_class *cls;
+    struct htb_pkt *pkt;
+    uint32_t *free; /* indices of the free pkt entries */
+    unsigned int nfree;
+    struct htb_list feed[HTB_MAX_LEVELS];
+    struct htb_list wheel[HTB_WHEEL_SLOTS];
+    uint64_t tick; /* last wheel slot run, in slots */
+    int64_t mbuffer; /* the most tokens a class may owe */
+    uint64_t tsc2ns20;
+};
+
+/* Load a tree from a file. On failure errbuf (HTB_ERRBUF_SIZE bytes)
+ * tells why. */
+struct htb_conf *htb_conf_load(const char *path, char *errbuf);
+void htb_conf_free(struct htb_conf *conf);
+
+struct htb *htb_create(struct htb_conf *conf, uint64_t hz);
+/* Free the tree, returning the queued buffers to the pool of q. */
+void htb_free(struct htb *h, struct qos *q);
+
+/* Queue the packet of slot rs (buffer rxbuf) at TSC now, taking a
+ * buffer from the pool of q. Returns 0 if it was dropped. */
+int htb_enqueue(struct htb *h, struct qos *q, struct pio_slot *rs,
+                const char *rxbuf, uint64_t now);
+/* Dequeue the next packet that may be sent at now into *idx (a buffer
+ * of the pool of q) and *len. Returns 0 if there is none. The packets
+ * dropped by CoDel on the way go back to the pool. */
+int htb_dequeue(struct htb *h, struct qos *q, uint64_t now, uint32_t *idx,
+                uint16_t *len);
+/* TSC from which htb_dequeue() may find a packet again: 0 if it may
+ * now, UINT64_MAX if no class is waiting for its tokens. */
+uint64_t htb_next(const struct htb *h);
+
+/* Publish the counters of st. */
+int htb_stats_add(struct stats *s, struct htb_stats *st);
+
+#endif /* __HTB_H__ */
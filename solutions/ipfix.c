@@ -0,0 +1,507 @@
+/*
+ * Flow metering and IPFIX export through an exporter thread, see
+ * ipfix.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ipfix.h"
+#include "pkt.h"
+#include "tsc.h"
+
+#define IPFIX_VERSION 10
+#define IPFIX_HDR_LEN 16
+#define IPFIX_SET_TEMPLATE 2
+#define IPFIX_TEMPLATE_ID 256
+#define IPFIX_DOMAIN 1
+#define IPFIX_REC_LEN 46    /* the fields of the template */
+#define IPFIX_FLUSH_MS 1000 /* oldest record waiting in a message */
+#define IPFIX_BURST 64
+
+/* Information elements of the template (ID, length). */
+static const uint16_t ipfix_fields[][2] = {
+    {8, 4},   /* sourceIPv4Address */
+    {12, 4},  /* destinationIPv4Address */
+    {7, 2},   /* sourceTransportPort */
+    {11, 2},  /* destinationTransportPort */
+    {4, 1},   /* protocolIdentifier */
+    {2, 8},   /* packetDeltaCount */
+    {1, 8},   /* octetDeltaCount */
+    {152, 8}, /* flowStartMilliseconds */
+    {153, 8}, /* flowEndMilliseconds */
+    {136, 1}, /* flowEndReason */
+};
+#define IPFIX_NFIELDS (sizeof(ipfix_fields) / sizeof(ipfix_fields[0]))
+
+/* A message being encoded by the exporter. */
+struct ipfix_msg {
+    uint8_t buf[IPFIX_MSG_SIZE];
+    unsigned int len;
+    unsigned int set; /* offset of the data set header */
+    unsigned int nrecs;
+    uint32_t seq;      /* data records sent before this message */
+    uint64_t started;  /* ms, when the first record was added */
+    time_t template_t; /* when the template was last sent */
+    int template_sent;
+};
+
+static inline uint8_t *
+put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static inline uint8_t *
+put32(uint8_t *p, uint32_t v)
+{
+    p = put16(p, v >> 16);
+    return put16(p, v);
+}
+
+static inline uint8_t *
+put64(uint8_t *p, uint64_t v)
+{
+    p = put32(p, v >> 32);
+    return put32(p, v);
+}
+
+static uint64_t
+wall_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+ipfix_tsc2ms(const struct ipfix *fx, uint64_t t)
+{
+    int64_t dt = t - fx->tsc0;
+
+    return fx->wall0_ms + dt * 1000 / (int64_t)fx->tsc_hz;
+}
+
+int
+ipfix_timeouts_parse(const char *s, unsigned int *active_s,
+                     unsigned int *idle_s)
+{
+    char *end;
+
+    *active_s = strtoul(s, &end, 10);
+    *idle_s   = IPFIX_IDLE_SECS;
+    if (*end == ':') {
+        *idle_s = strtoul(end + 1, &end, 10);
+    }
+    if (end == s || *end != '\0' || *active_s == 0 || *idle_s == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Start a message, with the template first if it is due. */
+static void
+ipfix_msg_begin(struct ipfix *fx, struct ipfix_msg *m)
+{
+    time_t t = time(NULL);
+    uint8_t *p;
+    unsigned int i;
+
+    m->len   = IPFIX_HDR_LEN;
+    m->nrecs = 0;
+    if (!m->template_sent ||
+        (fx->udp && t - m->template_t >= IPFIX_TEMPLATE_SECS)) {
+        p = m->buf + m->len;
+        p = put16(p, IPFIX_SET_TEMPLATE);
+        p = put16(p, 4 + 4 + IPFIX_NFIELDS * 4);
+        p = put16(p, IPFIX_TEMPLATE_ID);
+        p = put16(p, IPFIX_NFIELDS);
+        for (i = 0; i < IPFIX_NFIELDS; i++) {
+            p = put16(p, ipfix_fields[i][0]);
+            p = put16(p, ipfix_fields[i][1]);
+        }
+        m->len           = p - m->buf;
+        m->template_sent = 1;
+        m->template_t    = t;
+    }
+    m->set = m->len;
+    m->len += 4;
+}
+
+/* Write out the message if it has records, and start the next one. */
+static void
+ipfix_msg_send(struct ipfix *fx, struct ipfix_msg *m)
+{
+    uint8_t *p;
+    ssize_t n;
+
+    if (m->nrecs == 0) {
+        return;
+    }
+    p = put16(m->buf, IPFIX_VERSION);
+    p = put16(p, m->len);
+    p = put32(p, time(NULL));
+    p = put32(p, m->seq);
+    put32(p, IPFIX_DOMAIN);
+    p = put16(m->buf + m->set, IPFIX_TEMPLATE_ID);
+    put16(p, m->len - m->set);
+
+    if (!fx->error) {
+        do {
+            n = write(fx->fd, m->buf, m->len);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && !(fx->udp && errno == ECONNREFUSED)) {
+            /* A UDP collector not listening (yet) is not fatal. */
+            fx->error = errno;
+        }
+    }
+    m->seq += m->nrecs;
+    __atomic_fetch_add(&fx->msgs, 1, __ATOMIC_RELAXED);
+    ipfix_msg_begin(fx, m);
+}
+
+static void
+ipfix_msg_add(struct ipfix *fx, struct ipfix_msg *m,
+              const struct ipfix_rec *r)
+{
+    const struct ipfix_flow *f = &r->flow;
+    uint8_t *p;
+
+    if (m->len + IPFIX_REC_LEN > IPFIX_MSG_SIZE) {
+        ipfix_msg_send(fx, m);
+    }
+    if (m->nrecs == 0) {
+        m->started = wall_ms();
+    }
+    p = m->buf + m->len;
+    /* The addresses are already in network byte order. */
+    memcpy(p, &f->key.saddr, 4);
+    memcpy(p + 4, &f->key.daddr, 4);
+    p    = put16(p + 8, f->key.sport);
+    p    = put16(p, f->key.dport);
+    *p++ = f->key.proto;
+    p    = put64(p, f->pkts);
+    p    = put64(p, f->bytes);
+    p    = put64(p, ipfix_tsc2ms(fx, f->first));
+    p    = put64(p, ipfix_tsc2ms(fx, f->last));
+    *p++ = r->reason;
+    m->len += IPFIX_REC_LEN;
+    m->nrecs++;
+}
+
+static void *
+ipfix_exporter(void *arg)
+{
+    struct ipfix *fx = arg;
+    struct ipfix_msg *m;
+    uint32_t idx[IPFIX_BURST];
+
+    m = calloc(1, sizeof(*m));
+    if (m == NULL) {
+        fx->error = ENOMEM;
+        return NULL;
+    }
+    ipfix_msg_begin(fx, m);
+    for (;;) {
+        /* Look at done first: what was handed over before is seen. */
+        int done = __atomic_load_n(&fx->done, __ATOMIC_ACQUIRE);
+        unsigned int n, i;
+
+        n = spsc_dequeue_burst(fx->full, idx, IPFIX_BURST);
+        for (i = 0; i < n; i++) {
+            ipfix_msg_add(fx, m, &fx->recs[idx[i]]);
+        }
+        if (n > 0) {
+            /* The ring holds all the records, there is always room. */
+            spsc_enqueue_burst(fx->free, idx, n);
+            continue;
+        }
+        if (done) {
+            ipfix_msg_send(fx, m);
+            break;
+        }
+        if (m->nrecs > 0 && wall_ms() - m->started >= IPFIX_FLUSH_MS) {
+            ipfix_msg_send(fx, m);
+        }
+        usleep(1000);
+    }
+    free(m);
+
+    return NULL;
+}
+
+/* Open a UDP socket connected to HOST:PORT. */
+static int
+ipfix_udp_open(const char *dst)
+{
+    struct addrinfo hints, *res;
+    char host[256];
+    const char *port = strrchr(dst, ':');
+    int fd, ret;
+
+    if (port == NULL || port == dst || (size_t)(port - dst) >= sizeof(host)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(host, dst, port - dst);
+    host[port - dst] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    ret               = getaddrinfo(host, port + 1, &hints, &res);
+    if (ret) {
+        errno = ret == EAI_SYSTEM ? errno : EINVAL;
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen)) {
+        ret = errno;
+        close(fd);
+        fd    = -1;
+        errno = ret;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+static void
+ipfix_free(struct ipfix *fx)
+{
+    if (fx->fd >= 0) {
+        close(fx->fd);
+    }
+    free(fx->full);
+    free(fx->free);
+    free(fx->recs);
+    free(fx->cache);
+    free(fx);
+}
+
+struct ipfix *
+ipfix_open(const char *collector, unsigned int active_s, unsigned int idle_s,
+           uint64_t hz)
+{
+    struct ipfix *fx;
+    unsigned int i;
+    int ret;
+
+    fx = calloc(1, sizeof(*fx));
+    if (fx == NULL) {
+        return NULL;
+    }
+    fx->fd    = -1;
+    fx->cache = calloc(IPFIX_CACHE_SIZE, sizeof(*fx->cache));
+    fx->recs  = calloc(IPFIX_RECS, sizeof(*fx->recs));
+    fx->full  = spsc_ring_create(IPFIX_RECS);
+    fx->free  = spsc_ring_create(IPFIX_RECS);
+    if (fx->cache == NULL || fx->recs == NULL || fx->full == NULL ||
+        fx->free == NULL) {
+        errno = ENOMEM;
+        goto err;
+    }
+    for (i = 0; i < IPFIX_RECS; i++) {
+        fx->stash[i] = i;
+    }
+    fx->nstash = IPFIX_RECS;
+
+    if (!strncmp(collector, "udp:", 4)) {
+        fx->udp = 1;
+        fx->fd  = ipfix_udp_open(collector + 4);
+    } else {
+        fx->fd = open(collector, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fx->fd < 0) {
+        goto err;
+    }
+
+    fx->tsc_hz   = hz;
+    fx->active   = active_s * hz;
+    fx->idle     = idle_s * hz;
+    fx->wall0_ms = wall_ms();
+    fx->tsc0     = rdtsc();
+    fx->swept    = fx->tsc0;
+    ret          = pthread_create(&fx->exporter, NULL, ipfix_exporter, fx);
+    if (ret) {
+        errno = ret;
+        goto err;
+    }
+
+    return fx;
+err:
+    ret = errno;
+    ipfix_free(fx);
+    errno = ret;
+    return NULL;
+}
+
+/* Hand the expired records over to the exporter. */
+static inline void
+ipfix_flush(struct ipfix *fx)
+{
+    if (fx->nout > 0) {
+        spsc_enqueue_burst(fx->full, fx->out, fx->nout);
+        fx->nout = 0;
+    }
+}
+
+/* Take a free record, -1 if there is none. */
+static inline int64_t
+ipfix_rec_get(struct ipfix *fx)
+{
+    if (fx->nstash == 0) {
+        fx->nstash = spsc_dequeue_burst(fx->free, fx->stash, IPFIX_RECS);
+        if (fx->nstash == 0) {
+            return -1;
+        }
+    }
+    return fx->stash[--fx->nstash];
+}
+
+/* Report the flow and free its slot. */
+static void
+ipfix_export(struct ipfix *fx, struct ipfix_flow *f, uint8_t reason)
+{
+    int64_t idx = ipfix_rec_get(fx);
+
+    if (idx < 0) {
+        fx->drops++;
+    } else {
+        fx->recs[idx].flow   = *f;
+        fx->recs[idx].reason = reason;
+        fx->out[fx->nout++]  = idx;
+        fx->records++;
+        if (fx->nout == IPFIX_BURST) {
+            ipfix_flush(fx);
+        }
+    }
+    f->pkts = 0;
+}
+
+void
+ipfix_packet(struct ipfix *fx, const char *buf, unsigned int len,
+             uint64_t now)
+{
+    struct ipfix_flow *bucket, *f, *slot = NULL;
+    struct ipfix_key key;
+    struct pkt_meta m;
+    unsigned int i;
+
+    pkt_parse(buf, len, &m);
+    if (!(m.flags & PKT_META_IPV4)) {
+        fx->unmetered++;
+        return;
+    }
+    key.saddr = m.saddr;
+    key.daddr = m.daddr;
+    key.sport = m.sport;
+    key.dport = m.dport;
+    key.proto = m.proto;
+
+    /* The slots of a flow are a bucket of IPFIX_PROBE aligned on its
+     * hash, so the lookup touches the same few cache lines every time.
+     * Slots are freed anywhere in the bucket: look at all of them. */
+    bucket = &fx->cache[m.hash & (IPFIX_CACHE_SIZE - IPFIX_PROBE)];
+    for (i = 0; i < IPFIX_PROBE; i++) {
+        f = &bucket[i];
+        if (f->pkts == 0) {
+            if (slot == NULL || slot->pkts != 0) {
+                slot = f;
+            }
+            continue;
+        }
+        if (!memcmp(&f->key, &key, sizeof(key))) {
+            f->pkts++;
+            f->bytes += len;
+            f->last = now;
+            return;
+        }
+        if (slot == NULL || (slot->pkts != 0 && f->last < slot->last)) {
+            slot = f; /* least recently seen so far */
+        }
+    }
+
+    if (slot->pkts != 0) {
+        fx->evictions++;
+        ipfix_export(fx, slot, IPFIX_END_LACK);
+    }
+    slot->key   = key;
+    slot->pkts  = 1;
+    slot->bytes = len;
+    slot->first = now;
+    slot->last  = now;
+    fx->flows++;
+}
+
+void
+ipfix_expire(struct ipfix *fx, uint64_t now)
+{
+    uint64_t n = (now - fx->swept) * IPFIX_CACHE_SIZE / fx->tsc_hz;
+
+    if (n > 0) {
+        /* Keep the remainder for the next call. */
+        if (n >= IPFIX_CACHE_SIZE) {
+            n         = IPFIX_CACHE_SIZE;
+            fx->swept = now;
+        } else {
+            fx->swept += n * fx->tsc_hz / IPFIX_CACHE_SIZE;
+        }
+        for (; n > 0; n--) {
+            struct ipfix_flow *f = &fx->cache[fx->sweep];
+
+            fx->sweep = (fx->sweep + 1) & (IPFIX_CACHE_SIZE - 1);
+            if (f->pkts == 0) {
+                continue;
+            }
+            if (now - f->last >= fx->idle) {
+                ipfix_export(fx, f, IPFIX_END_IDLE);
+            } else if (now - f->first >= fx->active) {
+                ipfix_export(fx, f, IPFIX_END_ACTIVE);
+            }
+        }
+    }
+    ipfix_flush(fx);
+}
+
+int
+ipfix_close(struct ipfix *fx)
+{
+    unsigned int i;
+    int ret = 0;
+
+    /* Wait for free records rather than dropping the last flows. */
+    for (i = 0; i < IPFIX_CACHE_SIZE; i++) {
+        if (fx->cache[i].pkts == 0) {
+            continue;
+        }
+        while (fx->nstash == 0 && !fx->error &&
+               (fx->nstash = spsc_dequeue_burst(fx->free, fx->stash,
+                                                IPFIX_RECS)) == 0) {
+            ipfix_flush(fx);
+            usleep(1000);
+        }
+        ipfix_export(fx, &fx->cache[i], IPFIX_END_FORCED);
+    }
+    ipfix_flush(fx);
+    __atomic_store_n(&fx->done, 1, __ATOMIC_RELEASE);
+    pthread_join(fx->exporter, NULL);
+
+    if (fx->error) {
+        errno = fx->error;
+        ret   = -1;
+    }
+    ipfix_free(fx);
+
+    return ret;
+}
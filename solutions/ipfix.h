@@ -0,0 +1,114 @@
+/*
+ * Flow metering and IPFIX (RFC 7011) export, without ever blocking the
+ * RX loop on the collector.
+ *
+ * The RX loop keeps a bounded cache of the IPv4 flows, keyed by their
+ * 5-tuple: a packet costs one lookup, which looks at a few consecutive
+ * slots from its hash. A flow expires when it has been idle for the
+ * idle timeout, or active for the active timeout (long flows are then
+ * reported in several records). The cache is swept for expired flows a
+ * bit at each call of ipfix_expire(), so that all of it is seen once a
+ * second. When the slots of a new flow are all taken, the flow seen
+ * least recently among them is exported early to make room.
+ *
+ * An expired flow is copied into a record from a preallocated pool and
+ * handed to an exporter thread through a lock-free ring of record
+ * indices. The exporter encodes the records in IPFIX messages of at
+ * most IPFIX_MSG_SIZE bytes and gives the records back through another
+ * ring. It writes the messages to a file, or sends them to a UDP
+ * collector, sending the template again every IPFIX_TEMPLATE_SECS.
+ * When the exporter is behind and no record is free, the flows are
+ * dropped and counted instead.
+ */
+#ifndef __IPFIX_H__
+#define __IPFIX_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "spsc.h"
+
+#define IPFIX_CACHE_SIZE 65536 /* flows, a power of two */
+#define IPFIX_PROBE 8          /* slots looked at from the hash */
+#define IPFIX_RECS 8192        /* records in flight, a power of two */
+#define IPFIX_MSG_SIZE 1400    /* bytes, within the MTU over UDP */
+#define IPFIX_TEMPLATE_SECS 30 /* template refresh over UDP */
+#define IPFIX_ACTIVE_SECS 60   /* default timeouts */
+#define IPFIX_IDLE_SECS 15
+
+/* flowEndReason */
+#define IPFIX_END_IDLE 1
+#define IPFIX_END_ACTIVE 2
+#define IPFIX_END_FORCED 4 /* the meter stopped */
+#define IPFIX_END_LACK 5   /* evicted from a full cache */
+
+struct ipfix_key {
+    uint32_t saddr; /* network byte order */
+    uint32_t daddr;
+    uint16_t sport; /* host byte order */
+    uint16_t dport;
+    uint32_t proto;
+};
+
+struct ipfix_flow {
+    struct ipfix_key key;
+    uint64_t pkts; /* 0 for a free slot */
+    uint64_t bytes;
+    uint64_t first; /* TSC */
+    uint64_t last;
+};
+
+struct ipfix_rec {
+    struct ipfix_flow flow;
+    uint8_t reason;
+};
+
+struct ipfix {
+    struct ipfix_flow *cache;
+    uint64_t active, idle; /* timeouts, TSC */
+    uint32_t sweep;        /* next slot to sweep */
+    uint64_t swept;        /* TSC of the last sweep */
+    uint64_t tsc_hz;
+    uint64_t tsc0;     /* TSC at wall0_ms */
+    uint64_t wall0_ms; /* for the timestamps of the records */
+
+    struct ipfix_rec *recs;
+    struct spsc_ring *full; /* to the exporter */
+    struct spsc_ring *free; /* back from the exporter */
+    uint32_t stash[IPFIX_RECS]; /* free records taken by the RX loop */
+    unsigned int nstash;
+    uint32_t out[64]; /* expired records not handed over yet */
+    unsigned int nout;
+
+    int fd;
+    int udp;
+    pthread_t exporter;
+    int done;
+    int error; /* errno of a failed write, set by the exporter */
+
+    unsigned long long flows;     /* created */
+    unsigned long long records;   /* handed to the exporter */
+    unsigned long long drops;     /* lost with no record free */
+    unsigned long long evictions; /* exported early, cache full */
+    unsigned long long msgs;      /* sent by the exporter */
+    unsigned long long unmetered; /* not IPv4 */
+};
+
+/* Parse ACTIVE_S[:IDLE_S] into the timeouts. Returns 0 on success. */
+int ipfix_timeouts_parse(const char *s, unsigned int *active_s,
+                         unsigned int *idle_s);
+
+/* Export to FILE or udp:HOST:PORT, with the given timeouts in seconds.
+ * tsc_hz converts the TSC of the packets. */
+struct ipfix *ipfix_open(const char *collector, unsigned int active_s,
+                         unsigned int idle_s, uint64_t tsc_hz);
+/* Meter a frame received at TSC now. */
+void ipfix_packet(struct ipfix *fx, const char *buf, unsigned int len,
+                  uint64_t now);
+/* Expire the flows due at now in the next part of the cache, and hand
+ * the records over. To be called at every iteration of the RX loop. */
+void ipfix_expire(struct ipfix *fx, uint64_t now);
+/* Export all the flows, stop the exporter and close the collector.
+ * Returns -1 with errno set if a write failed. */
+int ipfix_close(struct ipfix *fx);
+
+#endif /* __IPFIX_H__ */
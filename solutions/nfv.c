@@ -0,0 +1,952 @@
+/*
+ * This program runs a whole NFV graph, like the one described in
+ * codelab/flowgraph.txt, inside a single process. Every node of the
+ * graph (gen, fe, swap or sink) becomes a stage, and stages are
+ * connected by lock-free single-producer single-consumer rings of
+ * buffer indices. All the packet buffers come from one shared pool,
+ * split among the gen stages; the stages consuming packets hand the
+ * buffers back to their gen through dedicated return rings.
+ *
+ * Three placements are available: "pipeline" runs every stage on its
+ * own thread (optionally pinned to a list of CPUs), "rtc"
+ * (run-to-completion) runs all the stages in graph order on one thread,
+ * and "fused" runs the whole subtree of each gen batch by batch, with
+ * no rings in between (see fused_thread()).
+ *
+ * The headers of the packets are parsed once into pool_meta[], where
+ * the stages read them rather than in the packets: only swap touches
+ * the packets after gen. As the packets of gen are copies of its flow
+ * templates, it parses the templates with pkt_parse() at startup and
+ * copies their metadata along with them.
+ *
+ * The graph description is a text file, see flowgraph.nfv.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "pkt.h"
+#include "flows.h"
+#include "spsc.h"
+#include "tsc.h"
+
+#define NFV_MAX_STAGES 32
+#define NFV_MAX_OUTS 2
+#define NFV_BATCH 64
+#define NFV_RING_SIZE 1024
+#define NFV_GEN_BUFS 8192 /* buffers owned by each gen stage */
+#define NFV_BUF_SIZE 2048
+
+enum stage_type { ST_GEN, ST_FE, ST_SWAP, ST_SINK };
+
+enum placement { PL_PIPELINE, PL_RTC, PL_FUSED };
+
+static const char *placement_names[] = {"pipeline", "run-to-completion",
+                                        "fused"};
+
+static const char *stage_type_names[] = {"gen", "fe", "swap", "sink"};
+
+struct stage {
+    char name[32];
+    enum stage_type type;
+    unsigned int id;
+    struct spsc_ring *in;
+    struct spsc_ring *out[NFV_MAX_OUTS];
+    int cpu;
+
+    /* Parameters. */
+    int udp_port[NFV_MAX_OUTS]; /* fe: ports a and b; sink: port */
+    struct flow_range src, dst;
+    unsigned int len;
+
+    /* gen state. */
+    struct flow_set fs;
+    struct pkt_meta *fs_meta; /* parsed headers of each template */
+    unsigned int flow;
+    unsigned int gen_idx;
+    uint32_t *free_bufs;
+    unsigned int nfree;
+
+    /* Counters. */
+    unsigned long long tot;
+    unsigned long long out_cnt[NFV_MAX_OUTS];
+    unsigned long long dropped;
+    unsigned long long matched;
+};
+
+static int stop = 0; /* shared with the threads, accessed atomically */
+static struct stage stages[NFV_MAX_STAGES];
+static unsigned int nstages;
+static unsigned int ngens;
+static char *pool_bufs;
+static struct pkt_meta *pool_meta; /* parsed headers of each buffer */
+static struct spsc_ring **pool_ret; /* [stage id * ngens + gen idx] */
+static struct stage *gens[NFV_MAX_STAGES];
+
+static void
+sigint_handler(int signum)
+{
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+}
+
+static inline char *
+nfv_buf(uint32_t idx)
+{
+    return pool_bufs + (size_t)idx * NFV_BUF_SIZE;
+}
+
+/* Fill buffer idx with the next packet of gen stage s. */
+static inline void
+nfv_fill(struct stage *s, uint32_t idx)
+{
+    flow_fill(&s->fs, s->flow, nfv_buf(idx));
+    pool_meta[idx] = s->fs_meta[s->flow];
+    if (++s->flow == s->fs.nflows) {
+        s->flow = 0;
+    }
+}
+
+/* Give buffers back to the gen stages owning them. */
+static inline void
+nfv_free(struct stage *s, const uint32_t *idx, unsigned int n)
+{
+    unsigned int i;
+
+    if (n == 0) {
+        return;
+    }
+    if (ngens == 1) {
+        spsc_enqueue_burst(pool_ret[s->id], idx, n);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        unsigned int g = idx[i] / NFV_GEN_BUFS;
+
+        spsc_enqueue_burst(pool_ret[s->id * ngens + g], &idx[i], 1);
+    }
+}
+
+static unsigned int
+gen_run(struct stage *s)
+{
+    uint32_t batch[NFV_BATCH];
+    unsigned int n = spsc_free_space(s->out[0]);
+    unsigned int i;
+
+    if (n > NFV_BATCH) {
+        n = NFV_BATCH;
+    }
+    if (s->nfree < n) {
+        /* Collect the buffers released by the other stages. */
+        for (i = 0; i < nstages; i++) {
+            s->nfree +=
+                spsc_dequeue_burst(pool_ret[i * ngens + s->gen_idx],
+                                   s->free_bufs + s->nfree,
+                                   NFV_GEN_BUFS - s->nfree);
+        }
+        if (n > s->nfree) {
+            n = s->nfree;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        uint32_t idx = s->free_bufs[--s->nfree];
+
+        nfv_fill(s, idx);
+        batch[i] = idx;
+    }
+    spsc_enqueue_burst(s->out[0], batch, n);
+    s->tot += n;
+    s->out_cnt[0] += n;
+
+    return n;
+}
+
+static unsigned int
+fe_run(struct stage *s)
+{
+    uint32_t batch[NFV_BATCH];
+    uint32_t outs[NFV_MAX_OUTS][NFV_BATCH];
+    unsigned int nout[NFV_MAX_OUTS] = {0, 0};
+    uint32_t drop[NFV_BATCH];
+    unsigned int ndrop = 0;
+    unsigned int n, i, o;
+
+    n = spsc_dequeue_burst(s->in, batch, NFV_BATCH);
+    for (i = 0; i < n; i++) {
+        int udp_port = pkt_meta_udp_port(&pool_meta[batch[i]]);
+
+        if (udp_port == s->udp_port[0] && s->out[0]) {
+            outs[0][nout[0]++] = batch[i];
+        } else if (udp_port == s->udp_port[1] && s->out[1]) {
+            outs[1][nout[1]++] = batch[i];
+        } else {
+            drop[ndrop++] = batch[i];
+        }
+    }
+    for (o = 0; o < NFV_MAX_OUTS; o++) {
+        unsigned int m;
+
+        if (nout[o] == 0) {
+            continue;
+        }
+        m = spsc_enqueue_burst(s->out[o], outs[o], nout[o]);
+        s->out_cnt[o] += m;
+        /* Drop what does not fit, as fe does. */
+        s->dropped += nout[o] - m;
+        nfv_free(s, outs[o] + m, nout[o] - m);
+    }
+    s->dropped += ndrop;
+    nfv_free(s, drop, ndrop);
+    s->tot += n;
+
+    return n;
+}
+
+static unsigned int
+swap_run(struct stage *s)
+{
+    uint32_t batch[NFV_BATCH];
+    unsigned int n = NFV_BATCH;
+    unsigned int i;
+
+    if (s->out[0]) {
+        /* Do not take more than what we can pass on. */
+        n = spsc_free_space(s->out[0]);
+        if (n > NFV_BATCH) {
+            n = NFV_BATCH;
+        }
+    }
+    n = spsc_dequeue_burst(s->in, batch, n);
+    for (i = 0; i < n; i++) {
+        s->matched +=
+            pkt_meta_udp_swap(nfv_buf(batch[i]), &pool_meta[batch[i]]);
+    }
+    if (s->out[0]) {
+        spsc_enqueue_burst(s->out[0], batch, n);
+        s->out_cnt[0] += n;
+    } else {
+        nfv_free(s, batch, n);
+    }
+    s->tot += n;
+
+    return n;
+}
+
+static unsigned int
+sink_run(struct stage *s)
+{
+    uint32_t batch[NFV_BATCH];
+    unsigned int n, i;
+
+    n = spsc_dequeue_burst(s->in, batch, NFV_BATCH);
+    for (i = 0; i < n; i++) {
+        s->matched += pkt_meta_udp_match(&pool_meta[batch[i]], s->udp_port[0]);
+    }
+    nfv_free(s, batch, n);
+    s->tot += n;
+
+    return n;
+}
+
+static unsigned int
+stage_run(struct stage *s)
+{
+    switch (s->type) {
+    case ST_GEN:
+        return gen_run(s);
+    case ST_FE:
+        return fe_run(s);
+    case ST_SWAP:
+        return swap_run(s);
+    case ST_SINK:
+        return sink_run(s);
+    }
+    return 0;
+}
+
+static void
+pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        printf("Failed to pin thread to CPU %d\n", cpu);
+    }
+}
+
+static void *
+pipeline_thread(void *arg)
+{
+    struct stage *s = arg;
+
+    pin_cpu(s->cpu);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        if (stage_run(s) == 0) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static void *
+rtc_thread(void *arg)
+{
+    int cpu = *(int *)arg;
+
+    pin_cpu(cpu);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        unsigned int work = 0;
+        unsigned int i;
+
+        for (i = 0; i < nstages; i++) {
+            work += stage_run(&stages[i]);
+        }
+        if (work == 0) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Fused mode: each gen runs its whole subtree on one thread, one batch
+ * at a time, so that every packet goes through classification, rewrite
+ * and counting while it is still in L1. No rings are involved, and the
+ * buffers of a batch are reused as soon as the batch is done.
+ *
+ * The chains of stages following fe (or gen) are specialized at compile
+ * time: FUSED_CHAIN*() expand to functions calling the stage kernels
+ * inline, and fused_chains[] maps each chain shape to its function.
+ * Shapes missing from the table fall back to chain_generic().
+ */
+#define NFV_MAX_CHAIN 8
+
+typedef void (*fused_fn)(struct stage **st, const uint32_t *b,
+                         unsigned int n);
+
+struct fused_path {
+    fused_fn fn;
+    struct stage *st[NFV_MAX_CHAIN + 1]; /* NULL terminated */
+};
+
+struct fused_plan {
+    struct stage *gen;
+    struct stage *fe; /* NULL if gen feeds path[0] directly */
+    struct fused_path path[NFV_MAX_OUTS];
+};
+
+static struct fused_plan plans[NFV_MAX_STAGES];
+
+static inline __attribute__((always_inline)) void
+swap_kern(struct stage *s, const uint32_t *b, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        s->matched += pkt_meta_udp_swap(nfv_buf(b[i]), &pool_meta[b[i]]);
+    }
+    s->tot += n;
+    if (s->out[0]) {
+        s->out_cnt[0] += n;
+    }
+}
+
+static inline __attribute__((always_inline)) void
+sink_kern(struct stage *s, const uint32_t *b, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        s->matched += pkt_meta_udp_match(&pool_meta[b[i]], s->udp_port[0]);
+    }
+    s->tot += n;
+}
+
+#define FUSED_CHAIN1(name, k1)                                             \
+    static void name(struct stage **st, const uint32_t *b, unsigned int n) \
+    {                                                                      \
+        k1(st[0], b, n);                                                   \
+    }
+
+#define FUSED_CHAIN2(name, k1, k2)                                         \
+    static void name(struct stage **st, const uint32_t *b, unsigned int n) \
+    {                                                                      \
+        k1(st[0], b, n);                                                   \
+        k2(st[1], b, n);                                                   \
+    }
+
+#define FUSED_CHAIN3(name, k1, k2, k3)                                     \
+    static void name(struct stage **st, const uint32_t *b, unsigned int n) \
+    {                                                                      \
+        k1(st[0], b, n);                                                   \
+        k2(st[1], b, n);                                                   \
+        k3(st[2], b, n);                                                   \
+    }
+
+FUSED_CHAIN1(chain_sink, sink_kern)
+FUSED_CHAIN1(chain_swap, swap_kern)
+FUSED_CHAIN2(chain_swap_sink, swap_kern, sink_kern)
+FUSED_CHAIN3(chain_swap_swap_sink, swap_kern, swap_kern, sink_kern)
+
+static void
+chain_generic(struct stage **st, const uint32_t *b, unsigned int n)
+{
+    for (; *st; st++) {
+        if ((*st)->type == ST_SWAP) {
+            swap_kern(*st, b, n);
+        } else {
+            sink_kern(*st, b, n);
+        }
+    }
+}
+
+static const struct {
+    const char *shape;
+    fused_fn fn;
+} fused_chains[] = {
+    {"sink", chain_sink},
+    {"swap", chain_swap},
+    {"swap,sink", chain_swap_sink},
+    {"swap,swap,sink", chain_swap_swap_sink},
+};
+
+static void *
+fused_thread(void *arg)
+{
+    struct fused_plan *p = arg;
+    struct stage *g      = p->gen;
+    struct stage *fe     = p->fe;
+
+    pin_cpu(g->cpu);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        /* The top of the free list is the batch: the buffers go back
+         * there as soon as the batch has been processed. */
+        const uint32_t *batch = g->free_bufs + g->nfree - NFV_BATCH;
+        uint32_t outs[NFV_MAX_OUTS][NFV_BATCH];
+        unsigned int nout[NFV_MAX_OUTS] = {0, 0};
+        unsigned int i, o;
+
+        for (i = 0; i < NFV_BATCH; i++) {
+            nfv_fill(g, batch[i]);
+        }
+        g->tot += NFV_BATCH;
+        g->out_cnt[0] += NFV_BATCH;
+
+        if (fe == NULL) {
+            p->path[0].fn(p->path[0].st, batch, NFV_BATCH);
+            continue;
+        }
+        for (i = 0; i < NFV_BATCH; i++) {
+            int udp_port = pkt_meta_udp_port(&pool_meta[batch[i]]);
+
+            if (udp_port == fe->udp_port[0] && p->path[0].fn) {
+                outs[0][nout[0]++] = batch[i];
+            } else if (udp_port == fe->udp_port[1] && p->path[1].fn) {
+                outs[1][nout[1]++] = batch[i];
+            }
+        }
+        fe->tot += NFV_BATCH;
+        fe->dropped += NFV_BATCH - nout[0] - nout[1];
+        for (o = 0; o < NFV_MAX_OUTS; o++) {
+            if (nout[o]) {
+                fe->out_cnt[o] += nout[o];
+                p->path[o].fn(p->path[o].st, outs[o], nout[o]);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Stage reading from ring r, if any. */
+static struct stage *
+stage_consumer(struct spsc_ring *r)
+{
+    unsigned int i;
+
+    for (i = 0; r && i < nstages; i++) {
+        if (stages[i].in == r) {
+            return &stages[i];
+        }
+    }
+    return NULL;
+}
+
+static int
+fused_path_build(struct fused_path *path, struct stage *s)
+{
+    char shape[NFV_MAX_CHAIN * 8] = "";
+    unsigned int n                = 0;
+    unsigned int i;
+
+    for (; s; s = stage_consumer(s->out[0])) {
+        if ((s->type != ST_SWAP && s->type != ST_SINK) ||
+            n == NFV_MAX_CHAIN) {
+            printf("Node %s: fused mode only supports gen [-> fe] followed "
+                   "by chains of up to %d swap/sink nodes\n",
+                   s->name, NFV_MAX_CHAIN);
+            return -1;
+        }
+        if (n) {
+            strcat(shape, ",");
+        }
+        strcat(shape, stage_type_names[s->type]);
+        path->st[n++] = s;
+    }
+    path->st[n] = NULL;
+
+    path->fn = chain_generic;
+    for (i = 0; i < sizeof(fused_chains) / sizeof(fused_chains[0]); i++) {
+        if (!strcmp(fused_chains[i].shape, shape)) {
+            path->fn = fused_chains[i].fn;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int
+fused_setup(void)
+{
+    unsigned int i, o;
+
+    for (i = 0; i < ngens; i++) {
+        struct fused_plan *p = &plans[i];
+        struct stage *next   = stage_consumer(gens[i]->out[0]);
+
+        memset(p, 0, sizeof(*p));
+        p->gen = gens[i];
+        if (next->type != ST_FE) {
+            if (fused_path_build(&p->path[0], next)) {
+                return -1;
+            }
+            continue;
+        }
+        p->fe = next;
+        for (o = 0; o < NFV_MAX_OUTS; o++) {
+            if (next->out[o] &&
+                fused_path_build(&p->path[o], stage_consumer(next->out[o]))) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static struct stage *
+stage_lookup(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < nstages; i++) {
+        if (!strcmp(stages[i].name, name)) {
+            return &stages[i];
+        }
+    }
+    return NULL;
+}
+
+static int
+node_parse(char **tok, int ntok, unsigned int lineno)
+{
+    struct stage *s;
+    int i;
+
+    if (ntok < 3 || nstages == NFV_MAX_STAGES || stage_lookup(tok[1])) {
+        printf("line %u: invalid or duplicate node\n", lineno);
+        return -1;
+    }
+    s = &stages[nstages];
+    memset(s, 0, sizeof(*s));
+    snprintf(s->name, sizeof(s->name), "%s", tok[1]);
+    s->id  = nstages;
+    s->cpu = -1;
+    for (i = 0; i < 4; i++) {
+        if (!strcmp(tok[2], stage_type_names[i])) {
+            s->type = i;
+            break;
+        }
+    }
+    if (i == 4) {
+        printf("line %u: unknown node type '%s'\n", lineno, tok[2]);
+        return -1;
+    }
+
+    /* Defaults, as in the single programs. */
+    s->udp_port[0] = 8000;
+    s->udp_port[1] = 8001;
+    s->len         = 60;
+    flow_range_parse("10.0.0.1:7000", &s->src);
+    flow_range_parse("10.0.0.1:8000", &s->dst);
+
+    for (i = 3; i < ntok; i++) {
+        char *val = strchr(tok[i], '=');
+        int ok    = 0;
+
+        if (val == NULL) {
+            printf("line %u: expected KEY=VALUE, got '%s'\n", lineno, tok[i]);
+            return -1;
+        }
+        *val++ = '\0';
+        if (s->type == ST_GEN && !strcmp(tok[i], "src")) {
+            ok = !flow_range_parse(val, &s->src);
+        } else if (s->type == ST_GEN && !strcmp(tok[i], "dst")) {
+            ok = !flow_range_parse(val, &s->dst);
+        } else if (s->type == ST_GEN && !strcmp(tok[i], "len")) {
+            s->len = atoi(val);
+            ok     = 1;
+        } else if (s->type == ST_FE &&
+                   (!strcmp(tok[i], "a") || !strcmp(tok[i], "b"))) {
+            s->udp_port[tok[i][0] - 'a'] = atoi(val);
+            ok                           = 1;
+        } else if (s->type == ST_SINK && !strcmp(tok[i], "port")) {
+            s->udp_port[0] = atoi(val);
+            ok             = 1;
+        }
+        if (!ok) {
+            printf("line %u: invalid parameter '%s'\n", lineno, tok[i]);
+            return -1;
+        }
+    }
+    nstages++;
+
+    return 0;
+}
+
+static int
+link_parse(char **tok, int ntok, unsigned int lineno)
+{
+    struct stage *from, *to;
+    unsigned int out = 0;
+    char *dot;
+
+    if (ntok != 3) {
+        printf("line %u: expected 'link FROM[.OUTPUT] TO'\n", lineno);
+        return -1;
+    }
+    dot = strchr(tok[1], '.');
+    if (dot) {
+        *dot++ = '\0';
+    }
+    from = stage_lookup(tok[1]);
+    to   = stage_lookup(tok[2]);
+    if (from == NULL || to == NULL) {
+        printf("line %u: unknown node\n", lineno);
+        return -1;
+    }
+    if (dot) {
+        if (from->type != ST_FE || strlen(dot) != 1 || dot[0] < 'a' ||
+            dot[0] > 'b') {
+            printf("line %u: invalid output '%s'\n", lineno, dot);
+            return -1;
+        }
+        out = dot[0] - 'a';
+    }
+    if (from->type == ST_SINK || to->type == ST_GEN || from->out[out] ||
+        to->in) {
+        printf("line %u: invalid link\n", lineno);
+        return -1;
+    }
+    from->out[out] = spsc_ring_create(NFV_RING_SIZE);
+    if (from->out[out] == NULL) {
+        printf("Failed to allocate a ring\n");
+        return -1;
+    }
+    to->in = from->out[out];
+
+    return 0;
+}
+
+static int
+graph_load(const char *path)
+{
+    char line[512];
+    unsigned int lineno = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        printf("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *tok[16];
+        int ntok = 0;
+        char *p;
+        int ret  = 0;
+
+        lineno++;
+        p = strchr(line, '#');
+        if (p) {
+            *p = '\0';
+        }
+        for (p = strtok(line, " \t\r\n"); p && ntok < 16;
+             p = strtok(NULL, " \t\r\n")) {
+            tok[ntok++] = p;
+        }
+        if (ntok == 0) {
+            continue;
+        }
+        if (!strcmp(tok[0], "node")) {
+            ret = node_parse(tok, ntok, lineno);
+        } else if (!strcmp(tok[0], "link")) {
+            ret = link_parse(tok, ntok, lineno);
+        } else {
+            printf("line %u: unknown directive '%s'\n", lineno, tok[0]);
+            ret = -1;
+        }
+        if (ret) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+
+    return 0;
+}
+
+/* Allocate the buffer pool and check that the graph is complete. */
+static int
+graph_setup(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < nstages; i++) {
+        struct stage *s = &stages[i];
+
+        if ((s->type != ST_GEN && s->in == NULL) ||
+            (s->type == ST_GEN && s->out[0] == NULL)) {
+            printf("Node %s is not connected\n", s->name);
+            return -1;
+        }
+        if (s->type == ST_GEN) {
+            s->gen_idx    = ngens;
+            gens[ngens++] = s;
+        }
+    }
+    if (ngens == 0) {
+        printf("The graph has no gen node\n");
+        return -1;
+    }
+
+    pool_bufs = aligned_alloc(4096, (size_t)ngens * NFV_GEN_BUFS *
+                                        NFV_BUF_SIZE);
+    pool_meta = calloc(ngens * NFV_GEN_BUFS, sizeof(pool_meta[0]));
+    pool_ret  = calloc(nstages * ngens, sizeof(pool_ret[0]));
+    if (pool_bufs == NULL || pool_meta == NULL || pool_ret == NULL) {
+        printf("Failed to allocate the buffer pool\n");
+        return -1;
+    }
+    for (i = 0; i < nstages * ngens; i++) {
+        /* As large as a partition, so that they never overflow. */
+        pool_ret[i] = spsc_ring_create(NFV_GEN_BUFS);
+        if (pool_ret[i] == NULL) {
+            printf("Failed to allocate the return rings\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < ngens; i++) {
+        struct stage *g = gens[i];
+
+        if (flow_set_build(&g->fs, &g->src, &g->dst, g->len)) {
+            printf("Node %s: failed to build the flow templates\n", g->name);
+            return -1;
+        }
+        g->fs_meta = malloc(g->fs.nflows * sizeof(g->fs_meta[0]));
+        if (g->fs_meta == NULL) {
+            printf("Failed to allocate the template metadata\n");
+            return -1;
+        }
+        for (j = 0; j < g->fs.nflows; j++) {
+            pkt_parse(flow_tmpl(&g->fs, j), g->fs.len, &g->fs_meta[j]);
+        }
+        g->free_bufs = malloc(NFV_GEN_BUFS * sizeof(g->free_bufs[0]));
+        if (g->free_bufs == NULL) {
+            printf("Failed to allocate the free lists\n");
+            return -1;
+        }
+        for (j = 0; j < NFV_GEN_BUFS; j++) {
+            g->free_bufs[j] = i * NFV_GEN_BUFS + j;
+        }
+        g->nfree = NFV_GEN_BUFS;
+    }
+
+    return 0;
+}
+
+static void
+graph_report(double secs)
+{
+    unsigned int i;
+
+    printf("%-10s %-5s %14s %14s %14s %14s %14s\n", "node", "type", "packets",
+           "out a", "out b", "dropped", "matched");
+    for (i = 0; i < nstages; i++) {
+        struct stage *s = &stages[i];
+
+        printf("%-10s %-5s %14llu %14llu %14llu %14llu %14llu\n", s->name,
+               stage_type_names[s->type], s->tot, s->out_cnt[0],
+               s->out_cnt[1], s->dropped, s->matched);
+    }
+    for (i = 0; i < nstages; i++) {
+        if (stages[i].type == ST_SINK && secs > 0) {
+            printf("%s rate: %.3f Mpps\n", stages[i].name,
+                   stages[i].tot / secs / 1e6);
+        }
+    }
+}
+
+static int
+main_loop(enum placement mode, const int *cpus, int ncpus,
+          unsigned int duration)
+{
+    pthread_t threads[NFV_MAX_STAGES];
+    unsigned int nthreads = mode == PL_RTC ? 1 : nstages;
+    int rtc_cpu           = ncpus ? cpus[0] : -1;
+    uint64_t t0;
+    unsigned int i;
+
+    if (mode == PL_FUSED) {
+        nthreads = ngens;
+    }
+
+    t0 = rdtsc();
+    for (i = 0; i < nthreads; i++) {
+        int ret;
+
+        if (mode == PL_RTC) {
+            ret = pthread_create(&threads[i], NULL, rtc_thread, &rtc_cpu);
+        } else if (mode == PL_FUSED) {
+            gens[i]->cpu = ncpus ? cpus[i % ncpus] : -1;
+            ret = pthread_create(&threads[i], NULL, fused_thread, &plans[i]);
+        } else {
+            stages[i].cpu = ncpus ? cpus[i % ncpus] : -1;
+            ret = pthread_create(&threads[i], NULL, pipeline_thread,
+                                 &stages[i]);
+        }
+        if (ret) {
+            printf("Failed to create thread: %s\n", strerror(ret));
+            __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+            nthreads = i;
+            break;
+        }
+    }
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        sleep(1);
+        if (duration && --duration == 0) {
+            __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    graph_report(tsc2ns(rdtsc() - t0) / 1e9);
+
+    return 0;
+}
+
+static void
+usage(char **argv)
+{
+    printf("usage: %s [-h] [-g GRAPH_FILE] [-m pipeline|rtc|fused] "
+           "[-c CPU[,CPU...]] [-d SECONDS]\n",
+           argv[0]);
+    exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *graph     = "flowgraph.nfv";
+    enum placement mode   = PL_PIPELINE;
+    int cpus[NFV_MAX_STAGES];
+    int ncpus             = 0;
+    unsigned int duration = 0;
+    struct sigaction sa;
+    char *p;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "hg:m:c:d:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage(argv);
+            return 0;
+
+        case 'g':
+            graph = optarg;
+            break;
+
+        case 'm':
+            if (!strcmp(optarg, "rtc")) {
+                mode = PL_RTC;
+            } else if (!strcmp(optarg, "fused")) {
+                mode = PL_FUSED;
+            } else if (!strcmp(optarg, "pipeline")) {
+                mode = PL_PIPELINE;
+            } else {
+                printf("    invalid placement %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'c':
+            for (p = strtok(optarg, ","); p && ncpus < NFV_MAX_STAGES;
+                 p = strtok(NULL, ",")) {
+                cpus[ncpus++] = atoi(p);
+            }
+            break;
+
+        case 'd':
+            duration = atoi(optarg);
+            break;
+
+        default:
+            printf("    unrecognized option '-%c'\n", opt);
+            usage(argv);
+            return -1;
+        }
+    }
+
+    if (graph_load(graph) || graph_setup() ||
+        (mode == PL_FUSED && fused_setup())) {
+        return -1;
+    }
+
+    /* Register Ctrl-C handler. */
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    ret         = sigaction(SIGINT, &sa, NULL);
+    if (ret) {
+        perror("sigaction(SIGINT)");
+        exit(EXIT_FAILURE);
+    }
+
+    tsc_calibrate();
+
+    printf("Graph    : %s (%u nodes)\n", graph, nstages);
+    printf("Placement: %s\n", placement_names[mode]);
+
+    main_loop(mode, cpus, ncpus, duration);
+
+    return 0;
+}
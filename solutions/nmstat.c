@@ -0,0 +1,279 @@
+/*
+ * This program shows, top-like, the counters that the running programs
+ * (sink, forward, swap, fe) publish in their shared-memory stats
+ * segments (see stats.h). Every interval it takes a consistent snapshot
+ * of each segment and prints the value and the per-second rate of each
+ * counter, and the average of each histogram. Segments are found under
+ * /dev/shm, and optionally filtered by program name.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include "stats.h"
+
+#define NMSTAT_MAX_PROCS 64
+
+struct proc {
+    char shm_name[NAME_MAX + 2];
+    const struct stats_shm *shm;
+    struct stats_snap prev;
+    int have_prev;
+    int seen; /* found during the last scan */
+};
+
+static int stop = 0;
+static struct proc procs[NMSTAT_MAX_PROCS];
+
+static void
+sigint_handler(int signum)
+{
+    stop = 1;
+}
+
+static int
+prog_selected(const char *prog, char **filters, int nfilters)
+{
+    int i;
+
+    if (nfilters == 0) {
+        return 1;
+    }
+    for (i = 0; i < nfilters; i++) {
+        if (!strcmp(prog, filters[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Attach to new segments and drop the ones that disappeared. */
+static void
+procs_scan(char **filters, int nfilters)
+{
+    struct dirent *de;
+    DIR *dir;
+    int i;
+
+    for (i = 0; i < NMSTAT_MAX_PROCS; i++) {
+        procs[i].seen = 0;
+    }
+    dir = opendir("/dev/shm");
+    if (dir == NULL) {
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        char shm_name[NAME_MAX + 2];
+        const struct stats_shm *shm;
+        int free_i = -1;
+
+        if (strncmp(de->d_name, STATS_PREFIX + 1, strlen(STATS_PREFIX) - 1)) {
+            continue;
+        }
+        snprintf(shm_name, sizeof(shm_name), "/%s", de->d_name);
+        for (i = 0; i < NMSTAT_MAX_PROCS; i++) {
+            if (procs[i].shm && !strcmp(procs[i].shm_name, shm_name)) {
+                break;
+            }
+            if (procs[i].shm == NULL && free_i < 0) {
+                free_i = i;
+            }
+        }
+        if (i < NMSTAT_MAX_PROCS) {
+            procs[i].seen = 1;
+            continue;
+        }
+        if (free_i < 0) {
+            continue;
+        }
+        shm = stats_attach(shm_name);
+        if (shm == NULL) {
+            continue;
+        }
+        if (!prog_selected(shm->prog, filters, nfilters) ||
+            (kill(shm->pid, 0) && errno == ESRCH)) {
+            /* Not interesting, or left behind by a dead process. */
+            stats_detach(shm);
+            continue;
+        }
+        memset(&procs[free_i], 0, sizeof(procs[free_i]));
+        snprintf(procs[free_i].shm_name, sizeof(procs[free_i].shm_name),
+                 "%s", shm_name);
+        procs[free_i].shm  = shm;
+        procs[free_i].seen = 1;
+    }
+    closedir(dir);
+
+    for (i = 0; i < NMSTAT_MAX_PROCS; i++) {
+        if (procs[i].shm && !procs[i].seen) {
+            stats_detach(procs[i].shm);
+            procs[i].shm = NULL;
+        }
+    }
+}
+
+static const char *
+fmt_rate(char *buf, size_t len, double r)
+{
+    if (r >= 1e9) {
+        snprintf(buf, len, "%.2fG", r / 1e9);
+    } else if (r >= 1e6) {
+        snprintf(buf, len, "%.2fM", r / 1e6);
+    } else if (r >= 1e3) {
+        snprintf(buf, len, "%.2fK", r / 1e3);
+    } else {
+        snprintf(buf, len, "%.0f", r);
+    }
+    return buf;
+}
+
+static void
+procs_show(int clear)
+{
+    int nprocs = 0;
+    int i;
+
+    for (i = 0; i < NMSTAT_MAX_PROCS; i++) {
+        nprocs += procs[i].shm != NULL;
+    }
+    if (clear) {
+        printf("\033[H\033[2J");
+    }
+    printf("nmstat: %d process%s\n\n", nprocs, nprocs == 1 ? "" : "es");
+    printf("%-10s %8s  %-20s %16s %10s\n", "PROG", "PID", "COUNTER", "VALUE",
+           "RATE/s");
+
+    for (i = 0; i < NMSTAT_MAX_PROCS; i++) {
+        struct proc *p = &procs[i];
+        struct stats_snap snap;
+        unsigned long long hcount = 0, prev_hcount = 0;
+        double dt                 = 0;
+        int first                 = 1;
+        unsigned int c;
+
+        if (p->shm == NULL) {
+            continue;
+        }
+        if (stats_snapshot(p->shm, &snap)) {
+            printf("%-10s %8d  (busy)\n", p->shm->prog, p->shm->pid);
+            continue;
+        }
+        if (p->have_prev && snap.ts_ns > p->prev.ts_ns) {
+            dt = (snap.ts_ns - p->prev.ts_ns) / 1e9;
+        }
+        for (c = 0; c < snap.n; c++) {
+            const struct stats_desc *d = &p->shm->desc[c];
+            unsigned long long val     = snap.val[c];
+            char name[STATS_NAME_MAX + 4];
+            char rate[32] = "-";
+
+            if (d->type == STATS_BUCKET) {
+                /* Histograms are shown as their average, with the rate
+                 * of samples, on the line of their sum. */
+                if (c == 0 || p->shm->desc[c - 1].type != STATS_BUCKET) {
+                    hcount = prev_hcount = 0;
+                }
+                hcount += val;
+                if (c < p->prev.n) {
+                    prev_hcount += p->prev.val[c];
+                }
+                continue;
+            }
+            snprintf(name, sizeof(name), "%.*s%s", (int)sizeof(d->name),
+                     d->name, d->type == STATS_SUM ? ".avg" : "");
+            if (d->type == STATS_SUM) {
+                val = hcount ? val / hcount : 0;
+                if (dt > 0) {
+                    fmt_rate(rate, sizeof(rate), (hcount - prev_hcount) / dt);
+                }
+            } else if (d->type == STATS_COUNTER && dt > 0 && c < p->prev.n) {
+                fmt_rate(rate, sizeof(rate),
+                         (snap.val[c] - p->prev.val[c]) / dt);
+            }
+            if (first) {
+                printf("%-10s %8d", p->shm->prog, p->shm->pid);
+                first = 0;
+            } else {
+                printf("%-10s %8s", "", "");
+            }
+            printf("  %-20s %16llu %10s\n", name, val, rate);
+        }
+        p->prev      = snap;
+        p->have_prev = 1;
+    }
+    fflush(stdout);
+}
+
+static void
+usage(char **argv)
+{
+    printf("usage: %s [-h] [-i INTERVAL_SECONDS] [-n COUNT] [PROG...]\n",
+           argv[0]);
+    exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+    double interval = 1.0;
+    int count       = 0; /* zero means forever */
+    struct sigaction sa;
+    int opt;
+    int ret;
+    int i;
+
+    while ((opt = getopt(argc, argv, "hi:n:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage(argv);
+            return 0;
+
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0) {
+                printf("    invalid interval %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'n':
+            count = atoi(optarg);
+            break;
+
+        default:
+            printf("    unrecognized option '-%c'\n", opt);
+            usage(argv);
+            return -1;
+        }
+    }
+
+    /* Register Ctrl-C handler. */
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0; /* interrupt usleep() */
+    ret         = sigaction(SIGINT, &sa, NULL);
+    if (ret) {
+        perror("sigaction(SIGINT)");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; !stop && (count == 0 || i < count); i++) {
+        if (i) {
+            usleep(interval * 1e6);
+        }
+        procs_scan(argv + optind, argc - optind);
+        procs_show(isatty(STDOUT_FILENO));
+    }
+
+    for (i = 0; i < NMSTAT_MAX_PROCS; i++) {
+        if (procs[i].shm) {
+            stats_detach(procs[i].shm);
+        }
+    }
+
+    return 0;
+}
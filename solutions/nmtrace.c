@@ -0,0 +1,176 @@
+/*
+ * This program decodes the flight recorder file written by fe -F (see
+ * trace.h), also after fe crashed. It prints the records still in the
+ * circular buffer, oldest first, with wall clock timestamps, the place
+ * each packet was found, its verdict and a summary of its headers;
+ * optionally it dumps the captured bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include "trace.h"
+
+static void
+print_headers(const struct trace_rec *r)
+{
+    const struct ether_header *ethh = (const struct ether_header *)r->data;
+    const struct ip *iph            = (const struct ip *)(ethh + 1);
+    const struct udphdr *udph;
+    char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+    if (r->caplen < sizeof(*ethh) + sizeof(*iph) ||
+        ethh->ether_type != htons(ETHERTYPE_IP)) {
+        printf("  ethertype 0x%04x", ntohs(ethh->ether_type));
+        return;
+    }
+    inet_ntop(AF_INET, &iph->ip_src, src, sizeof(src));
+    inet_ntop(AF_INET, &iph->ip_dst, dst, sizeof(dst));
+    udph = (const struct udphdr *)((const char *)iph + iph->ip_hl * 4);
+    if ((iph->ip_p == IPPROTO_UDP || iph->ip_p == IPPROTO_TCP) &&
+        (const unsigned char *)(udph + 1) <= r->data + r->caplen) {
+        printf("  %s %s:%u > %s:%u", iph->ip_p == IPPROTO_UDP ? "udp" : "tcp",
+               src, ntohs(udph->uh_sport), dst, ntohs(udph->uh_dport));
+    } else {
+        printf("  proto %u %s > %s", iph->ip_p, src, dst);
+    }
+}
+
+static void
+print_hex(const struct trace_rec *r)
+{
+    unsigned int i;
+
+    for (i = 0; i < r->caplen; i++) {
+        printf("%s%02x", i % 16 ? " " : "\n    ", r->data[i]);
+    }
+}
+
+static void
+usage(char **argv)
+{
+    printf("usage: %s [-h] [-n LAST] [-v VERDICT[,VERDICT...]] [-x] FILE\n"
+           "    verdicts: fwd-a, fwd-b, back, drop, full\n",
+           argv[0]);
+    exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long long last  = 0; /* zero means all */
+    uint32_t vmask           = ~0U;
+    int hex                  = 0;
+    unsigned long long shown = 0;
+    unsigned long long torn  = 0;
+    unsigned long long counts[TRACE_NVERDICTS];
+    const struct trace_hdr *hdr;
+    uint64_t head, first, i;
+    size_t size;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:v:x")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage(argv);
+            return 0;
+
+        case 'n':
+            last = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'v':
+            if (trace_parse_verdicts(optarg, &vmask)) {
+                printf("    invalid verdicts %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'x':
+            hex = 1;
+            break;
+
+        default:
+            printf("    unrecognized option '-%c'\n", opt);
+            usage(argv);
+            return -1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        printf("    missing trace file\n");
+        usage(argv);
+    }
+
+    hdr = trace_attach(argv[optind], &size);
+    if (hdr == NULL) {
+        printf("Failed to open %s: %s\n", argv[optind], strerror(errno));
+        return -1;
+    }
+
+    head  = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    first = head > hdr->nrecs ? head - hdr->nrecs : 0;
+    if (last && head - first > last) {
+        first = head - last;
+    }
+    memset(counts, 0, sizeof(counts));
+    printf("%s: %s, %llu records written, showing %llu\n", argv[optind],
+           hdr->prog, (unsigned long long)head,
+           (unsigned long long)(head - first));
+
+    for (i = first; i < head; i++) {
+        const struct trace_rec *r = trace_hdr_rec(hdr, i);
+        struct trace_rec rec;
+        uint64_t ns;
+        time_t sec;
+        struct tm tm;
+        char tbuf[32];
+
+        rec = *r;
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != i ||
+            rec.seq != i || rec.verdict >= TRACE_NVERDICTS) {
+            /* Being written when the program stopped, or overwritten
+             * while we were reading. */
+            torn++;
+            continue;
+        }
+        counts[rec.verdict]++;
+        if (!(vmask & (1U << rec.verdict))) {
+            continue;
+        }
+        ns = hdr->start_ns;
+        if (hdr->tsc_hz && rec.ts >= hdr->start_tsc) {
+            ns += (uint64_t)((double)(rec.ts - hdr->start_tsc) * 1e9 /
+                             hdr->tsc_hz);
+        }
+        sec = ns / 1000000000ULL;
+        localtime_r(&sec, &tm);
+        strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+        printf("%s.%09llu  port %u ring %u slot %u len %u  %-5s", tbuf,
+               (unsigned long long)(ns % 1000000000ULL), rec.port, rec.ring,
+               rec.slot, rec.len, trace_verdict_names[rec.verdict]);
+        print_headers(&rec);
+        if (hex) {
+            print_hex(&rec);
+        }
+        printf("\n");
+        shown++;
+    }
+
+    printf("Shown records   : %llu\n", shown);
+    printf("Torn records    : %llu\n", torn);
+    for (i = 0; i < TRACE_NVERDICTS; i++) {
+        printf("Verdict %-8s: %llu\n", trace_verdict_names[i], counts[i]);
+    }
+    trace_detach(hdr, size);
+
+    return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Per-packet functions shared by the programs in this directory. They
+ * all assume an untagged Ethernet frame carrying IPv4 without options.
+ */
+#ifndef __PKT_H__
+#define __PKT_H__
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+/* Returns 1 if the packet is UDP with destination port udp_port, or
+ * if udp_port is 0 (no filter). */
+static inline int
+pkt_select(const char *buf, int udp_port)
+{
+    struct ether_header *ethh;
+    struct ip *iph;
+    struct udphdr *udph;
+
+    if (udp_port == 0) {
+        return 1; /* no filter */
+    }
+
+    ethh = (struct ether_header *)buf;
+    if (ethh->ether_type != htons(ETHERTYPE_IP)) {
+        /* Filter out non-IP traffic. */
+        return 0;
+    }
+    iph = (struct ip *)(ethh + 1);
+    if (iph->ip_p != IPPROTO_UDP) {
+        /* Filter out non-UDP traffic. */
+        return 0;
+    }
+    udph = (struct udphdr *)(iph + 1);
+
+    /* Match the destination port. */
+    if (udph->uh_dport != htons(udp_port)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Returns the UDP destination port, or 0 for non-UDP packets. */
+static inline int
+pkt_get_udp_port(const char *buf)
+{
+    struct ether_header *ethh;
+    struct ip *iph;
+    struct udphdr *udph;
+
+    ethh = (struct ether_header *)buf;
+    if (ethh->ether_type != htons(ETHERTYPE_IP)) {
+        /* Filter out non-IP traffic. */
+        return 0;
+    }
+    iph = (struct ip *)(ethh + 1);
+    if (iph->ip_p != IPPROTO_UDP) {
+        /* Filter out non-UDP traffic. */
+        return 0;
+    }
+    udph = (struct udphdr *)(iph + 1);
+
+    /* Return destination port. */
+    return ntohs(udph->uh_dport);
+}
+
+static inline int
+udp_port_match(const char *buf, unsigned len, int udp_port)
+{
+    struct ether_header *ethh;
+    struct ip *iph;
+    struct udphdr *udph;
+
+    ethh = (struct ether_header *)buf;
+    if (ethh->ether_type != htons(ETHERTYPE_IP)) {
+        /* Filter out non-IP traffic. */
+        return 0;
+    }
+    iph = (struct ip *)(ethh + 1);
+    if (iph->ip_p != IPPROTO_UDP) {
+        /* Filter out non-UDP traffic. */
+        return 0;
+    }
+    udph = (struct udphdr *)(iph + 1);
+
+    /* Match the destination port. */
+    if (udph->uh_dport == htons(udp_port)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Swap UDP source and destination ports. Returns 1 if a
+ * swap was performed, 0 otherwise. */
+static inline int
+pkt_udp_port_swap(char *buf)
+{
+    struct ether_header *ethh;
+    struct ip *iph;
+    struct udphdr *udph;
+    uint16_t tmp;
+
+    ethh = (struct ether_header *)buf;
+    if (ethh->ether_type != htons(ETHERTYPE_IP)) {
+        /* Filter out non-IP traffic. */
+        return 0;
+    }
+    iph = (struct ip *)(ethh + 1);
+    if (iph->ip_p != IPPROTO_UDP) {
+        /* Filter out non-UDP traffic. */
+        return 0;
+    }
+    udph           = (struct udphdr *)(iph + 1);
+    tmp            = udph->uh_sport;
+    udph->uh_sport = udph->uh_dport;
+    udph->uh_dport = tmp;
+
+    return 1;
+}
+
+/*
+ * Parsed headers of a packet, filled once by pkt_parse() so that the
+ * stages handling the packet after that read them here rather than in
+ * the packet. Unlike the functions above, the parser honours the IP
+ * header length and the frame length.
+ */
+#define PKT_META_IPV4 0x1 /* proto, saddr, daddr, l4_ofs and hash valid */
+#define PKT_META_L4 0x2   /* TCP or UDP, sport and dport are valid */
+#define PKT_META_UDP 0x4
+
+struct pkt_meta {
+    uint16_t len;   /* frame length */
+    uint8_t flags;  /* PKT_META_* */
+    uint8_t proto;  /* IP protocol */
+    uint8_t l3_ofs; /* IP header */
+    uint8_t l4_ofs; /* TCP or UDP header */
+    uint16_t sport; /* host byte order */
+    uint16_t dport; /* host byte order */
+    uint32_t saddr; /* network byte order */
+    uint32_t daddr; /* network byte order */
+    uint32_t hash;  /* flow hash, the same in both directions */
+};
+
+/* Hash of the 5-tuple, symmetric so that both directions of a flow (and
+ * a packet before and after pkt_meta_udp_swap()) get the same value:
+ * the two endpoints are ordered without branches, which would be
+ * mispredicted on mixed traffic, and mixed with 64-bit multiplies. */
+static inline uint32_t
+pkt_flow_hash(uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+              uint8_t proto)
+{
+    uint64_t a  = (uint64_t)saddr << 16 | sport;
+    uint64_t b  = (uint64_t)daddr << 16 | dport;
+    uint64_t lo = a < b ? a : b;
+    uint64_t hi = a < b ? b : a;
+    uint64_t h;
+
+    h = (lo ^ (uint64_t)proto << 48) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ hi) * 0xc2b2ae3d27d4eb4fULL;
+
+    return h >> 32;
+}
+
+/* Parse the headers of a frame of len bytes into m. */
+static inline void
+pkt_parse(const char *buf, unsigned len, struct pkt_meta *m)
+{
+    const struct ether_header *ethh = (const struct ether_header *)buf;
+    const struct ip *iph            = (const struct ip *)(ethh + 1);
+    const struct udphdr *udph;
+
+    m->len    = len;
+    m->flags  = 0;
+    m->l3_ofs = sizeof(*ethh);
+    m->hash   = 0;
+    if (len < sizeof(*ethh) + sizeof(*iph) ||
+        ethh->ether_type != htons(ETHERTYPE_IP) || iph->ip_v != 4 ||
+        iph->ip_hl < 5) {
+        return;
+    }
+    m->flags  = PKT_META_IPV4;
+    m->proto  = iph->ip_p;
+    m->saddr  = iph->ip_src.s_addr;
+    m->daddr  = iph->ip_dst.s_addr;
+    m->l4_ofs = m->l3_ofs + iph->ip_hl * 4;
+    m->sport  = 0;
+    m->dport  = 0;
+    if ((m->proto == IPPROTO_UDP || m->proto == IPPROTO_TCP) &&
+        m->l4_ofs + 4 <= len) {
+        /* The ports are at the same place in TCP and UDP. */
+        udph     = (const struct udphdr *)(buf + m->l4_ofs);
+        m->sport = ntohs(udph->uh_sport);
+        m->dport = ntohs(udph->uh_dport);
+        m->flags |= m->proto == IPPROTO_UDP ? PKT_META_L4 | PKT_META_UDP
+                                            : PKT_META_L4;
+    }
+    m->hash = pkt_flow_hash(m->saddr, m->daddr, m->sport, m->dport, m->proto);
+}
+
+/* pkt_get_udp_port() on parsed headers. */
+static inline int
+pkt_meta_udp_port(const struct pkt_meta *m)
+{
+    return (m->flags & PKT_META_UDP) ? m->dport : 0;
+}
+
+/* udp_port_match() on parsed headers. */
+static inline int
+pkt_meta_udp_match(const struct pkt_meta *m, int udp_port)
+{
+    return (m->flags & PKT_META_UDP) && m->dport == udp_port;
+}
+
+/* pkt_udp_port_swap() on parsed headers, which are kept up to date. */
+static inline int
+pkt_meta_udp_swap(char *buf, struct pkt_meta *m)
+{
+    struct udphdr *udph;
+    uint16_t tmp;
+
+    if (!(m->flags & PKT_META_UDP)) {
+        return 0;
+    }
+    udph           = (struct udphdr *)(buf + m->l4_ofs);
+    tmp            = udph->uh_sport;
+    udph->uh_sport = udph->uh_dport;
+    udph->uh_dport = tmp;
+    tmp            = m->sport;
+    m->sport       = m->dport;
+    m->dport       = tmp;
+
+    return 1;
+}
+
+/* Optional payload of the generated UDP packets, right after the UDP
+ * header, which lets receivers check ordering and latency. The sequence
+ * numbers are per flow, so that a receiver of only some of the flows
+ * still sees them in sequence. ts is a TSC value, comparable only on the
+ * same host. */
+#define PKT_STAMP_MAGIC 0x6e73 /* "ns" */
+#define PKT_STAMP_FLOWS 65536  /* flow indices fit in 16 bits */
+#define PKT_STAMP_OFS                                                          \
+    (sizeof(struct ether_header) + sizeof(struct ip) + sizeof(struct udphdr))
+
+struct pkt_stamp {
+    uint16_t magic; /* network byte order */
+    uint16_t flow;  /* network byte order, index of the flow at gen */
+    uint32_t seq;   /* network byte order, per flow */
+    uint64_t ts;
+} __attribute__((packed));
+
+/* Returns the stamp of a generated packet, or NULL if there is none. */
+static inline const struct pkt_stamp *
+pkt_get_stamp(const char *buf, unsigned len)
+{
+    const struct pkt_stamp *st;
+
+    if (len < PKT_STAMP_OFS + sizeof(*st) || !pkt_get_udp_port(buf)) {
+        return NULL;
+    }
+    st = (const struct pkt_stamp *)(buf + PKT_STAMP_OFS);
+
+    return st->magic == htons(PKT_STAMP_MAGIC) ? st : NULL;
+}
+
+#endif /* __PKT_H__ */
@@ -0,0 +1,320 @@
+/*
+ * This program measures the per-packet functions in pkt.h. Each function
+ * runs over a synthetic ring of packet buffers filled with a given mix of
+ * traffic; the cost is reported in TSC cycles per packet, together with
+ * the branch misses per packet counted with perf_event_open(). Thresholds
+ * can be given to turn the benchmark into a regression check.
+ *
+ * With -e, or -f for a tcpdump expression, an eBPF classifier (see
+ * ebpf.h) is measured as well, run by the interpreter and by the JIT
+ * over bursts of EBPF_BURST packets, as forward and sink run it, to
+ * compare it with pkt_select().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "pkt.h"
+#include "ebpf.h"
+#include "tsc.h"
+
+#define RING_SLOTS 1024
+#define BUF_SIZE 2048
+#define UDP_PORT 8000
+
+enum { MIX_MATCH, MIX_MISS, MIX_NONIP, MIX_RANDOM, MIX_MAX };
+
+static const char *mix_names[] = {"all-match", "all-miss", "non-ip",
+                                  "random"};
+
+static char *bufs;
+static volatile unsigned long long sink;
+static struct ebpf_prog *filter;
+static void *pkts[RING_SLOTS];
+static uint32_t lens[RING_SLOTS];
+
+static void
+build_udp(char *buf, uint16_t sport, uint16_t dport, uint8_t proto)
+{
+    struct ether_header *ethh = (struct ether_header *)buf;
+    struct ip *iph            = (struct ip *)(ethh + 1);
+    struct udphdr *udph       = (struct udphdr *)(iph + 1);
+
+    memset(buf, 0, 64);
+    ethh->ether_type = htons(ETHERTYPE_IP);
+    iph->ip_v        = 4;
+    iph->ip_hl       = 5;
+    iph->ip_p        = proto;
+    udph->uh_sport   = htons(sport);
+    udph->uh_dport   = htons(dport);
+}
+
+static void
+fill_ring(int mix)
+{
+    unsigned int i;
+
+    for (i = 0; i < RING_SLOTS; i++) {
+        char *buf = bufs + i * BUF_SIZE;
+
+        switch (mix) {
+        case MIX_MATCH:
+            build_udp(buf, 7000, UDP_PORT, IPPROTO_UDP);
+            break;
+        case MIX_MISS:
+            build_udp(buf, 7000, UDP_PORT + 1, IPPROTO_UDP);
+            break;
+        case MIX_NONIP:
+            memset(buf, 0, 64);
+            ((struct ether_header *)buf)->ether_type = htons(ETHERTYPE_ARP);
+            break;
+        case MIX_RANDOM:
+            switch (rand() % 4) {
+            case 0:
+                build_udp(buf, 7000, UDP_PORT, IPPROTO_UDP);
+                break;
+            case 1:
+                build_udp(buf, rand(), rand(), IPPROTO_UDP);
+                break;
+            case 2:
+                build_udp(buf, rand(), rand(), IPPROTO_TCP);
+                break;
+            default:
+                memset(buf, 0, 64);
+                ((struct ether_header *)buf)->ether_type =
+                    htons(ETHERTYPE_ARP);
+                break;
+            }
+            break;
+        }
+    }
+}
+
+static int
+perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_BRANCH_MISSES;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#define BENCH_LOOP(expr)                                                       \
+    do {                                                                       \
+        unsigned int r, i;                                                     \
+        for (r = 0; r < rounds; r++) {                                         \
+            for (i = 0; i < RING_SLOTS; i++) {                                 \
+                char *buf = bufs + i * BUF_SIZE;                               \
+                acc += (expr);                                                 \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+static unsigned long long
+run_ebpf(int jit, unsigned int rounds)
+{
+    unsigned long long acc = 0;
+    uint32_t verdict[EBPF_BURST];
+    unsigned int r, i, k;
+
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < RING_SLOTS; i += EBPF_BURST) {
+            if (jit) {
+                filter->jitted(pkts + i, lens + i, verdict, EBPF_BURST);
+            } else {
+                ebpf_interp(filter, pkts + i, lens + i, verdict, EBPF_BURST);
+            }
+            for (k = 0; k < EBPF_BURST; k++) {
+                acc += verdict[k] != EBPF_DROP;
+            }
+        }
+    }
+
+    return acc;
+}
+
+static void
+run_fn(int fn, unsigned int rounds)
+{
+    unsigned long long acc = 0;
+    struct pkt_meta meta;
+
+    switch (fn) {
+    case 0:
+        BENCH_LOOP(pkt_select(buf, UDP_PORT));
+        break;
+    case 1:
+        BENCH_LOOP(pkt_get_udp_port(buf));
+        break;
+    case 2:
+        BENCH_LOOP(udp_port_match(buf, 60, UDP_PORT));
+        break;
+    case 3:
+        BENCH_LOOP(pkt_udp_port_swap(buf));
+        break;
+    case 4:
+        BENCH_LOOP((pkt_parse(buf, 60, &meta), meta.hash));
+        break;
+    case 5:
+    case 6:
+        acc = run_ebpf(fn == 6, rounds);
+        break;
+    }
+    sink += acc;
+}
+
+static const char *fn_names[] = {"pkt_select",         "pkt_get_udp_port",
+                                 "udp_port_match",     "pkt_udp_port_swap",
+                                 "pkt_parse",          "ebpf (interpreter)",
+                                 "ebpf (JIT)"};
+
+static void
+usage(char **argv)
+{
+    printf("usage: %s [-h] [-r ROUNDS] [-c MAX_CYCLES_PER_PKT] "
+           "[-b MAX_BRANCH_MISSES_PER_PKT] [-e FILE[:SECTION]] "
+           "[-f EXPR|@FILE]\n",
+           argv[0]);
+    exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int rounds = 10000;
+    double max_cycles   = 0;
+    double max_misses   = 0;
+    int failed          = 0;
+    int nfns            = 5;
+    char errbuf[CBPF_ERRBUF_SIZE];
+    int perf_fd;
+    int opt;
+    int fn, mix;
+
+    while ((opt = getopt(argc, argv, "hr:c:b:e:f:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage(argv);
+            return 0;
+
+        case 'r':
+            rounds = atoi(optarg);
+            if (rounds == 0) {
+                printf("    invalid number of rounds %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'c':
+            max_cycles = atof(optarg);
+            break;
+
+        case 'b':
+            max_misses = atof(optarg);
+            break;
+
+        case 'e':
+            filter = ebpf_open(optarg);
+            if (filter == NULL) {
+                printf("    failed to load %s: %s\n", optarg,
+                       strerror(errno));
+                usage(argv);
+            }
+            nfns = filter->jitted ? 7 : 6;
+            break;
+
+        case 'f':
+            filter = cbpf_compile(optarg, errbuf);
+            if (filter == NULL) {
+                printf("    invalid filter '%s': %s\n", optarg, errbuf);
+                usage(argv);
+            }
+            nfns = filter->jitted ? 7 : 6;
+            break;
+
+        default:
+            printf("    unrecognized option '-%c'\n", opt);
+            usage(argv);
+            return -1;
+        }
+    }
+
+    bufs = aligned_alloc(64, RING_SLOTS * BUF_SIZE);
+    if (bufs == NULL) {
+        printf("Failed to allocate the ring buffers\n");
+        return -1;
+    }
+    perf_fd = perf_open();
+    if (perf_fd < 0) {
+        printf("perf_event_open(): %s, branch misses not available\n",
+               strerror(errno));
+    }
+    for (fn = 0; fn < RING_SLOTS; fn++) {
+        pkts[fn] = bufs + fn * BUF_SIZE;
+        lens[fn] = 60;
+    }
+    srand(1);
+
+    printf("%-18s %-10s %10s %14s\n", "function", "mix", "cycles/pkt",
+           "br-misses/pkt");
+    for (fn = 0; fn < nfns; fn++) {
+        for (mix = 0; mix < MIX_MAX; mix++) {
+            double npkts = (double)rounds * RING_SLOTS;
+            long long misses = 0;
+            double cycles, mpp;
+            uint64_t t0;
+
+            fill_ring(mix);
+            run_fn(fn, 1); /* warm up the caches */
+            if (perf_fd >= 0) {
+                ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+            t0 = rdtsc();
+            run_fn(fn, rounds);
+            cycles = (rdtsc() - t0) / npkts;
+            if (perf_fd >= 0) {
+                ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(perf_fd, &misses, sizeof(misses)) !=
+                    sizeof(misses)) {
+                    misses = 0;
+                }
+            }
+            mpp = misses / npkts;
+
+            printf("%-18s %-10s %10.2f ", fn_names[fn], mix_names[mix],
+                   cycles);
+            if (perf_fd >= 0) {
+                printf("%14.4f", mpp);
+            } else {
+                printf("%14s", "n/a");
+            }
+            if ((max_cycles > 0 && cycles > max_cycles) ||
+                (perf_fd >= 0 && max_misses > 0 && mpp > max_misses)) {
+                printf("  REGRESSION");
+                failed = 1;
+            }
+            printf("\n");
+        }
+    }
+
+    if (perf_fd >= 0) {
+        close(perf_fd);
+    }
+    free(bufs);
+    ebpf_free(filter);
+
+    return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,514 @@
+/*
+ * Backend independent part of the packet I/O layer: port lookup by
+ * name prefix and the poll() wrapper that synchronizes the rings.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include "pktio.h"
+
+#define PIO_POLL_MAX 16
+
+static const struct pio_ops *pio_backends[] = {
+    &pio_afpacket_ops,
+    &pio_xdp_ops,
+    &pio_mem_ops,
+#ifndef PIO_NO_NETMAP
+    &pio_netmap_ops, /* default, must be the last one */
+#endif
+};
+
+struct pio_port *
+pio_open(const char *ifname, const struct pio_port *parent)
+{
+    return pio_open_extra(ifname, parent, 0);
+}
+
+/* Open a port asking the backend for nextra buffers besides the ones of
+ * the rings. port->nextra tells how many were obtained, 0 with the
+ * backends that have none. */
+struct pio_port *
+pio_open_extra(const char *ifname, const struct pio_port *parent,
+               unsigned int nextra)
+{
+    const struct pio_ops *ops = NULL;
+    struct pio_port *port;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(pio_backends) / sizeof(pio_backends[0]); i++) {
+        const char *prefix = pio_backends[i]->prefix;
+
+        if (prefix == NULL || !strncmp(ifname, prefix, strlen(prefix))) {
+            ops = pio_backends[i];
+            break;
+        }
+    }
+    if (ops == NULL) {
+        errno = 0; /* not a port we know about */
+        return NULL;
+    }
+
+    port = calloc(1, sizeof(*port));
+    if (port == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    port->ops    = ops;
+    port->fd     = -1;
+    port->nextra = nextra; /* the request, for the backend */
+    snprintf(port->name, sizeof(port->name), "%s", ifname);
+    if (parent && parent->ops != ops) {
+        parent = NULL; /* memory can only be shared within a backend */
+    }
+    if (ops->open(port, ifname + (ops->prefix ? strlen(ops->prefix) : 0),
+                  parent)) {
+        int err = errno;
+
+        free(port);
+        errno = err;
+        return NULL;
+    }
+    if (port->extra_head == 0) {
+        port->nextra = 0; /* none given */
+    }
+
+    return port;
+}
+
+/* Take up to n extra buffers off the list of port, returns how many. */
+unsigned int
+pio_extra_take(struct pio_port *port, uint32_t *idx, unsigned int n)
+{
+    const struct pio_ring *ring = port->rx[port->first_rx_ring];
+    unsigned int i;
+
+    for (i = 0; i < n && port->extra_head; i++) {
+        idx[i]           = port->extra_head;
+        port->extra_head = *(uint32_t *)PIO_BUF(ring, idx[i]);
+    }
+
+    return i;
+}
+
+/* Put n buffers of the memory of port on its list of extra buffers. All
+ * the buffers taken must be given back before pio_close(), though not
+ * necessarily the same ones. */
+void
+pio_extra_give(struct pio_port *port, const uint32_t *idx, unsigned int n)
+{
+    const struct pio_ring *ring = port->rx[port->first_rx_ring];
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        *(uint32_t *)PIO_BUF(ring, idx[i]) = port->extra_head;
+        port->extra_head                   = idx[i];
+    }
+}
+
+/* Open the host rings of a port (NAME^), sharing its memory so that
+ * buffers can be swapped between them. */
+struct pio_port *
+pio_open_host(const struct pio_port *port)
+{
+    char name[PIO_NAME_MAX];
+
+    if (snprintf(name, sizeof(name), "%s^", port->name) >= sizeof(name)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    return pio_open(name, port);
+}
+
+void
+pio_close(struct pio_port *port)
+{
+    port->ops->push(port); /* flush the TX slots held back */
+    port->ops->close(port);
+    free(port);
+}
+
+/* Refresh the tails of a port, and the RX bitmap with them. */
+int
+pio_pull(struct pio_port *port)
+{
+    unsigned int ri;
+    int ret;
+
+    ret = port->ops->pull(port);
+    for (ri = port->first_rx_ring; ri <= port->last_rx_ring; ri++) {
+        pio_rx_update(port, ri);
+    }
+
+    return ret;
+}
+
+/* The events of a port that its rings satisfy right now. */
+short
+pio_revents(const struct pio_port *port, short events)
+{
+    short revents = 0;
+    unsigned int i;
+
+    if (events & POLLIN) {
+        for (i = port->first_rx_ring; i <= port->last_rx_ring; i++) {
+            if (pio_ring_space(port->rx[i])) {
+                revents |= POLLIN;
+                break;
+            }
+        }
+    }
+    if (events & POLLOUT) {
+        for (i = port->first_tx_ring; i <= port->last_tx_ring; i++) {
+            if (pio_ring_space(port->tx[i])) {
+                revents |= POLLOUT;
+                break;
+            }
+        }
+    }
+
+    return revents;
+}
+
+static long long
+pio_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Parse BATCH[:DELAY_US], the default delay being 20 us. */
+int
+pio_txflush_parse(struct pio_txflush *tf, const char *s)
+{
+    char *end;
+
+    memset(tf, 0, sizeof(*tf));
+    tf->batch    = strtoul(s, &end, 10);
+    tf->delay_us = 20;
+    if (*end == ':') {
+        tf->delay_us = strtoul(end + 1, &end, 10);
+    }
+    if (*end != '\0' || tf->batch == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+pio_set_txflush(struct pio_port *port, struct pio_txflush *tf)
+{
+    unsigned int i;
+
+    for (i = port->first_tx_ring; i <= port->last_tx_ring; i++) {
+        port->tx[i]->flushed = port->tx[i]->head;
+    }
+    port->txflush  = tf;
+    port->tx_since = 0;
+}
+
+/* Make the next pio_poll() on port return within ns, e.g. when a shaper
+ * lets TX go on again. */
+void
+pio_wake_in(struct pio_port *port, long long ns)
+{
+    port->wake_at = pio_nsecs() + ns;
+}
+
+/*
+ * Hand the released slots of a port to the backend, applying its TX
+ * coalescing policy. Returns the time by which the TX slots held back
+ * must be flushed, 0 if none are.
+ */
+static long long
+pio_push(struct pio_port *port)
+{
+    struct pio_txflush *tf = port->txflush;
+    uint32_t head[PIO_MAX_RINGS + 1];
+    unsigned int pending = 0;
+    int full             = 0;
+    long long now;
+    unsigned int i;
+
+    if (tf == NULL) {
+        port->ops->push(port);
+        return 0;
+    }
+
+    for (i = port->first_tx_ring; i <= port->last_tx_ring; i++) {
+        struct pio_ring *ring = port->tx[i];
+
+        pending += (ring->head + ring->num_slots - ring->flushed) %
+                   ring->num_slots;
+        full |= !pio_ring_space(ring);
+    }
+    if (pending == 0) {
+        port->ops->push(port);
+        port->tx_since = 0;
+        return 0;
+    }
+
+    now = pio_nsecs();
+    if (port->tx_since == 0) {
+        port->tx_since = now;
+    }
+    if (pending >= tf->batch || full) {
+        tf->by_batch++;
+    } else if (now - port->tx_since >= tf->delay_us * 1000LL) {
+        tf->by_deadline++;
+    } else {
+        /* Release the RX slots only, hiding the new TX ones. */
+        for (i = port->first_tx_ring; i <= port->last_tx_ring; i++) {
+            struct pio_ring *ring = port->tx[i];
+
+            head[i]    = ring->head;
+            ring->head = ring->cur = ring->flushed;
+        }
+        port->ops->push(port);
+        for (i = port->first_tx_ring; i <= port->last_tx_ring; i++) {
+            port->tx[i]->head = port->tx[i]->cur = head[i];
+        }
+        tf->deferred++;
+        return port->tx_since + tf->delay_us * 1000LL;
+    }
+
+    port->ops->push(port);
+    for (i = port->first_tx_ring; i <= port->last_tx_ring; i++) {
+        port->tx[i]->flushed = port->tx[i]->head;
+    }
+    port->tx_since = 0;
+
+    return 0;
+}
+
+/*
+ * Same semantics as poll(), applied to ports. Released slots are handed
+ * to the backends before waiting and the ring tails are refreshed after
+ * waking up. Ports without a file descriptor are busy-polled. When TX
+ * slots are held back, the wait ends in time to flush them, and it ends
+ * by the wake_at of the ports if set (it is reset for the next call).
+ */
+int
+pio_poll(struct pio_pollfd *pfd, unsigned int n, int timeout)
+{
+    struct pollfd fds[PIO_POLL_MAX];
+    long long wait_ns  = timeout < 0 ? -1 : timeout * 1000000LL;
+    long long wake_at  = 0;
+    long long deadline = 0;
+    struct timespec ts;
+    unsigned int i;
+    int busy = 0;
+
+    if (n > PIO_POLL_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        long long t = pio_push(pfd[i].port);
+
+        if (t && (!wake_at || t < wake_at)) {
+            wake_at = t;
+        }
+        t                    = pfd[i].port->wake_at;
+        pfd[i].port->wake_at = 0;
+        if (t && (!wake_at || t < wake_at)) {
+            wake_at = t;
+        }
+        fds[i].fd      = pfd[i].port->fd;
+        fds[i].events  = pfd[i].events;
+        fds[i].revents = 0;
+        if (fds[i].fd < 0) {
+            busy = 1;
+        }
+    }
+    if (wake_at) {
+        long long left = wake_at - pio_nsecs();
+
+        if (left < 0) {
+            left = 0;
+        }
+        if (wait_ns < 0 || left < wait_ns) {
+            wait_ns = left;
+        }
+    }
+    if (busy && wait_ns > 0) {
+        deadline = pio_nsecs() + wait_ns;
+    }
+    ts.tv_sec  = busy ? 0 : wait_ns / 1000000000LL;
+    ts.tv_nsec = busy ? 0 : wait_ns % 1000000000LL;
+
+    for (;;) {
+        int ready = 0;
+        int ret;
+
+        ret = ppoll(fds, n, busy || wait_ns >= 0 ? &ts : NULL, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        for (i = 0; i < n; i++) {
+            struct pio_port *port = pfd[i].port;
+
+            pio_pull(port);
+            pfd[i].revents = fds[i].revents;
+            if (port->fd < 0) {
+                pfd[i].revents = pio_revents(port, pfd[i].events);
+            }
+            if (pfd[i].revents) {
+                ready++;
+            }
+        }
+        if (ready || !busy || wait_ns == 0 ||
+            (wait_ns > 0 && pio_nsecs() >= deadline)) {
+            return ready;
+        }
+        sched_yield();
+    }
+}
+
+/* Parse TARGET[:MAX_US], the default budget being 50 us. */
+int
+pio_wakeup_parse(struct pio_wakeup *w, const char *s)
+{
+    char *end;
+
+    memset(w, 0, sizeof(*w));
+    w->target = strtoul(s, &end, 10);
+    w->max_us = 50;
+    if (*end == ':') {
+        w->max_us = strtoul(end + 1, &end, 10);
+    }
+    if (*end != '\0' || w->target == 0 || w->max_us == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The default timer slack (50 us) would swamp short hold-offs: lower it
+ * for the calling thread. */
+int
+pio_wakeup_start(const struct pio_wakeup *w)
+{
+    if (w == NULL) {
+        return 0;
+    }
+    return prctl(PR_SET_TIMERSLACK, 1000UL, 0, 0, 0);
+}
+
+/* Work waiting in the directions the caller is waiting for: the RX
+ * slots to be processed, and the TX slots not transmitted yet. Free TX
+ * slots are no work, counting them would never hold a wakeup back. */
+static unsigned int
+pio_pending(const struct pio_pollfd *pfd, unsigned int n)
+{
+    unsigned int pending = 0;
+    unsigned int i, ri;
+
+    for (i = 0; i < n; i++) {
+        const struct pio_port *port = pfd[i].port;
+
+        if (pfd[i].revents & POLLIN) {
+            for (ri = port->first_rx_ring; ri <= port->last_rx_ring; ri++) {
+                pending += pio_ring_space(port->rx[ri]);
+            }
+        }
+        if (pfd[i].revents & POLLOUT) {
+            for (ri = port->first_tx_ring; ri <= port->last_tx_ring; ri++) {
+                const struct pio_ring *ring = port->tx[ri];
+                int busy = (int)ring->head - (int)ring->tail - 1;
+
+                /* tail up to head, minus the slot kept empty. */
+                if (busy < 0) {
+                    busy += ring->num_slots;
+                }
+                pending += busy;
+            }
+        }
+    }
+
+    return pending;
+}
+
+/*
+ * pio_poll() that holds small wakeups back for a while, so that more
+ * slots are processed per wakeup. A NULL w is plain pio_poll().
+ */
+int
+pio_poll_moderated(struct pio_pollfd *pfd, unsigned int n, int timeout,
+                   struct pio_wakeup *w)
+{
+    unsigned int pending;
+    long long waited = 0;
+    int ret;
+
+    ret = pio_poll(pfd, n, timeout);
+    if (ret <= 0 || w == NULL) {
+        return ret;
+    }
+
+    pending = pio_pending(pfd, n);
+    if (pending < w->target && w->holdoff_us > 0) {
+        struct timespec ts = {0, w->holdoff_us * 1000};
+        long long t0       = pio_nsecs();
+
+        nanosleep(&ts, NULL);
+        /* A non-blocking poll refreshes the tails (netmap only updates
+         * them in the system call). */
+        pio_poll(pfd, n, 0);
+        waited  = pio_nsecs() - t0;
+        pending = pio_pending(pfd, n);
+    }
+
+    if (waited > w->max_us * 1000LL || pending >= 2 * w->target) {
+        w->holdoff_us /= 2;
+    } else if (pending < w->target && w->holdoff_us < w->max_us) {
+        w->holdoff_us++;
+    }
+    w->wakeups++;
+    w->slots += pending;
+
+    return ret;
+}
+
+struct pio_ring *
+pio_ring_alloc(uint32_t num_slots, int alloc_slots)
+{
+    struct pio_ring *ring;
+
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->num_slots = num_slots;
+    if (alloc_slots) {
+        ring->slot = calloc(num_slots, sizeof(ring->slot[0]));
+        if (ring->slot == NULL) {
+            free(ring);
+            return NULL;
+        }
+        ring->flags |= PIO_RING_OWN_SLOTS;
+    }
+
+    return ring;
+}
+
+void
+pio_ring_free(struct pio_ring *ring)
+{
+    if (ring && (ring->flags & PIO_RING_OWN_SLOTS)) {
+        free(ring->slot);
+    }
+    free(ring);
+}
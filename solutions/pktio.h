@@ -0,0 +1,232 @@
+/*
+ * Thin packet I/O layer used by the programs in this directory.
+ *
+ * A port exposes netmap-like RX and TX rings. Each ring is an array of
+ * slots (buffer index + length); the program owns the slots between
+ * head and tail, exactly as with netmap, and the backend moves them
+ * to/from the wire when pio_poll() is called. The backend is selected
+ * by the prefix of the port name:
+ *
+ *   netmap:IF, vale*    netmap (zero-copy between ports sharing memory)
+ *   afpacket:IF         AF_PACKET socket with TPACKET_V3 mmap'd rings
+ *   xdp:IF[@QUEUE]      AF_XDP socket over a private UMEM
+ *   mem:NAME{ID         the two ends of a shared-memory pipe
+ *   mem:NAME}ID
+ *   mem:NAME            shared-memory loopback (TX comes back on RX)
+ *
+ * The hot path only uses the inline helpers below, so it costs the same
+ * as the raw netmap API.
+ */
+#ifndef __PKTIO_H__
+#define __PKTIO_H__
+
+#include <stdint.h>
+#include <poll.h>
+
+#define PIO_MAX_RINGS 64
+#define PIO_NAME_MAX 64
+#define PIO_RXMAP_WORDS ((PIO_MAX_RINGS + 64) / 64)
+
+/* Slot flags. The values match the netmap ones. */
+#define PIO_BUF_CHANGED 0x0001 /* buf_idx was changed by the program */
+
+struct pio_slot {
+    uint32_t buf_idx;
+    uint16_t len;
+    uint16_t flags;
+    uint64_t ptr; /* reserved to the backend */
+};
+
+struct pio_ring {
+    uint32_t head;
+    uint32_t cur;
+    uint32_t tail;
+    uint32_t num_slots;
+    char *buf_base;
+    uint32_t buf_size;
+    uint32_t flags;
+    struct pio_slot *slot;
+    void *priv;       /* backend state for this ring */
+    uint32_t flushed; /* TX: head when last handed to the backend */
+};
+
+#define PIO_RING_OWN_SLOTS 0x1 /* slot array allocated by pio_ring_alloc() */
+
+struct pio_port;
+
+/*
+ * TX coalescing. The TX slots released by the program are handed to the
+ * backend (and thus synced) only once batch of them are pending or the
+ * oldest one has waited delay_us, whichever comes first; RX slots are
+ * always released at once. Several ports can share the same policy and
+ * counters.
+ */
+struct pio_txflush {
+    unsigned int batch;
+    unsigned int delay_us;
+    unsigned long long by_batch;    /* flushes of batch slots or more */
+    unsigned long long by_deadline; /* flushes after delay_us */
+    unsigned long long deferred;    /* pio_poll() calls holding TX back */
+};
+
+struct pio_ops {
+    const char *prefix; /* NULL for the default backend */
+    int (*open)(struct pio_port *port, const char *ifname,
+                const struct pio_port *parent);
+    void (*close)(struct pio_port *port);
+    /* Hand the slots released by the program over to the backend. */
+    int (*push)(struct pio_port *port);
+    /* Refresh the tail of all the rings. */
+    int (*pull)(struct pio_port *port);
+    /* Start transmitting the pushed slots when not waiting in poll(),
+     * NULL if push already does it. */
+    int (*kick)(struct pio_port *port);
+};
+
+struct pio_port {
+    const struct pio_ops *ops;
+    char name[PIO_NAME_MAX];
+    int fd; /* -1 if the port cannot be waited on with poll() */
+    unsigned int first_rx_ring, last_rx_ring;
+    unsigned int first_tx_ring, last_tx_ring;
+    struct pio_ring *rx[PIO_MAX_RINGS + 1];
+    struct pio_ring *tx[PIO_MAX_RINGS + 1];
+    const void *mem; /* ports with the same mem can swap buffers, NULL never */
+    void *priv;
+    /* Bitmap of the RX rings with slots to read, refreshed with the
+     * tails and kept up to date by the program with pio_rx_update(). */
+    uint64_t rx_pending[PIO_RXMAP_WORDS];
+    struct pio_txflush *txflush; /* NULL to flush at every pio_poll() */
+    long long tx_since;          /* when TX slots were first held back */
+    long long wake_at; /* pio_nsecs() by which the next pio_poll() ends */
+    /* Extra buffers asked for with pio_open_extra() (netmap only): they
+     * belong to mem but to no ring, and are chained through their first
+     * 4 bytes from extra_head, 0 ending the list. */
+    unsigned int nextra;
+    uint32_t extra_head;
+};
+
+struct pio_pollfd {
+    struct pio_port *port;
+    short events;
+    short revents;
+};
+
+#define PIO_RXRING(port, index) ((port)->rx[index])
+#define PIO_TXRING(port, index) ((port)->tx[index])
+#define PIO_BUF(ring, index)                                                   \
+    ((ring)->buf_base + (uint64_t)(index) * (ring)->buf_size)
+
+static inline uint32_t
+pio_ring_next(const struct pio_ring *ring, uint32_t i)
+{
+    return (i + 1 == ring->num_slots ? 0 : i + 1);
+}
+
+/* Can buffers move from a to b by swapping indices, with no copy? */
+static inline int
+pio_same_mem(const struct pio_port *a, const struct pio_port *b)
+{
+    return a->mem != NULL && a->mem == b->mem;
+}
+
+static inline uint32_t
+pio_ring_space(const struct pio_ring *ring)
+{
+    int ret = ring->tail - ring->cur;
+
+    if (ret < 0) {
+        ret += ring->num_slots;
+    }
+    return ret;
+}
+
+/*
+ * Wakeup moderation for pio_poll_moderated(). When a wakeup finds fewer
+ * than target slots to work on (RX slots for POLLIN, TX space for
+ * POLLOUT), the caller sleeps holdoff_us more before processing them.
+ * The hold-off follows an AIMD controller: it grows by one microsecond
+ * while the wakeups stay small, and is halved when a wakeup finds twice
+ * the target or when the wait exceeds max_us, the latency budget.
+ */
+struct pio_wakeup {
+    unsigned int target;
+    unsigned int max_us;
+    unsigned long long holdoff_us;
+    unsigned long long wakeups; /* wakeups with something to do */
+    unsigned long long slots;   /* slots found by those wakeups */
+};
+
+/* Does the port have slots to read on any RX ring? */
+static inline int
+pio_rx_ready(const struct pio_port *port)
+{
+    uint64_t any = 0;
+    unsigned int w;
+
+    for (w = 0; w < PIO_RXMAP_WORDS; w++) {
+        any |= port->rx_pending[w];
+    }
+    return any != 0;
+}
+
+/* The first RX ring from ri on with slots to read, or last_rx_ring + 1. */
+static inline unsigned int
+pio_rx_next(const struct pio_port *port, unsigned int ri)
+{
+    for (; ri <= port->last_rx_ring; ri = (ri | 63) + 1) {
+        uint64_t m = port->rx_pending[ri / 64] >> (ri % 64);
+
+        if (m) {
+            return ri + __builtin_ctzll(m);
+        }
+    }
+    return port->last_rx_ring + 1;
+}
+
+/* To be called after moving the head of RX ring ri. */
+static inline void
+pio_rx_update(struct pio_port *port, unsigned int ri)
+{
+    const struct pio_ring *ring = port->rx[ri];
+    uint64_t bit                = 1ULL << (ri % 64);
+
+    if (ring->head == ring->tail) {
+        port->rx_pending[ri / 64] &= ~bit;
+    } else {
+        port->rx_pending[ri / 64] |= bit;
+    }
+}
+
+struct pio_port *pio_open(const char *ifname, const struct pio_port *parent);
+struct pio_port *pio_open_extra(const char *ifname,
+                                const struct pio_port *parent,
+                                unsigned int nextra);
+unsigned int pio_extra_take(struct pio_port *port, uint32_t *idx,
+                            unsigned int n);
+void pio_extra_give(struct pio_port *port, const uint32_t *idx,
+                    unsigned int n);
+struct pio_port *pio_open_host(const struct pio_port *port);
+void pio_close(struct pio_port *port);
+int pio_poll(struct pio_pollfd *pfd, unsigned int n, int timeout);
+short pio_revents(const struct pio_port *port, short events);
+int pio_pull(struct pio_port *port);
+int pio_txflush_parse(struct pio_txflush *tf, const char *s);
+void pio_set_txflush(struct pio_port *port, struct pio_txflush *tf);
+void pio_wake_in(struct pio_port *port, long long ns);
+int pio_wakeup_parse(struct pio_wakeup *w, const char *s);
+/* To be called by the thread of pio_poll_moderated(), before it. */
+int pio_wakeup_start(const struct pio_wakeup *w);
+int pio_poll_moderated(struct pio_pollfd *pfd, unsigned int n, int timeout,
+                       struct pio_wakeup *w);
+
+/* Helpers for the backends. */
+struct pio_ring *pio_ring_alloc(uint32_t num_slots, int alloc_slots);
+void pio_ring_free(struct pio_ring *ring);
+
+extern const struct pio_ops pio_netmap_ops;
+extern const struct pio_ops pio_afpacket_ops;
+extern const struct pio_ops pio_xdp_ops;
+extern const struct pio_ops pio_mem_ops;
+
+#endif /* __PKTIO_H__ */
@@ -0,0 +1,278 @@
+/*
+ * AF_PACKET backend using TPACKET_V3 mmap'd rings.
+ *
+ * The kernel fills RX blocks of variable length frames; each ready block
+ * is translated into a run of slots pointing into the mmap'd area, and
+ * the block is given back to the kernel once the program has released
+ * all of its slots. TX uses fixed size frames, one per slot. Buffer
+ * indices are byte offsets from the start of the mapping (buf_size 1).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include "pktio.h"
+
+#define AFP_BLOCK_SIZE (1 << 18)
+#define AFP_RX_BLOCKS 64
+#define AFP_TX_BLOCKS 16
+#define AFP_FRAME_SIZE 2048
+#define AFP_RX_SLOTS 8192 /* more than the frames fitting in a block */
+#define AFP_TX_FRAMES (AFP_TX_BLOCKS * AFP_BLOCK_SIZE / AFP_FRAME_SIZE)
+#define AFP_TX_DATA TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct afp_port {
+    char *map;
+    size_t map_size;
+    unsigned int rx_next; /* next block to be handed to the program */
+    unsigned int rx_held; /* oldest block held by the program */
+    unsigned int nheld;
+    uint32_t blk_end[AFP_RX_BLOCKS]; /* slot after the last one of a block */
+    uint32_t rx_released;            /* slot up to which blocks were freed */
+    uint32_t tx_pushed;
+    uint32_t tx_done;
+};
+
+static inline struct tpacket_block_desc *
+afp_rx_block(struct afp_port *ap, unsigned int i)
+{
+    return (struct tpacket_block_desc *)(ap->map + i * AFP_BLOCK_SIZE);
+}
+
+static inline struct tpacket3_hdr *
+afp_tx_frame(struct afp_port *ap, unsigned int i)
+{
+    return (struct tpacket3_hdr *)(ap->map +
+                                   AFP_RX_BLOCKS * AFP_BLOCK_SIZE +
+                                   i * AFP_FRAME_SIZE);
+}
+
+static void
+afp_close(struct pio_port *port)
+{
+    struct afp_port *ap = port->priv;
+
+    pio_ring_free(port->rx[0]);
+    pio_ring_free(port->tx[0]);
+    if (ap && ap->map) {
+        munmap(ap->map, ap->map_size);
+    }
+    if (port->fd >= 0) {
+        close(port->fd);
+    }
+    free(ap);
+}
+
+static int
+afp_open(struct pio_port *port, const char *ifname,
+         const struct pio_port *parent)
+{
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    struct afp_port *ap;
+    int ver = TPACKET_V3;
+    int one = 1;
+    uint32_t i;
+
+    ap = calloc(1, sizeof(*ap));
+    if (ap == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    port->priv = ap;
+
+    port->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (port->fd < 0) {
+        goto err;
+    }
+    if (setsockopt(port->fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver))) {
+        goto err;
+    }
+    /* Do not receive what we transmit, and skip the qdisc on TX. These
+     * are optimizations, so failures are not fatal. */
+    setsockopt(port->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+               sizeof(one));
+    setsockopt(port->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size       = AFP_BLOCK_SIZE;
+    req.tp_block_nr         = AFP_RX_BLOCKS;
+    req.tp_frame_size       = AFP_FRAME_SIZE;
+    req.tp_frame_nr         = AFP_RX_BLOCKS * AFP_BLOCK_SIZE / AFP_FRAME_SIZE;
+    req.tp_retire_blk_tov   = 1; /* milliseconds */
+    req.tp_feature_req_word = 0;
+    if (setsockopt(port->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+        goto err;
+    }
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = AFP_BLOCK_SIZE;
+    req.tp_block_nr   = AFP_TX_BLOCKS;
+    req.tp_frame_size = AFP_FRAME_SIZE;
+    req.tp_frame_nr   = AFP_TX_FRAMES;
+    if (setsockopt(port->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req))) {
+        goto err;
+    }
+
+    ap->map_size = (size_t)(AFP_RX_BLOCKS + AFP_TX_BLOCKS) * AFP_BLOCK_SIZE;
+    ap->map = mmap(NULL, ap->map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_LOCKED, port->fd, 0);
+    if (ap->map == MAP_FAILED) {
+        /* Retry without locking the pages in memory. */
+        ap->map = mmap(NULL, ap->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       port->fd, 0);
+        if (ap->map == MAP_FAILED) {
+            ap->map = NULL;
+            goto err;
+        }
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = if_nametoindex(ifname);
+    if (sll.sll_ifindex == 0) {
+        goto err;
+    }
+    if (bind(port->fd, (struct sockaddr *)&sll, sizeof(sll))) {
+        goto err;
+    }
+
+    port->rx[0] = pio_ring_alloc(AFP_RX_SLOTS, 1);
+    port->tx[0] = pio_ring_alloc(AFP_TX_FRAMES, 1);
+    if (port->rx[0] == NULL || port->tx[0] == NULL) {
+        errno = ENOMEM;
+        goto err;
+    }
+    port->rx[0]->buf_base = port->tx[0]->buf_base = ap->map;
+    port->rx[0]->buf_size = port->tx[0]->buf_size = 1;
+    for (i = 0; i < AFP_TX_FRAMES; i++) {
+        port->tx[0]->slot[i].buf_idx =
+            (char *)afp_tx_frame(ap, i) + AFP_TX_DATA - ap->map;
+    }
+    /* No buffer swaps: the TX frames are fixed, each slot sends its own
+     * frame whatever buf_idx says. */
+    port->tx[0]->tail = AFP_TX_FRAMES - 1;
+    port->mem         = NULL;
+
+    return 0;
+err:
+    {
+        int err = errno;
+
+        afp_close(port);
+        errno = err;
+    }
+    return -1;
+}
+
+static int
+afp_push(struct pio_port *port)
+{
+    struct afp_port *ap    = port->priv;
+    struct pio_ring *rx    = port->rx[0];
+    struct pio_ring *tx    = port->tx[0];
+    uint32_t consumed      = (rx->head + rx->num_slots - ap->rx_released) %
+                        rx->num_slots;
+    int kick = 0;
+
+    /* Give back the RX blocks whose slots have all been released. */
+    while (ap->nheld) {
+        uint32_t end = ap->blk_end[ap->rx_held];
+        uint32_t len = (end + rx->num_slots - ap->rx_released) % rx->num_slots;
+
+        if (len > consumed) {
+            break;
+        }
+        consumed -= len;
+        ap->rx_released = end;
+        __atomic_store_n(&afp_rx_block(ap, ap->rx_held)->hdr.bh1.block_status,
+                         TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        ap->rx_held = (ap->rx_held + 1) % AFP_RX_BLOCKS;
+        ap->nheld--;
+    }
+
+    /* Mark the new TX frames as ready to be sent. */
+    for (; ap->tx_pushed != tx->head;
+         ap->tx_pushed = pio_ring_next(tx, ap->tx_pushed)) {
+        struct tpacket3_hdr *hdr = afp_tx_frame(ap, ap->tx_pushed);
+
+        hdr->tp_len         = tx->slot[ap->tx_pushed].len;
+        hdr->tp_snaplen     = tx->slot[ap->tx_pushed].len;
+        hdr->tp_next_offset = 0;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
+        kick = 1;
+    }
+    if (kick) {
+        sendto(port->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+
+    return 0;
+}
+
+static int
+afp_pull(struct pio_port *port)
+{
+    struct afp_port *ap = port->priv;
+    struct pio_ring *rx = port->rx[0];
+    struct pio_ring *tx = port->tx[0];
+
+    /* Translate the ready RX blocks into slots, as long as they fit. */
+    while (ap->nheld < AFP_RX_BLOCKS) {
+        struct tpacket_block_desc *bd = afp_rx_block(ap, ap->rx_next);
+        struct tpacket3_hdr *hdr;
+        uint32_t npkts, space, k;
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+              TP_STATUS_USER)) {
+            break;
+        }
+        npkts = bd->hdr.bh1.num_pkts;
+        space = (rx->head + rx->num_slots - 1 - rx->tail) % rx->num_slots;
+        if (npkts > space) {
+            break;
+        }
+        hdr = (struct tpacket3_hdr *)((char *)bd +
+                                      bd->hdr.bh1.offset_to_first_pkt);
+        for (k = 0; k < npkts; k++) {
+            struct pio_slot *slot = &rx->slot[rx->tail];
+
+            slot->buf_idx = (char *)hdr + hdr->tp_mac - ap->map;
+            slot->len     = hdr->tp_snaplen;
+            rx->tail      = pio_ring_next(rx, rx->tail);
+            hdr = (struct tpacket3_hdr *)((char *)hdr + hdr->tp_next_offset);
+        }
+        ap->blk_end[ap->rx_next] = rx->tail;
+        ap->rx_next              = (ap->rx_next + 1) % AFP_RX_BLOCKS;
+        ap->nheld++;
+    }
+
+    /* Reclaim the TX frames already sent by the kernel. */
+    while (ap->tx_done != ap->tx_pushed) {
+        struct tpacket3_hdr *hdr = afp_tx_frame(ap, ap->tx_done);
+        uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+        if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+            break;
+        }
+        ap->tx_done = pio_ring_next(tx, ap->tx_done);
+    }
+    tx->tail = (ap->tx_done + tx->num_slots - 1) % tx->num_slots;
+
+    return 0;
+}
+
+const struct pio_ops pio_afpacket_ops = {
+    .prefix = "afpacket:",
+    .open   = afp_open,
+    .close  = afp_close,
+    .push   = afp_push,
+    .pull   = afp_pull,
+};
@@ -0,0 +1,218 @@
+/*
+ * In-memory backend. A POSIX shared memory segment holds two queues of
+ * slots and the buffers they point to; the two ends of a pipe (NAME{ID
+ * and NAME}ID, as with netmap pipes) can live in different processes.
+ * Each queue is the TX ring of one end and the RX ring of the other one,
+ * so buffers can be swapped across the pipe. A plain NAME opens a loopback
+ * port whose TX ring feeds its own RX ring.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pktio.h"
+
+#define MEM_MAGIC 0x70696f6d
+#define MEM_SLOTS 1024
+#define MEM_BUF_SIZE 2048
+
+struct mem_queue {
+    uint32_t prod __attribute__((aligned(64))); /* written by the TX end */
+    uint32_t cons __attribute__((aligned(64))); /* written by the RX end */
+    struct pio_slot slot[MEM_SLOTS] __attribute__((aligned(64)));
+};
+
+struct mem_shm {
+    uint32_t magic;
+    uint32_t num_slots;
+    uint32_t buf_size;
+    struct mem_queue q[2];
+    char bufs[] __attribute__((aligned(4096)));
+};
+
+struct mem_port {
+    char shm_name[PIO_NAME_MAX];
+    struct mem_shm *shm;
+    size_t size;
+    int creator;
+    struct mem_queue *txq;
+    struct mem_queue *rxq;
+};
+
+static void
+mem_close(struct pio_port *port)
+{
+    struct mem_port *mp = port->priv;
+
+    pio_ring_free(port->rx[0]);
+    pio_ring_free(port->tx[0]);
+    if (mp == NULL) {
+        return;
+    }
+    if (mp->shm != NULL) {
+        munmap(mp->shm, mp->size);
+    }
+    if (mp->creator) {
+        shm_unlink(mp->shm_name);
+    }
+    free(mp);
+}
+
+static void
+mem_init(struct mem_shm *shm)
+{
+    uint32_t i;
+
+    shm->num_slots = MEM_SLOTS;
+    shm->buf_size  = MEM_BUF_SIZE;
+    for (i = 0; i < MEM_SLOTS; i++) {
+        shm->q[0].slot[i].buf_idx = i;
+        shm->q[1].slot[i].buf_idx = MEM_SLOTS + i;
+    }
+    __atomic_store_n(&shm->magic, MEM_MAGIC, __ATOMIC_RELEASE);
+}
+
+static int
+mem_open(struct pio_port *port, const char *ifname,
+         const struct pio_port *parent)
+{
+    const char *brace = strpbrk(ifname, "{}");
+    size_t len        = strlen(ifname);
+    struct mem_port *mp;
+    int end = -1; /* -1 loopback, 0 '{' end, 1 '}' end */
+    int fd;
+
+    if (len == 0 || len >= PIO_NAME_MAX - 10) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mp = calloc(1, sizeof(*mp));
+    if (mp == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    port->priv = mp;
+    if (brace) {
+        /* Both ends map the segment named after NAME and ID. */
+        end = (*brace == '}');
+        snprintf(mp->shm_name, sizeof(mp->shm_name), "/pio-mem-%.*s-%s",
+                 (int)(brace - ifname), ifname, brace + 1);
+    } else {
+        snprintf(mp->shm_name, sizeof(mp->shm_name), "/pio-mem-%s", ifname);
+    }
+    mp->size = sizeof(struct mem_shm) + 2 * MEM_SLOTS * MEM_BUF_SIZE;
+
+    fd = shm_open(mp->shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        mp->creator = 1;
+        if (ftruncate(fd, mp->size)) {
+            close(fd);
+            goto err;
+        }
+    } else if (errno == EEXIST) {
+        fd = shm_open(mp->shm_name, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        goto err;
+    }
+    if (!mp->creator) {
+        struct stat st;
+
+        /* Mapping the segment before the creator sized it would fault
+         * (SIGBUS) on the first access. */
+        for (;;) {
+            if (fstat(fd, &st)) {
+                close(fd);
+                goto err;
+            }
+            if ((size_t)st.st_size >= mp->size) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    mp->shm = mmap(NULL, mp->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mp->shm == MAP_FAILED) {
+        mp->shm = NULL;
+        goto err;
+    }
+    if (mp->creator) {
+        mem_init(mp->shm);
+    } else {
+        /* Wait for the creator to initialize the segment. */
+        while (__atomic_load_n(&mp->shm->magic, __ATOMIC_ACQUIRE) !=
+               MEM_MAGIC) {
+            sched_yield();
+        }
+    }
+
+    mp->txq = &mp->shm->q[end == 1];
+    mp->rxq = &mp->shm->q[end == 0];
+
+    port->rx[0] = pio_ring_alloc(MEM_SLOTS, 0);
+    port->tx[0] = pio_ring_alloc(MEM_SLOTS, 0);
+    if (port->rx[0] == NULL || port->tx[0] == NULL) {
+        errno = ENOMEM;
+        goto err;
+    }
+    port->rx[0]->slot = mp->rxq->slot;
+    port->rx[0]->head = port->rx[0]->cur = mp->rxq->cons;
+    port->rx[0]->tail = __atomic_load_n(&mp->rxq->prod, __ATOMIC_ACQUIRE);
+    port->tx[0]->slot = mp->txq->slot;
+    port->tx[0]->head = port->tx[0]->cur = mp->txq->prod;
+    port->tx[0]->tail =
+        (__atomic_load_n(&mp->txq->cons, __ATOMIC_ACQUIRE) + MEM_SLOTS - 1) %
+        MEM_SLOTS;
+    port->rx[0]->buf_base = port->tx[0]->buf_base = mp->shm->bufs;
+    port->rx[0]->buf_size = port->tx[0]->buf_size = MEM_BUF_SIZE;
+    port->mem = mp->shm;
+
+    return 0;
+err:
+    {
+        int err = errno;
+
+        mem_close(port);
+        errno = err;
+    }
+    return -1;
+}
+
+static int
+mem_push(struct pio_port *port)
+{
+    struct mem_port *mp = port->priv;
+
+    __atomic_store_n(&mp->rxq->cons, port->rx[0]->head, __ATOMIC_RELEASE);
+    __atomic_store_n(&mp->txq->prod, port->tx[0]->head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static int
+mem_pull(struct pio_port *port)
+{
+    struct mem_port *mp = port->priv;
+    uint32_t cons;
+
+    port->rx[0]->tail = __atomic_load_n(&mp->rxq->prod, __ATOMIC_ACQUIRE);
+    cons              = __atomic_load_n(&mp->txq->cons, __ATOMIC_ACQUIRE);
+    port->tx[0]->tail = (cons + MEM_SLOTS - 1) % MEM_SLOTS;
+
+    return 0;
+}
+
+const struct pio_ops pio_mem_ops = {
+    .prefix = "mem:",
+    .open   = mem_open,
+    .close  = mem_close,
+    .push   = mem_push,
+    .pull   = mem_pull,
+};
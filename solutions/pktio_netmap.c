@@ -0,0 +1,170 @@
+/*
+ * netmap backend. The pio rings share the slot arrays and the buffers
+ * with the netmap rings, so only head, cur and tail need to be copied
+ * around the poll() system call.
+ */
+#ifndef PIO_NO_NETMAP
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <net/netmap.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+#include "pktio.h"
+
+_Static_assert(sizeof(struct pio_slot) == sizeof(struct netmap_slot),
+               "pio_slot must alias netmap_slot");
+_Static_assert(PIO_BUF_CHANGED == NS_BUF_CHANGED, "flags must match");
+
+static struct pio_ring *
+netmap_ring_wrap(struct netmap_ring *nring)
+{
+    struct pio_ring *ring = pio_ring_alloc(nring->num_slots, 0);
+
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->head     = nring->head;
+    ring->cur      = nring->cur;
+    ring->tail     = nring->tail;
+    ring->buf_base = (char *)nring + nring->buf_ofs;
+    ring->buf_size = nring->nr_buf_size;
+    ring->slot     = (struct pio_slot *)nring->slot;
+    ring->priv     = nring;
+
+    return ring;
+}
+
+static void
+netmap_close(struct pio_port *port)
+{
+    unsigned int i;
+
+    for (i = 0; i <= PIO_MAX_RINGS; i++) {
+        pio_ring_free(port->rx[i]);
+        pio_ring_free(port->tx[i]);
+    }
+    if (port->priv) {
+        struct nm_desc *nmd = port->priv;
+
+        /* netmap frees the extra buffers found on the list. */
+        if (port->nextra) {
+            nmd->nifp->ni_bufs_head = port->extra_head;
+        }
+        nm_close(nmd);
+    }
+}
+
+static int
+netmap_open(struct pio_port *port, const char *ifname,
+            const struct pio_port *parent)
+{
+    struct nm_desc *nmd;
+    struct nmreq req;
+    unsigned int i;
+
+    memset(&req, 0, sizeof(req));
+    req.nr_arg3 = port->nextra; /* extra buffers */
+    if (parent) {
+        nmd = nm_open(ifname, &req, NM_OPEN_NO_MMAP, parent->priv);
+    } else {
+        nmd = nm_open(ifname, &req, 0, NULL);
+    }
+    if (nmd == NULL) {
+        return -1;
+    }
+    if (nmd->last_rx_ring > PIO_MAX_RINGS ||
+        nmd->last_tx_ring > PIO_MAX_RINGS) {
+        nm_close(nmd);
+        errno = ERANGE;
+        return -1;
+    }
+    port->priv          = nmd;
+    port->fd            = nmd->fd;
+    port->mem           = nmd->mem;
+    port->first_rx_ring = nmd->first_rx_ring;
+    port->last_rx_ring  = nmd->last_rx_ring;
+    port->first_tx_ring = nmd->first_tx_ring;
+    port->last_tx_ring  = nmd->last_tx_ring;
+    port->nextra        = nmd->req.nr_arg3;
+    port->extra_head    = nmd->req.nr_arg3 ? nmd->nifp->ni_bufs_head : 0;
+
+    for (i = port->first_rx_ring; i <= port->last_rx_ring; i++) {
+        port->rx[i] = netmap_ring_wrap(NETMAP_RXRING(nmd->nifp, i));
+        if (port->rx[i] == NULL) {
+            goto nomem;
+        }
+    }
+    for (i = port->first_tx_ring; i <= port->last_tx_ring; i++) {
+        port->tx[i] = netmap_ring_wrap(NETMAP_TXRING(nmd->nifp, i));
+        if (port->tx[i] == NULL) {
+            goto nomem;
+        }
+    }
+
+    return 0;
+nomem:
+    netmap_close(port);
+    errno = ENOMEM;
+    return -1;
+}
+
+static int
+netmap_push(struct pio_port *port)
+{
+    unsigned int i;
+
+    for (i = port->first_rx_ring; i <= port->last_rx_ring; i++) {
+        struct netmap_ring *nring = port->rx[i]->priv;
+
+        nring->head = port->rx[i]->head;
+        nring->cur  = port->rx[i]->cur;
+    }
+    for (i = port->first_tx_ring; i <= port->last_tx_ring; i++) {
+        struct netmap_ring *nring = port->tx[i]->priv;
+
+        nring->head = port->tx[i]->head;
+        nring->cur  = port->tx[i]->cur;
+    }
+
+    return 0;
+}
+
+static int
+netmap_pull(struct pio_port *port)
+{
+    unsigned int i;
+
+    for (i = port->first_rx_ring; i <= port->last_rx_ring; i++) {
+        struct netmap_ring *nring = port->rx[i]->priv;
+
+        port->rx[i]->tail = nring->tail;
+    }
+    for (i = port->first_tx_ring; i <= port->last_tx_ring; i++) {
+        struct netmap_ring *nring = port->tx[i]->priv;
+
+        port->tx[i]->tail = nring->tail;
+    }
+
+    return 0;
+}
+
+static int
+netmap_kick(struct pio_port *port)
+{
+    return ioctl(port->fd, NIOCTXSYNC, NULL);
+}
+
+const struct pio_ops pio_netmap_ops = {
+    .prefix = NULL,
+    .open   = netmap_open,
+    .close  = netmap_close,
+    .push   = netmap_push,
+    .pull   = netmap_pull,
+    .kick   = netmap_kick,
+};
+#endif /* !PIO_NO_NETMAP */
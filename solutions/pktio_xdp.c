@@ -0,0 +1,366 @@
+/*
+ * AF_XDP backend. Each port owns a UMEM split in two halves: the first
+ * one feeds the fill ring (and therefore RX), the second one backs the
+ * TX slots. Buffer indices are UMEM addresses (buf_size 1), so RX
+ * descriptors map to slots without any copy. A minimal XDP program that
+ * redirects the selected queue to the socket is loaded and attached
+ * with raw bpf() calls, to avoid depending on libbpf/libxdp.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#include "pktio.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_FRAME_SIZE 2048
+#define XDP_RING_SIZE 2048
+#define XDP_NUM_FRAMES (2 * XDP_RING_SIZE)
+
+struct xdp_uring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *ring;
+    uint32_t *flags;
+    void *map;
+    size_t map_size;
+    uint32_t cached; /* local copy of the index we own */
+};
+
+struct xdp_port {
+    char *umem;
+    struct xdp_uring fill, comp, rxq, txq;
+    int prog_fd, map_fd, link_fd;
+    uint32_t rx_released;
+    uint32_t tx_pushed;
+    uint32_t tx_done;
+};
+
+static long
+sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Load "return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS)"
+ * and attach it to the interface. */
+static int
+xdp_attach_prog(struct xdp_port *xp, int ifindex, uint32_t queue, int xsk)
+{
+    struct bpf_insn insns[] = {
+        /* r2 = ctx->rx_queue_index */
+        {BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1,
+         offsetof(struct xdp_md, rx_queue_index), 0},
+        /* r1 = &xsks */
+        {BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, 0},
+        {0, 0, 0, 0, 0},
+        /* r3 = XDP_PASS */
+        {BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS},
+        {BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map},
+        {BPF_JMP | BPF_EXIT, 0, 0, 0, 0},
+    };
+    static const char license[] = "Dual BSD/GPL";
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size    = sizeof(uint32_t);
+    attr.value_size  = sizeof(int);
+    attr.max_entries = PIO_MAX_RINGS;
+    xp->map_fd       = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (xp->map_fd < 0) {
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xp->map_fd;
+    attr.key    = (uint64_t)(uintptr_t)&queue;
+    attr.value  = (uint64_t)(uintptr_t)&xsk;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+        return -1;
+    }
+
+    insns[1].imm = xp->map_fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns     = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt  = sizeof(insns) / sizeof(insns[0]);
+    attr.license   = (uint64_t)(uintptr_t)license;
+    xp->prog_fd    = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (xp->prog_fd < 0) {
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd        = xp->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type    = BPF_XDP;
+    xp->link_fd                     = sys_bpf(BPF_LINK_CREATE, &attr);
+
+    return xp->link_fd < 0 ? -1 : 0;
+}
+
+static int
+xdp_map_ring(int fd, struct xdp_uring *r, const struct xdp_ring_offset *off,
+             size_t desc_size, off_t pgoff)
+{
+    r->map_size = off->desc + XDP_RING_SIZE * desc_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return -1;
+    }
+    r->producer = (uint32_t *)((char *)r->map + off->producer);
+    r->consumer = (uint32_t *)((char *)r->map + off->consumer);
+    r->flags    = (uint32_t *)((char *)r->map + off->flags);
+    r->ring     = (char *)r->map + off->desc;
+
+    return 0;
+}
+
+static void
+xdp_close(struct pio_port *port)
+{
+    struct xdp_port *xp = port->priv;
+
+    pio_ring_free(port->rx[0]);
+    pio_ring_free(port->tx[0]);
+    if (xp == NULL) {
+        return;
+    }
+    if (xp->link_fd >= 0) {
+        close(xp->link_fd);
+    }
+    if (xp->prog_fd >= 0) {
+        close(xp->prog_fd);
+    }
+    if (xp->map_fd >= 0) {
+        close(xp->map_fd);
+    }
+    if (xp->fill.map) {
+        munmap(xp->fill.map, xp->fill.map_size);
+    }
+    if (xp->comp.map) {
+        munmap(xp->comp.map, xp->comp.map_size);
+    }
+    if (xp->rxq.map) {
+        munmap(xp->rxq.map, xp->rxq.map_size);
+    }
+    if (xp->txq.map) {
+        munmap(xp->txq.map, xp->txq.map_size);
+    }
+    if (port->fd >= 0) {
+        close(port->fd);
+    }
+    free(xp->umem);
+    free(xp);
+}
+
+static int
+xdp_open(struct pio_port *port, const char *ifname,
+         const struct pio_port *parent)
+{
+    char name[IF_NAMESIZE];
+    struct xdp_umem_reg mr;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    socklen_t optlen;
+    struct xdp_port *xp;
+    unsigned int ifindex;
+    uint32_t queue = 0;
+    const char *at;
+    int size = XDP_RING_SIZE;
+    uint32_t i;
+
+    at = strchr(ifname, '@');
+    if (at) {
+        queue = atoi(at + 1);
+    }
+    snprintf(name, sizeof(name), "%.*s",
+             (int)(at ? at - ifname : strlen(ifname)), ifname);
+    ifindex = if_nametoindex(name);
+    if (ifindex == 0) {
+        return -1;
+    }
+
+    xp = calloc(1, sizeof(*xp));
+    if (xp == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    port->priv  = xp;
+    xp->prog_fd = xp->map_fd = xp->link_fd = -1;
+    if (posix_memalign((void **)&xp->umem, getpagesize(),
+                       XDP_NUM_FRAMES * XDP_FRAME_SIZE)) {
+        errno = ENOMEM;
+        goto err;
+    }
+
+    port->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (port->fd < 0) {
+        goto err;
+    }
+    memset(&mr, 0, sizeof(mr));
+    mr.addr       = (uint64_t)(uintptr_t)xp->umem;
+    mr.len        = XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+    mr.chunk_size = XDP_FRAME_SIZE;
+    if (setsockopt(port->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) ||
+        setsockopt(port->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size,
+                   sizeof(size)) ||
+        setsockopt(port->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+                   sizeof(size)) ||
+        setsockopt(port->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) ||
+        setsockopt(port->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size))) {
+        goto err;
+    }
+    optlen = sizeof(off);
+    if (getsockopt(port->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)) {
+        goto err;
+    }
+    if (xdp_map_ring(port->fd, &xp->fill, &off.fr, sizeof(uint64_t),
+                     XDP_UMEM_PGOFF_FILL_RING) ||
+        xdp_map_ring(port->fd, &xp->comp, &off.cr, sizeof(uint64_t),
+                     XDP_UMEM_PGOFF_COMPLETION_RING) ||
+        xdp_map_ring(port->fd, &xp->rxq, &off.rx, sizeof(struct xdp_desc),
+                     XDP_PGOFF_RX_RING) ||
+        xdp_map_ring(port->fd, &xp->txq, &off.tx, sizeof(struct xdp_desc),
+                     XDP_PGOFF_TX_RING)) {
+        goto err;
+    }
+
+    /* The first half of the UMEM goes to the fill ring. */
+    for (i = 0; i < XDP_RING_SIZE; i++) {
+        ((uint64_t *)xp->fill.ring)[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    }
+    xp->fill.cached = XDP_RING_SIZE;
+    __atomic_store_n(xp->fill.producer, xp->fill.cached, __ATOMIC_RELEASE);
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family   = AF_XDP;
+    sxdp.sxdp_ifindex  = ifindex;
+    sxdp.sxdp_queue_id = queue;
+    if (bind(port->fd, (struct sockaddr *)&sxdp, sizeof(sxdp))) {
+        goto err;
+    }
+    if (xdp_attach_prog(xp, ifindex, queue, port->fd)) {
+        goto err;
+    }
+
+    port->rx[0] = pio_ring_alloc(XDP_RING_SIZE + 1, 1);
+    port->tx[0] = pio_ring_alloc(XDP_RING_SIZE, 1);
+    if (port->rx[0] == NULL || port->tx[0] == NULL) {
+        errno = ENOMEM;
+        goto err;
+    }
+    port->rx[0]->buf_base = port->tx[0]->buf_base = xp->umem;
+    port->rx[0]->buf_size = port->tx[0]->buf_size = 1;
+    /* The second half of the UMEM backs the TX slots. */
+    for (i = 0; i < XDP_RING_SIZE; i++) {
+        port->tx[0]->slot[i].buf_idx = (XDP_RING_SIZE + i) * XDP_FRAME_SIZE;
+    }
+    port->tx[0]->tail = XDP_RING_SIZE - 1;
+    port->mem         = xp->umem;
+
+    return 0;
+err:
+    {
+        int err = errno;
+
+        xdp_close(port);
+        errno = err;
+    }
+    return -1;
+}
+
+static int
+xdp_push(struct pio_port *port)
+{
+    struct xdp_port *xp = port->priv;
+    struct pio_ring *rx = port->rx[0];
+    struct pio_ring *tx = port->tx[0];
+    uint64_t *fill      = xp->fill.ring;
+    struct xdp_desc *descs = xp->txq.ring;
+    uint32_t n = 0;
+
+    /* Recycle the released RX buffers through the fill ring. Frames are
+     * never lost, so the fill ring always has room for them. */
+    for (; xp->rx_released != rx->head;
+         xp->rx_released = pio_ring_next(rx, xp->rx_released)) {
+        uint64_t addr = rx->slot[xp->rx_released].buf_idx;
+
+        fill[xp->fill.cached++ & (XDP_RING_SIZE - 1)] =
+            addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+    }
+    __atomic_store_n(xp->fill.producer, xp->fill.cached, __ATOMIC_RELEASE);
+
+    /* Post the new TX slots. */
+    for (; xp->tx_pushed != tx->head;
+         xp->tx_pushed = pio_ring_next(tx, xp->tx_pushed), n++) {
+        struct xdp_desc *d = &descs[xp->txq.cached++ & (XDP_RING_SIZE - 1)];
+
+        d->addr    = tx->slot[xp->tx_pushed].buf_idx;
+        d->len     = tx->slot[xp->tx_pushed].len;
+        d->options = 0;
+    }
+    if (n) {
+        __atomic_store_n(xp->txq.producer, xp->txq.cached, __ATOMIC_RELEASE);
+        sendto(port->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+
+    return 0;
+}
+
+static int
+xdp_pull(struct pio_port *port)
+{
+    struct xdp_port *xp = port->priv;
+    struct pio_ring *rx = port->rx[0];
+    struct pio_ring *tx = port->tx[0];
+    struct xdp_desc *descs = xp->rxq.ring;
+    uint32_t prod, n;
+
+    /* Move the received descriptors into the RX slots. */
+    prod = __atomic_load_n(xp->rxq.producer, __ATOMIC_ACQUIRE);
+    for (n = prod - xp->rxq.cached; n > 0; n--) {
+        const struct xdp_desc *d = &descs[xp->rxq.cached++ &
+                                          (XDP_RING_SIZE - 1)];
+
+        rx->slot[rx->tail].buf_idx = d->addr;
+        rx->slot[rx->tail].len     = d->len;
+        rx->tail                   = pio_ring_next(rx, rx->tail);
+    }
+    __atomic_store_n(xp->rxq.consumer, xp->rxq.cached, __ATOMIC_RELEASE);
+
+    /* Completions free TX slots in order. */
+    prod = __atomic_load_n(xp->comp.producer, __ATOMIC_ACQUIRE);
+    for (n = prod - xp->comp.cached; n > 0; n--) {
+        xp->tx_done = pio_ring_next(tx, xp->tx_done);
+    }
+    xp->comp.cached = prod;
+    __atomic_store_n(xp->comp.consumer, prod, __ATOMIC_RELEASE);
+    tx->tail = (xp->tx_done + tx->num_slots - 1) % tx->num_slots;
+
+    return 0;
+}
+
+const struct pio_ops pio_xdp_ops = {
+    .prefix = "xdp:",
+    .open   = xdp_open,
+    .close  = xdp_close,
+    .push   = xdp_push,
+    .pull   = xdp_pull,
+};
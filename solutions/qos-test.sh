@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Check that forward -Q with few TX slots in flight keeps up with bursts
+# of the four DSCP classes mixed (over mem: pipes, so no netmap module is
+# needed): every packet must come out, and no class may see drops.
+#
+# usage: ./qos-test.sh [TXSLOTS]
+
+Q=${1:-32}
+BURSTS=10
+BURST=4000 # 1000 packets per class, within a class queue
+OUT=$(mktemp -d)
+
+./sink -i mem:qtest}2 > $OUT/sink &
+PIDS="$!"
+./forward -i mem:qtest}1 -i mem:qtest{2 -Q $Q > $OUT/forward &
+PIDS="$PIDS $!"
+sleep 0.5
+i=0
+while [ $i -lt $BURSTS ]; do
+    ./gen -i mem:qtest{1 -d 10.0.0.1:8000-10.0.0.1:8003 -t 46,32,0,8 \
+        -n $BURST > /dev/null
+    sleep 0.2
+    i=$((i + 1))
+done
+sleep 0.5
+kill -INT $PIDS
+wait
+
+grep Class $OUT/forward
+awk -v want=$((BURSTS * BURST)) '
+    /Total received/ { got = $4 }
+    END {
+        printf "received %d of %d packets\n", got, want
+        exit got != want
+    }' $OUT/sink
+ret=$?
+if awk '/^Class/ && $6 != 0 { bad = 1 } END { exit !bad }' $OUT/forward; then
+    echo "drops at -Q $Q"
+    ret=1
+fi
+rm -rf $OUT
+[ $ret -eq 0 ] && echo PASS || echo FAIL
+exit $ret
@@ -0,0 +1,311 @@
+/*
+ * Strict-priority egress queues, see qos.h.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "qos.h"
+
+int
+qos_conf_parse(struct qos_conf *c, const char *s)
+{
+    char *end;
+
+    c->txslots = strtoul(s, &end, 10);
+    c->mbps    = 0;
+    if (end == s) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (*end == ':') {
+        c->mbps = strtoul(end + 1, &end, 10);
+    }
+    if (*end != '\0' || (c->txslots && c->txslots < QOS_TXSLOTS_MIN)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+qos_class_parse(struct qos_conf *c, const char *s)
+{
+    unsigned long cls;
+    char *end;
+
+    cls = strtoul(s, &end, 10);
+    if (end == s || *end != ':' || cls >= QOS_CLASSES) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->cls[cls].mbps = strtoul(end + 1, &end, 10);
+    if (*end != '\0' || c->cls[cls].mbps == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+qos_rate_init(struct qos_queue *queue, unsigned int mbps, uint64_t tsc_hz)
+{
+    queue->tat = 0;
+    if (mbps == 0) {
+        queue->cost = 0;
+        return;
+    }
+    queue->cost  = (tsc_hz * 8 << 16) / (mbps * 1000000ULL);
+    queue->burst = (QOS_BURST * queue->cost) >> 16;
+}
+
+/* May the queue send at now? */
+static inline int
+qos_rate_ok(const struct qos_queue *queue, uint64_t now)
+{
+    return queue->cost == 0 || queue->tat <= now + queue->burst;
+}
+
+static inline void
+qos_rate_charge(struct qos_queue *queue, unsigned int len, uint64_t now)
+{
+    if (queue->cost) {
+        queue->tat = (queue->tat > now ? queue->tat : now) +
+                     ((len * queue->cost) >> 16);
+    }
+}
+
+int
+qos_init(struct qos *q, struct qos_conf *conf, struct pio_port *src,
+         const struct pio_port *dst, uint64_t tsc_hz)
+{
+    const struct pio_ring *rxring = PIO_RXRING(src, src->first_rx_ring);
+    unsigned int nbufs            = qos_conf_bufs(conf);
+    unsigned int c;
+
+    memset(q, 0, sizeof(*q));
+    q->cls      = conf->cls;
+    q->txslots  = conf->txslots;
+    q->tsc2ns20 = (1000000000ULL << 20) / tsc_hz;
+    q->tx_wait  = tsc_hz * QOS_TX_WAIT_US / 1000000;
+    q->free     = malloc(nbufs * sizeof(*q->free));
+    q->q[0].e   = calloc(QOS_BUFS, sizeof(*q->q[0].e));
+    if (q->free == NULL || q->q[0].e == NULL) {
+        goto nomem;
+    }
+    if (conf->htb) {
+        q->htb = htb_create(conf->htb, tsc_hz);
+        if (q->htb == NULL) {
+            goto nomem;
+        }
+    }
+    for (c = 0; c < QOS_CLASSES; c++) {
+        q->q[c].e = q->q[0].e + c * QOS_QLEN;
+        qos_rate_init(&q->q[c], conf->cls[c].mbps, tsc_hz);
+        codel_init(&q->q[c].codel);
+    }
+    codel_params_init(&q->codel, conf->codel_target_us,
+                      conf->codel_interval_us, tsc_hz);
+    qos_rate_init(&q->link, conf->mbps, tsc_hz);
+
+    /* Swap buffers if they can go from src to dst, copy otherwise. */
+    if (pio_same_mem(src, dst)) {
+        q->nfree = pio_extra_take(src, q->free, nbufs);
+    }
+    q->buf_size = rxring->buf_size;
+    if (q->nfree > 0) {
+        q->zerocopy = 1;
+        q->buf_base = rxring->buf_base;
+    } else {
+        /* afpacket and AF_XDP index their buffers by byte (buf_size 1),
+         * a private buffer holds a frame of any backend. */
+        q->buf_size = QOS_BUF_SIZE;
+        q->mem      = malloc((size_t)nbufs * q->buf_size);
+        if (q->mem == NULL) {
+            goto nomem;
+        }
+        q->buf_base = q->mem;
+        for (q->nfree = 0; q->nfree < nbufs; q->nfree++) {
+            q->free[q->nfree] = q->nfree;
+        }
+    }
+
+    return 0;
+nomem:
+    htb_free(q->htb, NULL);
+    free(q->free);
+    free(q->q[0].e);
+    errno = ENOMEM;
+    return -1;
+}
+
+void
+qos_free(struct qos *q, struct pio_port *src)
+{
+    unsigned int c;
+
+    for (c = 0; c < QOS_CLASSES; c++) {
+        struct qos_queue *queue = &q->q[c];
+
+        q->cls[c].depth -= queue->tail - queue->head;
+        for (; queue->head != queue->tail; queue->head++) {
+            struct qos_entry *e = &queue->e[queue->head & (QOS_QLEN - 1)];
+
+            q->free[q->nfree++] = e->buf_idx;
+        }
+    }
+    htb_free(q->htb, q);
+    if (q->zerocopy) {
+        pio_extra_give(src, q->free, q->nfree);
+    }
+    free(q->mem);
+    free(q->free);
+    free(q->q[0].e);
+}
+
+/* Free slots of a TX ring, within the txslots in flight. */
+static inline unsigned int
+qos_tx_space(const struct qos *q, const struct pio_ring *ring)
+{
+    unsigned int space  = pio_ring_space(ring);
+    unsigned int flight = ring->num_slots - 1 - space;
+
+    if (q->txslots == 0) {
+        return space;
+    }
+    if (flight >= q->txslots) {
+        return 0;
+    }
+    return q->txslots - flight < space ? q->txslots - flight : space;
+}
+
+/* Take the next packet of the strict-priority queues that may be sent
+ * at now, with the class cursor *c, dropping those that CoDel says to
+ * on the way. Returns 0 if there is none. */
+static inline int
+qos_prio_dequeue(struct qos *q, unsigned int *c, uint64_t now,
+                 uint32_t *idx, uint16_t *len)
+{
+    struct qos_queue *queue;
+    struct qos_entry *e;
+
+    for (;;) {
+        /* The first class with packets that its cap lets go. No class
+         * gets packets or tokens while draining, so those skipped are
+         * not looked at again. */
+        while (*c < QOS_CLASSES && (q->q[*c].head == q->q[*c].tail ||
+                                    !qos_rate_ok(&q->q[*c], now))) {
+            (*c)++;
+        }
+        if (*c == QOS_CLASSES) {
+            return 0;
+        }
+        queue = &q->q[*c];
+        e     = &queue->e[queue->head++ & (QOS_QLEN - 1)];
+        if (!codel_drop(&queue->codel, &q->codel, e->ts, now,
+                        queue->head == queue->tail)) {
+            break;
+        }
+        qos_pool_free(q, e->buf_idx);
+        q->cls[*c].depth--;
+        q->cls[*c].codel_drops++;
+        q->queued--;
+    }
+    *idx = e->buf_idx;
+    *len = e->len;
+    qos_rate_charge(queue, e->len, now);
+    q->cls[*c].pkts++;
+    q->cls[*c].depth--;
+    stats_hist_add(&q->cls[*c].sojourn, ((now - e->ts) * q->tsc2ns20) >> 20);
+
+    return 1;
+}
+
+unsigned int
+qos_drain(struct qos *q, struct pio_port *dst, uint64_t now)
+{
+    unsigned int sent = 0;
+    unsigned int c    = 0;
+    unsigned int ri;
+
+    for (ri = dst->first_tx_ring; ri <= dst->last_tx_ring; ri++) {
+        struct pio_ring *txring = PIO_TXRING(dst, ri);
+        unsigned int space      = qos_tx_space(q, txring);
+        unsigned int head       = txring->head;
+
+        for (; space > 0; space--) {
+            uint32_t idx;
+            uint16_t len;
+
+            if (!qos_rate_ok(&q->link, now) ||
+                !(q->htb ? htb_dequeue(q->htb, q, now, &idx, &len)
+                         : qos_prio_dequeue(q, &c, now, &idx, &len))) {
+                txring->head = txring->cur = head;
+                return sent;
+            }
+            qos_pool_put(q, txring, &txring->slot[head], idx, len);
+            qos_rate_charge(&q->link, len, now);
+            q->queued--;
+            sent++;
+            head = pio_ring_next(txring, head);
+        }
+        txring->head = txring->cur = head;
+    }
+
+    return sent;
+}
+
+short
+qos_wait(const struct qos *q, const struct pio_port *dst, uint64_t now,
+         uint64_t *at)
+{
+    uint64_t t = UINT64_MAX;
+    unsigned int c, ri;
+
+    *at = UINT64_MAX;
+    if (q->queued == 0) {
+        return 0;
+    }
+    if (q->htb) {
+        t = htb_next(q->htb);
+    } else {
+        for (c = 0; c < QOS_CLASSES; c++) {
+            const struct qos_queue *queue = &q->q[c];
+
+            if (queue->head == queue->tail) {
+                continue;
+            }
+            if (qos_rate_ok(queue, now)) {
+                t = 0;
+                break;
+            }
+            if (queue->tat - queue->burst < t) {
+                t = queue->tat - queue->burst;
+            }
+        }
+    }
+    /* The link cap holds all the classes back. */
+    if (!qos_rate_ok(&q->link, now) && q->link.tat - q->link.burst > t) {
+        t = q->link.tat - q->link.burst;
+    }
+    if (t > now) {
+        *at = t;
+        return 0;
+    }
+
+    /* TX space it is. A full ring wakes us up when it gets room, but
+     * nothing does when the slots in flight go below txslots with the
+     * ring not full: POLLOUT would return at once and spin, so we look
+     * again a bit later. */
+    for (ri = dst->first_tx_ring; ri <= dst->last_tx_ring; ri++) {
+        const struct pio_ring *ring = PIO_TXRING(dst, ri);
+
+        if (pio_ring_space(ring) && !qos_tx_space(q, ring)) {
+            *at = now + q->tx_wait;
+            return 0;
+        }
+    }
+
+    return POLLOUT;
+}
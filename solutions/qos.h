@@ -0,0 +1,255 @@
+/*
+ * Strict-priority egress queues for forward.
+ *
+ * Rather than going straight to the TX rings of the other port, the
+ * packets are classified by the DSCP of their IP header and queued in
+ * one of QOS_CLASSES FIFOs. qos_drain() then fills the TX rings from the
+ * highest class with packets, so that latency-sensitive packets never
+ * wait behind a backlog of bulk ones. Only txslots slots of each TX ring
+ * are let in flight: the backlog then builds up here, where it is sorted
+ * by class, and not in the TX rings and the NIC, where it would not be.
+ *
+ * A class can be capped to a rate, so that the classes below it are not
+ * starved. The cap is a token bucket kept as a GCRA deadline in TSC
+ * units: the class may send while its theoretical arrival time is less
+ * than a burst ahead of now, and each packet moves it forward by its
+ * length times the cost of a byte. The same is done for the whole link
+ * when it is slower than the port (a shaper in front of a slower WAN
+ * link, or a test over mem pipes).
+ *
+ * The queued packets are held in a pool of buffers. When the two ports
+ * share memory and the backend gives extra buffers (netmap, see
+ * pio_open_extra()), the pool holds those and packets move by swapping
+ * buffer indices with the RX and TX slots. Otherwise the pool is private
+ * memory and packets are copied in and out.
+ *
+ * With a hierarchical token bucket tree (see htb.h) in the configuration,
+ * the packets go to its leaves instead of the DSCP classes, and the tree
+ * decides the order in which they leave.
+ *
+ * With CoDel (see codel.h), each DSCP class or leaf drops at dequeue the
+ * packets that stood in it too long, so that overload does not turn
+ * into a standing queue of latency.
+ */
+#ifndef __QOS_H__
+#define __QOS_H__
+
+#include <stdint.h>
+#include <string.h>
+#include "pktio.h"
+#include "pkt.h"
+#include "stats.h"
+#include "htb.h"
+#include "codel.h"
+
+#define QOS_CLASSES 4
+#define QOS_QLEN 1024 /* packets per class, a power of two */
+#define QOS_BUFS (QOS_CLASSES * QOS_QLEN)
+#define QOS_BURST 32768 /* bytes let through at once by a rate cap */
+#define QOS_BUF_SIZE 2048 /* private buffers, as large as the pio ones */
+#define QOS_TX_WAIT_US 10 /* between looks at the slots in flight */
+#define QOS_TXSLOTS_MIN 32 /* fewer would cost a wakeup every few packets */
+
+/* A class, shared by the two directions of forward. */
+struct qos_class {
+    unsigned int mbps;              /* rate cap, 0 for none */
+    unsigned long long pkts;        /* sent */
+    unsigned long long drops;       /* dropped with the queue full */
+    unsigned long long codel_drops; /* dropped at dequeue by CoDel */
+    unsigned long long depth;       /* packets queued, gauge */
+    struct stats_hist sojourn;      /* ns from the RX ring to the TX ring */
+};
+
+struct qos_conf {
+    unsigned int txslots; /* TX slots in flight per ring, 0 for no limit */
+    unsigned int mbps;    /* link rate, 0 for the rate of the port */
+    struct qos_class cls[QOS_CLASSES];
+    struct htb_conf *htb; /* shape with this tree rather than by DSCP */
+    unsigned int codel_target_us; /* 0 for no CoDel */
+    unsigned int codel_interval_us;
+};
+
+struct qos_entry {
+    uint32_t buf_idx;
+    uint16_t len;
+    uint64_t ts; /* TSC when queued */
+};
+
+struct qos_queue {
+    struct qos_entry *e;
+    uint32_t head, tail; /* free running, masked with QOS_QLEN - 1 */
+    uint64_t cost;       /* TSC per byte << 16, 0 if not capped */
+    uint64_t burst;      /* TSC */
+    uint64_t tat;        /* theoretical arrival time, TSC */
+    struct codel codel;
+};
+
+/* The queues of one direction. */
+struct qos {
+    struct qos_class *cls;
+    struct qos_queue q[QOS_CLASSES];
+    struct qos_queue link; /* no entries, only the rate */
+    unsigned int queued;
+    unsigned int txslots;
+    int zerocopy;   /* the pool holds extra buffers of src */
+    char *buf_base; /* the pool buffers, and the RX ones with zerocopy */
+    uint32_t buf_size;
+    uint32_t *free; /* indices of the free pool buffers */
+    unsigned int nfree;
+    char *mem;         /* private buffers without zerocopy */
+    uint64_t tsc2ns20; /* ns per TSC tick << 20 */
+    uint64_t tx_wait;  /* QOS_TX_WAIT_US in TSC ticks */
+    struct htb *htb;
+    struct codel_params codel;
+};
+
+/* Pool buffers of a direction, also the extra buffers to ask for. */
+static inline unsigned int
+qos_conf_bufs(const struct qos_conf *conf)
+{
+    return conf->htb ? HTB_BUFS : QOS_BUFS;
+}
+
+/* Class of a DSCP, as in the WMM mapping of the IP precedence (the
+ * top 3 bits): 6 and 7 voice, 4 and 5 video, 0 and 3 best effort, 1
+ * and 2 background. EF (46) is voice too. */
+static inline unsigned int
+qos_dscp_class(unsigned int dscp)
+{
+    static const uint8_t prec[8] = {2, 3, 3, 2, 1, 1, 0, 0};
+
+    return dscp == 46 ? 0 : prec[dscp >> 3];
+}
+
+/* Class of an IPv4 or IPv6 frame, best effort for anything else. */
+static inline unsigned int
+qos_classify(const char *buf, unsigned int len)
+{
+    const struct ether_header *ethh = (const struct ether_header *)buf;
+    const uint8_t *l3               = (const uint8_t *)(ethh + 1);
+
+    if (len < sizeof(*ethh) + 2) {
+        return 2;
+    }
+    if (ethh->ether_type == htons(ETHERTYPE_IP)) {
+        return qos_dscp_class(l3[1] >> 2);
+    }
+    if (ethh->ether_type == htons(ETHERTYPE_IPV6)) {
+        /* The traffic class is across the first two bytes. */
+        return qos_dscp_class(((l3[0] & 0x0f) << 4 | l3[1] >> 4) >> 2);
+    }
+
+    return 2;
+}
+
+static inline char *
+qos_buf(const struct qos *q, uint32_t idx)
+{
+    return q->buf_base + (uint64_t)idx * q->buf_size;
+}
+
+/* Move the packet of RX slot rs (buffer rxbuf) to a pool buffer, whose
+ * index goes to *idx. Returns 0 if the pool is empty. */
+static inline int
+qos_pool_get(struct qos *q, struct pio_slot *rs, const char *rxbuf,
+             uint32_t *idx)
+{
+    uint32_t b;
+
+    if (q->nfree == 0) {
+        return 0;
+    }
+    b = q->free[--q->nfree];
+    if (q->zerocopy) {
+        *idx        = rs->buf_idx;
+        rs->buf_idx = b;
+        rs->flags |= PIO_BUF_CHANGED;
+    } else {
+        *idx = b;
+        memcpy(qos_buf(q, b), rxbuf, rs->len);
+    }
+
+    return 1;
+}
+
+static inline void
+qos_pool_free(struct qos *q, uint32_t idx)
+{
+    q->free[q->nfree++] = idx;
+}
+
+/* Move the packet of pool buffer idx to TX slot ts of txring. */
+static inline void
+qos_pool_put(struct qos *q, struct pio_ring *txring, struct pio_slot *ts,
+             uint32_t idx, uint16_t len)
+{
+    ts->len = len;
+    if (q->zerocopy) {
+        q->free[q->nfree++] = ts->buf_idx;
+        ts->buf_idx         = idx;
+        ts->flags |= PIO_BUF_CHANGED;
+    } else {
+        memcpy(PIO_BUF(txring, ts->buf_idx), qos_buf(q, idx), len);
+        q->free[q->nfree++] = idx;
+    }
+}
+
+/* Queue the packet in slot rs (buffer rxbuf), received at TSC now.
+ * Returns 0 if it was dropped. */
+static inline int
+qos_enqueue(struct qos *q, struct pio_slot *rs, const char *rxbuf,
+            uint64_t now)
+{
+    struct qos_queue *queue;
+    unsigned int c;
+    struct qos_entry *e;
+    uint32_t idx;
+
+    if (q->htb) {
+        if (!htb_enqueue(q->htb, q, rs, rxbuf, now)) {
+            return 0;
+        }
+        q->queued++;
+        return 1;
+    }
+    c     = qos_classify(rxbuf, rs->len);
+    queue = &q->q[c];
+    if (queue->tail - queue->head == QOS_QLEN ||
+        !qos_pool_get(q, rs, rxbuf, &idx)) {
+        q->cls[c].drops++;
+        return 0;
+    }
+    e          = &queue->e[queue->tail++ & (QOS_QLEN - 1)];
+    e->buf_idx = idx;
+    e->len     = rs->len;
+    e->ts      = now;
+    q->cls[c].depth++;
+    q->queued++;
+
+    return 1;
+}
+
+/* Parse -Q TXSLOTS[:MBPS] and -c CLASS:MBPS into c, 0 on success.
+ * TXSLOTS is 0 or at least QOS_TXSLOTS_MIN. */
+int qos_conf_parse(struct qos_conf *c, const char *s);
+int qos_class_parse(struct qos_conf *c, const char *s);
+
+/* Set up the queues from src to dst, taking extra buffers from src if
+ * possible. tsc_hz converts the rates and the sojourn times. */
+int qos_init(struct qos *q, struct qos_conf *conf, struct pio_port *src,
+             const struct pio_port *dst, uint64_t tsc_hz);
+/* Release the queues, before closing src. */
+void qos_free(struct qos *q, struct pio_port *src);
+
+/* Move queued packets to the TX rings of dst by strict priority or the
+ * tree, at TSC now. Returns the number of packets sent. */
+unsigned int qos_drain(struct qos *q, struct pio_port *dst, uint64_t now);
+/* What the packets left by qos_drain() to dst at now wait for: POLLOUT
+ * if it is room in a full TX ring, to be polled for. Otherwise returns 0,
+ * with *at set to the TSC when a rate cap or the tree lets one go, or
+ * when to look at the slots in flight again, UINT64_MAX if none is
+ * queued: polling for TX space would then return at once and spin. */
+short qos_wait(const struct qos *q, const struct pio_port *dst, uint64_t now,
+               uint64_t *at);
+
+#endif /* __QOS_H__ */
@@ -0,0 +1,499 @@
+/*
+ * This program replays a pcap or pcapng file on a port, to reproduce
+ * captured traffic against fe, swap or forward. The file is mmap'd and
+ * indexed once (packet offsets, lengths and timestamps in two flat
+ * arrays, no per-packet allocation); then TX slots are filled in
+ * batches, each packet being sent when it is due according to its
+ * original timestamp, optionally sped up or slowed down. Pacing uses
+ * the TSC with busy waiting. In loop mode the timestamps are ignored
+ * and the file is sent over and over as fast as possible.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <byteswap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pktio.h"
+#include "tsc.h"
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BOM 0x1a2b3c4d
+#define PCAPNG_MAX_IFACES 64
+/* Largest packet for the backends addressing buffers by byte offset
+ * (buf_size 1), whose 2048-byte frames also hold a header. */
+#define REPLAY_BYTE_ADDR_MAX 1536
+
+struct rpkt {
+    uint64_t off; /* of the packet data in the file */
+    uint32_t len;
+    uint32_t pad;
+};
+
+struct pcap_index {
+    const unsigned char *base;
+    size_t size;
+    uint64_t n;
+    struct rpkt *pkt;
+    uint64_t *ts; /* nanoseconds; turned into TSC offsets before replay */
+};
+
+static int stop                   = 0;
+static unsigned long long sent    = 0;
+static unsigned long long skipped = 0;
+
+static void
+sigint_handler(int signum)
+{
+    stop = 1;
+}
+
+static inline uint32_t
+rd32(const unsigned char *p, int swap)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swap ? bswap_32(v) : v;
+}
+
+static inline uint16_t
+rd16(const unsigned char *p, int swap)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swap ? bswap_16(v) : v;
+}
+
+static inline void
+index_add(struct pcap_index *ix, uint64_t n, uint64_t off, uint32_t len,
+          uint64_t ts)
+{
+    if (ix->pkt) {
+        ix->pkt[n].off = off;
+        ix->pkt[n].len = len;
+        ix->ts[n]      = ts;
+    }
+}
+
+/* Walk a pcap file. With a NULL ix->pkt only count the packets. */
+static int64_t
+index_pcap(struct pcap_index *ix)
+{
+    const unsigned char *p = ix->base;
+    uint32_t magic         = rd32(p, 0);
+    int swap               = magic == bswap_32(PCAP_MAGIC_USEC) ||
+               magic == bswap_32(PCAP_MAGIC_NSEC);
+    uint64_t mult;
+    uint64_t off = 24;
+    int64_t n    = 0;
+
+    mult = (rd32(p, swap) == PCAP_MAGIC_NSEC) ? 1 : 1000;
+    while (off + 16 <= ix->size) {
+        uint64_t ts  = rd32(p + off, swap) * 1000000000ULL +
+                      rd32(p + off + 4, swap) * mult;
+        uint32_t len = rd32(p + off + 8, swap);
+
+        if (off + 16 + len > ix->size) {
+            break; /* truncated capture */
+        }
+        index_add(ix, n++, off + 16, len, ts);
+        off += 16 + len;
+    }
+
+    return n;
+}
+
+/* Walk a pcapng file, see index_pcap(). */
+static int64_t
+index_pcapng(struct pcap_index *ix)
+{
+    const unsigned char *p = ix->base;
+    uint64_t tsres[PCAPNG_MAX_IFACES]; /* timestamp units per second */
+    unsigned int nifaces = 0;
+    uint64_t last_ts     = 0;
+    uint64_t off         = 0;
+    int64_t n            = 0;
+    int swap             = 0;
+
+    while (off + 12 <= ix->size) {
+        uint32_t type = rd32(p + off, swap);
+        uint32_t blen;
+
+        if (type == PCAPNG_SHB) {
+            /* A new section, possibly with a different byte order. */
+            swap    = rd32(p + off + 8, 0) != PCAPNG_BOM;
+            nifaces = 0;
+        }
+        blen = rd32(p + off + 4, swap);
+        if (blen < 12 || (blen & 3) || off + blen > ix->size) {
+            break;
+        }
+
+        if (type == PCAPNG_IDB && nifaces < PCAPNG_MAX_IFACES) {
+            uint64_t opt = off + 16;
+
+            tsres[nifaces] = 1000000; /* default: microseconds */
+            while (opt + 4 <= off + blen - 4) {
+                uint16_t code = rd16(p + opt, swap);
+                uint16_t olen = rd16(p + opt + 2, swap);
+
+                if (code == 0) {
+                    break;
+                }
+                if (code == 9 && olen == 1) {
+                    uint8_t r = p[opt + 4];
+
+                    tsres[nifaces] = 1;
+                    while (r & 0x7f) {
+                        tsres[nifaces] *= (r & 0x80) ? 2 : 10;
+                        r--;
+                    }
+                }
+                opt += 4 + ((olen + 3) & ~3);
+            }
+            nifaces++;
+        } else if (type == PCAPNG_EPB && blen >= 32) {
+            uint32_t iface = rd32(p + off + 8, swap);
+            uint64_t t     = ((uint64_t)rd32(p + off + 12, swap) << 32) |
+                         rd32(p + off + 16, swap);
+            uint32_t len   = rd32(p + off + 20, swap);
+            uint64_t res   = iface < nifaces ? tsres[iface] : 1000000;
+
+            if (28 + len <= blen) {
+                last_ts = t / res * 1000000000ULL +
+                          t % res * 1000000000ULL / res;
+                index_add(ix, n++, off + 28, len, last_ts);
+            }
+        } else if (type == PCAPNG_SPB && blen >= 16) {
+            /* No timestamp: send it together with the previous one. */
+            uint32_t len = rd32(p + off + 8, swap);
+
+            if (len > blen - 16) {
+                len = blen - 16;
+            }
+            index_add(ix, n++, off + 12, len, last_ts);
+        }
+        off += blen;
+    }
+
+    return n;
+}
+
+static int
+index_build(struct pcap_index *ix, const char *path)
+{
+    int64_t (*walk)(struct pcap_index *);
+    struct stat sb;
+    uint32_t magic;
+    int fd;
+
+    memset(ix, 0, sizeof(*ix));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &sb) || sb.st_size < 24) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    ix->size = sb.st_size;
+    ix->base = mmap(NULL, ix->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ix->base == MAP_FAILED) {
+        return -1;
+    }
+    madvise((void *)ix->base, ix->size, MADV_SEQUENTIAL);
+
+    magic = rd32(ix->base, 0);
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC ||
+        magic == bswap_32(PCAP_MAGIC_USEC) ||
+        magic == bswap_32(PCAP_MAGIC_NSEC)) {
+        walk = index_pcap;
+    } else if (magic == PCAPNG_SHB) {
+        walk = index_pcapng;
+    } else {
+        munmap((void *)ix->base, ix->size);
+        errno = EPROTO;
+        return -1;
+    }
+
+    /* Count first, then fill two flat arrays. */
+    ix->n   = walk(ix);
+    ix->pkt = malloc((ix->n + 1) * sizeof(ix->pkt[0]));
+    ix->ts  = malloc((ix->n + 1) * sizeof(ix->ts[0]));
+    if (ix->pkt == NULL || ix->ts == NULL) {
+        free(ix->pkt);
+        free(ix->ts);
+        munmap((void *)ix->base, ix->size);
+        errno = ENOMEM;
+        return -1;
+    }
+    walk(ix);
+
+    return 0;
+}
+
+static void
+index_free(struct pcap_index *ix)
+{
+    free(ix->pkt);
+    free(ix->ts);
+    munmap((void *)ix->base, ix->size);
+}
+
+static int
+main_loop(const char *netmap_port, struct pcap_index *ix, double speed,
+          int loop, unsigned long long count, unsigned int batch)
+{
+    struct pio_port *port;
+    uint64_t next = 0; /* next packet of the index */
+    uint64_t t_start, t_end;
+    unsigned long long bytes = 0;
+    uint64_t i;
+
+    port = pio_open(netmap_port, NULL);
+    if (port == NULL) {
+        if (!errno) {
+            printf("Failed to pio_open(%s): unknown port type\n", netmap_port);
+        } else {
+            printf("Failed to pio_open(%s): %s\n", netmap_port,
+                   strerror(errno));
+        }
+        return -1;
+    }
+
+    /* Timestamps become TSC offsets from the first packet. The file may
+     * not be sorted: never go back in time. */
+    for (i = ix->n; i-- > 1;) {
+        ix->ts[i] = ix->ts[i] > ix->ts[0] ? ix->ts[i] - ix->ts[0] : 0;
+    }
+    ix->ts[0] = 0;
+    for (i = 0; i < ix->n; i++) {
+        ix->ts[i] = ns2tsc(ix->ts[i] / speed);
+        if (i && ix->ts[i] < ix->ts[i - 1]) {
+            ix->ts[i] = ix->ts[i - 1];
+        }
+    }
+    t_start = rdtsc();
+
+    while (!stop && (count == 0 || sent < count) && (loop || next < ix->n)) {
+        struct pio_pollfd pfd[1];
+        unsigned int ri;
+        int ret;
+
+        pfd[0].port   = port;
+        pfd[0].events = POLLOUT;
+
+        ret = pio_poll(pfd, 1, 1000);
+        if (ret < 0) {
+            perror("pio_poll()");
+        } else if (ret == 0) {
+            /* Timeout */
+            continue;
+        }
+
+        for (ri = port->first_tx_ring; ri <= port->last_tx_ring; ri++) {
+            struct pio_ring *txring = PIO_TXRING(port, ri);
+            unsigned int n          = pio_ring_space(txring);
+            unsigned int head       = txring->head;
+            unsigned int maxlen     = txring->buf_size > 1
+                                          ? txring->buf_size
+                                          : REPLAY_BYTE_ADDR_MAX;
+
+            if (n > batch) {
+                n = batch;
+            }
+            if (count && n > count - sent) {
+                n = count - sent;
+            }
+            if (!loop) {
+                uint64_t now;
+                unsigned int m;
+
+                if (n > ix->n - next) {
+                    n = ix->n - next;
+                }
+                if (n == 0) {
+                    continue;
+                }
+                /* Busy wait for the first packet, then take all the
+                 * ones that are due. */
+                while ((now = rdtsc()) - t_start < ix->ts[next] && !stop) {
+                }
+                for (m = 1; m < n && ix->ts[next + m] <= now - t_start; m++) {
+                }
+                n = m;
+            }
+
+            for (; n > 0; n--) {
+                const struct rpkt *rp = &ix->pkt[next];
+                struct pio_slot *slot = &txring->slot[head];
+
+                if (++next == ix->n && loop) {
+                    next = 0;
+                }
+                if (rp->len > maxlen) {
+                    skipped++;
+                    continue;
+                }
+                memcpy(PIO_BUF(txring, slot->buf_idx), ix->base + rp->off,
+                       rp->len);
+                slot->len = rp->len;
+                bytes += rp->len;
+                sent++;
+                head = pio_ring_next(txring, head);
+            }
+            txring->head = txring->cur = head;
+        }
+    }
+
+    /* Flush the last batch. */
+    {
+        struct pio_pollfd pfd[1] = {{port, 0, 0}};
+
+        pio_poll(pfd, 1, 0);
+    }
+    t_end = rdtsc();
+    pio_close(port);
+
+    printf("Total sent packets: %llu\n", sent);
+    printf("Skipped (too long): %llu\n", skipped);
+    if (t_end > t_start) {
+        double ns = tsc2ns(t_end - t_start);
+
+        printf("Duration          : %.3f s\n", ns / 1e9);
+        printf("Average rate      : %.3f Mpps, %.3f Gbps\n", sent / ns * 1e3,
+               bytes * 8 / ns);
+    }
+
+    return 0;
+}
+
+static void
+usage(char **argv)
+{
+    printf("usage: %s [-h] [-i NETMAP_PORT] [-f PCAP_FILE] [-x SPEED] [-l] "
+           "[-n COUNT] [-b BATCH]\n"
+           "    -x 2 replays twice as fast, -l loops ignoring timestamps\n",
+           argv[0]);
+    exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *netmap_port  = NULL;
+    const char *file         = NULL;
+    double speed             = 1.0;
+    int loop                 = 0;
+    unsigned long long count = 0; /* zero means the whole file */
+    unsigned int batch       = 256;
+    struct pcap_index ix;
+    struct sigaction sa;
+    uint64_t t0;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "hi:f:x:ln:b:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage(argv);
+            return 0;
+
+        case 'i':
+            netmap_port = optarg;
+            break;
+
+        case 'f':
+            file = optarg;
+            break;
+
+        case 'x':
+            speed = atof(optarg);
+            if (speed <= 0) {
+                printf("    invalid speed %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        case 'l':
+            loop = 1;
+            break;
+
+        case 'n':
+            count = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'b':
+            batch = atoi(optarg);
+            if (batch == 0) {
+                printf("    invalid batch %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
+        default:
+            printf("    unrecognized option '-%c'\n", opt);
+            usage(argv);
+            return -1;
+        }
+    }
+
+    if (netmap_port == NULL || file == NULL) {
+        printf("    missing netmap port or pcap file\n");
+        usage(argv);
+    }
+
+    /* Register Ctrl-C handler. */
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    ret         = sigaction(SIGINT, &sa, NULL);
+    if (ret) {
+        perror("sigaction(SIGINT)");
+        exit(EXIT_FAILURE);
+    }
+
+    t0 = ns_now();
+    if (index_build(&ix, file)) {
+        printf("Failed to index %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    if (ix.n == 0) {
+        printf("No packets in %s\n", file);
+        index_free(&ix);
+        return -1;
+    }
+    printf("Indexed %llu packets in %.1f ms\n", (unsigned long long)ix.n,
+           (ns_now() - t0) / 1e6);
+
+    tsc_calibrate();
+
+    printf("Port      : %s\n", netmap_port);
+    printf("File      : %s\n", file);
+    if (loop) {
+        printf("Mode      : loop, ignoring timestamps\n");
+    } else {
+        printf("Mode      : original timing x %.3f\n", speed);
+    }
+
+    main_loop(netmap_port, &ix, speed, loop, count, batch);
+
+    index_free(&ix);
+
+    return 0;
+}
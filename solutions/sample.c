@@ -0,0 +1,222 @@
+/*
+ * 1:N packet sampling through an exporter thread, see sample.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "sample.h"
+#include "capture.h"
+#include "pkt.h"
+#include "tsc.h"
+
+int
+sample_parse(const char *s, int *mode, uint32_t *rate)
+{
+    unsigned long n;
+    char *end;
+
+    *mode = SAMPLE_COUNT;
+    if (!strncmp(s, "count:", 6)) {
+        s += 6;
+    } else if (!strncmp(s, "flow:", 5)) {
+        *mode = SAMPLE_FLOW;
+        s += 5;
+    }
+    n = strtoul(s, &end, 10);
+    if (end == s || *end != '\0' || n == 0 || n > UINT32_MAX / 2) {
+        errno = EINVAL;
+        return -1;
+    }
+    *rate = n;
+
+    return 0;
+}
+
+static void *
+sample_exporter(void *arg)
+{
+    struct sampler *s = arg;
+    uint32_t idx[SAMPLE_BURST];
+
+    for (;;) {
+        /* Look at done first: what was handed over before is seen. */
+        int done = __atomic_load_n(&s->done, __ATOMIC_ACQUIRE);
+        unsigned int n, i;
+
+        n = spsc_dequeue_burst(s->full, idx, SAMPLE_BURST);
+        for (i = 0; i < n; i++) {
+            const struct sample_rec *r = &s->recs[idx[i]];
+            uint64_t dt                = r->ts - s->tsc0;
+            uint64_t ns                = s->wall0_ns;
+
+            /* In two steps, dt * 10^9 would overflow within seconds. */
+            ns += dt / s->tsc_hz * 1000000000;
+            ns += dt % s->tsc_hz * 1000000000 / s->tsc_hz;
+
+            if (cap_packet_snap(s->cap, (const char *)r->data, r->caplen,
+                                r->len, ns)) {
+                /* The capture writer is behind, counted as its drop. */
+                continue;
+            }
+            __atomic_fetch_add(&s->written, 1, __ATOMIC_RELAXED);
+        }
+        if (n > 0) {
+            /* The ring holds all the records, there is always room. */
+            spsc_enqueue_burst(s->free, idx, n);
+            continue;
+        }
+        if (done) {
+            break;
+        }
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+static void
+sample_free(struct sampler *s)
+{
+    free(s->full);
+    free(s->free);
+    free(s->recs);
+    free(s);
+}
+
+struct sampler *
+sample_open(const char *path, int mode, uint32_t rate, uint64_t hz)
+{
+    struct sampler *s;
+    struct timespec ts;
+    unsigned int i;
+    int ret;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->mode      = mode;
+    s->rate      = rate;
+    s->threshold = UINT32_MAX / rate;
+    s->rng       = 0x9e3779b9;
+    s->recs      = calloc(SAMPLE_RECS, sizeof(*s->recs));
+    s->full      = spsc_ring_create(SAMPLE_RECS);
+    s->free      = spsc_ring_create(SAMPLE_RECS);
+    if (s->recs == NULL || s->full == NULL || s->free == NULL) {
+        sample_free(s);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < SAMPLE_RECS; i++) {
+        s->stash[i] = i;
+    }
+    s->nstash = SAMPLE_RECS;
+
+    s->cap = cap_open(path);
+    if (s->cap == NULL) {
+        goto err;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    s->wall0_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    s->tsc0     = rdtsc();
+    s->tsc_hz   = hz;
+    ret         = pthread_create(&s->exporter, NULL, sample_exporter, s);
+    if (ret) {
+        cap_close(s->cap);
+        errno = ret;
+        goto err;
+    }
+
+    return s;
+err:
+    ret = errno;
+    sample_free(s);
+    errno = ret;
+    return NULL;
+}
+
+uint32_t
+sample_countdown(struct sampler *s)
+{
+    uint32_t x;
+
+    if (s == NULL) {
+        return UINT32_MAX;
+    }
+    if (s->mode == SAMPLE_FLOW || s->rate == 1) {
+        return 1; /* in flow mode every packet is hashed */
+    }
+    x = s->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    s->rng = x;
+
+    return 1 + x % (2 * (uint64_t)s->rate - 1);
+}
+
+void
+sample_flush(struct sampler *s)
+{
+    if (s && s->nout > 0) {
+        spsc_enqueue_burst(s->full, s->out, s->nout);
+        s->nout = 0;
+    }
+}
+
+uint32_t
+sample_take(struct sampler *s, const char *buf, unsigned int len)
+{
+    struct sample_rec *r;
+
+    if (s == NULL) {
+        return UINT32_MAX;
+    }
+    if (s->mode == SAMPLE_FLOW) {
+        struct pkt_meta m;
+
+        s->pool++;
+        pkt_parse(buf, len, &m);
+        /* Only IPv4 packets have a flow hash. */
+        if (!(m.flags & PKT_META_IPV4) || m.hash > s->threshold) {
+            return 1;
+        }
+    }
+
+    if (s->nstash == 0) {
+        s->nstash = spsc_dequeue_burst(s->free, s->stash, SAMPLE_RECS);
+        if (s->nstash == 0) {
+            s->drops++;
+            return sample_countdown(s);
+        }
+    }
+    s->out[s->nout] = s->stash[--s->nstash];
+    r               = &s->recs[s->out[s->nout++]];
+    r->ts           = rdtsc();
+    r->len          = len;
+    r->caplen       = len < SAMPLE_CAPLEN ? len : SAMPLE_CAPLEN;
+    memcpy(r->data, buf, r->caplen);
+    s->samples++;
+    if (s->nout == SAMPLE_BURST) {
+        sample_flush(s);
+    }
+
+    return sample_countdown(s);
+}
+
+int
+sample_close(struct sampler *s)
+{
+    int ret;
+
+    sample_flush(s);
+    __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+    pthread_join(s->exporter, NULL);
+    ret = cap_close(s->cap);
+    sample_free(s);
+
+    return ret;
+}
@@ -0,0 +1,101 @@
+/*
+ * 1:N packet sampling, for sFlow-like samples of the traffic at a small
+ * fraction of the cost of mirroring it.
+ *
+ * The forwarding loop keeps a countdown of the packets until the next
+ * sample: a packet that is not sampled costs a decrement and a compare.
+ * When the countdown reaches zero, sample_take() copies the first
+ * SAMPLE_CAPLEN bytes of the packet, with its length and a timestamp,
+ * and returns the next countdown. The selection is either
+ *
+ *   count  one packet in N on average, whatever the flow. The gaps are
+ *          drawn uniformly from 1..2N-1 by a seeded xorshift, the
+ *          sequence is the same from run to run: a fixed gap of N would
+ *          alias with periodic traffic, e.g. always pick the same flow
+ *          of N sent in round robin;
+ *   flow   the packets of one flow in N, by their symmetric flow hash,
+ *          so that a sampled flow is seen in full, in both directions.
+ *          Every packet then goes through sample_take() to be hashed.
+ *
+ * The copies are records from a preallocated pool, handed to an exporter
+ * thread through a lock-free ring of record indices and given back
+ * through another one, as in ipfix.h. The exporter writes them to a pcap
+ * or pcapng file (see capture.h), truncated and with their original
+ * length. When it is behind and no record is free, the samples are
+ * dropped and counted instead.
+ */
+#ifndef __SAMPLE_H__
+#define __SAMPLE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "spsc.h"
+
+#define SAMPLE_CAPLEN 128
+#define SAMPLE_RECS 4096 /* records in flight, a power of two */
+#define SAMPLE_BURST 32
+
+/* Selection. */
+enum {
+    SAMPLE_COUNT,
+    SAMPLE_FLOW,
+};
+
+struct sample_rec {
+    uint64_t ts; /* TSC */
+    uint16_t len;
+    uint16_t caplen;
+    unsigned char data[SAMPLE_CAPLEN];
+};
+
+struct capture;
+
+struct sampler {
+    int mode;
+    uint32_t rate;      /* N */
+    uint32_t threshold; /* SAMPLE_FLOW: hashes below are sampled */
+    uint32_t rng;       /* SAMPLE_COUNT: xorshift state of the gaps */
+
+    struct sample_rec *recs;
+    struct spsc_ring *full; /* to the exporter */
+    struct spsc_ring *free; /* back from the exporter */
+    uint32_t stash[SAMPLE_RECS]; /* free records taken by the RX loop */
+    unsigned int nstash;
+    uint32_t out[SAMPLE_BURST]; /* records not handed over yet */
+    unsigned int nout;
+
+    struct capture *cap;
+    pthread_t exporter;
+    int done;
+    uint64_t tsc_hz;
+    uint64_t tsc0;    /* TSC at wall0_ns */
+    uint64_t wall0_ns;
+
+    unsigned long long pool;    /* packets looked at in flow mode */
+    unsigned long long samples; /* handed to the exporter */
+    unsigned long long drops;   /* lost with no record free */
+    unsigned long long written; /* by the exporter */
+};
+
+/* Parse [count:|flow:]N, the selection defaulting to count. Returns 0
+ * on success. */
+int sample_parse(const char *s, int *mode, uint32_t *rate);
+
+/* Sample 1 in rate packets into the file path. tsc_hz converts the
+ * timestamps. */
+struct sampler *sample_open(const char *path, int mode, uint32_t rate,
+                            uint64_t tsc_hz);
+/* The next countdown. With no sampler it is UINT32_MAX, and
+ * sample_take() is called once every 2^32 packets for nothing. */
+uint32_t sample_countdown(struct sampler *s);
+/* The countdown reached zero on the frame buf of len bytes: sample it
+ * if selected, and return the next countdown. s may be NULL. */
+uint32_t sample_take(struct sampler *s, const char *buf, unsigned int len);
+/* Hand the samples taken over to the exporter. To be called after each
+ * batch. */
+void sample_flush(struct sampler *s);
+/* Export the samples left, stop the exporter and close the file.
+ * Returns -1 with errno set if a write failed. */
+int sample_close(struct sampler *s);
+
+#endif /* __SAMPLE_H__ */
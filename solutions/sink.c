@@ -1,7 +1,10 @@
 /*
  * This program opens a netmap port and starts receiving packets,
  * counting all the UDP packets with a destination port specified
- * by command-line option.
+ * by command-line option, or selected by an eBPF program (-e) or a
+ * tcpdump expression (-f), see ebpf.h. Optionally (-w) the counted
+ * packets are captured to a pcap or pcapng file, see capture.h, and
+ * (-x) metered into flows exported as IPFIX records, see ipfix.h.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,17 +12,22 @@
 #include <signal.h>
 #include <errno.h>
 #include <poll.h>
+#include <string.h>
 #include <net/if.h>
 #include <stdint.h>
-#include <net/netmap.h>
-#define NETMAP_WITH_LIBS
-#include <net/netmap_user.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
 #include <netinet/tcp.h>
+#include "pktio.h"
+#include "pkt.h"
+#include "capture.h"
+#include "ipfix.h"
+#include "ebpf.h"
+#include "stats.h"
+#include "tsc.h"
 
 static int stop = 0;
 
@@ -29,78 +37,192 @@ sigint_handler(int signum)
     stop = 1;
 }
 
-static inline int
-udp_port_match(const char *buf, unsigned len, int udp_port)
+#ifdef SOLUTION
+/* Statistics about the stamps embedded by gen -T. */
+struct stamp_stats {
+    unsigned long long stamped;
+    unsigned long long reordered;
+    unsigned long long gaps;
+    uint32_t *next_seq; /* by flow index, 0 before the first */
+    uint64_t lat_min, lat_max, lat_sum;
+    struct stats_hist lat_ns;
+};
+
+static void
+stamp_check(struct stamp_stats *ss, const char *buf, unsigned len,
+            uint64_t now)
 {
-    struct ether_header *ethh;
-    struct ip *iph;
-    struct udphdr *udph;
+    const struct pkt_stamp *st = pkt_get_stamp(buf, len);
+    uint32_t *next;
+    uint64_t lat;
+    uint32_t seq;
 
-    ethh = (struct ether_header *)buf;
-    if (ethh->ether_type != htons(ETHERTYPE_IP)) {
-        /* Filter out non-IP traffic. */
-        return 0;
+    if (st == NULL) {
+        return;
+    }
+    /* The flows are checked on their own: a receiver may get only some
+     * of them, or get them reordered relative to each other. */
+    next = &ss->next_seq[ntohs(st->flow)];
+    seq  = ntohl(st->seq);
+    if (*next && seq != *next) {
+        if ((int32_t)(seq - *next) < 0) {
+            ss->reordered++;
+        } else {
+            ss->gaps++;
+        }
     }
-    iph = (struct ip *)(ethh + 1);
-    if (iph->ip_p != IPPROTO_UDP) {
-        /* Filter out non-UDP traffic. */
-        return 0;
+    *next = seq + 1;
+    lat   = now > st->ts ? now - st->ts : 0;
+    if (ss->stamped == 0 || lat < ss->lat_min) {
+        ss->lat_min = lat;
     }
-    udph = (struct udphdr *)(iph + 1);
-
-    /* Match the destination port. */
-    if (udph->uh_dport == htons(udp_port)) {
-        return 1;
+    if (lat > ss->lat_max) {
+        ss->lat_max = lat;
     }
-
-    return 0;
+    ss->lat_sum += lat;
+    ss->stamped++;
+    stats_hist_add(&ss->lat_ns, tsc2ns(lat));
 }
+#endif /* SOLUTION */
 
 static int
-main_loop(const char *netmap_port, int udp_port)
+main_loop(const char *netmap_port, int udp_port, int check,
+          const char *metrics, const char *capture_file,
+          const char *collector, unsigned int active_s, unsigned int idle_s,
+          struct pio_wakeup *wk, struct ebpf_prog *filter)
 {
 #ifdef SOLUTION
-    struct nm_desc *nmd;
+    struct capture *cap = NULL;
+    struct ipfix *fx    = NULL;
+    struct pio_port *port;
     unsigned long long cnt = 0;
     unsigned long long tot = 0;
+    struct stamp_stats ss;
+    struct stats_hist batch_h, proc_h;
+    struct stats *st;
+    int serr = 0; /* a stats registration failed */
 
-    nmd = nm_open(netmap_port, NULL, 0, NULL);
-    if (nmd == NULL) {
+    memset(&ss, 0, sizeof(ss));
+    memset(&batch_h, 0, sizeof(batch_h));
+    memset(&proc_h, 0, sizeof(proc_h));
+    if (check) {
+        ss.next_seq = calloc(PKT_STAMP_FLOWS, sizeof(*ss.next_seq));
+        if (ss.next_seq == NULL) {
+            printf("Failed to allocate the sequence numbers\n");
+            return -1;
+        }
+    }
+
+    port = pio_open(netmap_port, NULL);
+    if (port == NULL) {
         if (!errno) {
-            printf("Failed to nm_open(%s): not a netmap port\n", netmap_port);
+            printf("Failed to pio_open(%s): unknown port type\n", netmap_port);
         } else {
-            printf("Failed to nm_open(%s): %s\n", netmap_port, strerror(errno));
+            printf("Failed to pio_open(%s): %s\n", netmap_port,
+                   strerror(errno));
         }
         return -1;
     }
+
+    if (capture_file) {
+        cap = cap_open(capture_file);
+        if (cap == NULL) {
+            printf("Failed to open %s: %s\n", capture_file, strerror(errno));
+            pio_close(port);
+            return -1;
+        }
+    }
+    if (collector) {
+        fx = ipfix_open(collector, active_s, idle_s, tsc_hz);
+        if (fx == NULL) {
+            printf("Failed to open %s: %s\n", collector, strerror(errno));
+            if (cap) {
+                cap_close(cap);
+            }
+            pio_close(port);
+            return -1;
+        }
+    }
+
+    st = stats_open("sink");
+    if (st == NULL) {
+        printf("Failed to create the stats segment: %s\n", strerror(errno));
+    }
+    serr |= stats_add(st, "tot", &tot);
+    serr |= stats_add(st, "cnt", &cnt);
+    if (check) {
+        serr |= stats_add(st, "stamped", &ss.stamped);
+        serr |= stats_add(st, "gaps", &ss.gaps);
+        serr |= stats_add(st, "reordered", &ss.reordered);
+        serr |= stats_add_hist(st, "latency_ns", &ss.lat_ns);
+    }
+    if (cap) {
+        serr |= stats_add(st, "cap_pkts", &cap->pkts);
+        serr |= stats_add(st, "cap_drops", &cap->drops);
+    }
+    if (fx) {
+        serr |= stats_add(st, "ipfix_flows", &fx->flows);
+        serr |= stats_add(st, "ipfix_records", &fx->records);
+        serr |= stats_add(st, "ipfix_drops", &fx->drops);
+        serr |= stats_add(st, "ipfix_evictions", &fx->evictions);
+        serr |= stats_add(st, "ipfix_msgs", &fx->msgs);
+    }
+    serr |= stats_add_port(st, "rx", port);
+    serr |= stats_add_hist(st, "batch", &batch_h);
+    serr |= stats_add_hist(st, "proc_ns", &proc_h);
+    serr |= stats_add_wakeup(st, wk);
+    if (serr) {
+        printf("Failed to register the stats: %s\n", strerror(errno));
+    }
+    if (metrics && stats_export(st, metrics)) {
+        printf("Failed to export metrics on %s: %s\n", metrics,
+               strerror(errno));
+    }
+    if (pio_wakeup_start(wk)) {
+        printf("Failed to lower the timer slack: %s\n", strerror(errno));
+    }
 #endif /* SOLUTION */
 
     while (!stop) {
 #ifdef SOLUTION
-        struct pollfd pfd[1];
+        struct pio_pollfd pfd[1];
+        unsigned long long tot0;
         unsigned int ri;
+        uint64_t t0;
         int ret;
 
-        pfd[0].fd     = nmd->fd;
+        stats_publish(st);
+
+        pfd[0].port   = port;
         pfd[0].events = POLLIN;
 
         /* We poll with a timeout to have a chance to break the main loop if
          * no packets are coming. */
-        ret = poll(pfd, 1, 1000);
+        ret = pio_poll_moderated(pfd, 1, 1000, wk);
+        if (fx) {
+            /* Flows expire also when no packets are coming. */
+            ipfix_expire(fx, rdtsc());
+        }
         if (ret < 0) {
-            perror("poll()");
+            perror("pio_poll()");
         } else if (ret == 0) {
             /* Timeout */
             continue;
         }
+        t0   = rdtsc();
+        tot0 = tot;
 
         /* Scan all the receive rings. */
-        for (ri = nmd->first_rx_ring; ri <= nmd->last_rx_ring; ri++) {
-            struct netmap_ring *rxring;
+        for (ri = port->first_rx_ring; ri <= port->last_rx_ring; ri++) {
+            struct pio_ring *rxring;
             unsigned head, tail;
-            int batch;
+            uint64_t now     = 0;
+            uint64_t wall_ns = 0;
+            uint32_t verdict[EBPF_BURST];
+            unsigned int nv = 0, k = 0;
+            int batch, left;
 
-            rxring = NETMAP_RXRING(nmd->nifp, ri);
+            rxring = PIO_RXRING(port, ri);
             head   = rxring->head;
             tail   = rxring->tail;
             batch  = tail - head;
@@ -108,23 +230,94 @@ main_loop(const char *netmap_port, int udp_port)
                 batch += rxring->num_slots;
             }
             tot += batch;
-            for (; head != tail; head = nm_ring_next(rxring, head)) {
-                struct netmap_slot *slot = rxring->slot + head;
-                char *buf                = NETMAP_BUF(rxring, slot->buf_idx);
+            left = batch;
+            if ((check || fx) && batch) {
+                now = rdtsc();
+            }
+            if (cap && batch) {
+                struct timespec ts;
 
-                if (udp_port_match(buf, slot->len, udp_port)) {
+                /* One timestamp per batch, as the NIC would give us. */
+                clock_gettime(CLOCK_REALTIME, &ts);
+                wall_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            }
+            for (; head != tail; head = pio_ring_next(rxring, head), left--) {
+                struct pio_slot *slot = rxring->slot + head;
+                char *buf             = PIO_BUF(rxring, slot->buf_idx);
+                int match;
+
+                if (filter) {
+                    if (k == nv) {
+                        /* Classify the next burst with one call. */
+                        nv = left < EBPF_BURST ? left : EBPF_BURST;
+                        ebpf_run_ring(filter, rxring, head, nv, verdict);
+                        k = 0;
+                    }
+                    match = verdict[k++] != EBPF_DROP;
+                } else {
+                    match = udp_port_match(buf, slot->len, udp_port);
+                }
+                if (match) {
                     cnt++;
+                    if (cap) {
+                        cap_packet(cap, buf, slot->len, wall_ns);
+                    }
+                    if (fx) {
+                        ipfix_packet(fx, buf, slot->len, now);
+                    }
+                }
+                if (check) {
+                    stamp_check(&ss, buf, slot->len, now);
                 }
             }
             rxring->cur = rxring->head = head;
         }
+        if (tot != tot0) {
+            stats_hist_add(&batch_h, tot - tot0);
+            stats_hist_add(&proc_h, tsc2ns(rdtsc() - t0));
+        }
 #endif /* SOLUTION */
     }
 
 #ifdef SOLUTION
-    nm_close(nmd);
+    stats_close(st);
+    pio_close(port);
     printf("Total received packets: %llu\n", tot);
     printf("Counted packets       : %llu\n", cnt);
+    if (wk && wk->wakeups) {
+        printf("Wakeups               : %llu (%.1f slots each)\n",
+               wk->wakeups, (double)wk->slots / wk->wakeups);
+    }
+    if (cap) {
+        printf("Captured packets      : %llu\n", cap->pkts);
+        printf("Capture drops         : %llu\n", cap->drops);
+        if (cap_close(cap)) {
+            printf("Failed to write %s: %s\n", capture_file,
+                   strerror(errno));
+        }
+    }
+    if (fx) {
+        printf("Metered flows         : %llu\n", fx->flows);
+        printf("IPFIX records         : %llu (%llu evicted, %llu dropped)\n",
+               fx->records, fx->evictions, fx->drops);
+        printf("IPFIX messages        : %llu\n", fx->msgs);
+        if (ipfix_close(fx)) {
+            printf("Failed to export to %s: %s\n", collector,
+                   strerror(errno));
+        }
+    }
+    if (check) {
+        printf("Stamped packets       : %llu\n", ss.stamped);
+        printf("Sequence gaps         : %llu\n", ss.gaps);
+        printf("Reordered packets     : %llu\n", ss.reordered);
+        if (ss.stamped) {
+            printf("Latency min/avg/max   : %llu/%llu/%llu ns\n",
+                   (unsigned long long)tsc2ns(ss.lat_min),
+                   (unsigned long long)tsc2ns(ss.lat_sum / ss.stamped),
+                   (unsigned long long)tsc2ns(ss.lat_max));
+        }
+    }
+    free(ss.next_seq);
 #endif /* SOLUTION */
 
     return 0;
@@ -133,20 +326,36 @@ main_loop(const char *netmap_port, int udp_port)
 static void
 usage(char **argv)
 {
-    printf("usage: %s [-h] [-p UDP_PORT] [-i NETMAP_PORT]\n", argv[0]);
+    printf("usage: %s [-h] [-p UDP_PORT] [-i NETMAP_PORT] [-T] "
+           "[-M unix:PATH|tcp:PORT] [-w FILE.pcap|FILE.pcapng] "
+           "[-W TARGET[:MAX_US]] [-e FILE[:SECTION]] "
+           "[-f EXPR|@FILE] [-x FILE|udp:HOST:PORT] "
+           "[-X ACTIVE_S[:IDLE_S]]\n",
+           argv[0]);
     exit(EXIT_SUCCESS);
 }
 
 int
 main(int argc, char **argv)
 {
-    const char *netmap_port = NULL;
-    int udp_port            = 8000;
+    const char *netmap_port  = NULL;
+    int udp_port             = 8000;
+    int check                = 0;
+    const char *metrics      = NULL;
+    const char *capture      = NULL;
+    const char *collector    = NULL;
+    unsigned int active_s    = IPFIX_ACTIVE_SECS;
+    unsigned int idle_s      = IPFIX_IDLE_SECS;
+    struct pio_wakeup *wk    = NULL;
+    struct ebpf_prog *filter = NULL;
+    const char *filter_name  = NULL;
+    char errbuf[CBPF_ERRBUF_SIZE];
+    struct pio_wakeup wakeup;
     struct sigaction sa;
     int opt;
     int ret;
 
-    while ((opt = getopt(argc, argv, "hi:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "hi:p:TM:w:W:e:f:x:X:")) != -1) {
         switch (opt) {
         case 'h':
             usage(argv);
@@ -164,6 +373,70 @@ main(int argc, char **argv)
             }
             break;
 
+        case 'T':
+            /* Check the stamps embedded by gen -T. */
+            check = 1;
+            break;
+
+        case 'M':
+            /* Serve OpenMetrics on a Unix socket or localhost TCP. */
+            metrics = optarg;
+            break;
+
+        case 'w':
+            capture = optarg;
+            break;
+
+        case 'W':
+            /* Hold small wakeups back, TARGET slots within MAX_US. */
+            if (pio_wakeup_parse(&wakeup, optarg)) {
+                printf("    invalid wakeup moderation %s\n", optarg);
+                usage(argv);
+            }
+            wk = &wakeup;
+            break;
+
+        case 'e':
+            /* Count the packets selected by an eBPF program. */
+            if (filter) {
+                printf("    at most one -e or -f filter\n");
+                usage(argv);
+            }
+            filter = ebpf_open(optarg);
+            if (filter == NULL) {
+                printf("    failed to load %s: %s\n", optarg,
+                       strerror(errno));
+                usage(argv);
+            }
+            filter_name = optarg;
+            break;
+
+        case 'f':
+            /* Count the packets matching a tcpdump expression. */
+            if (filter) {
+                printf("    at most one -e or -f filter\n");
+                usage(argv);
+            }
+            filter = cbpf_compile(optarg, errbuf);
+            if (filter == NULL) {
+                printf("    invalid filter '%s': %s\n", optarg, errbuf);
+                usage(argv);
+            }
+            filter_name = optarg;
+            break;
+
+        case 'x':
+            /* Meter the counted packets and export the flows. */
+            collector = optarg;
+            break;
+
+        case 'X':
+            if (ipfix_timeouts_parse(optarg, &active_s, &idle_s)) {
+                printf("    invalid flow timeouts %s\n", optarg);
+                usage(argv);
+            }
+            break;
+
         default:
             printf("    unrecognized option '-%c'\n", opt);
             usage(argv);
@@ -187,11 +460,18 @@ main(int argc, char **argv)
     }
 
     printf("Port    : %s\n", netmap_port);
-    printf("UDP port: %d\n", udp_port);
+    if (filter) {
+        printf("Filter  : %s (%u eBPF insns, %s)\n", filter_name,
+               filter->ninsns, filter->jitted ? "JIT compiled" : "interpreted");
+    } else {
+        printf("UDP port: %d\n", udp_port);
+    }
 
-    main_loop(netmap_port, udp_port);
+    tsc_calibrate();
 
-    (void)udp_port_match; /* silence the compiler */
+    main_loop(netmap_port, udp_port, check, metrics, capture, collector,
+              active_s, idle_s, wk, filter);
+    ebpf_free(filter);
 
     return 0;
 }
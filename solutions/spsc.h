@@ -0,0 +1,113 @@
+/*
+ * Lock-free single-producer single-consumer ring of 32-bit entries
+ * (typically buffer indices), for handing packets between threads of
+ * the same process. The producer and the consumer indices live in
+ * different cache lines, and each side caches the index of the other
+ * one to touch the shared line only when needed.
+ */
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct spsc_ring {
+    uint32_t mask;
+    uint32_t prod __attribute__((aligned(64)));
+    uint32_t cons_cache;
+    uint32_t cons __attribute__((aligned(64)));
+    uint32_t prod_cache;
+    uint32_t slot[] __attribute__((aligned(64)));
+};
+
+/* size must be a power of two. */
+static inline struct spsc_ring *
+spsc_ring_create(uint32_t size)
+{
+    struct spsc_ring *r;
+
+    if (size == 0 || (size & (size - 1))) {
+        return NULL;
+    }
+    r = aligned_alloc(64, sizeof(*r) + size * sizeof(r->slot[0]));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->mask       = size - 1;
+    r->prod       = 0;
+    r->cons_cache = 0;
+    r->cons       = 0;
+    r->prod_cache = 0;
+
+    return r;
+}
+
+static inline unsigned int
+spsc_free_space(struct spsc_ring *r)
+{
+    unsigned int space = r->mask + 1 - (r->prod - r->cons_cache);
+
+    if (space == 0) {
+        r->cons_cache = __atomic_load_n(&r->cons, __ATOMIC_ACQUIRE);
+        space         = r->mask + 1 - (r->prod - r->cons_cache);
+    }
+    return space;
+}
+
+static inline unsigned int
+spsc_count(struct spsc_ring *r)
+{
+    unsigned int n = r->prod_cache - r->cons;
+
+    if (n == 0) {
+        r->prod_cache = __atomic_load_n(&r->prod, __ATOMIC_ACQUIRE);
+        n             = r->prod_cache - r->cons;
+    }
+    return n;
+}
+
+/* Enqueue up to n entries, returns the number of entries enqueued. */
+static inline unsigned int
+spsc_enqueue_burst(struct spsc_ring *r, const uint32_t *e, unsigned int n)
+{
+    unsigned int space = spsc_free_space(r);
+    unsigned int i;
+
+    if (n > space) {
+        r->cons_cache = __atomic_load_n(&r->cons, __ATOMIC_ACQUIRE);
+        space         = r->mask + 1 - (r->prod - r->cons_cache);
+        if (n > space) {
+            n = space;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        r->slot[(r->prod + i) & r->mask] = e[i];
+    }
+    __atomic_store_n(&r->prod, r->prod + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/* Dequeue up to n entries, returns the number of entries dequeued. */
+static inline unsigned int
+spsc_dequeue_burst(struct spsc_ring *r, uint32_t *e, unsigned int n)
+{
+    unsigned int avail = spsc_count(r);
+    unsigned int i;
+
+    if (n > avail) {
+        r->prod_cache = __atomic_load_n(&r->prod, __ATOMIC_ACQUIRE);
+        avail         = r->prod_cache - r->cons;
+        if (n > avail) {
+            n = avail;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        e[i] = r->slot[(r->cons + i) & r->mask];
+    }
+    __atomic_store_n(&r->cons, r->cons + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+#endif /* __SPSC_H__ */
@@ -0,0 +1,539 @@
+/*
+ * Shared-memory stats segment, see stats.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "stats.h"
+
+#define STATS_EXPORT_BUF (128 * 1024)
+
+struct stats_src {
+    const unsigned long long *ctr;
+    const struct pio_ring *ring; /* gauge: slots ready on the ring */
+};
+
+struct stats {
+    struct stats_shm *shm;
+    char shm_name[64];
+    unsigned int n;
+    struct stats_src src[STATS_MAX];
+
+    /* OpenMetrics exporter. */
+    int exp_fd;
+    int exp_stop;
+    pthread_t exp_thread;
+    char exp_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+};
+
+struct stats *
+stats_open(const char *prog)
+{
+    struct stats *st;
+    int fd;
+
+    st = calloc(1, sizeof(*st));
+    if (st == NULL) {
+        return NULL;
+    }
+    st->exp_fd = -1;
+    snprintf(st->shm_name, sizeof(st->shm_name), STATS_PREFIX "%s-%d", prog,
+             (int)getpid());
+    fd = shm_open(st->shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(st);
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(*st->shm))) {
+        goto err;
+    }
+    st->shm = mmap(NULL, sizeof(*st->shm), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (st->shm == MAP_FAILED) {
+        goto err;
+    }
+    close(fd);
+
+    st->shm->version   = STATS_VERSION;
+    st->shm->desc_size = sizeof(struct stats_desc);
+    st->shm->pid       = getpid();
+    snprintf(st->shm->prog, sizeof(st->shm->prog), "%s", prog);
+    /* Readers ignore the segment until the magic is there. */
+    __atomic_store_n(&st->shm->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    return st;
+err:
+    close(fd);
+    shm_unlink(st->shm_name);
+    free(st);
+    return NULL;
+}
+
+static int
+stats_add_src(struct stats *st, const char *name, uint8_t type, uint64_t le,
+              const unsigned long long *ctr, const struct pio_ring *ring)
+{
+    struct stats_desc *d;
+
+    if (st == NULL) {
+        return 0;
+    }
+    if (st->n == STATS_MAX) {
+        errno = ENOSPC;
+        return -1;
+    }
+    d = &st->shm->desc[st->n];
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    d->type             = type;
+    d->le               = le;
+    st->src[st->n].ctr  = ctr;
+    st->src[st->n].ring = ring;
+    st->n++;
+    __atomic_store_n(&st->shm->ncounters, st->n, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int
+stats_add(struct stats *st, const char *name, const unsigned long long *ctr)
+{
+    return stats_add_src(st, name, STATS_COUNTER, 0, ctr, NULL);
+}
+
+/* A gauge reports the value as is, it may go down. */
+int
+stats_add_gauge(struct stats *st, const char *name,
+                const unsigned long long *val)
+{
+    return stats_add_src(st, name, STATS_GAUGE, 0, val, NULL);
+}
+
+/* Wakeup moderation: the achieved batch is wake_slots / wakeups. */
+int
+stats_add_wakeup(struct stats *st, const struct pio_wakeup *w)
+{
+    if (w == NULL) {
+        return 0;
+    }
+    if (stats_add(st, "wakeups", &w->wakeups) ||
+        stats_add(st, "wake_slots", &w->slots)) {
+        return -1;
+    }
+    return stats_add_gauge(st, "holdoff_us", &w->holdoff_us);
+}
+
+/* TX coalescing: flushes by reason, and pushes held back. */
+int
+stats_add_txflush(struct stats *st, const struct pio_txflush *tf)
+{
+    if (tf == NULL) {
+        return 0;
+    }
+    if (stats_add(st, "flush_batch", &tf->by_batch) ||
+        stats_add(st, "flush_deadline", &tf->by_deadline)) {
+        return -1;
+    }
+    return stats_add(st, "flush_deferred", &tf->deferred);
+}
+
+/* Register one gauge per RX ring of port, named NAME.rxI, reporting the
+ * number of slots waiting to be processed. */
+int
+stats_add_port(struct stats *st, const char *name,
+               const struct pio_port *port)
+{
+    unsigned int ri;
+
+    for (ri = port->first_rx_ring; ri <= port->last_rx_ring; ri++) {
+        char rname[STATS_NAME_MAX];
+
+        snprintf(rname, sizeof(rname), "%s.rx%u", name, ri);
+        if (stats_add_src(st, rname, STATS_GAUGE, 0, NULL,
+                          PIO_RXRING(port, ri))) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+stats_add_hist(struct stats *st, const char *name,
+               const struct stats_hist *h)
+{
+    unsigned int i;
+
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        uint64_t le = i == STATS_HIST_BUCKETS - 1 ? UINT64_MAX : 1ULL << i;
+
+        if (stats_add_src(st, name, STATS_BUCKET, le, &h->bucket[i], NULL)) {
+            return -1;
+        }
+    }
+
+    return stats_add_src(st, name, STATS_SUM, 0, &h->sum, NULL);
+}
+
+void
+stats_publish(struct stats *st)
+{
+    struct stats_shm *shm;
+    struct timespec ts;
+    uint32_t seq;
+    unsigned int i;
+
+    if (st == NULL) {
+        return;
+    }
+    shm = st->shm;
+    clock_gettime(CLOCK_MONOTONIC, &ts); /* vDSO, no syscall */
+
+    seq = shm->seq;
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < st->n; i++) {
+        const struct stats_src *s = &st->src[i];
+        uint64_t v;
+
+        if (s->ring) {
+            v = pio_ring_space(s->ring);
+        } else {
+            v = *s->ctr;
+        }
+        __atomic_store_n(&shm->val[i], v, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&shm->ts_ns, ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void
+stats_close(struct stats *st)
+{
+    if (st == NULL) {
+        return;
+    }
+    if (st->exp_fd >= 0) {
+        __atomic_store_n(&st->exp_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(st->exp_thread, NULL);
+        close(st->exp_fd);
+        if (st->exp_path[0]) {
+            unlink(st->exp_path);
+        }
+    }
+    munmap(st->shm, sizeof(*st->shm));
+    shm_unlink(st->shm_name);
+    free(st);
+}
+
+const struct stats_shm *
+stats_attach(const char *shm_name)
+{
+    struct stats_shm *shm;
+    struct stat sb;
+    int fd;
+
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &sb) || sb.st_size < (off_t)sizeof(*shm)) {
+        /* Not created yet, or a different layout. */
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        return NULL;
+    }
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        shm->version != STATS_VERSION ||
+        shm->desc_size != sizeof(struct stats_desc)) {
+        munmap(shm, sizeof(*shm));
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return shm;
+}
+
+void
+stats_detach(const struct stats_shm *shm)
+{
+    munmap((void *)shm, sizeof(*shm));
+}
+
+/* Take a consistent copy of the values. Returns -1 if the writer kept
+ * updating the segment for too long. */
+int
+stats_snapshot(const struct stats_shm *shm, struct stats_snap *snap)
+{
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+        uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        unsigned int i;
+
+        if (seq & 1) {
+            continue; /* update in progress */
+        }
+        snap->n = __atomic_load_n(&shm->ncounters, __ATOMIC_ACQUIRE);
+        if (snap->n > STATS_MAX) {
+            snap->n = STATS_MAX;
+        }
+        for (i = 0; i < snap->n; i++) {
+            snap->val[i] = __atomic_load_n(&shm->val[i], __ATOMIC_RELAXED);
+        }
+        snap->ts_ns = __atomic_load_n(&shm->ts_ns, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Metric names only allow [a-zA-Z0-9_:]. */
+static void
+metric_name(char *dst, size_t len, const char *prog, const char *name)
+{
+    size_t i;
+
+    snprintf(dst, len, "%s_%s", prog, name);
+    for (i = 0; dst[i]; i++) {
+        if (!(dst[i] >= 'a' && dst[i] <= 'z') &&
+            !(dst[i] >= 'A' && dst[i] <= 'Z') &&
+            !(dst[i] >= '0' && dst[i] <= '9') && dst[i] != ':') {
+            dst[i] = '_';
+        }
+    }
+}
+
+/* Format a snapshot as OpenMetrics text, returns the length. */
+static size_t
+stats_format(const struct stats_shm *shm, const struct stats_snap *snap,
+             char *buf, size_t size)
+{
+    unsigned long long cum = 0;
+    size_t ofs             = 0;
+    unsigned int i;
+
+#define OUT(...)                                                       \
+    do {                                                               \
+        if (ofs < size) {                                              \
+            ofs += snprintf(buf + ofs, size - ofs, __VA_ARGS__);       \
+        }                                                              \
+    } while (0)
+
+    for (i = 0; i < snap->n; i++) {
+        const struct stats_desc *d = &shm->desc[i];
+        unsigned long long v       = snap->val[i];
+        char name[2 * STATS_NAME_MAX];
+
+        metric_name(name, sizeof(name), shm->prog, d->name);
+        switch (d->type) {
+        case STATS_COUNTER:
+            OUT("# TYPE %s counter\n%s_total %llu\n", name, name, v);
+            break;
+
+        case STATS_GAUGE:
+            OUT("# TYPE %s gauge\n%s %llu\n", name, name, v);
+            break;
+
+        case STATS_BUCKET:
+            if (i == 0 || shm->desc[i - 1].type != STATS_BUCKET) {
+                OUT("# TYPE %s histogram\n", name);
+                cum = 0;
+            }
+            cum += v;
+            if (d->le == UINT64_MAX) {
+                OUT("%s_bucket{le=\"+Inf\"} %llu\n", name, cum);
+            } else {
+                OUT("%s_bucket{le=\"%llu\"} %llu\n", name,
+                    (unsigned long long)d->le, cum);
+            }
+            break;
+
+        case STATS_SUM:
+            OUT("%s_count %llu\n%s_sum %llu\n", name, cum, name, v);
+            break;
+        }
+    }
+    OUT("# EOF\n");
+#undef OUT
+
+    return ofs < size ? ofs : size;
+}
+
+static void
+stats_serve(struct stats *st, int fd, char *buf)
+{
+    static const char hdr[] = "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/openmetrics-text; "
+                              "version=1.0.0; charset=utf-8\r\n"
+                              "Connection: close\r\n";
+    struct timeval tv = {1, 0};
+    struct stats_snap snap;
+    char req[1024];
+    size_t reqlen = 0;
+    char clen[64];
+    size_t len;
+
+    /* Read (and ignore) the request headers, whatever they ask for. */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (reqlen < sizeof(req) - 1) {
+        ssize_t n = read(fd, req + reqlen, sizeof(req) - 1 - reqlen);
+
+        if (n <= 0) {
+            break;
+        }
+        reqlen += n;
+        req[reqlen] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            break;
+        }
+    }
+
+    if (stats_snapshot(st->shm, &snap)) {
+        static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                   "Content-Length: 0\r\n\r\n";
+
+        send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+        return;
+    }
+    len = stats_format(st->shm, &snap, buf, STATS_EXPORT_BUF);
+    snprintf(clen, sizeof(clen), "Content-Length: %zu\r\n\r\n", len);
+    /* MSG_NOSIGNAL: a client going away must not kill the program. */
+    send(fd, hdr, sizeof(hdr) - 1, MSG_NOSIGNAL);
+    send(fd, clen, strlen(clen), MSG_NOSIGNAL);
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+        if (n <= 0) {
+            break;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void *
+stats_export_thread(void *arg)
+{
+    struct stats *st = arg;
+    char *buf        = malloc(STATS_EXPORT_BUF);
+
+    if (buf == NULL) {
+        return NULL;
+    }
+    while (!__atomic_load_n(&st->exp_stop, __ATOMIC_RELAXED)) {
+        struct pollfd pfd = {st->exp_fd, POLLIN, 0};
+        int fd;
+
+        /* Wake up now and then to check for stats_close(). */
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        fd = accept(st->exp_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        stats_serve(st, fd, buf);
+        close(fd);
+    }
+    free(buf);
+
+    return NULL;
+}
+
+/* Serve the counters as OpenMetrics text on addr, which is either
+ * unix:PATH or tcp:PORT (bound to localhost only). */
+int
+stats_export(struct stats *st, const char *addr)
+{
+    int fd = -1;
+    int ret;
+
+    if (st == NULL || st->exp_fd >= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!strncmp(addr, "unix:", 5)) {
+        struct sockaddr_un sun;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(addr + 5) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, addr + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        unlink(sun.sun_path); /* left behind by a previous run */
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+            goto err;
+        }
+        strcpy(st->exp_path, sun.sun_path);
+    } else if (!strncmp(addr, "tcp:", 4)) {
+        struct sockaddr_in sin;
+        int one = 1;
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family      = AF_INET;
+        sin.sin_port        = htons(atoi(addr + 4));
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd                  = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin))) {
+            goto err;
+        }
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    if (listen(fd, 8)) {
+        goto err;
+    }
+
+    st->exp_fd   = fd;
+    st->exp_stop = 0;
+    ret          = pthread_create(&st->exp_thread, NULL, stats_export_thread,
+                                  st);
+    if (ret) {
+        st->exp_fd = -1;
+        errno      = ret;
+        goto err;
+    }
+
+    return 0;
+err:
+    ret = errno;
+    close(fd);
+    if (st->exp_path[0]) {
+        unlink(st->exp_path);
+        st->exp_path[0] = '\0';
+    }
+    errno = ret;
+    return -1;
+}
@@ -0,0 +1,111 @@
+/*
+ * Counters published in a POSIX shared-memory segment, so that external
+ * tools (nmstat) can sample them at any rate while the program runs.
+ *
+ * Each program creates "/nmstat-PROG-PID" and registers pointers to its
+ * own counters. The datapath keeps incrementing its plain variables;
+ * stats_publish(), called once per main loop iteration, copies them
+ * into the segment under a sequence lock: the writer makes the sequence
+ * number odd, updates the values and makes it even again, and readers
+ * retry if the number changed or was odd. No syscalls nor locks are
+ * involved on either side.
+ *
+ * The layout is versioned: readers must check magic and version before
+ * trusting anything else in the segment.
+ *
+ * Histograms have power-of-two buckets: bucket i counts the values up to
+ * 2^i, the last one everything else. They are published as one entry
+ * per bucket followed by the sum of the values. stats_export() serves
+ * all of this as OpenMetrics text from a separate thread, which only
+ * reads the segment and thus never stalls the main loop.
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include "pktio.h"
+
+#define STATS_MAGIC 0x6e6d7374 /* "nmst" */
+#define STATS_VERSION 3
+#define STATS_MAX 512
+#define STATS_NAME_MAX 32
+#define STATS_PREFIX "/nmstat-"
+#define STATS_HIST_BUCKETS 32
+#define STATS_HIST_ENTRIES (STATS_HIST_BUCKETS + 1) /* with the sum */
+#define STATS_PORT_ENTRIES (PIO_MAX_RINGS + 1) /* stats_add_port(), most */
+
+/* Counter types. */
+#define STATS_COUNTER 0 /* monotonic, nmstat shows its rate */
+#define STATS_GAUGE 1   /* instantaneous value */
+#define STATS_BUCKET 2  /* histogram bucket, values up to le */
+#define STATS_SUM 3     /* sum of the values of a histogram */
+
+struct stats_desc {
+    char name[STATS_NAME_MAX - 1];
+    uint8_t type;
+    uint64_t le; /* STATS_BUCKET only, UINT64_MAX for +Inf */
+};
+
+struct stats_shm {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t desc_size; /* sizeof(struct stats_desc) */
+    uint32_t ncounters; /* published after the descriptors */
+    int32_t pid;
+    char prog[32];
+    struct stats_desc desc[STATS_MAX];
+
+    /* Written under the sequence lock. */
+    uint32_t seq __attribute__((aligned(64)));
+    uint64_t ts_ns; /* CLOCK_MONOTONIC time of the last update */
+    uint64_t val[STATS_MAX];
+};
+
+/* A consistent copy of the values, taken by stats_snapshot(). */
+struct stats_snap {
+    unsigned int n;
+    uint64_t ts_ns;
+    uint64_t val[STATS_MAX];
+};
+
+struct stats_hist {
+    unsigned long long bucket[STATS_HIST_BUCKETS];
+    unsigned long long sum;
+};
+
+static inline void
+stats_hist_add(struct stats_hist *h, uint64_t v)
+{
+    unsigned int i = v <= 1 ? 0 : 64 - __builtin_clzll(v - 1);
+
+    if (i >= STATS_HIST_BUCKETS) {
+        i = STATS_HIST_BUCKETS - 1;
+    }
+    h->bucket[i]++;
+    h->sum += v;
+}
+
+struct stats;
+
+/* Writer side. All the functions accept a NULL stats (no segment). */
+struct stats *stats_open(const char *prog);
+int stats_add(struct stats *st, const char *name,
+              const unsigned long long *ctr);
+int stats_add_gauge(struct stats *st, const char *name,
+                    const unsigned long long *val);
+int stats_add_port(struct stats *st, const char *name,
+                   const struct pio_port *port);
+int stats_add_hist(struct stats *st, const char *name,
+                   const struct stats_hist *h);
+int stats_add_wakeup(struct stats *st, const struct pio_wakeup *w);
+int stats_add_txflush(struct stats *st, const struct pio_txflush *tf);
+int stats_export(struct stats *st, const char *addr);
+void stats_publish(struct stats *st);
+void stats_close(struct stats *st);
+
+/* Reader side. */
+const struct stats_shm *stats_attach(const char *shm_name);
+void stats_detach(const struct stats_shm *shm);
+int stats_snapshot(const struct stats_shm *shm, struct stats_snap *snap);
+
+#endif /* __STATS_H__ */
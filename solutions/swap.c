@@ -10,21 +10,26 @@
 #include <signal.h>
 #include <errno.h>
 #include <poll.h>
+#include <string.h>
 #include <net/if.h>
 #include <stdint.h>
-#include <net/netmap.h>
-#define NETMAP_WITH_LIBS
-#include <net/netmap_user.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
 #include <netinet/tcp.h>
+#include "pktio.h"
+#include "pkt.h"
+#include "fwdloop.h"
+#include "stats.h"
+#include "tsc.h"
 
 static int stop                   = 0;
 static unsigned long long swapped = 0;
 static unsigned long long tot     = 0;
+static struct stats_hist batch_h;
+static struct stats_hist proc_h;
 
 static void
 sigint_handler(int signum)
@@ -33,154 +38,100 @@ sigint_handler(int signum)
 }
 
 static int
-rx_ready(struct nm_desc *nmd)
+main_loop(const char *netmap_port_one, const char *netmap_port_two,
+          const char *metrics, struct pio_wakeup *wk,
+          struct pio_txflush *tf)
 {
-    unsigned int ri;
-
-    for (ri = nmd->first_rx_ring; ri <= nmd->last_rx_ring; ri++) {
-        struct netmap_ring *ring;
-
-        ring = NETMAP_RXRING(nmd->nifp, ri);
-        if (nm_ring_space(ring)) {
-            return 1; /* there is something to read */
-        }
-    }
-
-    return 0;
-}
-
-/* Swap UDP source and destination ports. Returns 1 if a
- * swap was performed, 0 otherwise. */
-static inline int
-pkt_udp_port_swap(char *buf)
-{
-    struct ether_header *ethh;
-    struct ip *iph;
-    struct udphdr *udph;
-    uint16_t tmp;
-
-    ethh = (struct ether_header *)buf;
-    if (ethh->ether_type != htons(ETHERTYPE_IP)) {
-        /* Filter out non-IP traffic. */
-        return 0;
-    }
-    iph = (struct ip *)(ethh + 1);
-    if (iph->ip_p != IPPROTO_UDP) {
-        /* Filter out non-UDP traffic. */
-        return 0;
-    }
-    udph           = (struct udphdr *)(iph + 1);
-    tmp            = udph->uh_sport;
-    udph->uh_sport = udph->uh_dport;
-    udph->uh_dport = tmp;
-
-    return 1;
-}
-
+    struct pio_port *port_one;
+    struct pio_port *port_two;
+    struct stats *st;
+    int zerocopy;
+    int serr = 0; /* a stats registration failed */
 #ifdef SOLUTION
-static void
-swap_and_forward(struct nm_desc *src, struct nm_desc *dst, int zerocopy)
-{
-    unsigned int si = src->first_rx_ring;
-    unsigned int di = dst->first_tx_ring;
-
-    while (si <= src->last_rx_ring && di <= dst->last_tx_ring) {
-        struct netmap_ring *txring;
-        struct netmap_ring *rxring;
-        unsigned int rxhead, txhead;
-        int nrx, ntx;
-
-        rxring = NETMAP_RXRING(src->nifp, si);
-        txring = NETMAP_TXRING(dst->nifp, di);
-        nrx    = nm_ring_space(rxring);
-        ntx    = nm_ring_space(txring);
-        if (nrx == 0) {
-            si++;
-            continue;
-        }
-        if (ntx == 0) {
-            di++;
-            continue;
-        }
-
-        rxhead = rxring->head;
-        txhead = txring->head;
-        for (; nrx > 0 && ntx > 0; nrx--, ntx--, tot++) {
-            struct netmap_slot *rs = &rxring->slot[rxhead];
-            struct netmap_slot *ts = &txring->slot[txhead];
-            char *txbuf;
-
-            ts->len = rs->len;
-            if (zerocopy) {
-                uint32_t idx = ts->buf_idx;
-                ts->buf_idx  = rs->buf_idx;
-                rs->buf_idx  = idx;
-                /* report the buffer change. */
-                ts->flags |= NS_BUF_CHANGED;
-                rs->flags |= NS_BUF_CHANGED;
-                txbuf = NETMAP_BUF(txring, ts->buf_idx);
-            } else {
-                char *rxbuf = NETMAP_BUF(rxring, rs->buf_idx);
-                txbuf       = NETMAP_BUF(txring, ts->buf_idx);
-                memcpy(txbuf, rxbuf, ts->len);
-            }
-
-            swapped += pkt_udp_port_swap(txbuf);
-            txhead = nm_ring_next(txring, txhead);
-            rxhead = nm_ring_next(rxring, rxhead);
-        }
-        /* Update state of netmap ring. */
-        rxring->head = rxring->cur = rxhead;
-        txring->head = txring->cur = txhead;
-    }
-}
+    fwd_fn swap_and_forward;
+    struct fwd_ctx ctx;
 #endif /* SOLUTION */
 
-static int
-main_loop(const char *netmap_port_one, const char *netmap_port_two)
-{
-    struct nm_desc *nmd_one;
-    struct nm_desc *nmd_two;
-    int zerocopy;
-
-    nmd_one = nm_open(netmap_port_one, NULL, 0, NULL);
-    if (nmd_one == NULL) {
+    port_one = pio_open(netmap_port_one, NULL);
+    if (port_one == NULL) {
         if (!errno) {
-            printf("Failed to nm_open(%s): not a netmap port\n",
+            printf("Failed to pio_open(%s): unknown port type\n",
                    netmap_port_one);
         } else {
-            printf("Failed to nm_open(%s): %s\n", netmap_port_one,
+            printf("Failed to pio_open(%s): %s\n", netmap_port_one,
                    strerror(errno));
         }
         return -1;
     }
 
-    nmd_two = nm_open(netmap_port_two, NULL, NM_OPEN_NO_MMAP, nmd_one);
-    if (nmd_two == NULL) {
+    port_two = pio_open(netmap_port_two, port_one);
+    if (port_two == NULL) {
         if (!errno) {
-            printf("Failed to nm_open(%s): not a netmap port\n",
+            printf("Failed to pio_open(%s): unknown port type\n",
                    netmap_port_two);
         } else {
-            printf("Failed to nm_open(%s): %s\n", netmap_port_two,
+            printf("Failed to pio_open(%s): %s\n", netmap_port_two,
                    strerror(errno));
         }
         return -1;
     }
 
     /* Check if we can do zerocopy. */
-    zerocopy = (nmd_one->mem == nmd_two->mem);
+    zerocopy = pio_same_mem(port_one, port_two);
     printf("zerocopy %sabled\n", zerocopy ? "en" : "dis");
 
+#ifdef SOLUTION
+    /* Pick the forwarding loop compiled for this configuration. */
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.zerocopy     = zerocopy;
+    ctx.filter       = FWD_FILTER_NONE;
+    ctx.rewrite      = FWD_REWRITE_SWAP;
+    ctx.tot          = &tot;
+    ctx.out          = &swapped;
+    swap_and_forward = fwd_select(&ctx);
+#endif /* SOLUTION */
+
+    if (tf) {
+        pio_set_txflush(port_one, tf);
+        pio_set_txflush(port_two, tf);
+    }
+
+    st = stats_open("swap");
+    if (st == NULL) {
+        printf("Failed to create the stats segment: %s\n", strerror(errno));
+    }
+    serr |= stats_add(st, "tot", &tot);
+    serr |= stats_add(st, "swapped", &swapped);
+    serr |= stats_add_port(st, "one", port_one);
+    serr |= stats_add_port(st, "two", port_two);
+    serr |= stats_add_hist(st, "batch", &batch_h);
+    serr |= stats_add_hist(st, "proc_ns", &proc_h);
+    serr |= stats_add_wakeup(st, wk);
+    serr |= stats_add_txflush(st, tf);
+    if (serr) {
+        printf("Failed to register the stats: %s\n", strerror(errno));
+    }
+    if (metrics && stats_export(st, metrics)) {
+        printf("Failed to export metrics on %s: %s\n", metrics,
+               strerror(errno));
+    }
+    if (pio_wakeup_start(wk)) {
+        printf("Failed to lower the timer slack: %s\n", strerror(errno));
+    }
+
     while (!stop) {
+        stats_publish(st);
 #ifdef SOLUTION
-        struct pollfd pfd[2];
+        struct pio_pollfd pfd[2];
+        unsigned long long tot0;
+        uint64_t t0;
         int ret;
 
-        pfd[0].fd     = nmd_one->fd;
-        pfd[1].fd     = nmd_two->fd;
+        pfd[0].port   = port_one;
+        pfd[1].port   = port_two;
         pfd[0].events = 0;
         pfd[1].events = 0;
-        if (!rx_ready(nmd_one)) {
+        if (!pio_rx_ready(port_one)) {
             /* Ran out of input packets on the first port, we need to
              * wait for them. */
             pfd[0].events |= POLLIN;
@@ -189,7 +140,7 @@ main_loop(const char *netmap_port_one, const char *netmap_port_two)
              * TX ring space in the other port. */
             pfd[1].events |= POLLOUT;
         }
-        if (!rx_ready(nmd_two)) {
+        if (!pio_rx_ready(port_two)) {
             /* Ran out of input packets on the second port, we need to
              * wait for them. */
             pfd[1].events |= POLLIN;
@@ -201,24 +152,39 @@ main_loop(const char *netmap_port_one, const char *netmap_port_two)
 
         /* We poll with a timeout to have a chance to break the main loop if
          * no packets are coming. */
-        ret = poll(pfd, 2, 1000);
+        ret = pio_poll_moderated(pfd, 2, 1000, wk);
         if (ret < 0) {
-            perror("poll()");
+            perror("pio_poll()");
         } else if (ret == 0) {
             /* Timeout */
             continue;
         }
+        t0   = rdtsc();
+        tot0 = tot;
 
         /* Forward in the two directions. */
-        swap_and_forward(nmd_one, nmd_two, zerocopy);
-        swap_and_forward(nmd_two, nmd_one, zerocopy);
+        swap_and_forward(port_one, port_two, NULL, &ctx);
+        swap_and_forward(port_two, port_one, NULL, &ctx);
+        if (tot != tot0) {
+            stats_hist_add(&batch_h, tot - tot0);
+            stats_hist_add(&proc_h, tsc2ns(rdtsc() - t0));
+        }
 #endif /* SOLUTION */
     }
 
-    nm_close(nmd_one);
-    nm_close(nmd_two);
+    stats_close(st);
+    pio_close(port_one);
+    pio_close(port_two);
 
     printf("Total processed packets: %llu\n", tot);
+    if (wk && wk->wakeups) {
+        printf("Wakeups                : %llu (%.1f slots each)\n",
+               wk->wakeups, (double)wk->slots / wk->wakeups);
+    }
+    if (tf) {
+        printf("TX flushes             : %llu batch, %llu deadline\n",
+               tf->by_batch, tf->by_deadline);
+    }
     printf("Swapped packets        : %llu\n", swapped);
 
     return 0;
@@ -228,7 +194,8 @@ static void
 usage(char **argv)
 {
     printf("usage: %s [-h] [-i NETMAP_PORT_ONE] "
-           "[-i NETMAP_PORT_TWO]\n",
+           "[-i NETMAP_PORT_TWO] [-M unix:PATH|tcp:PORT] "
+           "[-W TARGET[:MAX_US]] [-D BATCH[:DELAY_US]]\n",
            argv[0]);
     exit(EXIT_SUCCESS);
 }
@@ -238,11 +205,16 @@ main(int argc, char **argv)
 {
     const char *netmap_port_one = NULL;
     const char *netmap_port_two = NULL;
+    const char *metrics         = NULL;
+    struct pio_wakeup *wk       = NULL;
+    struct pio_txflush *tf      = NULL;
+    struct pio_wakeup wakeup;
+    struct pio_txflush txflush;
     struct sigaction sa;
     int opt;
     int ret;
 
-    while ((opt = getopt(argc, argv, "hi:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "hi:p:M:W:D:")) != -1) {
         switch (opt) {
         case 'h':
             usage(argv);
@@ -256,6 +228,29 @@ main(int argc, char **argv)
             }
             break;
 
+        case 'M':
+            /* Serve OpenMetrics on a Unix socket or localhost TCP. */
+            metrics = optarg;
+            break;
+
+        case 'W':
+            /* Hold small wakeups back, TARGET slots within MAX_US. */
+            if (pio_wakeup_parse(&wakeup, optarg)) {
+                printf("    invalid wakeup moderation %s\n", optarg);
+                usage(argv);
+            }
+            wk = &wakeup;
+            break;
+
+        case 'D':
+            /* Flush TX after BATCH slots or DELAY_US. */
+            if (pio_txflush_parse(&txflush, optarg)) {
+                printf("    invalid TX flush policy %s\n", optarg);
+                usage(argv);
+            }
+            tf = &txflush;
+            break;
+
         default:
             printf("    unrecognized option '-%c'\n", opt);
             usage(argv);
@@ -282,14 +277,13 @@ main(int argc, char **argv)
         perror("sigaction(SIGINT)");
         exit(EXIT_FAILURE);
     }
-    (void)rx_ready;
 
     printf("Port one: %s\n", netmap_port_one);
     printf("Port two: %s\n", netmap_port_two);
 
-    main_loop(netmap_port_one, netmap_port_two);
+    tsc_calibrate();
 
-    (void)pkt_udp_port_swap;
+    main_loop(netmap_port_one, netmap_port_two, metrics, wk, tf);
 
     return 0;
 }
@@ -0,0 +1,153 @@
+/*
+ * Flight recorder files, see trace.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "tsc.h"
+
+const char *trace_verdict_names[TRACE_NVERDICTS] = {
+    "fwd-a", "fwd-b", "back", "drop", "full", "host",
+};
+
+struct trace *
+trace_open(const char *path, const char *prog, uint32_t nrecs,
+           uint64_t tsc_hz)
+{
+    struct trace *t;
+    struct timespec ts;
+    int fd;
+
+    if (nrecs == 0 || (nrecs & (nrecs - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->size = TRACE_HDR_SIZE + (size_t)nrecs * sizeof(struct trace_rec);
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(t);
+        return NULL;
+    }
+    if (ftruncate(fd, t->size)) {
+        goto err;
+    }
+    t->hdr = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (t->hdr == MAP_FAILED) {
+        goto err;
+    }
+    close(fd);
+
+    t->rec       = (struct trace_rec *)((char *)t->hdr + TRACE_HDR_SIZE);
+    t->mask      = nrecs - 1;
+    t->every     = 1;
+    t->countdown = 1;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t->hdr->version   = TRACE_VERSION;
+    t->hdr->rec_size  = sizeof(struct trace_rec);
+    t->hdr->nrecs     = nrecs;
+    t->hdr->caplen    = TRACE_CAPLEN;
+    t->hdr->tsc_hz    = tsc_hz;
+    t->hdr->start_ns  = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    t->hdr->start_tsc = rdtsc();
+    snprintf(t->hdr->prog, sizeof(t->hdr->prog), "%s", prog);
+    __atomic_store_n(&t->hdr->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+
+    return t;
+err:
+    close(fd);
+    free(t);
+    return NULL;
+}
+
+void
+trace_close(struct trace *t)
+{
+    if (t == NULL) {
+        return;
+    }
+    /* The file stays, for nmtrace. */
+    munmap(t->hdr, t->size);
+    free(t);
+}
+
+/* Parse a comma separated list of verdict names into a bitmask. */
+int
+trace_parse_verdicts(const char *s, uint32_t *mask)
+{
+    *mask = 0;
+    while (*s) {
+        size_t len = strcspn(s, ",");
+        int v;
+
+        for (v = 0; v < TRACE_NVERDICTS; v++) {
+            if (strlen(trace_verdict_names[v]) == len &&
+                !strncmp(s, trace_verdict_names[v], len)) {
+                break;
+            }
+        }
+        if (v == TRACE_NVERDICTS) {
+            return -1;
+        }
+        *mask |= 1U << v;
+        s += len;
+        if (*s == ',') {
+            s++;
+        }
+    }
+
+    return 0;
+}
+
+const struct trace_hdr *
+trace_attach(const char *path, size_t *size)
+{
+    struct trace_hdr *hdr;
+    struct stat sb;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &sb) || sb.st_size < TRACE_HDR_SIZE) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        return NULL;
+    }
+    if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION ||
+        hdr->rec_size != sizeof(struct trace_rec) || hdr->nrecs == 0 ||
+        (hdr->nrecs & (hdr->nrecs - 1)) ||
+        (size_t)sb.st_size <
+            TRACE_HDR_SIZE + (size_t)hdr->nrecs * sizeof(struct trace_rec)) {
+        munmap(hdr, sb.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+    *size = sb.st_size;
+
+    return hdr;
+}
+
+void
+trace_detach(const struct trace_hdr *hdr, size_t size)
+{
+    munmap((void *)hdr, size);
+}
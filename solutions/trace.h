@@ -0,0 +1,131 @@
+/*
+ * Flight recorder: a circular trace of packet records in a memory-mapped
+ * file, to see after the fact what a program saw.
+ *
+ * Each record holds a TSC timestamp, the port, ring and slot the packet
+ * was found in, its length, the first TRACE_CAPLEN bytes and the verdict
+ * of the program. Records are written by a single thread with plain
+ * stores: the sequence number of a record is invalidated first and set
+ * last, and the head index is published after it, so a reader (nmtrace)
+ * can tell complete records from the ones being overwritten, also after
+ * a crash, since the file mapping outlives the process.
+ *
+ * Packets are recorded one in "every" (sampling), plus all the packets
+ * whose verdict is in the trigger mask.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#define TRACE_MAGIC 0x6e6d7472 /* "nmtr" */
+#define TRACE_VERSION 1
+#define TRACE_CAPLEN 64
+#define TRACE_HDR_SIZE 4096 /* records start on the second page */
+#define TRACE_DEFAULT_RECS 65536
+
+/* Verdicts. */
+enum {
+    TRACE_FWD_A = 0, /* forwarded to port two */
+    TRACE_FWD_B,     /* forwarded to port three */
+    TRACE_BACK,      /* forwarded back to port one */
+    TRACE_DROP,      /* no matching UDP port */
+    TRACE_FULL,      /* dropped, no space on the TX rings */
+    TRACE_HOST,      /* passed to the host stack (-H) */
+    TRACE_NVERDICTS,
+};
+
+extern const char *trace_verdict_names[TRACE_NVERDICTS];
+
+struct trace_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    uint32_t nrecs; /* power of two */
+    uint32_t caplen;
+    uint64_t tsc_hz;
+    uint64_t start_tsc; /* TSC at start_ns */
+    uint64_t start_ns;  /* CLOCK_REALTIME */
+    char prog[32];
+    uint64_t head __attribute__((aligned(64))); /* records written */
+};
+
+struct trace_rec {
+    uint64_t seq; /* UINT64_MAX while being written */
+    uint64_t ts;
+    uint32_t slot;
+    uint16_t ring;
+    uint16_t len;
+    uint8_t port;
+    uint8_t verdict;
+    uint8_t caplen;
+    uint8_t pad[5];
+    unsigned char data[TRACE_CAPLEN];
+};
+
+struct trace {
+    struct trace_hdr *hdr;
+    struct trace_rec *rec;
+    size_t size;
+    uint64_t head;
+    uint32_t mask;
+    uint32_t every; /* zero means no sampling */
+    uint32_t countdown;
+    uint32_t trigger; /* bitmask of verdicts always recorded */
+};
+
+struct trace *trace_open(const char *path, const char *prog, uint32_t nrecs,
+                         uint64_t tsc_hz);
+void trace_close(struct trace *t);
+int trace_parse_verdicts(const char *s, uint32_t *mask);
+
+/* Reader side. */
+const struct trace_hdr *trace_attach(const char *path, size_t *size);
+void trace_detach(const struct trace_hdr *hdr, size_t size);
+
+static inline const struct trace_rec *
+trace_hdr_rec(const struct trace_hdr *hdr, uint64_t i)
+{
+    return (const struct trace_rec *)((const char *)hdr + TRACE_HDR_SIZE) +
+           (i & (hdr->nrecs - 1));
+}
+
+static inline void
+trace_record(struct trace *t, unsigned int port, unsigned int ring,
+             unsigned int slot, const char *buf, unsigned int len,
+             unsigned int verdict, uint64_t ts)
+{
+    struct trace_rec *r = &t->rec[t->head & t->mask];
+    unsigned int caplen = len < TRACE_CAPLEN ? len : TRACE_CAPLEN;
+
+    __atomic_store_n(&r->seq, UINT64_MAX, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->ts      = ts;
+    r->slot    = slot;
+    r->ring    = ring;
+    r->len     = len;
+    r->port    = port;
+    r->verdict = verdict;
+    r->caplen  = caplen;
+    memcpy(r->data, buf, caplen);
+    __atomic_store_n(&r->seq, t->head, __ATOMIC_RELEASE);
+    t->head++;
+    __atomic_store_n(&t->hdr->head, t->head, __ATOMIC_RELEASE);
+}
+
+/* Whether a packet with this verdict has to be recorded. */
+static inline int
+trace_want(struct trace *t, unsigned int verdict)
+{
+    if (t->trigger & (1U << verdict)) {
+        return 1;
+    }
+    if (t->every && --t->countdown == 0) {
+        t->countdown = t->every;
+        return 1;
+    }
+    return 0;
+}
+
+#endif /* __TRACE_H__ */
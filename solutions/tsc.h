@@ -0,0 +1,66 @@
+/*
+ * Time stamp counter helpers, for cheap timestamps in the fast path.
+ * tsc_calibrate() must be called once before using the conversions.
+ */
+#ifndef __TSC_H__
+#define __TSC_H__
+
+#include <stdint.h>
+#include <time.h>
+
+static uint64_t tsc_hz = 1;
+
+static inline uint64_t
+rdtsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t
+ns_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Measure the TSC frequency against CLOCK_MONOTONIC. */
+static inline uint64_t
+tsc_calibrate(void)
+{
+    uint64_t ns0 = ns_now(), t0 = rdtsc();
+    uint64_t ns1, t1;
+
+    do {
+        ns1 = ns_now();
+    } while (ns1 - ns0 < 50000000ULL); /* 50 ms */
+    t1     = rdtsc();
+    tsc_hz = (t1 - t0) * 1000000000ULL / (ns1 - ns0);
+
+    return tsc_hz;
+}
+
+static inline uint64_t
+tsc2ns(uint64_t tsc)
+{
+    return (uint64_t)((double)tsc * 1e9 / tsc_hz);
+}
+
+static inline uint64_t
+ns2tsc(uint64_t ns)
+{
+    return (uint64_t)((double)ns * tsc_hz / 1e9);
+}
+
+#endif /* __TSC_H__ */
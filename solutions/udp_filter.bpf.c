@@ -0,0 +1,32 @@
+/*
+ * Sample eBPF classifier for the -e option of forward, sink and pktbench:
+ * the same selection as pkt_select(), UDP packets to port 8000, but
+ * honouring the IP header length. Build it with make udp_filter.bpf.o
+ * (needs clang with the bpf target).
+ *
+ * There are no explicit length checks: the accesses beyond the frame
+ * are caught by the VM, which drops the packet.
+ */
+#include <stdint.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#define UDP_PORT 8000
+
+__attribute__((section("classifier"), used)) uint32_t
+udp_filter(const uint8_t *pkt, uint32_t len)
+{
+    const struct ethhdr *eth = (const struct ethhdr *)pkt;
+    const struct iphdr *ip   = (const struct iphdr *)(eth + 1);
+    const struct udphdr *udp;
+
+    if (eth->h_proto != __builtin_bswap16(ETH_P_IP) ||
+        ip->protocol != IPPROTO_UDP) {
+        return 0; /* EBPF_DROP */
+    }
+    udp = (const struct udphdr *)((const uint8_t *)ip + ip->ihl * 4);
+
+    return udp->dest == __builtin_bswap16(UDP_PORT); /* EBPF_PASS */
+}